@@ -1,11 +1,23 @@
 #ifndef SRC_CONNECTION_H
 #define SRC_CONNECTION_H
 
+#include <stddef.h>
 #include <openssl/ssl.h>
 
+// Size of the input buffer of a Connection
+#define CONNECTION_BUFFER_SIZE 8192
+
+// Data read ahead from a Connection, handed out before reading it again
+typedef struct connectionBuffer {
+  unsigned char data[CONNECTION_BUFFER_SIZE];
+  size_t start;  // first byte not handed out yet
+  size_t end;  // end of the data read
+} ConnectionBuffer;
+
 typedef struct connectionStruct {
   int socket;
   SSL* ssl;  // If ssl != NULL, then it is an SSL connection.
+  ConnectionBuffer* in;  // Data read ahead, allocated on first use or NULL.
 } Connection;
 
 #endif  // SRC_CONNECTION_H
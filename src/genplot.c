@@ -30,6 +30,7 @@
 
 #include "web100srv.h"
 #include "usage.h"
+#include "ndtsnap.h"
 
 char *color[16] = { "green", "blue", "orange", "red", "yellow", "magenta",
   "pink", "white", "black" };
@@ -86,6 +87,47 @@ void log_println(int lvl, const char* format, ...) {
 
 #endif
 
+/* The log being read when it is in the binary columnar format, and the row
+ * standing for the current snap */
+static NdtSnapReader* binlog = NULL;
+static int binrow = 0;
+
+/**
+ * Read the next snap of a log into 'snap', or step to the next row of a
+ * binary log.
+ *
+ * @param snap Allocated storage for Web100 - NULL for Web10G
+ * @param log A open Web100/Web10G log file - ignored for binary logs
+ * @param first Read the first snap of the log?
+ *
+ * @return 0 on success, -1 at the end of the log or on failure.
+ */
+static int next_snap(tcp_stat_snap** snap, tcp_stat_log* log, int first) {
+#if USE_WEB10G
+  estats_error* err = NULL;
+#endif
+
+  if (binlog != NULL) {
+    binrow = first ? 0 : binrow + 1;
+    return binrow < ndtsnap_rows(binlog) ? 0 : -1;
+  }
+#if USE_WEB100
+  if ((web100_snap_from_log(*snap, log)) != WEB100_ERR_SUCCESS) {
+    if (first)
+      web100_perror("web100_snap_from_log");
+    return -1;
+  }
+#elif USE_WEB10G
+  if ((err = estats_record_read_data(snap, log)) != NULL) {
+    if (first)
+      estats_error_print(stderr, err);
+    estats_error_free(&err);
+    return -1;
+  }
+#endif
+  return 0;
+}
+
 /**
  * Given a snap (likely read from a log) read a value as a double.
  * Upon failure will exit the program with error code EXIT_FAILURE.
@@ -106,6 +148,16 @@ double tcp_stat_read_double(const char * name, tcp_stat_snap* snap,
 #elif USE_WEB10G
   estats_val val;
 #endif
+  const int64_t* column;
+
+  if (binlog != NULL) {
+    if ((column = ndtsnap_column(
+        binlog, ndtsnap_find_column(binlog, name))) == NULL) {
+      fprintf(stderr, "Cannot read %s from the snaplog\n", name);
+      exit(EXIT_FAILURE);
+    }
+    return (double) column[binrow];
+  }
 
 #if USE_WEB100
   if ((web100_agent_find_var_and_group(agent, name, &group,
@@ -157,7 +209,7 @@ double tcp_stat_read_double(const char * name, tcp_stat_snap* snap,
  * address:port.
  * 
  * For Web10G this also logs the start_time because this is expected
- * to be the first snap captured.
+ * to be the first snap captured. Binary logs keep this in their header.
  * 
  * @param snap A Web100/Web10G snap
  * @param agent A Web100 agent - ignored by Web10G should be NULL
@@ -171,7 +223,18 @@ void get_title(tcp_stat_snap* snap, tcp_stat_agent* agent,
 #if USE_WEB100
   web100_var* var;
   char buf[128];
+#endif
+  const NdtSnapTuple* tuple;
+
+  if (binlog != NULL) {
+    tuple = ndtsnap_tuple(binlog);
+    sprintf(title, "%s:%s --> %s", tuple->local_addr, tuple->local_port,
+            tuple->rem_addr);
+    sprintf(remport, "%s", tuple->rem_port);
+    return;
+  }
 
+#if USE_WEB100
   if ((web100_agent_find_var_and_group(agent, "LocalAddress", &group, &var))
       != WEB100_ERR_SUCCESS) {
     web100_perror("web100_agent_find_var_and_group");
@@ -267,9 +330,6 @@ void get_title(tcp_stat_snap* snap, tcp_stat_agent* agent,
 void plot_var(char *list, int cnt, char *name, tcp_stat_snap* snap,
               tcp_stat_log* log, tcp_stat_agent* agent, tcp_stat_group* group,
               int(*func)(const int arg, const int value)) {
-#if USE_WEB10G
-  estats_error* err = NULL;
-#endif
   char *varg;
   /*char buf[256];
   web100_var* var;*/
@@ -288,19 +348,8 @@ void plot_var(char *list, int cnt, char *name, tcp_stat_snap* snap,
   memset(lname, 0, 256);
 
   /* Get the first snap from the log */
-#if USE_WEB100
-  if ((web100_snap_from_log(snap, log)) != WEB100_ERR_SUCCESS) {
-    web100_perror("web100_snap_from_log");
-    return;
-  }
-#elif USE_WEB10G
-  if ((err = estats_record_read_data(&snap, log)) != NULL) {
-    estats_record_close(&log);
-    estats_error_print(stderr, err);
-    estats_error_free(&err);
+  if (next_snap(&snap, log, 1) != 0)
     return;
-  }
-#endif
 
   get_title(snap, agent, group, title, remport);
 
@@ -331,12 +380,7 @@ void plot_var(char *list, int cnt, char *name, tcp_stat_snap* snap,
   for (;;) {
     /* We've already read the first item to use with get_title */
     if (first != 0) {
-#if USE_WEB100
-      if ((web100_snap_from_log(snap, log)) != WEB100_ERR_SUCCESS) {
-#elif USE_WEB10G
-      if ((err = estats_record_read_data(&snap, log)) != NULL) {
-        estats_error_free(&err);
-#endif
+      if (next_snap(&snap, log, 0) != 0) {
         fprintf(fn, "go\n");
         return;
       }
@@ -426,9 +470,6 @@ void plot_var(char *list, int cnt, char *name, tcp_stat_snap* snap,
  */
 void plot_cwndtime(char *name, tcp_stat_snap* snap, tcp_stat_log* log,
                    tcp_stat_agent* agent, tcp_stat_group* group) {
-#if USE_WEB10G
-  estats_error* err = NULL;
-#endif
   double SndLimTimeRwin = 0, SndLimTimeSender = 0;
   char lname[256], remport[8];
   char title[256];
@@ -441,19 +482,8 @@ void plot_cwndtime(char *name, tcp_stat_snap* snap, tcp_stat_log* log,
   memset(lname, 0, 256);
 
   /* Get the first snap from the log */
-#if USE_WEB100
-  if ((web100_snap_from_log(snap, log)) != WEB100_ERR_SUCCESS) {
-    web100_perror("web100_snap_from_log");
-    return;
-  }
-#elif USE_WEB10G
-  if ((err = estats_record_read_data(&snap, log)) != NULL) {
-    estats_record_close(&log);
-    estats_error_print(stderr, err);
-    estats_error_free(&err);
+  if (next_snap(&snap, log, 1) != 0)
     return;
-  }
-#endif
 
   get_title(snap, agent, group, title, remport);
 
@@ -477,12 +507,7 @@ void plot_cwndtime(char *name, tcp_stat_snap* snap, tcp_stat_log* log,
   for (;;) {
     /* We've already read the first item to use with get_title */
     if (first != 0) {
-#if USE_WEB100
-      if ((web100_snap_from_log(snap, log)) != WEB100_ERR_SUCCESS) {
-#elif USE_WEB10G
-      if ((err = estats_record_read_data(&snap, log)) != NULL) {
-        estats_error_free(&err);
-#endif
+      if (next_snap(&snap, log, 0) != 0) {
         fprintf(fn, "go\n");
         return;
       }
@@ -567,27 +592,13 @@ void print_var(char *varlist, tcp_stat_snap* snap, tcp_stat_log* log,
   char *varg, savelist[256];
   char title[256], remport[8];
   int i, j;
-#if USE_WEB10G
-  estats_error* err = NULL;
-#endif
   FILE* fn;
 
   fn = stdout;
 
   /* Get the first snap from the log */
-#if USE_WEB100
-  if ((web100_snap_from_log(snap, log)) != WEB100_ERR_SUCCESS) {
-    web100_perror("web100_snap_from_log");
+  if (next_snap(&snap, log, 1) != 0)
     return;
-  }
-#elif USE_WEB10G
-  if ((err = estats_record_read_data(&snap, log)) != NULL) {
-    estats_record_close(&log);
-    estats_error_print(stderr, err);
-    estats_error_free(&err);
-    return;
-  }
-#endif
 
   get_title(snap, agent, group, title, remport);
   fprintf(fn, "Extracting Data from %s:%s connection\n\n", title, remport);
@@ -611,12 +622,7 @@ void print_var(char *varlist, tcp_stat_snap* snap, tcp_stat_log* log,
   for (i = 0;; i++) {
     /* We've already read the first item to use with get_title */
     if (i != 0) {
-#if USE_WEB100
-      if ((web100_snap_from_log(snap, log)) != WEB100_ERR_SUCCESS) {
-#elif USE_WEB10G
-      if ((err = estats_record_read_data(&snap, log)) != NULL) {
-        estats_error_free(&err);
-#endif
+      if (next_snap(&snap, log, 0) != 0) {
         printf("-------------- End Of Data  --------------\n\n");
         return;
       }
@@ -777,41 +783,46 @@ int main(int argc, char** argv) {
 
   for (j = optind; j < argc; j++) {
     snprintf(fn, sizeof(fn), "%s", argv[j]);
+    if (ndtsnap_probe(fn) == 1) {
+      if ((binlog = ndtsnap_open_read(fn)) == NULL) {
+        perror("ndtsnap_open_read");
+        exit(EXIT_FAILURE);
+      }
+    } else {
 #if USE_WEB100
-    if ((log = web100_log_open_read(fn)) == NULL) {
-      web100_perror("web100_log_open_read");
-      exit(EXIT_FAILURE);
-    }
+      if ((log = web100_log_open_read(fn)) == NULL) {
+        web100_perror("web100_log_open_read");
+        exit(EXIT_FAILURE);
+      }
 
-    if ((agent = web100_get_log_agent(log)) == NULL) {
-      web100_perror("web100_get_log_agent");
-      exit(EXIT_FAILURE);
-    }
+      if ((agent = web100_get_log_agent(log)) == NULL) {
+        web100_perror("web100_get_log_agent");
+        exit(EXIT_FAILURE);
+      }
 
-    if ((group = web100_get_log_group(log)) == NULL) {
-      web100_perror("web100_get_log_group");
-      exit(EXIT_FAILURE);
-    }
+      if ((group = web100_get_log_group(log)) == NULL) {
+        web100_perror("web100_get_log_group");
+        exit(EXIT_FAILURE);
+      }
 
-    if ((conn = web100_get_log_connection(log)) == NULL) {
-      web100_perror("web100_get_log_connection");
-      exit(EXIT_FAILURE);
-    }
+      if ((conn = web100_get_log_connection(log)) == NULL) {
+        web100_perror("web100_get_log_connection");
+        exit(EXIT_FAILURE);
+      }
+
+      if ((snap = web100_snapshot_alloc_from_log(log)) == NULL) {
+        web100_perror("web100_snapshot_alloc_from_log");
+        exit(EXIT_FAILURE);
+      }
 #elif USE_WEB10G
-    if ((err = estats_record_open(&log, fn, "r")) != NULL) {
-      estats_error_print(stderr, err);
-      estats_error_free(&err);
-      exit(EXIT_FAILURE);
-    }
+      if ((err = estats_record_open(&log, fn, "r")) != NULL) {
+        estats_error_print(stderr, err);
+        estats_error_free(&err);
+        exit(EXIT_FAILURE);
+      }
 #endif
-    fprintf(stderr, "Extracting data from Snaplog '%s'\n\n", fn);
-
-#if USE_WEB100
-    if ((snap = web100_snapshot_alloc_from_log(log)) == NULL) {
-      web100_perror("web100_snapshot_alloc_from_log");
-      exit(EXIT_FAILURE);
     }
-#endif
+    fprintf(stderr, "Extracting data from Snaplog '%s'\n\n", fn);
 
     if (plotuser == 1) {
       memset(list, 0, 1024);
@@ -874,6 +885,11 @@ int main(int argc, char** argv) {
       else
         plot_var(list, 3, "Both", snap, log, agent, group, NULL);
     }
+    if (binlog != NULL) {
+      ndtsnap_close_read(binlog);
+      binlog = NULL;
+      continue;
+    }
 #if USE_WEB100
   web100_log_close_read(log);
 #elif USE_WEB10G
@@ -32,6 +32,65 @@ char* json_create_from_single_value(const char* value) {
 	return ret;
 }
 
+/**
+ * Writes the same JSON object as json_create_from_single_value into a given
+ * buffer, without allocating memory.  Like snprintf, nothing is written when
+ * the object does not fit, but its length is still returned.
+ *
+ * @param dest buffer for the encoded JSON string, not null-terminated
+ * @param size size of dest
+ * @param value value of map entry
+ * @param len length of value
+ * @return length of the encoded JSON string, or -1 if value is not plain
+ *         ASCII and must be encoded with json_create_from_single_value
+ */
+int json_write_single_value(char* dest, int size, const char* value, int len) {
+	static const char hex[] = "0123456789ABCDEF";
+	static const char prefix[] = "{\"" DEFAULT_KEY "\": \"";
+	char seq[6];
+	const char* text;
+	int i, n, textlen;
+	unsigned char c;
+
+	n = sizeof(prefix) - 1;
+	if (n <= size)
+		memcpy(dest, prefix, n);
+	for (i = 0; i < len; i++) {
+		c = (unsigned char) value[i];
+		if (c >= 0x80)
+			return -1;
+		text = seq;
+		textlen = 2;
+		seq[0] = '\\';
+		switch (c) {
+			case '\\': seq[1] = '\\'; break;
+			case '"': seq[1] = '"'; break;
+			case '\b': seq[1] = 'b'; break;
+			case '\f': seq[1] = 'f'; break;
+			case '\n': seq[1] = 'n'; break;
+			case '\r': seq[1] = 'r'; break;
+			case '\t': seq[1] = 't'; break;
+			default:
+				if (c < 0x20) {
+					// same escape as jansson, \u00XX
+					memcpy(seq + 1, "u00", 3);
+					seq[4] = hex[c >> 4];
+					seq[5] = hex[c & 0xF];
+					textlen = 6;
+				} else {
+					text = value + i;
+					textlen = 1;
+				}
+		}
+		if (n + textlen <= size)
+			memcpy(dest + n, text, textlen);
+		n += textlen;
+	}
+	if (n + 2 <= size)
+		memcpy(dest + n, "\"}", 2);
+	return n + 2;
+}
+
 /**
  * Creates string representing JSON object with multiple key:value pairs
  * where keys are taken from "keys" parameter (separated by "keys_separator"
@@ -17,6 +17,7 @@
 #define DEFAULT_KEY "msg"
 
 char* json_create_from_single_value(const char* value);
+int json_write_single_value(char* dest, int size, const char* value, int len);
 char* json_create_from_multiple_values(const char *keys, const char *keys_delimiters,
 		                               const char *values, char *values_delimiters);
 char* json_create_from_key_value_pairs(const char* pairs);
@@ -931,14 +931,13 @@ char * get_ISOtime(char *isoTime, int isotimearrsize) {
  * @param cputime integer flag indicating if cputime trace logging is on
  * @param snapshotting integer flag indicating if snapshotting is enabled
  * @param snaplog integer flag indicating if snaplogging is enabled
- * @param tcpdump integer flag indicating if tcpdump trace logging is on
  * @param s2c_ThroughputSnapshots s2c throughput snapshots
  * @param c2s_ThroughputSnapshots c2s throughput snapshots
  *
  * RAC 7/7/09
  */
 
-void writeMeta(int compress, int cputime, int snapshotting, int snaplog, int tcpdump,
+void writeMeta(int compress, int cputime, int snapshotting, int snaplog,
         struct throughputSnapshot *s2c_ThroughputSnapshots, struct throughputSnapshot *c2s_ThroughputSnapshots) {
   FILE * fp;
   char tmpstr[256];
@@ -1026,29 +1025,7 @@ void writeMeta(int compress, int cputime, int snapshotting, int snaplog, int tcp
       }
     }
 
-    // If tcpdump file writing is enabled, compress those
-    if (tcpdump) {
-      // Try compressing C->S test tcpdump.
-      // The tcpdump file extension is as specified in the "meta" data-structure
-      memset(filename, 0, sizeof(filename));
-      snprintf(filename, sizeof(filename), "%s/%s", dirpathstr,
-               meta.c2s_ndttrace);
-      if (zlib_def(filename) != 0)
-        log_println(1, "compression failed for tcpdump file %s =%s",
-                    filename, meta.c2s_ndttrace);
-      else
-        strlcat(meta.c2s_ndttrace, ".gz", sizeof(meta.c2s_ndttrace));
-
-      // Try compressing S->C test tcpdumps
-      memset(filename, 0, sizeof(filename));
-      snprintf(filename, sizeof(filename), "%s/%s", dirpathstr,
-               meta.s2c_ndttrace);
-      if (zlib_def(filename) != 0)
-        log_println(1, "compression failed for tcpdump file %s =%s",
-                    filename, meta.s2c_ndttrace);
-      else
-        strlcat(meta.s2c_ndttrace, ".gz", sizeof(meta.s2c_ndttrace));
-    }
+    // The tcpdump files are compressed as they are written
 
     // If writing "cputime" file is enabled, compress those log files too
     if (cputime) {
@@ -0,0 +1,729 @@
+/**
+ * This file contains the functions to write and read snap logs in the
+ * compact NDT binary columnar format, described in ndtsnap.h.
+ *
+ * All integers of the header and the index are little endian.  The header
+ * is the magic, the version, the number of columns and of rows, the four
+ * connection endpoint strings and the column names, strings being stored
+ * as a 16 bit length followed by the bytes.  The index then gives, for
+ * every column, its 64 bit offset from the start of the file and its 32 bit
+ * length.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ndtsnap.h"
+
+#define NDTSNAP_COLUMN_CHUNK 256  // initial size of a column buffer
+#define NDTSNAP_VARINT_MAX 10  // longest varint of a 64 bit value
+
+// One variable being written: its samples encoded so far
+typedef struct ndtSnapColumn {
+  char* name;
+  unsigned char* data;
+  size_t len;
+  size_t size;
+  int64_t prev;  // last sample, the next one is stored as a delta from it
+} NdtSnapColumn;
+
+struct ndtSnapWriter {
+  FILE* fp;
+  NdtSnapTuple tuple;
+  int columns;
+  int rows;
+  NdtSnapColumn* cols;
+  int64_t* row;  // the row being converted from a tcp_stat snapshot
+#if USE_WEB100
+  web100_var** vars;  // the variable behind each column
+  int* types;  // and its type
+#elif USE_WEB10G
+  int elapsed;  // column of ElapsedMicroSecs, -1 if none
+  int64_t start;  // time of the first snapshot, in microseconds
+#endif
+};
+
+struct ndtSnapReader {
+  unsigned char* file;  // the whole file
+  size_t size;
+  NdtSnapTuple tuple;
+  int columns;
+  int rows;
+  char** names;
+  uint64_t* offsets;
+  uint32_t* lengths;
+  int64_t** values;  // decoded columns, NULL until first asked for
+};
+
+// Bounds checked cursor over the bytes of a file being read
+typedef struct ndtSnapCursor {
+  const unsigned char* p;
+  size_t left;
+} NdtSnapCursor;
+
+/**
+ * Append a varint to a column, growing its buffer as needed.
+ * @param col the column
+ * @param value the value, already zigzag encoded
+ * @return 0 on success, -1 if out of memory
+ */
+static int put_varint(NdtSnapColumn* col, uint64_t value) {
+  unsigned char* data;
+  size_t size;
+
+  if (col->size - col->len < NDTSNAP_VARINT_MAX) {
+    size = col->size ? col->size * 2 : NDTSNAP_COLUMN_CHUNK;
+    if ((data = (unsigned char*) realloc(col->data, size)) == NULL)
+      return -1;
+    col->data = data;
+    col->size = size;
+  }
+  while (value >= 0x80) {
+    col->data[col->len++] = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  col->data[col->len++] = (unsigned char) value;
+  return 0;
+}
+
+/**
+ * Read a varint, advancing the cursor.
+ * @param cur the cursor
+ * @param value the value is stored here on success
+ * @return 0 on success, -1 if the varint runs past the end
+ */
+static int get_varint(NdtSnapCursor* cur, uint64_t* value) {
+  unsigned int shift = 0;
+  uint64_t result = 0;
+  unsigned char byte;
+
+  do {
+    if (cur->left == 0 || shift >= 64)
+      return -1;
+    byte = *cur->p++;
+    cur->left--;
+    result |= (uint64_t) (byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  *value = result;
+  return 0;
+}
+
+/**
+ * Map a signed delta to an unsigned value that is small when the delta is
+ * close to zero, in either direction.
+ */
+static uint64_t zigzag_encode(uint64_t delta) {
+  return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+static uint64_t zigzag_decode(uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+static unsigned char* put_le(unsigned char* p, uint64_t value, int bytes) {
+  int i;
+  for (i = 0; i < bytes; i++)
+    *p++ = (unsigned char) (value >> (8 * i));
+  return p;
+}
+
+static unsigned char* put_string(unsigned char* p, const char* str) {
+  size_t len = strlen(str);
+  p = put_le(p, len, 2);
+  memcpy(p, str, len);
+  return p + len;
+}
+
+static int get_le(NdtSnapCursor* cur, uint64_t* value, int bytes) {
+  int i;
+
+  if (cur->left < (size_t) bytes)
+    return -1;
+  *value = 0;
+  for (i = 0; i < bytes; i++)
+    *value |= (uint64_t) cur->p[i] << (8 * i);
+  cur->p += bytes;
+  cur->left -= bytes;
+  return 0;
+}
+
+/**
+ * Read a header string, advancing the cursor.
+ * @param cur the cursor
+ * @param buf the string is stored here, NUL terminated
+ * @param size size of buf; longer strings are truncated
+ * @return 0 on success, -1 if the string runs past the end
+ */
+static int get_string(NdtSnapCursor* cur, char* buf, size_t size) {
+  uint64_t len;
+
+  if (get_le(cur, &len, 2) != 0 || cur->left < len)
+    return -1;
+  snprintf(buf, size, "%.*s", (int) len, (const char*) cur->p);
+  cur->p += len;
+  cur->left -= len;
+  return 0;
+}
+
+static void free_writer(NdtSnapWriter* writer) {
+  int i;
+
+  for (i = 0; i < writer->columns; i++) {
+    free(writer->cols[i].name);
+    free(writer->cols[i].data);
+  }
+  free(writer->cols);
+  free(writer->row);
+#if USE_WEB100
+  free(writer->vars);
+  free(writer->types);
+#endif
+  free(writer);
+}
+
+/**
+ * Create a binary snap log.  The samples are kept in memory, encoded, and
+ * written out by ndtsnap_close_write().
+ * @param filename the file to create
+ * @param tuple the connection endpoints, or NULL if unknown
+ * @param columns number of variables logged
+ * @param names names of the variables
+ * @return the writer, or NULL on failure, with errno set
+ */
+NdtSnapWriter* ndtsnap_open_write(const char* filename,
+                                  const NdtSnapTuple* tuple, int columns,
+                                  const char* const* names) {
+  NdtSnapWriter* writer;
+  int i;
+
+  if ((writer = (NdtSnapWriter*) calloc(1, sizeof(NdtSnapWriter))) == NULL)
+    return NULL;
+  if (tuple != NULL)
+    writer->tuple = *tuple;
+  writer->cols = (NdtSnapColumn*) calloc(columns + 1, sizeof(NdtSnapColumn));
+  writer->row = (int64_t*) calloc(columns + 1, sizeof(int64_t));
+  if (writer->cols == NULL || writer->row == NULL) {
+    free_writer(writer);
+    return NULL;
+  }
+  for (; writer->columns < columns; writer->columns++) {
+    if ((writer->cols[writer->columns].name =
+         strdup(names[writer->columns])) == NULL) {
+      free_writer(writer);
+      return NULL;
+    }
+  }
+  if ((writer->fp = fopen(filename, "w")) == NULL) {
+    i = errno;
+    free_writer(writer);
+    errno = i;
+    return NULL;
+  }
+  return writer;
+}
+
+/**
+ * Append one sample of every variable to a binary snap log.
+ * @param writer the snap log
+ * @param values the samples, in column order
+ * @return 0 on success, -1 if out of memory
+ */
+int ndtsnap_write_row(NdtSnapWriter* writer, const int64_t* values) {
+  NdtSnapColumn* col;
+  int i;
+
+  for (i = 0; i < writer->columns; i++) {
+    col = &writer->cols[i];
+    if (put_varint(col, zigzag_encode((uint64_t) values[i] -
+                                      (uint64_t) col->prev)) != 0)
+      return -1;
+    col->prev = values[i];
+  }
+  writer->rows++;
+  return 0;
+}
+
+/**
+ * Write out a binary snap log and release its writer.
+ * @param writer the snap log
+ * @return 0 on success, -1 on failure
+ */
+int ndtsnap_close_write(NdtSnapWriter* writer) {
+  unsigned char* header;
+  unsigned char* p;
+  size_t size;
+  uint64_t offset;
+  int i, ret = 0;
+
+  size = NDTSNAP_MAGIC_LEN + 3 * 4 + 2 * 4 + strlen(writer->tuple.local_addr) +
+      strlen(writer->tuple.local_port) + strlen(writer->tuple.rem_addr) +
+      strlen(writer->tuple.rem_port);
+  for (i = 0; i < writer->columns; i++)
+    size += 2 + strlen(writer->cols[i].name) + 8 + 4;
+
+  if ((header = (unsigned char*) malloc(size)) == NULL) {
+    ret = -1;
+  } else {
+    memcpy(header, NDTSNAP_MAGIC, NDTSNAP_MAGIC_LEN);
+    p = put_le(header + NDTSNAP_MAGIC_LEN, NDTSNAP_VERSION, 4);
+    p = put_le(p, writer->columns, 4);
+    p = put_le(p, writer->rows, 4);
+    p = put_string(p, writer->tuple.local_addr);
+    p = put_string(p, writer->tuple.local_port);
+    p = put_string(p, writer->tuple.rem_addr);
+    p = put_string(p, writer->tuple.rem_port);
+    for (i = 0; i < writer->columns; i++)
+      p = put_string(p, writer->cols[i].name);
+    offset = size;
+    for (i = 0; i < writer->columns; i++) {
+      p = put_le(p, offset, 8);
+      p = put_le(p, writer->cols[i].len, 4);
+      offset += writer->cols[i].len;
+    }
+    if (fwrite(header, size, 1, writer->fp) != 1)
+      ret = -1;
+    for (i = 0; i < writer->columns && ret == 0; i++) {
+      if (writer->cols[i].len &&
+          fwrite(writer->cols[i].data, writer->cols[i].len, 1,
+                 writer->fp) != 1)
+        ret = -1;
+    }
+    free(header);
+  }
+  if (fclose(writer->fp) != 0)
+    ret = -1;
+  free_writer(writer);
+  return ret;
+}
+
+/**
+ * Check whether a file is a binary snap log.
+ * @param filename the file
+ * @return 1 if it is, 0 if it is not, -1 if it cannot be read
+ */
+int ndtsnap_probe(const char* filename) {
+  char magic[NDTSNAP_MAGIC_LEN];
+  FILE* fp;
+  int ret;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+    return -1;
+  ret = fread(magic, sizeof(magic), 1, fp) == 1 &&
+      memcmp(magic, NDTSNAP_MAGIC, NDTSNAP_MAGIC_LEN) == 0;
+  fclose(fp);
+  return ret;
+}
+
+/**
+ * Open a binary snap log.  The file is read in one go; the columns are
+ * decoded when first asked for.
+ * @param filename the file
+ * @return the reader, or NULL on failure, with errno set
+ */
+NdtSnapReader* ndtsnap_open_read(const char* filename) {
+  NdtSnapReader* reader;
+  NdtSnapCursor cur;
+  FILE* fp;
+  long size;
+  uint64_t value;
+  char name[256];
+  int i, err = EINVAL;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+    return NULL;
+  if ((reader = (NdtSnapReader*) calloc(1, sizeof(NdtSnapReader))) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) != 0) {
+    err = errno;
+    goto fail;
+  }
+  reader->size = size;
+  if ((reader->file = (unsigned char*) malloc(size ? size : 1)) == NULL) {
+    err = ENOMEM;
+    goto fail;
+  }
+  if (size && fread(reader->file, size, 1, fp) != 1) {
+    err = EIO;
+    goto fail;
+  }
+  fclose(fp);
+  fp = NULL;
+
+  cur.p = reader->file;
+  cur.left = reader->size;
+  if (cur.left < NDTSNAP_MAGIC_LEN ||
+      memcmp(cur.p, NDTSNAP_MAGIC, NDTSNAP_MAGIC_LEN) != 0)
+    goto fail;
+  cur.p += NDTSNAP_MAGIC_LEN;
+  cur.left -= NDTSNAP_MAGIC_LEN;
+  if (get_le(&cur, &value, 4) != 0 || value != NDTSNAP_VERSION)
+    goto fail;
+  if (get_le(&cur, &value, 4) != 0 || value > cur.left)
+    goto fail;
+  reader->columns = value;
+  if (get_le(&cur, &value, 4) != 0 || value > INT32_MAX)
+    goto fail;
+  reader->rows = value;
+  if (get_string(&cur, reader->tuple.local_addr,
+                 sizeof(reader->tuple.local_addr)) != 0 ||
+      get_string(&cur, reader->tuple.local_port,
+                 sizeof(reader->tuple.local_port)) != 0 ||
+      get_string(&cur, reader->tuple.rem_addr,
+                 sizeof(reader->tuple.rem_addr)) != 0 ||
+      get_string(&cur, reader->tuple.rem_port,
+                 sizeof(reader->tuple.rem_port)) != 0)
+    goto fail;
+
+  reader->names = (char**) calloc(reader->columns + 1, sizeof(char*));
+  reader->offsets = (uint64_t*) calloc(reader->columns + 1, sizeof(uint64_t));
+  reader->lengths = (uint32_t*) calloc(reader->columns + 1, sizeof(uint32_t));
+  reader->values = (int64_t**) calloc(reader->columns + 1, sizeof(int64_t*));
+  if (reader->names == NULL || reader->offsets == NULL ||
+      reader->lengths == NULL || reader->values == NULL) {
+    err = ENOMEM;
+    goto fail;
+  }
+  for (i = 0; i < reader->columns; i++) {
+    if (get_string(&cur, name, sizeof(name)) != 0)
+      goto fail;
+    if ((reader->names[i] = strdup(name)) == NULL) {
+      err = ENOMEM;
+      goto fail;
+    }
+  }
+  for (i = 0; i < reader->columns; i++) {
+    if (get_le(&cur, &reader->offsets[i], 8) != 0 ||
+        get_le(&cur, &value, 4) != 0)
+      goto fail;
+    reader->lengths[i] = value;
+    if (reader->offsets[i] > reader->size ||
+        reader->lengths[i] > reader->size - reader->offsets[i])
+      goto fail;
+  }
+  return reader;
+
+fail:
+  if (fp != NULL)
+    fclose(fp);
+  ndtsnap_close_read(reader);
+  errno = err;
+  return NULL;
+}
+
+int ndtsnap_columns(const NdtSnapReader* reader) {
+  return reader->columns;
+}
+
+int ndtsnap_rows(const NdtSnapReader* reader) {
+  return reader->rows;
+}
+
+const char* ndtsnap_column_name(const NdtSnapReader* reader, int column) {
+  if (column < 0 || column >= reader->columns)
+    return NULL;
+  return reader->names[column];
+}
+
+/**
+ * Find a variable of a binary snap log.
+ * @param reader the snap log
+ * @param name name of the variable
+ * @return its column, or -1 if the log does not hold it
+ */
+int ndtsnap_find_column(const NdtSnapReader* reader, const char* name) {
+  int i;
+
+  for (i = 0; i < reader->columns; i++) {
+    if (strcmp(reader->names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Get all the samples of a variable of a binary snap log.
+ * @param reader the snap log
+ * @param column column of the variable
+ * @return ndtsnap_rows() samples, owned by the reader, or NULL if the
+ *         column is missing or corrupt
+ */
+const int64_t* ndtsnap_column(NdtSnapReader* reader, int column) {
+  NdtSnapCursor cur;
+  uint64_t value, prev = 0;
+  int64_t* values;
+  int i;
+
+  if (column < 0 || column >= reader->columns)
+    return NULL;
+  if (reader->values[column] != NULL)
+    return reader->values[column];
+
+  // Every sample takes at least one byte
+  if (reader->lengths[column] < (uint32_t) reader->rows)
+    return NULL;
+  cur.p = reader->file + reader->offsets[column];
+  cur.left = reader->lengths[column];
+  if ((values = (int64_t*) malloc((reader->rows ? reader->rows : 1) *
+                                  sizeof(int64_t))) == NULL)
+    return NULL;
+  for (i = 0; i < reader->rows; i++) {
+    if (get_varint(&cur, &value) != 0) {
+      free(values);
+      return NULL;
+    }
+    prev += zigzag_decode(value);
+    values[i] = (int64_t) prev;
+  }
+  reader->values[column] = values;
+  return values;
+}
+
+const NdtSnapTuple* ndtsnap_tuple(const NdtSnapReader* reader) {
+  return &reader->tuple;
+}
+
+void ndtsnap_close_read(NdtSnapReader* reader) {
+  int i;
+
+  if (reader == NULL)
+    return;
+  for (i = 0; i < reader->columns; i++) {
+    if (reader->names != NULL)
+      free(reader->names[i]);
+    if (reader->values != NULL)
+      free(reader->values[i]);
+  }
+  free(reader->names);
+  free(reader->offsets);
+  free(reader->lengths);
+  free(reader->values);
+  free(reader->file);
+  free(reader);
+}
+
+#if USE_WEB100
+/**
+ * Convert the binary value of a web100 variable to an integer, without
+ * going through web100_value_to_text().
+ * @param type web100 type of the variable
+ * @param buf the value as returned by web100_snap_read()/web100_raw_read()
+ * @return the value
+ */
+int64_t web100_value_to_int64(int type, const char* buf) {
+  int32_t s32;
+  u_int32_t u32;
+  u_int64_t u64;
+
+  switch (type) {
+    case WEB100_TYPE_COUNTER64:
+      memcpy(&u64, buf, sizeof(u64));
+      return (int64_t) u64;
+    case WEB100_TYPE_INTEGER:
+    case WEB100_TYPE_INTEGER32:
+      memcpy(&s32, buf, sizeof(s32));
+      return s32;
+    default:
+      memcpy(&u32, buf, sizeof(u32));
+      return u32;
+  }
+}
+
+/**
+ * Tell whether a web100 type is logged as a column: the addresses, ports
+ * and strings only go to the header.
+ */
+static int web100_type_is_integer(int type) {
+  switch (type) {
+    case WEB100_TYPE_INTEGER:
+    case WEB100_TYPE_INTEGER32:
+    case WEB100_TYPE_COUNTER32:
+    case WEB100_TYPE_GAUGE32:
+    case WEB100_TYPE_UNSIGNED32:
+    case WEB100_TYPE_TIME_TICKS:
+    case WEB100_TYPE_COUNTER64:
+      return 1;
+    default:
+      return 0;
+  }
+}
+#elif USE_WEB10G
+/**
+ * Get a web10g value as an integer.
+ * @param data A web10g data capture
+ * @param index index of the variable in estats_var_array
+ * @param value the value is stored here on success
+ * @return 0 on success, -1 if the variable is missing or masked
+ */
+int web10g_value_at(const tcp_stat_snap* data, int index, int64_t* value) {
+  if (index < 0 || index >= data->length || data->val[index].masked)
+    return -1;
+  switch (estats_var_array[index].valtype) {
+    case ESTATS_UNSIGNED64:
+      *value = (int64_t) data->val[index].uv64;
+      break;
+    case ESTATS_SIGNED32:
+      *value = data->val[index].sv32;
+      break;
+    case ESTATS_UNSIGNED16:
+      *value = data->val[index].uv16;
+      break;
+    case ESTATS_UNSIGNED8:
+      *value = data->val[index].uv8;
+      break;
+    default:
+      *value = data->val[index].uv32;
+      break;
+  }
+  return 0;
+}
+#endif
+
+/**
+ * Create a binary snap log for the snapshots of a connection, with a column
+ * for every integer variable of the snapshot.
+ * @param filename the file to create
+ * @param agent tcp_stat agent
+ * @param group web100 group of the snapshot - ignored by Web10G
+ * @param snap a snapshot of the connection, used for the endpoints
+ * @return the writer, or NULL on failure
+ */
+NdtSnapWriter* tcp_stat_ndtsnap_open(const char* filename,
+                                     tcp_stat_agent* agent,
+                                     tcp_stat_group* group,
+                                     tcp_stat_snap* snap) {
+  NdtSnapWriter* writer;
+  NdtSnapTuple tuple;
+  const char** names;
+  int count = 0;
+#if USE_WEB100
+  web100_var* var;
+  web100_var** vars;
+  char buf[WEB100_VALUE_LEN_MAX];
+  char* field;
+  size_t size;
+  const char* name;
+  int type;
+
+  memset(&tuple, 0, sizeof(tuple));
+  for (var = web100_var_head(group); var != NULL; var = web100_var_next(var))
+    count++;
+  names = (const char**) calloc(count + 1, sizeof(char*));
+  vars = (web100_var**) calloc(count + 1, sizeof(web100_var*));
+  if (names == NULL || vars == NULL) {
+    free(names);
+    free(vars);
+    return NULL;
+  }
+  count = 0;
+  for (var = web100_var_head(group); var != NULL; var = web100_var_next(var)) {
+    name = web100_get_var_name(var);
+    type = web100_get_var_type(var);
+    if (web100_type_is_integer(type)) {
+      names[count] = name;
+      vars[count++] = var;
+      continue;
+    }
+    field = NULL;
+    if (strcmp(name, "LocalAddress") == 0) {
+      field = tuple.local_addr;
+      size = sizeof(tuple.local_addr);
+    } else if (strcmp(name, "LocalPort") == 0) {
+      field = tuple.local_port;
+      size = sizeof(tuple.local_port);
+    } else if (strcmp(name, "RemAddress") == 0) {
+      field = tuple.rem_addr;
+      size = sizeof(tuple.rem_addr);
+    } else if (strcmp(name, "RemPort") == 0) {
+      field = tuple.rem_port;
+      size = sizeof(tuple.rem_port);
+    }
+    if (field != NULL && web100_snap_read(var, snap, buf) == WEB100_ERR_SUCCESS)
+      snprintf(field, size, "%s", web100_value_to_text(type, buf));
+  }
+  writer = ndtsnap_open_write(filename, &tuple, count, names);
+  free(names);
+  if (writer == NULL) {
+    free(vars);
+    return NULL;
+  }
+  writer->vars = vars;
+  if ((writer->types = (int*) calloc(count + 1, sizeof(int))) == NULL) {
+    fclose(writer->fp);
+    free_writer(writer);
+    return NULL;
+  }
+  for (count = 0; count < writer->columns; count++)
+    writer->types[count] = web100_get_var_type(vars[count]);
+#elif USE_WEB10G
+  struct estats_connection_tuple_ascii tuple_ascii;
+  estats_error* err = NULL;
+
+  memset(&tuple, 0, sizeof(tuple));
+  if ((err = estats_connection_tuple_as_strings(&tuple_ascii,
+                                                &snap->tuple)) != NULL) {
+    estats_error_free(&err);
+  } else {
+    snprintf(tuple.local_addr, sizeof(tuple.local_addr), "%s",
+             tuple_ascii.local_addr);
+    snprintf(tuple.local_port, sizeof(tuple.local_port), "%s",
+             tuple_ascii.local_port);
+    snprintf(tuple.rem_addr, sizeof(tuple.rem_addr), "%s",
+             tuple_ascii.rem_addr);
+    snprintf(tuple.rem_port, sizeof(tuple.rem_port), "%s",
+             tuple_ascii.rem_port);
+  }
+  if ((names = (const char**) calloc(WEB10G_NUM_VARS, sizeof(char*))) == NULL)
+    return NULL;
+  for (count = 0; count < WEB10G_NUM_VARS; count++)
+    names[count] = estats_var_array[count].name;
+  writer = ndtsnap_open_write(filename, &tuple, count, names);
+  free(names);
+  if (writer == NULL)
+    return NULL;
+  writer->elapsed = -1;
+  for (count = 0; count < writer->columns; count++) {
+    if (strcmp(writer->cols[count].name, "ElapsedMicroSecs") == 0)
+      writer->elapsed = count;
+  }
+  writer->start = (int64_t) snap->tv.sec * 1000000 + snap->tv.usec;
+#endif
+  return writer;
+}
+
+/**
+ * Append a snapshot to a binary snap log opened by tcp_stat_ndtsnap_open().
+ * Variables that cannot be read are logged as 0.  ElapsedMicroSecs, not
+ * kept by the Web10G kernel patch, is taken from the snapshot timestamps.
+ * @param writer the snap log
+ * @param snap the snapshot
+ * @return 0 on success, -1 if out of memory
+ */
+int tcp_stat_ndtsnap_write(NdtSnapWriter* writer, tcp_stat_snap* snap) {
+  int i;
+#if USE_WEB100
+  char buf[WEB100_VALUE_LEN_MAX];
+
+  for (i = 0; i < writer->columns; i++) {
+    if (web100_snap_read(writer->vars[i], snap, buf) == WEB100_ERR_SUCCESS)
+      writer->row[i] = web100_value_to_int64(writer->types[i], buf);
+    else
+      writer->row[i] = 0;
+  }
+#elif USE_WEB10G
+  for (i = 0; i < writer->columns; i++) {
+    if (web10g_value_at(snap, i, &writer->row[i]) != 0)
+      writer->row[i] = 0;
+  }
+  if (writer->elapsed != -1) {
+    writer->row[writer->elapsed] =
+        (int64_t) snap->tv.sec * 1000000 + snap->tv.usec - writer->start;
+  }
+#endif
+  return ndtsnap_write_row(writer, writer->row);
+}
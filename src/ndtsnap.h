@@ -0,0 +1,64 @@
+/*
+ * This file contains the definitions and function declarations to write
+ * and read snap logs in the compact NDT binary columnar format.
+ *
+ * A file holds a header, with the connection endpoints and the names of
+ * the variables, an index giving the offset and length of each column,
+ * and then the columns themselves.  Every column holds the samples of one
+ * variable, each one stored as the zigzag varint of its difference to the
+ * previous sample, so the slowly changing counters of a snap log take one
+ * or two bytes per sample instead of the four or eight of a raw snapshot.
+ */
+
+#ifndef SRC_NDTSNAP_H_
+#define SRC_NDTSNAP_H_
+
+#include <stdint.h>
+
+#include "web100srv.h"
+
+#define NDTSNAP_MAGIC "NDTSNAP"  // first 8 bytes of a file, NUL included
+#define NDTSNAP_MAGIC_LEN 8
+#define NDTSNAP_VERSION 1
+
+// Connection endpoints recorded in the header, as text
+typedef struct ndtSnapTuple {
+  char local_addr[64];
+  char local_port[8];
+  char rem_addr[64];
+  char rem_port[8];
+} NdtSnapTuple;
+
+typedef struct ndtSnapWriter NdtSnapWriter;
+typedef struct ndtSnapReader NdtSnapReader;
+
+NdtSnapWriter* ndtsnap_open_write(const char* filename,
+                                  const NdtSnapTuple* tuple, int columns,
+                                  const char* const* names);
+int ndtsnap_write_row(NdtSnapWriter* writer, const int64_t* values);
+int ndtsnap_close_write(NdtSnapWriter* writer);
+
+int ndtsnap_probe(const char* filename);
+NdtSnapReader* ndtsnap_open_read(const char* filename);
+int ndtsnap_columns(const NdtSnapReader* reader);
+int ndtsnap_rows(const NdtSnapReader* reader);
+const char* ndtsnap_column_name(const NdtSnapReader* reader, int column);
+int ndtsnap_find_column(const NdtSnapReader* reader, const char* name);
+const int64_t* ndtsnap_column(NdtSnapReader* reader, int column);
+const NdtSnapTuple* ndtsnap_tuple(const NdtSnapReader* reader);
+void ndtsnap_close_read(NdtSnapReader* reader);
+
+/* Snap logs of tcp_stat snapshots */
+NdtSnapWriter* tcp_stat_ndtsnap_open(const char* filename,
+                                     tcp_stat_agent* agent,
+                                     tcp_stat_group* group,
+                                     tcp_stat_snap* snap);
+int tcp_stat_ndtsnap_write(NdtSnapWriter* writer, tcp_stat_snap* snap);
+
+#if USE_WEB100
+int64_t web100_value_to_int64(int type, const char* buf);
+#elif USE_WEB10G
+int web10g_value_at(const tcp_stat_snap* data, int index, int64_t* value);
+#endif
+
+#endif  // SRC_NDTSNAP_H_
@@ -0,0 +1,164 @@
+/*
+ * ndtsnapconv: converts Web100/Web10G snaplogs to the compact binary
+ *              columnar format read by genplot and web100srv.
+ *
+ * Usage: ndtsnapconv [-o output] <snaplog> [<snaplog> ...]
+ */
+
+#include "../config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "web100srv.h"
+#include "usage.h"
+#include "ndtsnap.h"
+
+static struct option long_options[] = { { "output", 1, 0, 'o' }, { "help", 0,
+  0, 'h' }, { "version", 0, 0, 'v' }, { 0, 0, 0, 0 } };
+
+/**
+ * Get the size of a file.
+ * @param name the file
+ * @return its size, or -1 if it cannot be found
+ */
+static long file_size(const char* name) {
+  struct stat st;
+
+  if (stat(name, &st) != 0)
+    return -1;
+  return st.st_size;
+}
+
+/**
+ * Convert one snaplog.
+ * @param in name of the Web100/Web10G snaplog
+ * @param out name of the binary snaplog to create
+ * @return the number of snapshots converted, or -1 on failure
+ */
+static int convert(char* in, char* out) {
+  tcp_stat_agent* agent = NULL;
+  tcp_stat_group* group = NULL;
+  tcp_stat_log* log = NULL;
+  tcp_stat_snap* snap = NULL;
+  NdtSnapWriter* writer;
+  int count = 0;
+#if USE_WEB100
+  if ((log = web100_log_open_read(in)) == NULL) {
+    web100_perror("web100_log_open_read");
+    return -1;
+  }
+  if ((agent = web100_get_log_agent(log)) == NULL ||
+      (group = web100_get_log_group(log)) == NULL ||
+      (snap = web100_snapshot_alloc_from_log(log)) == NULL) {
+    web100_perror("web100_snapshot_alloc_from_log");
+    web100_log_close_read(log);
+    return -1;
+  }
+  if (web100_snap_from_log(snap, log) != WEB100_ERR_SUCCESS) {
+    web100_perror("web100_snap_from_log");
+    web100_snapshot_free(snap);
+    web100_log_close_read(log);
+    return -1;
+  }
+#elif USE_WEB10G
+  estats_error* err = NULL;
+
+  if ((err = estats_record_open(&log, in, "r")) != NULL ||
+      (err = estats_record_read_data(&snap, log)) != NULL) {
+    estats_error_print(stderr, err);
+    estats_error_free(&err);
+    if (log != NULL)
+      estats_record_close(&log);
+    return -1;
+  }
+#endif
+
+  if ((writer = tcp_stat_ndtsnap_open(out, agent, group, snap)) == NULL) {
+    perror(out);
+    count = -1;
+  }
+  while (writer != NULL) {
+    if (tcp_stat_ndtsnap_write(writer, snap) != 0) {
+      perror(out);
+      ndtsnap_close_write(writer);
+      count = -1;
+      break;
+    }
+    count++;
+#if USE_WEB100
+    if (web100_snap_from_log(snap, log) != WEB100_ERR_SUCCESS) {
+#elif USE_WEB10G
+    estats_val_data_free(&snap);
+    if ((err = estats_record_read_data(&snap, log)) != NULL) {
+      estats_error_free(&err);
+#endif
+      if (ndtsnap_close_write(writer) != 0) {
+        perror(out);
+        count = -1;
+      }
+      break;
+    }
+  }
+
+#if USE_WEB100
+  web100_snapshot_free(snap);
+  web100_log_close_read(log);
+#elif USE_WEB10G
+  estats_val_data_free(&snap);
+  estats_record_close(&log);
+#endif
+  return count;
+}
+
+int main(int argc, char** argv) {
+  char *output = NULL, out[256];
+  int c, j, count, ret = 0;
+
+  while ((c = getopt_long(argc, argv, "o:hv", long_options, 0)) != -1) {
+    switch (c) {
+      case 'o':
+        output = optarg;
+        break;
+      case 'h':
+        ndtsnapconv_long_usage(
+            "ANL/Internet2 NDT version " VERSION " (ndtsnapconv)", argv[0]);
+        break;
+      case 'v':
+        printf("ANL/Internet2 NDT version %s (ndtsnapconv)\n", VERSION);
+        exit(0);
+        break;
+    }
+  }
+
+  if (optind == argc) {
+    short_usage(argv[0], "Missing snaplog file");
+  }
+  if (output != NULL && argc - optind > 1) {
+    short_usage(argv[0], "--output needs a single snaplog file");
+  }
+
+  for (j = optind; j < argc; j++) {
+    if (output != NULL)
+      snprintf(out, sizeof(out), "%s", output);
+    else
+      snprintf(out, sizeof(out), "%s.ndtsnap", argv[j]);
+    if (ndtsnap_probe(argv[j]) == 1) {
+      fprintf(stderr, "'%s' is already a binary snaplog\n", argv[j]);
+      continue;
+    }
+    if ((count = convert(argv[j], out)) < 0) {
+      fprintf(stderr, "Cannot convert snaplog '%s'\n", argv[j]);
+      ret = 1;
+      continue;
+    }
+    printf("%s: %d snapshots, %ld -> %ld bytes (%s)\n", argv[j], count,
+           file_size(argv[j]), file_size(out), out);
+  }
+
+  exit(ret);
+}
@@ -0,0 +1,293 @@
+/**
+ * This file contains the functions to write the ndttrace packet captures
+ * in the background, described in ndttrace.h.
+ *
+ * The blocks form a ring: the capture thread fills the block at head and
+ * hands it over by moving head, the writer thread writes out the blocks
+ * from tail up to head and frees each one by moving tail.  Each index is
+ * only moved by one of the threads, so packets are copied without locking;
+ * the lock is only taken to wake up the writer once per block.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "ndttrace.h"
+
+#define NDTTRACE_MAGIC 0xa1b2c3d4  // tcpdump format, microsecond times
+#define NDTTRACE_LINKTYPE_ETHERNET 1
+
+// Header of a tcpdump file
+typedef struct ndtTraceFileHeader {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} NdtTraceFileHeader;
+
+// Header of a packet of a tcpdump file
+typedef struct ndtTraceRecord {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t caplen;
+  uint32_t len;
+} NdtTraceRecord;
+
+struct ndtTraceWriter {
+  int fd;
+  gzFile gz;  // compressed stream over fd, NULL to write the blocks as is
+  unsigned char* blocks[NDTTRACE_BLOCKS];
+  size_t used[NDTTRACE_BLOCKS];  // bytes filled in each block
+  int records[NDTTRACE_BLOCKS];  // packets in each block
+  unsigned int head;  // block being filled, only moved by the capture thread
+  unsigned int tail;  // next block to write, only moved by the writer thread
+  int stop;  // set when the writer should finish the blocks handed over
+  pthread_mutex_t lock;  // protects stop, and waiting for head to move
+  pthread_cond_t cond;  // signalled when head moves or stop is set
+  pthread_t thread;  // the writer thread
+  int dropped;  // packets without a free block, counted by the capture thread
+  int packets;  // packets written, counted by the writer thread
+  int lost;  // packets of the blocks that failed to be written
+  int error;  // errno of the first failed write, 0 if none
+};
+
+/**
+ * Write a block of packets out to an ndttrace file.
+ * @param writer the file
+ * @param p the bytes to write
+ * @param len the number of bytes
+ * @return 0 on success, -1 on failure, with errno set
+ */
+static int write_trace_bytes(NdtTraceWriter* writer, const unsigned char* p,
+                             size_t len) {
+  ssize_t n;
+
+  if (writer->gz != NULL) {
+    if (len > 0 && gzwrite(writer->gz, p, len) != (int) len) {
+      errno = EIO;
+      return -1;
+    }
+    return 0;
+  }
+  while (len > 0) {
+    if ((n = write(writer->fd, p, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Write out one block of an ndttrace file and empty it.  After a failure
+ * the next blocks are only counted as lost.
+ * @param writer the file
+ * @param block the block
+ */
+static void flush_trace_block(NdtTraceWriter* writer, int block) {
+  if (writer->error == 0 &&
+      write_trace_bytes(writer, writer->blocks[block],
+                        writer->used[block]) != 0)
+    writer->error = errno;
+  if (writer->error == 0)
+    writer->packets += writer->records[block];
+  else
+    writer->lost += writer->records[block];
+  writer->used[block] = 0;
+  writer->records[block] = 0;
+}
+
+/**
+ * The writer thread of an ndttrace file.  It writes out the blocks handed
+ * over by the capture thread until the file is closed.
+ * @param arg the NdtTraceWriter
+ * @return NULL
+ */
+static void* trace_writer(void* arg) {
+  NdtTraceWriter* writer = (NdtTraceWriter*) arg;
+  unsigned int tail = writer->tail;
+
+  for (;;) {
+    pthread_mutex_lock(&writer->lock);
+    while (tail == __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE) &&
+           !writer->stop)
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    if (tail == __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_unlock(&writer->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    flush_trace_block(writer, tail % NDTTRACE_BLOCKS);
+    __atomic_store_n(&writer->tail, ++tail, __ATOMIC_RELEASE);
+  }
+}
+
+static void free_trace_writer(NdtTraceWriter* writer) {
+  int i;
+
+  for (i = 0; i < NDTTRACE_BLOCKS; i++)
+    free(writer->blocks[i]);
+  free(writer);
+}
+
+/**
+ * Create an ndttrace file and start its writer thread.
+ * @param filename the file to create
+ * @param snaplen the most bytes captured of each packet
+ * @param compress 1 to compress the file with gzip, 0 to write it as is
+ * @return the writer, or NULL on failure, with errno set
+ */
+NdtTraceWriter* ndttrace_open(const char* filename, int snaplen,
+                              int compress) {
+  NdtTraceWriter* writer;
+  NdtTraceFileHeader header;
+  char mode[8];
+  int i, rc;
+
+  if ((writer = (NdtTraceWriter*) calloc(1, sizeof(NdtTraceWriter))) == NULL)
+    return NULL;
+  for (i = 0; i < NDTTRACE_BLOCKS; i++) {
+    if ((writer->blocks[i] = (unsigned char*) malloc(NDTTRACE_BLOCK_SIZE)) ==
+        NULL) {
+      free_trace_writer(writer);
+      return NULL;
+    }
+  }
+  if ((writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    rc = errno;
+    free_trace_writer(writer);
+    errno = rc;
+    return NULL;
+  }
+  if (compress) {
+    snprintf(mode, sizeof(mode), "wb%d", NDTTRACE_GZIP_LEVEL);
+    if ((writer->gz = gzdopen(writer->fd, mode)) == NULL) {
+      close(writer->fd);
+      unlink(filename);
+      free_trace_writer(writer);
+      errno = ENOMEM;
+      return NULL;
+    }
+    gzbuffer(writer->gz, NDTTRACE_BLOCK_SIZE);
+  }
+
+  // The file header goes out with the first block of packets
+  memset(&header, 0, sizeof(header));
+  header.magic = NDTTRACE_MAGIC;
+  header.version_major = 2;
+  header.version_minor = 4;
+  header.snaplen = snaplen;
+  header.linktype = NDTTRACE_LINKTYPE_ETHERNET;
+  memcpy(writer->blocks[0], &header, sizeof(header));
+  writer->used[0] = sizeof(header);
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  if ((rc = pthread_create(&writer->thread, NULL, trace_writer, writer)) !=
+      0) {
+    if (writer->gz != NULL)
+      gzclose(writer->gz);
+    else
+      close(writer->fd);
+    unlink(filename);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+    free_trace_writer(writer);
+    errno = rc;
+    return NULL;
+  }
+  return writer;
+}
+
+/**
+ * Add a packet to an ndttrace file.  It never waits for the disk: the
+ * packet is dropped if every block is waiting for the writer thread.  Only
+ * one thread at a time may add packets to a file.
+ * @param writer the file
+ * @param ts the time the packet was captured
+ * @param caplen the number of bytes captured
+ * @param len the length of the packet on the wire
+ * @param data the bytes captured
+ */
+void ndttrace_write(NdtTraceWriter* writer, const struct timeval* ts,
+                    uint32_t caplen, uint32_t len, const unsigned char* data) {
+  unsigned int block = writer->head % NDTTRACE_BLOCKS;
+  NdtTraceRecord record;
+
+  if (caplen > NDTTRACE_BLOCK_SIZE - sizeof(record)) {
+    writer->dropped++;
+    return;
+  }
+  if (writer->used[block] + sizeof(record) + caplen > NDTTRACE_BLOCK_SIZE) {
+    // Hand the full block over, unless the next one is still waiting
+    if (writer->head + 1 - __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE) >=
+        NDTTRACE_BLOCKS) {
+      writer->dropped++;
+      return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    __atomic_store_n(&writer->head, writer->head + 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    block = writer->head % NDTTRACE_BLOCKS;
+  }
+
+  record.ts_sec = ts->tv_sec;
+  record.ts_usec = ts->tv_usec;
+  record.caplen = caplen;
+  record.len = len;
+  memcpy(writer->blocks[block] + writer->used[block], &record,
+         sizeof(record));
+  memcpy(writer->blocks[block] + writer->used[block] + sizeof(record), data,
+         caplen);
+  writer->used[block] += sizeof(record) + caplen;
+  writer->records[block]++;
+}
+
+/**
+ * Write out the packets left in an ndttrace file, close it and release its
+ * writer.
+ * @param writer the file
+ * @param stats filled with the counts of the file, may be NULL
+ * @return 0 on success, else the errno of the first failure
+ */
+int ndttrace_close(NdtTraceWriter* writer, NdtTraceStats* stats) {
+  int ret;
+
+  pthread_mutex_lock(&writer->lock);
+  writer->stop = 1;
+  pthread_cond_signal(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  // The block being filled was never handed over
+  flush_trace_block(writer, writer->head % NDTTRACE_BLOCKS);
+  if (writer->gz != NULL) {
+    if (gzclose(writer->gz) != Z_OK && writer->error == 0)
+      writer->error = EIO;
+  } else if (close(writer->fd) != 0 && writer->error == 0) {
+    writer->error = errno;
+  }
+
+  if (stats != NULL) {
+    stats->packets = writer->packets;
+    stats->dropped = writer->dropped + writer->lost;
+  }
+  ret = writer->error;
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->cond);
+  free_trace_writer(writer);
+  return ret;
+}
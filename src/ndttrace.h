@@ -0,0 +1,36 @@
+/*
+ * This file contains the definitions and function declarations to write
+ * the ndttrace packet captures of the throughput tests in the background.
+ *
+ * The capture thread only copies each packet into a large block, and hands
+ * the full blocks to a writer thread which writes them out, compressed on
+ * the fly with gzip if asked to.  A slow disk therefore never stalls the
+ * capture: when every block waits for the writer, the packet is left out of
+ * the file and counted as dropped.  The files are in the tcpdump format.
+ */
+
+#ifndef SRC_NDTTRACE_H_
+#define SRC_NDTTRACE_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define NDTTRACE_BLOCK_SIZE (1 << 18)  // bytes of a block of packets
+#define NDTTRACE_BLOCKS 8  // blocks being filled or waiting for the writer
+#define NDTTRACE_GZIP_LEVEL 1  // favor speed, the traces compress well anyway
+
+// Counts of an ndttrace file, once it is closed
+typedef struct ndtTraceStats {
+  int packets;  // packets written to the file
+  int dropped;  // packets left out, for lack of a free block or on errors
+} NdtTraceStats;
+
+typedef struct ndtTraceWriter NdtTraceWriter;
+
+NdtTraceWriter* ndttrace_open(const char* filename, int snaplen,
+                              int compress);
+void ndttrace_write(NdtTraceWriter* writer, const struct timeval* ts,
+                    uint32_t caplen, uint32_t len, const unsigned char* data);
+int ndttrace_close(NdtTraceWriter* writer, NdtTraceStats* stats);
+
+#endif  // SRC_NDTTRACE_H_
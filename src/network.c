@@ -10,7 +10,10 @@
 #include <netdb.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "jsonutils.h"
 
@@ -62,6 +65,18 @@ static int OpenSocket(I2Addr addr, char* serv, int family, int options) {
     }
     // end trying to set socket option to reuse local address
 
+#ifdef SO_REUSEPORT
+    // let several processes bind their own listener on the same port, and
+    // have the kernel spread incoming connections across them
+    if (options & OPT_REUSEPORT) {
+      on = 1;
+      if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+        return_code = -2;
+        goto failsock;
+      }
+    }
+#endif
+
 #ifdef AF_INET6
 #ifdef IPV6_V6ONLY
     if (family == AF_INET6 && (options & OPT_IPV6_ONLY)) {
@@ -469,22 +484,42 @@ int send_json_message_any(Connection* ctl, int type, const char* msg, int len,
  * @return 0 on success, -1 otherwise
  */
 int send_msg_any(Connection* ctl, int type, const void* msg, int len) {
-  unsigned char buff[3];
+  return send_msg_prefixed(ctl, NULL, 0, type, msg, len);
+}
+
+/**
+ * Sends the protocol message to the control connection behind some framing,
+ * such as a websocket header.  The framing, the message header and the
+ * message go out in a single write.
+ * @param ctl control Connection
+ * @param prefix framing to send before the message, may be NULL
+ * @param prefix_len length of the framing, at most WEBSOCKET_MAX_HEADER
+ * @param type type of the message
+ * @param msg message to send
+ * @param len length of the message
+ * @return 0 on success, -1 otherwise
+ */
+int send_msg_prefixed(Connection* ctl, const void* prefix, int prefix_len,
+                      int type, const void* msg, int len) {
+  unsigned char buff[WEBSOCKET_MAX_HEADER + 3];
+  struct iovec iov[2];
 
   assert(msg);
   assert(len >= 0);
+  assert(prefix_len >= 0 && prefix_len <= WEBSOCKET_MAX_HEADER);
 
-  /*  memset(0, buff, 3); */
+  if (prefix_len > 0)
+    memcpy(buff, prefix, prefix_len);
   // set message type and length into message itself
-  buff[0] = type;
-  buff[1] = len >> 8;
-  buff[2] = len;
-
-  // Write initial data about length and type to socket
-  if (writen_any(ctl, buff, 3) != 3) return -1;
-
-  // Now write the actual message
-  if (writen_any(ctl, msg, len) != len) return -1;
+  buff[prefix_len] = type;
+  buff[prefix_len + 1] = len >> 8;
+  buff[prefix_len + 2] = len;
+
+  iov[0].iov_base = buff;
+  iov[0].iov_len = prefix_len + 3;
+  iov[1].iov_base = (void*) msg;
+  iov[1].iov_len = len;
+  if (writev_any(ctl, iov, 2) != prefix_len + 3 + len) return -1;
   log_println(8, ">>> send_msg: type=%d, len=%d, msg=%s, pid=%d", type, len,
               msg, getpid());
 
@@ -493,6 +528,138 @@ int send_msg_any(Connection* ctl, int type, const void* msg, int len) {
   return 0;
 }
 
+/**
+ * Starts a batch of protocol messages to the control connection.  The
+ * messages are framed into the buffer of the batch and written together
+ * when it fills up or is flushed, which over TLS is a single record.
+ * @param batch the batch
+ * @param ctl control Connection
+ * @param connectionFlags the JSON_SUPPORT and WEBSOCKET_SUPPORT flags of the
+ *                        client, which decide how the messages are framed
+ */
+void msg_batch_init(MsgBatch* batch, Connection* ctl, int connectionFlags) {
+  batch->conn = ctl;
+  batch->connectionFlags = connectionFlags;
+  batch->len = 0;
+  batch->error = 0;
+}
+
+/**
+ * Writes out the messages of a batch.
+ * @param batch the batch
+ * @return 0 on success, -1 if this or an earlier write failed
+ */
+int msg_batch_flush(MsgBatch* batch) {
+  if (batch->error == 0 && batch->len > 0 &&
+      writen_any(batch->conn, batch->buff, batch->len) != batch->len)
+    batch->error = -1;
+  batch->len = 0;
+  return batch->error;
+}
+
+/**
+ * Frames a message whose body has already been placed in the buffer of a
+ * batch, WEBSOCKET_MAX_HEADER + 3 bytes after its end, and appends it to the
+ * batch.
+ * @param batch the batch
+ * @param type type of the message
+ * @param len length of the body
+ */
+static void frame_batch_msg(MsgBatch* batch, int type, int len) {
+  unsigned char* p = batch->buff + batch->len;
+  unsigned char* body = p + WEBSOCKET_MAX_HEADER + 3;
+  int hdr_len = 0;
+
+  if (batch->connectionFlags & WEBSOCKET_SUPPORT)
+    hdr_len = websocket_frame_header(p, len + 3);
+  p[hdr_len] = type;
+  p[hdr_len + 1] = len >> 8;
+  p[hdr_len + 2] = len;
+  if (hdr_len + 3 < WEBSOCKET_MAX_HEADER + 3)
+    memmove(p + hdr_len + 3, body, len);
+  log_println(8, ">>> send_msg: type=%d, len=%d, msg=%.*s, pid=%d", type, len,
+              len, p + hdr_len + 3, getpid());
+  protolog_sendprintln(type, p + hdr_len + 3, len, getpid(),
+                       batch->conn->socket);
+  batch->len += hdr_len + 3 + len;
+}
+
+/**
+ * Adds a protocol message to a batch, framed for a websocket client if the
+ * batch is.  A message too large for the buffer is sent on its own.
+ * @param batch the batch
+ * @param type type of the message
+ * @param msg message to send
+ * @param len length of the message
+ * @return 0 on success, -1 if this or an earlier write failed
+ */
+int msg_batch_add(MsgBatch* batch, int type, const void* msg, int len) {
+  int room = MSG_BATCH_SIZE - WEBSOCKET_MAX_HEADER - 3;
+
+  assert(msg);
+  assert(len >= 0);
+
+  if (batch->error != 0)
+    return batch->error;
+  if (batch->len + len > room && msg_batch_flush(batch) != 0)
+    return batch->error;
+  if (len > room) {
+    if (batch->connectionFlags & WEBSOCKET_SUPPORT)
+      batch->error = send_websocket_msg(batch->conn, type, msg, len) ? -1 : 0;
+    else
+      batch->error = send_msg_any(batch->conn, type, msg, len);
+    return batch->error;
+  }
+  memcpy(batch->buff + batch->len + WEBSOCKET_MAX_HEADER + 3, msg, len);
+  frame_batch_msg(batch, type, len);
+  return 0;
+}
+
+/**
+ * Adds a protocol message to a batch, converted like send_json_message_any
+ * does with JSON_SINGLE_VALUE when the client supports JSON.  The JSON
+ * object is written straight into the buffer of the batch.
+ * @param batch the batch
+ * @param type type of the message
+ * @param msg message to send
+ * @param len length of the message
+ * @return 0 on success, error code otherwise
+ *        Error codes:
+ *        -1 - Cannot write to socket
+ *        -4 - Cannot convert msg to JSON
+ */
+int msg_batch_add_json(MsgBatch* batch, int type, const char* msg, int len) {
+  int room = MSG_BATCH_SIZE - WEBSOCKET_MAX_HEADER - 3;
+  char* body;
+  int n;
+
+  if (!(batch->connectionFlags & JSON_SUPPORT))
+    return msg_batch_add(batch, type, msg, len);
+  if (batch->error != 0)
+    return batch->error;
+
+  body = (char*) batch->buff + batch->len + WEBSOCKET_MAX_HEADER + 3;
+  n = json_write_single_value(body, room - batch->len, msg, len);
+  if (n > room - batch->len && n <= room) {
+    if (msg_batch_flush(batch) != 0)
+      return batch->error;
+    body = (char*) batch->buff + WEBSOCKET_MAX_HEADER + 3;
+    n = json_write_single_value(body, room, msg, len);
+  }
+  if (n < 0 || n > room) {
+    // Not plain ASCII, or too large: convert and send it on its own
+    if (msg_batch_flush(batch) != 0)
+      return batch->error;
+    n = send_json_message_any(batch->conn, type, msg, len,
+                              batch->connectionFlags, JSON_SINGLE_VALUE);
+    if (n != 0 && n != -4)
+      batch->error = -1;
+    return n;
+  }
+  frame_batch_msg(batch, type, n);
+  return 0;
+}
+
 /**
  * Receive the protocol message from the control socket.
  * @param ctl control Connection
@@ -712,6 +879,106 @@ int writen_any(Connection* conn, const void* buf, int amount) {
   return sent;
 }
 
+/**
+ * Write the given pieces of data to the Connection, in the same way as
+ * writen_any.  On a plain connection they go out with writev(), and over TLS
+ * they are gathered into SSL_write()s of a full TLS record, so that small
+ * pieces never make records of their own.  What is left of a large piece once
+ * a record is full is written straight from the piece.
+ *
+ * @param conn the Connection
+ * @param iov the pieces of data, changed while they are written
+ * @param iovcnt the number of pieces
+ * @return The amount of bytes written to the Connection.
+ *         -1 when it gets an unrecoverable error, just like write().
+ */
+int writev_any(Connection* conn, struct iovec* iov, int iovcnt) {
+  char buff[MSG_BATCH_SIZE];
+  const char* p;
+  int i, n, len, sent = 0, total = 0;
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  if (conn->ssl != NULL) {
+    for (i = 0; i < iovcnt; i++) {
+      p = iov[i].iov_base;
+      len = iov[i].iov_len;
+      if (sent > 0 || len < (int) sizeof(buff)) {
+        n = sizeof(buff) - sent;
+        if (n > len) n = len;
+        memcpy(buff + sent, p, n);
+        sent += n;
+        p += n;
+        len -= n;
+        if (sent < (int) sizeof(buff)) continue;
+        if (writen_any(conn, buff, sent) != sent) return -1;
+        sent = 0;
+      }
+      if (len >= (int) sizeof(buff)) {
+        if (writen_any(conn, p, len) != len) return -1;
+      } else if (len > 0) {
+        memcpy(buff, p, len);
+        sent = len;
+      }
+    }
+    if (sent > 0 && writen_any(conn, buff, sent) != sent) return -1;
+    return total;
+  }
+
+  while (sent < total) {
+    n = writev(conn->socket, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      log_println(6, "writev_any() Error! writev(%d) failed with err=%s (%d) "
+                  "pid=%d", conn->socket, strerror(errno), errno, getpid());
+      return -1;
+    }
+    sent += n;
+    // skip the pieces written, and the part written of the next one
+    while (iovcnt > 0 && n >= (int) iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return sent;
+}
+
+/**
+ * Try a single sendfile() from a file to a socket.  The data goes from the
+ * page cache to the socket without being copied through userspace, so this
+ * only works for connections without TLS.
+ * @param socketfd The socket
+ * @param fd The file holding the data
+ * @param offset The offset in the file to send from, advanced past the data
+ *               that was sent
+ * @param amount The most data to send
+ * @return The number of bytes written, -1 on fatal error, and 0 on recoverable
+ *         error.
+ */
+int sendfile_raw(int socketfd, int fd, off_t* offset, int amount) {
+  ssize_t n;
+  n = sendfile(socketfd, fd, offset, amount);
+  if (n == -1) {
+    if (errno == EINTR || errno == EAGAIN) {
+      // Recoverable errors
+      return 0;
+    } else {
+      // Everything else is unrecoverable
+      log_println(6,
+                  "sendfile_raw() Error! sendfile(%d) failed with err=%s (%d) "
+                  "pid=%d", socketfd, strerror(errno), errno, getpid());
+      return -1;
+    }
+  }
+  return n;
+}
+
 size_t readn_ssl(SSL *ssl, void *buf, size_t amount) {
   int received = 0;
   int ssl_err, ssl_errno;
@@ -763,7 +1030,42 @@ int readn_raw(int fd, void *buf, size_t amount) {
 }
 
 /**
- * Read the given amount of data from the Connection.
+ * Read once from the Connection, whatever is available up to the given amount.
+ * @param conn The connection to read
+ * @param buf buffer for data
+ * @param amount the most data to read
+ * @return The number of bytes read, 0 on recoverable error, or a negative
+ *         number on fatal error or EOF
+ */
+static int read_any(Connection *conn, void *buf, size_t amount) {
+  if (conn->ssl != NULL) {
+    return (int) readn_ssl(conn->ssl, buf, amount);
+  }
+  return readn_raw(conn->socket, buf, amount);
+}
+
+/**
+ * Hand out data already in the input buffer of the Connection.
+ * @param conn The connection
+ * @param buf buffer for data, or NULL to discard it
+ * @param amount the most data to hand out
+ * @return The number of bytes handed out
+ */
+static size_t take_buffered(Connection *conn, void *buf, size_t amount) {
+  ConnectionBuffer *in = conn->in;
+  size_t n;
+
+  if (in == NULL || in->start == in->end) return 0;
+  n = in->end - in->start;
+  if (n > amount) n = amount;
+  if (buf != NULL) memcpy(buf, in->data + in->start, n);
+  in->start += n;
+  return n;
+}
+
+/**
+ * Read the given amount of data from the Connection.  Data read ahead by
+ * peekn_any is handed out first.
  * @param conn The connection to read
  * @param buf buffer for data
  * @param amount size of the data to read
@@ -771,22 +1073,73 @@ int readn_raw(int fd, void *buf, size_t amount) {
  */
 size_t readn_any(Connection *conn, void *buf, size_t amount) {
   assert(amount >= 0);
-  size_t total_read = 0;
+  size_t total_read;
   char *ptr = buf;
   int received;
 
+  total_read = take_buffered(conn, buf, amount);
   while (total_read < amount) {
-    if (conn->ssl != NULL) {
-      received = readn_ssl(conn->ssl, ptr + total_read, amount - total_read);
-    } else {
-      received = readn_raw(conn->socket, ptr + total_read, amount - total_read);
-    }
+    received = read_any(conn, ptr + total_read, amount - total_read);
     if (received < 0) return 0;
     total_read += received;
   }
   return total_read;
 }
 
+/**
+ * Make sure that at least the given amount of data from the Connection waits
+ * in its input buffer, without handing it out.  Each read takes whatever is
+ * available, so small messages following each other are read together.
+ * @param conn The connection to read
+ * @param amount size of the data needed, at most CONNECTION_BUFFER_SIZE
+ * @return A pointer to the data, valid until the Connection is read again, or
+ *         NULL on failure
+ */
+const unsigned char* peekn_any(Connection *conn, size_t amount) {
+  ConnectionBuffer *in = conn->in;
+  int received;
+
+  assert(amount <= CONNECTION_BUFFER_SIZE);
+  if (in == NULL) {
+    if ((in = (ConnectionBuffer*) malloc(sizeof(ConnectionBuffer))) == NULL)
+      return NULL;
+    in->start = in->end = 0;
+    conn->in = in;
+  }
+  if (in->end - in->start >= amount) return in->data + in->start;
+  // Move what is left to the front to make room
+  memmove(in->data, in->data + in->start, in->end - in->start);
+  in->end -= in->start;
+  in->start = 0;
+  while (in->end < amount) {
+    received = read_any(conn, in->data + in->end,
+                        CONNECTION_BUFFER_SIZE - in->end);
+    if (received < 0) return NULL;
+    in->end += received;
+  }
+  return in->data;
+}
+
+/**
+ * Read and discard the given amount of data from the Connection.
+ * @param conn The connection to read
+ * @param amount size of the data to discard
+ * @return The amount of bytes discarded
+ */
+uint64_t skipn_any(Connection *conn, uint64_t amount) {
+  uint64_t skipped;
+  size_t n;
+
+  skipped = take_buffered(conn, NULL, amount);
+  while (skipped < amount) {
+    n = amount - skipped;
+    if (n > CONNECTION_BUFFER_SIZE) n = CONNECTION_BUFFER_SIZE;
+    if (peekn_any(conn, 1) == NULL) return 0;
+    skipped += take_buffered(conn, NULL, n);
+  }
+  return skipped;
+}
+
 /**
  * Shutdown the connection and free any resources associated with it.  After
  * this, neither this process nor any other process may use the Connection or
@@ -799,6 +1152,8 @@ void shutdown_connection(Connection *conn) {
   }
   SSL_free(conn->ssl);
   conn->ssl = NULL;
+  free(conn->in);
+  conn->in = NULL;
   shutdown(conn->socket, SHUT_RDWR);
 }
 
@@ -810,6 +1165,8 @@ void shutdown_connection(Connection *conn) {
 void close_connection(Connection *conn) {
   SSL_free(conn->ssl);
   conn->ssl = NULL;
+  free(conn->in);
+  conn->in = NULL;
   close(conn->socket);
 }
 
@@ -10,6 +10,8 @@
 #define SRC_NETWORK_H_
 
 #include <I2util/util.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "connection.h"
 
 #define NDT_BACKLOG 5
@@ -17,11 +19,24 @@
 
 #define OPT_IPV6_ONLY 1
 #define OPT_IPV4_ONLY 2
+#define OPT_REUSEPORT 4
 
 #define JSON_SUPPORT 1
 #define WEBSOCKET_SUPPORT 2
 #define TLS_SUPPORT 4
 
+// Size of the buffer of a MsgBatch, the largest TLS record
+#define MSG_BATCH_SIZE 16384
+
+// Protocol messages to the control connection, written out together
+typedef struct msgBatch {
+  Connection* conn;  // the control connection
+  int connectionFlags;  // how the client wants the messages framed
+  int len;  // bytes of framed messages in buff
+  int error;  // -1 once a write failed, after which nothing is written
+  unsigned char buff[MSG_BATCH_SIZE];
+} MsgBatch;
+
 I2Addr CreateListenSocket(I2Addr addr, char* serv, int options, int buf_size);
 int CreateConnectSocket(int* sockfd, I2Addr local_addr, I2Addr server_addr,
                         int option, int buf_sizes);
@@ -32,11 +47,21 @@ int send_json_msg_any(Connection* conn, int type, const char* msg, int len,
 int send_json_message_any(Connection* ctl, int type, const char* msg, int len,
                           int connectionFlags, int jsonConvertType);
 int send_msg_any(Connection* conn, int type, const void* msg, int len);
+int send_msg_prefixed(Connection* conn, const void* prefix, int prefix_len,
+                      int type, const void* msg, int len);
+void msg_batch_init(MsgBatch* batch, Connection* conn, int connectionFlags);
+int msg_batch_add(MsgBatch* batch, int type, const void* msg, int len);
+int msg_batch_add_json(MsgBatch* batch, int type, const char* msg, int len);
+int msg_batch_flush(MsgBatch* batch);
 int recv_msg_any(Connection* conn, int* type, void* msg, int* len);
 int recv_any_msg(Connection* conn, int* type, void* msg, int* len,
                  int connectionFlags);
 int writen_any(Connection* conn, const void* buf, int amount);
+int writev_any(Connection* conn, struct iovec* iov, int iovcnt);
+int sendfile_raw(int socketfd, int fd, off_t* offset, int amount);
 size_t readn_any(Connection* conn, void* buf, size_t amount);
+const unsigned char* peekn_any(Connection* conn, size_t amount);
+uint64_t skipn_any(Connection* conn, uint64_t amount);
 
 /* web100-util.c routine used in network. */
 int KillHung(void);
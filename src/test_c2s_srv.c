@@ -7,8 +7,12 @@
  *      Author: kkumar@internet2.edu
  */
 
+#define _GNU_SOURCE  // splice() and F_SETPIPE_SZ
+#include <fcntl.h>
+#include <inttypes.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/times.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -61,56 +65,311 @@ int raw_read(Connection *conn, char* buff, size_t buff_size,
   return 0;
 }
 
+// Reads of a stream per wakeup before moving on to the other streams
+#define C2S_MAX_READS_PER_WAKEUP 8
+
 /**
- * Reads all the streams that are in the FD_SET.  The data is put into buff,
- * but the intention is for buff to be just temporary storage, and that the
- * contents of the received data are completely irrelevant.
- * @param rfd The fd_set containing all streams that can be read
- * @param c2s_conns An array of all possible connections that could be read
- * @param c2s_conn_length The length of the array
- * @param buff A pointer to the buffer to put the read data
- * @param buff_size The size of the buffer
- * @param bytes_read An outparam which tracks the total number of bytes read
- * @return 0 on success, an error code otherwise.
+ * Watch the streams of a C2S test with epoll.  The sockets are made
+ * non-blocking, so that a ready stream can be read until it is empty.
+ * @param receiver The receiver to set up
+ * @param conns The array of stream Connections
+ * @param streamsNum The length of that array
+ * @return 0 on success, an error code otherwise
  */
-int read_ready_streams(fd_set *rfd, Connection *c2s_conns, int c2s_conn_length,
-                       char *buff, size_t buff_size, double *bytes_read) {
-  int i;
+int c2s_receiver_init(C2SReceiver* receiver, Connection* conns,
+                      int streamsNum) {
+  struct epoll_event ev;
+  int i, flags, error;
+
+  memset(receiver, 0, sizeof(*receiver));
+  receiver->pipefd[0] = receiver->pipefd[1] = receiver->devnull = -1;
+  receiver->conns = conns;
+  receiver->streamsNum = streamsNum;
+  if ((receiver->buff = (char*) malloc(C2S_RECV_BUFFER_SIZE)) == NULL)
+    return ENOMEM;
+  if ((receiver->epfd = epoll_create(MAX_STREAMS)) == -1) {
+    error = errno;
+    free(receiver->buff);
+    receiver->buff = NULL;
+    return error;
+  }
+  for (i = 0; i < streamsNum; i++) {
+    if (conns[i].socket <= 0) {
+      receiver->closed[i] = 1;
+      continue;
+    }
+    flags = fcntl(conns[i].socket, F_GETFL, 0);
+    if (flags == -1 ||
+        fcntl(conns[i].socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+      error = errno;
+      c2s_receiver_close(receiver);
+      return error;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, conns[i].socket, &ev) == -1) {
+      error = errno;
+      c2s_receiver_close(receiver);
+      return error;
+    }
+    receiver->active++;
+  }
+  return 0;
+}
+
+/**
+ * Stop splicing, and read the streams instead.
+ * @param receiver The receiver
+ */
+static void c2s_receiver_disable_splice(C2SReceiver* receiver) {
+  int j;
+
+  for (j = 0; j < 2; j++) {
+    if (receiver->pipefd[j] != -1)
+      close(receiver->pipefd[j]);
+    receiver->pipefd[j] = -1;
+  }
+  if (receiver->devnull != -1)
+    close(receiver->devnull);
+  receiver->devnull = -1;
+}
+
+/**
+ * Discard the data of the streams without TLS in the kernel: it is
+ * spliced from the socket into a pipe and from there into /dev/null, so
+ * it is never copied to user space.  The byte counts stay exact.
+ * @param receiver The receiver, set up by c2s_receiver_init()
+ * @return 0 on success, an error code otherwise (the data is then read)
+ */
+int c2s_receiver_enable_splice(C2SReceiver* receiver) {
   int error;
-  ssize_t current_bytes_read;
-  for (i = 0; i < c2s_conn_length; i++) {
-    if (FD_ISSET(c2s_conns[i].socket, rfd)) {
-      error = raw_read(&c2s_conns[i], buff, buff_size, &current_bytes_read);
-      if (error != 0) return error;
-      *bytes_read += current_bytes_read;
+
+  if (pipe(receiver->pipefd) == -1) {
+    error = errno;
+    receiver->pipefd[0] = receiver->pipefd[1] = -1;
+    return error;
+  }
+  if ((receiver->devnull = open("/dev/null", O_WRONLY)) == -1) {
+    error = errno;
+    c2s_receiver_disable_splice(receiver);
+    return error;
+  }
+  // A bigger pipe moves more data per splice; the default one is kept if
+  // the system does not allow it
+  fcntl(receiver->pipefd[1], F_SETPIPE_SZ, C2S_RECV_BUFFER_SIZE);
+  if ((receiver->pipeSize = fcntl(receiver->pipefd[1], F_GETPIPE_SZ)) <= 0) {
+    error = errno;
+    c2s_receiver_disable_splice(receiver);
+    return error;
+  }
+  return 0;
+}
+
+/**
+ * Count only the payload of the websocket frames of the streams.  The frame
+ * headers are parsed as the data is read, and the payload is discarded
+ * without being unmasked.  Data read ahead while setting the websocket up is
+ * counted first.
+ * @param receiver The receiver, set up by c2s_receiver_init()
+ * @return 0 on success, an error code otherwise
+ */
+int c2s_receiver_enable_websocket(C2SReceiver* receiver) {
+  ConnectionBuffer* in;
+  uint64_t payload;
+  int i, err;
+
+  if ((receiver->sinks = (WebsocketSink*) calloc(
+           MAX_STREAMS, sizeof(WebsocketSink))) == NULL)
+    return ENOMEM;
+  for (i = 0; i < receiver->streamsNum; i++) {
+    websocket_sink_init(&receiver->sinks[i]);
+    if ((in = receiver->conns[i].in) == NULL || in->start == in->end)
+      continue;
+    payload = 0;
+    if ((err = websocket_sink_feed(&receiver->sinks[i], in->data + in->start,
+                                   in->end - in->start, &payload)) != 0)
+      return -err;
+    in->start = in->end;
+    receiver->bytes[i] += payload;
+  }
+  return 0;
+}
+
+/**
+ * Count the data read from a websocket stream.  A stream whose client sent
+ * a CLOSE frame is answered and no longer watched.
+ * @param receiver The receiver
+ * @param i Index of the stream
+ * @param n The number of bytes read into the receiver's buffer
+ * @param bytes_read An outparam which tracks the total number of bytes read
+ * @return 0 on success, an error code otherwise
+ */
+static int count_websocket_data(C2SReceiver* receiver, int i, ssize_t n,
+                                double* bytes_read) {
+  WebsocketSink* sink = &receiver->sinks[i];
+  uint64_t payload = 0;
+  int err;
+
+  err = websocket_sink_feed(sink, (unsigned char*) receiver->buff, n,
+                            &payload);
+  receiver->bytes[i] += payload;
+  *bytes_read += payload;
+  if (err != 0) {
+    log_println(1, "Bad websocket frame %" PRIu64 " on C2S stream %d: %s",
+                sink->frames, i, strerror(-err));
+    return -err;
+  }
+  if (sink->closed && !receiver->closed[i]) {
+    websocket_close_response(&receiver->conns[i]);
+    epoll_ctl(receiver->epfd, EPOLL_CTL_DEL, receiver->conns[i].socket, NULL);
+    receiver->closed[i] = 1;
+    receiver->active--;
+  }
+  return 0;
+}
+
+/**
+ * Splice a ready stream into /dev/null until it is empty, or until it has
+ * had its share of splices.  A stream closed by the client is no longer
+ * watched.
+ * @param receiver The receiver
+ * @param i Index of the stream
+ * @param bytes_read An outparam which tracks the total number of bytes read
+ * @return 0 on success, EINVAL if the socket cannot be spliced, another
+ *         error code otherwise
+ */
+static int splice_c2s_stream(C2SReceiver* receiver, int i,
+                             double* bytes_read) {
+  Connection* conn = &receiver->conns[i];
+  ssize_t n, out;
+  int splices;
+
+  for (splices = 0; splices < C2S_MAX_READS_PER_WAKEUP; splices++) {
+    n = splice(conn->socket, NULL, receiver->pipefd[1], NULL,
+               receiver->pipeSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : errno;
+    }
+    if (n == 0) {
+      epoll_ctl(receiver->epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+      receiver->closed[i] = 1;
+      receiver->active--;
+      return 0;
+    }
+    receiver->bytes[i] += n;
+    *bytes_read += n;
+    // Empty the pipe, so that the next splice has all of it
+    while (n > 0) {
+      out = splice(receiver->pipefd[0], NULL, receiver->devnull, NULL, n,
+                   SPLICE_F_MOVE);
+      if (out == -1 && errno == EINTR)
+        continue;
+      if (out <= 0)
+        return out == -1 ? errno : EIO;
+      n -= out;
     }
   }
   return 0;
 }
 
 /**
- * Creates an fd_set out of the connections passed in.
- * @param connections The array of Connections
- * @param connections_length The length of that array
- * @param fd_set An outparam to hold the set we will create
- * @param max_fd An outparam to hold the max file descriptor we encounter
- * @returns The number of active streams
+ * Read a ready stream until it is empty, or until it has had its share of
+ * reads; epoll reports it again if data is left.  A stream closed by the
+ * client is no longer watched.
+ * @param receiver The receiver
+ * @param i Index of the stream
+ * @param bytes_read An outparam which tracks the total number of bytes read
+ * @return 0 on success, an error code otherwise
  */
-int connections_to_fd_set(Connection *connections, int connections_length,
-                          fd_set *fds, int *max_fd) {
-  int active_streams = 0;
-  int i;
-  *max_fd = 0;
-  FD_ZERO(fds);
-  for (i = 0; i < connections_length; i++) {
-    if (connections[i].socket > 0) {
-      active_streams++;
-      FD_SET(connections[i].socket, fds);
-      *max_fd = (connections[i].socket > *max_fd) ? connections[i].socket
-                                                : *max_fd;
+static int drain_c2s_stream(C2SReceiver* receiver, int i, double* bytes_read) {
+  Connection* conn = &receiver->conns[i];
+  ssize_t n;
+  int error, reads;
+
+  if (conn->ssl == NULL && receiver->pipefd[0] != -1) {
+    error = splice_c2s_stream(receiver, i, bytes_read);
+    if (error != EINVAL)
+      return error;
+    log_println(1, "Cannot splice the C2S streams, reading them instead");
+    c2s_receiver_disable_splice(receiver);
+  }
+  // SSL may keep decrypted data that epoll cannot see, so an SSL stream
+  // is also read for as long as it has some pending
+  for (reads = 0; reads < C2S_MAX_READS_PER_WAKEUP ||
+       (conn->ssl != NULL && SSL_pending(conn->ssl) > 0); reads++) {
+    error = raw_read(conn, receiver->buff, C2S_RECV_BUFFER_SIZE, &n);
+    if (error == EAGAIN || error == EWOULDBLOCK)
+      return 0;
+    if (error == EINTR)
+      continue;
+    if (error != 0)
+      return error;
+    if (n == 0 && conn->ssl == NULL) {
+      epoll_ctl(receiver->epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+      receiver->closed[i] = 1;
+      receiver->active--;
+      return 0;
+    }
+    if (n <= 0)  // SSL needs more data from the socket
+      return 0;
+    if (receiver->sinks != NULL) {
+      if ((error = count_websocket_data(receiver, i, n, bytes_read)) != 0 ||
+          receiver->closed[i])
+        return error;
+    } else {
+      receiver->bytes[i] += n;
+      *bytes_read += n;
     }
+    // A short read has emptied the socket; save the read that would
+    // only return EAGAIN
+    if (n < C2S_RECV_BUFFER_SIZE && conn->ssl == NULL)
+      return 0;
   }
-  return active_streams;
+  return 0;
+}
+
+/**
+ * Wait for the streams to become readable and drain the ready ones.  The
+ * data is read into the receiver's scratch buffer and discarded, as its
+ * contents are completely irrelevant.
+ * @param receiver The receiver
+ * @param timeout_ms How long to wait, in milliseconds
+ * @param bytes_read An outparam which tracks the total number of bytes read
+ * @return 0 on success or timeout, an error code otherwise
+ */
+int c2s_receiver_wait(C2SReceiver* receiver, int timeout_ms,
+                      double* bytes_read) {
+  struct epoll_event events[MAX_STREAMS];
+  int i, ready, error;
+
+  if ((ready = epoll_wait(receiver->epfd, events, MAX_STREAMS,
+                          timeout_ms)) == -1)
+    return errno;
+  for (i = 0; i < ready; i++) {
+    error = drain_c2s_stream(receiver, events[i].data.u32, bytes_read);
+    if (error != 0)
+      return error;
+  }
+  return 0;
+}
+
+/**
+ * Release a receiver set up by c2s_receiver_init().  The streams are left
+ * open.
+ * @param receiver The receiver
+ */
+void c2s_receiver_close(C2SReceiver* receiver) {
+  if (receiver->epfd > 0)
+    close(receiver->epfd);
+  receiver->epfd = -1;
+  free(receiver->buff);
+  receiver->buff = NULL;
+  free(receiver->sinks);
+  receiver->sinks = NULL;
+  c2s_receiver_disable_splice(receiver);
 }
 
 /**
@@ -145,63 +404,28 @@ const static int DRAIN_TIME = 1;
  *       which at 150k tests per day is a waste of 40+ hours of peoples' lives
  *       every day.
  *
- * @param c2s_conns The connections to drain
- * @param streamsNum The number of connections
- * @param buff The buffer into which we should read data
- * @param buff_size The size of said buffer
+ * @param receiver The receiver of the connections to drain
  */
-void drain_old_clients(Connection* c2s_conns, int streamsNum, char* buff, size_t buff_size) {
-  int activeStreams;
+void drain_old_clients(C2SReceiver* receiver) {
   double trash = 0;  // A byte count we ignore.
-  fd_set rfd;
-  int max_fd;
-  double start_time;
-  int msgretvalue, read_error;
-  struct timeval sel_tv;
+  double start_time, remaining;
+  int read_error;
 
   start_time = secs();
-  activeStreams = connections_to_fd_set(c2s_conns, streamsNum, &rfd, &max_fd);
-  while (activeStreams > 0 && (secs() - start_time) < DRAIN_TIME) {
-    sel_tv.tv_sec = DRAIN_TIME;
-    sel_tv.tv_usec = 0;
-    msgretvalue = select(max_fd + 1, &rfd, NULL, NULL, &sel_tv);
-    if (msgretvalue == -1) {
-      if (errno == EINTR) {
-        // select interrupted. Continue waiting for activity on socket
-        continue;
-      } else {
-        log_println(5,
-                    "Socket error while draining the client's send queue: %s. This is likely ok.",
-                    strerror(errno));
-        return;
-      }
-    } else if (msgretvalue == 0) {
-      log_println(5, "Done draining the client's send queue.");
-      return;
-    } else if (msgretvalue > 0) {
-      read_error = read_ready_streams(&rfd, c2s_conns, streamsNum, buff, buff_size, &trash);
-      if (read_error != 0 && read_error != EINTR) {
-        // EINTR is expected, but all other errors are actually errors
-        log_println(5, "Error while trying to drain client's send queue: %s. This is likely ok.",
-                    strerror(read_error));
-        return;
-      }
-    } else {
-      // This should never happen. select() returns -1, 0, or a positive number says POSIX.
-      log_println(0, "Unhandled return value from select: %d.", msgretvalue);
+  while (receiver->active > 0 &&
+         (remaining = DRAIN_TIME - (secs() - start_time)) > 0) {
+    read_error = c2s_receiver_wait(receiver, (int) (remaining * 1000) + 1,
+                                   &trash);
+    if (read_error != 0 && read_error != EINTR) {
+      // EINTR is expected, but all other errors are actually errors
+      log_println(5, "Error while trying to drain client's send queue: %s. This is likely ok.",
+                  strerror(read_error));
       return;
     }
-    // Set up the FD_SET and activeStreams for the next select.
-    activeStreams = connections_to_fd_set(c2s_conns, streamsNum, &rfd, &max_fd);
   }
+  log_println(5, "Done draining the client's send queue.");
 }
 
-// How long to sleep to avoid a race condition.  This is a bad hack.
-// At 150k tests per day, this one sleep(2) wastes 83 hours of peoples'
-// lives every day.
-// TODO: solve the race conditions some other way.
-const static int RACE_CONDITION_WAIT_TIME = 2;
-
 /**
  * Perform the C2S Throughput test. This test intends to measure throughput
  * from the client to the server by performing a 10 seconds memory-to-memory
@@ -234,6 +458,7 @@ const static int RACE_CONDITION_WAIT_TIME = 2;
  * @param conn_options Connection options
  * @param ctx The SSL context (possibly NULL)
  * @param c2s_ThroughputSnapshots Variable used to set c2s throughput snapshots
+ * @param c2s_series Set to the bytes received on each stream in each interval
  * @param extended indicates if extended c2s test should be performed
  * @return 0 on success, an error code otherwise
  *         Error codes:
@@ -250,19 +475,16 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
              int autotune, char *device, Options *options, int record_reverse,
              int count_vars, char spds[4][256], int *spd_index, SSL_CTX *ctx,
              struct throughputSnapshot **c2s_ThroughputSnapshots,
-             int extended) {
+             StreamSeries* c2s_series, int extended) {
   tcp_stat_connection conn;
   tcp_stat_group *group = NULL;
-  /* The pipe that will return packet pair results */
-  int mon_pipe[2];
+  PktTrace pkttrace;  // packet pair capture
   int packet_trace_running = 0;
-  pid_t c2s_childpid = 0;       // child process pids
   int msgretvalue, read_error;  // used during the "read"/"write" process
   int i;                  // used as loop iterator
   int conn_index, attempts;
   int retvalue = 0;
   int streamsNum = 1;
-  int activeStreams = 1;
   int local_errno;
 
   struct sockaddr_storage cli_addr[MAX_STREAMS];
@@ -270,28 +492,29 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   struct throughputSnapshot *lastThroughputSnapshot;
 
   socklen_t clilen;
-  char tmpstr[256];  // string array used for all sorts of temp storage purposes
   double start_time, measured_test_duration;
   double throughputSnapshotTime;  // specify the next snapshot time
   double testDuration = 10;       // default test duration
   double bytes_read = 0;    // number of bytes read during the throughput tests
+  double now, timeout;
+  double setup_start, setup_time;  // time taken to get ready for the test
+  C2SReceiver receiver;     // reads the streams during the throughput test
   struct timeval sel_tv;    // time
   fd_set rfd;       // receive file descriptors
-  int max_fd;
   char buff[BUFFSIZE + 1];  // message "payload" buffer
   PortPair pair;            // socket ports
   I2Addr c2ssrv_addr = NULL;  // c2s test's server address
   // I2Addr src_addr=NULL;  // c2s test source address
   char listenc2sport[10];  // listening port
-  pthread_t workerThreadId;
 
   // snap related variables
   SnapArgs snapArgs;
+  SnapArgs* snapStreams[1] = {&snapArgs};
+  SnapScheduler snapScheduler;
   snapArgs.snap = NULL;
 #if USE_WEB100
   snapArgs.log = NULL;
 #endif
-  snapArgs.delay = options->snapDelay;
 
   // Test ID and status descriptors
   enum TEST_ID testids = extended ? C2S_EXT : C2S;
@@ -301,6 +524,7 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   for (i = 0; i < MAX_STREAMS; i++) {
     c2s_conns[i].socket = 0;
     c2s_conns[i].ssl = NULL;
+    c2s_conns[i].in = NULL;
   }
 
   if (!extended && testOptions->c2sopt) {
@@ -505,63 +729,27 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   // Get tcp_stat connection. Used to collect tcp_stat variable statistics
   conn = tcp_stat_connection_from_socket(agent, c2s_conns[0].socket);
 
+  // The test starts as soon as the packet trace and the snapshots are
+  // running; the time that takes is logged
+  setup_start = secs();
+
   // set up packet tracing. Collected data is used for bottleneck link
   // calculations
   if (getuid() == 0) {
-    if (pipe(mon_pipe) != 0) {
-      log_println(0, "C2S test error: can't create pipe.");
-    } else {
-      if ((c2s_childpid = fork()) == 0) {
-        close(testOptions->c2ssockfd);
-        close_all_connections(c2s_conns, streamsNum);
-        // Don't capture more than 14 seconds of packet traces:
-        //   2 seconds of sleep + 10 seconds of test + 2 seconds of slop
-        // Causes a call to cleanup() if allowed to run for too long.
-        alarm(testDuration + RACE_CONDITION_WAIT_TIME + 2);
-        log_println(
-            5,
-            "C2S test Child %d thinks pipe() returned fd0=%d, fd1=%d",
-            testOptions->child0, mon_pipe[0], mon_pipe[1]);
-        log_println(2, "C2S test calling init_pkttrace() with pd=%p",
-                    &cli_addr[0]);
-        init_pkttrace(src_addr, cli_addr, streamsNum, clilen,
-                      mon_pipe, device, &pair, "c2s", options->c2s_duration / 1000.0);
-        log_println(1, "c2s is exiting gracefully");
-        /* Close the pipe */
-        close(mon_pipe[0]);
-        close(mon_pipe[1]);
-        exit(0); /* Packet trace finished, terminate gracefully */
-      } else if (c2s_childpid < 0) {
-        log_println(0, "C2S test error: can't create child process.");
-      }
-    }
-
-    packet_trace_running = wait_for_readable_fd(mon_pipe[0]);
-
+    packet_trace_running = start_pkttrace(&pkttrace, src_addr, cli_addr,
+                                          streamsNum, clilen, device, &pair,
+                                          "c2s", options->compress) == 0;
     if (packet_trace_running) {
-      // Get data collected from packet tracing into the C2S "ndttrace" file
-      memset(tmpstr, 0, 256);
-      for (i = 0; i < 5; i++) {
-        msgretvalue = read(mon_pipe[0], tmpstr, 128);
-        if ((msgretvalue == -1) && (errno == EINTR))
-          continue;
-        break;
-      }
-
-      if (strlen(tmpstr) > 5)
-        memcpy(meta.c2s_ndttrace, tmpstr, strlen(tmpstr));
-      // name of nettrace file passed back from pcap child
+      if (strlen(pkttrace.tracefile) > 0)
+        strlcpy(meta.c2s_ndttrace, pkttrace.tracefile,
+                sizeof(meta.c2s_ndttrace));
       log_println(3, "--tracefile after packet_trace %s",
                   meta.c2s_ndttrace);
     } else {
       log_println(0, "Packet trace was unable to be created");
-      packet_trace_emergency_shutdown(mon_pipe);
     }
   }
 
-  log_println(5, "C2S test Parent thinks pipe() returned fd0=%d, fd1=%d",
-              mon_pipe[0], mon_pipe[1]);
-
   // experimental code, delete when finished
   setCwndlimit(conn, group, agent, options);
 
@@ -570,15 +758,6 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   create_client_logdir((struct sockaddr *) &cli_addr[0], clilen,
                        options->c2s_logname, sizeof(options->c2s_logname),
                        namesuffix, sizeof(namesuffix));
-  sleep(RACE_CONDITION_WAIT_TIME);
-  // Reset alarm() again. This 10 sec test should finish before this signal is
-  // generated, but sleep() can render existing alarm()s invalid, and alarm() is
-  // our watchdog timer. Watchdog code is in cleanup().
-  alarm(30);
-
-  // send empty TEST_START indicating start of the test
-  send_json_message_any(ctl, TEST_START, "", 0, testOptions->connection_flags,
-                        JSON_SINGLE_VALUE);
 
   // If snaplog recording is enabled, update meta file to indicate the same
   // and proceed to get snapshot and log it.
@@ -591,33 +770,57 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
       &workerThreadId, meta.c2s_snaplog, options->c2s_logname,
       conn, group); */
   }
-  if (options->snapshots)
-    start_snap_worker(&snapArgs, agent, NULL, options->snaplog, &workerThreadId,
-                      options->c2s_logname, conn, group);
+  if (options->snapshots) {
+    open_snap_stream(&snapArgs, agent, options->snaplog,
+                     options->binarySnaplog, options->c2s_logname,
+                     conn, group);
+    start_snap_scheduler(&snapScheduler, snapStreams, 1, agent, NULL,
+                         options->snaplog, options->snapDelay);
+  }
+  setup_time = secs() - setup_start;
+  log_println(1, "C2S test ready after %0.0f ms (packet trace %s)",
+              setup_time * 1000, packet_trace_running ? "running" : "off");
+  addAdditionalMetaIntEntry("c2s.setuplatency", (int) (setup_time * 1.e6));
+
+  // Reset alarm() again. This 10 sec test should finish before this signal is
+  // generated, and alarm() is our watchdog timer. Watchdog code is in
+  // cleanup().
+  alarm(30);
+
+  // send empty TEST_START indicating start of the test
+  send_json_message_any(ctl, TEST_START, "", 0, testOptions->connection_flags,
+                        JSON_SINGLE_VALUE);
   // Wait on listening socket and read data once ready.
+  if ((read_error = c2s_receiver_init(&receiver, c2s_conns, streamsNum)) != 0)
+    log_println(0, "Cannot watch the C2S streams: %s", strerror(read_error));
+  else if ((testOptions->connection_flags & WEBSOCKET_SUPPORT) &&
+           (read_error = c2s_receiver_enable_websocket(&receiver)) != 0)
+    log_println(0, "Cannot count the C2S websocket frames: %s",
+                strerror(read_error));
+  else if (options->c2s_zerocopy &&
+           !(testOptions->connection_flags & WEBSOCKET_SUPPORT) &&
+           (local_errno = c2s_receiver_enable_splice(&receiver)) != 0)
+    log_println(1, "Cannot splice the C2S streams: %s", strerror(local_errno));
   start_time = secs();
   throughputSnapshotTime = start_time + (options->c2s_snapsoffset / 1000.0);
-
-  activeStreams = connections_to_fd_set(c2s_conns, streamsNum, &rfd, &max_fd);
-
-  while (activeStreams > 0 && (secs() - start_time) < testDuration) {
-    // POSIX says "Upon successful completion, the select() function may
-    // modify the object pointed to by the timeout argument."
-    // Therefore sel_tv is undefined afterwards and we must set it every time.
-    sel_tv.tv_sec = testDuration + 1;  // time out after test duration + 1sec
-    sel_tv.tv_usec = 0;
-    msgretvalue = select(max_fd + 1, &rfd, NULL, NULL, &sel_tv);
-    if (msgretvalue == -1) {
-      if (errno == EINTR) {
-        // select interrupted. Continue waiting for activity on socket
-        continue;
-      } else {
-        log_println(1,
-                    "Error while trying to wait for incoming data in c2s: %s",
-                    strerror(errno));
-        break;
-      }
-    }
+  stream_series_free(c2s_series);
+  if (stream_series_init(c2s_series, streamsNum, testDuration, start_time) != 0)
+    log_println(0, "Cannot allocate the C2S time series");
+
+  while (read_error == 0 && receiver.active > 0 &&
+         (now = secs()) - start_time < testDuration) {
+    timeout = start_time + testDuration - now;
+    if (extended && options->c2s_throughputsnaps &&
+        throughputSnapshotTime - now < timeout)
+      timeout = throughputSnapshotTime - now;
+    if (c2s_series->streamsNum > 0 &&
+        stream_series_next(c2s_series) - now < timeout)
+      timeout = stream_series_next(c2s_series) - now;
+    read_error = c2s_receiver_wait(&receiver,
+                                   timeout > 0 ? (int) (timeout * 1000) + 1 : 0,
+                                   &bytes_read);
+    if (c2s_series->streamsNum > 0)
+      stream_series_update(c2s_series, receiver.bytes, secs());
     if (extended && options->c2s_throughputsnaps && secs() > throughputSnapshotTime) {
       if (lastThroughputSnapshot != NULL) {
         lastThroughputSnapshot->next = (struct throughputSnapshot*) malloc(sizeof(struct throughputSnapshot));
@@ -633,20 +836,21 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
       throughputSnapshotTime += options->c2s_snapsdelay / 1000.0;
     }
 
-    if (msgretvalue > 0) {
-      read_error = read_ready_streams(&rfd, c2s_conns, streamsNum, buff, sizeof(buff), &bytes_read);
-      if (read_error != 0 && read_error != EINTR) {
-        // EINTR is expected, but all other errors are actually errors
-        log_println(1, "Error while trying to read incoming data in c2s: %s",
-                    strerror(read_error));
-        break;
-      }
+    if (read_error == EINTR) {
+      read_error = 0;
+    } else if (read_error != 0) {
+      // EINTR is expected, but all other errors are actually errors
+      log_println(1, "Error while trying to read incoming data in c2s: %s",
+                  strerror(read_error));
     }
-
-    // Set up the FD_SET and activeStreams for the next select.
-    activeStreams = connections_to_fd_set(c2s_conns, streamsNum, &rfd, &max_fd);
   }
   measured_test_duration = secs() - start_time;
+  if (c2s_series->streamsNum > 0)
+    stream_series_finish(c2s_series, receiver.bytes);
+  for (i = 0; i < streamsNum; i++) {
+    log_println(5, " ---C->S: stream %d received %0.0f bytes%s", i,
+                receiver.bytes[i], receiver.closed[i] ? ", closed" : "");
+  }
   // From the NDT spec:
   //  throughput in kilo bits per sec =
   //  (transmitted_byte_count * 8) / (time_duration)*(1000)
@@ -656,12 +860,17 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   // TODO: Fix web100clt code to eliminate the need for this.  In general,
   //       clients that need this line should be removed from their respective
   //       gene pools and this code should be deleted.
-  drain_old_clients(c2s_conns, streamsNum, buff, sizeof(buff));
+  if (receiver.buff != NULL) {
+    drain_old_clients(&receiver);
+    c2s_receiver_close(&receiver);
+  }
 
   // c->s throuput value calculated and assigned ! Release resources, conclude
   // snap writing.
-  if (options->snapshots)
-    stop_snap_worker(&workerThreadId, options->snaplog, &snapArgs);
+  if (options->snapshots) {
+    stop_snap_scheduler(&snapScheduler, "c2s");
+    close_snap_stream(&snapArgs, options->snaplog);
+  }
 
   // send the server calculated value of C->S throughput as result to client
   snprintf(buff, sizeof(buff), "%6.0f kbps outbound for child %d", *c2sspd,
@@ -689,64 +898,18 @@ int test_c2s(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   close(testOptions->c2ssockfd);
 
   if (packet_trace_running) {
-    log_println(1, "Signal USR1(%d) sent to child [%d]", SIGUSR1,
-                c2s_childpid);
-    testOptions->child1 = c2s_childpid;
-    kill(c2s_childpid, SIGUSR1);
-    i = 0;
-
-    for (;;) {
-      FD_ZERO(&rfd);
-      FD_SET(mon_pipe[0], &rfd);
-      sel_tv.tv_sec = 1;
-      sel_tv.tv_usec = 100000;
-      msgretvalue = select(mon_pipe[0] + 1, &rfd, NULL, NULL, &sel_tv);
-      if (msgretvalue <= 0) {
-        local_errno = (msgretvalue == -1) ? errno : 0;
-        if (local_errno == EINTR) continue;
-        // Either a timeout or an error that wasn't EINTR...
-        log_println(4, "Failed to read pkt-pair data from C2S flow, "
-                    "retcode=%d, reason=%d", msgretvalue, local_errno);
-        snprintf(spds[(*spd_index)++],
-                 sizeof(spds[*spd_index]),
-                 " -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 0.0 0 0 0 0 0 -1");
-        snprintf(spds[(*spd_index)++],
-                 sizeof(spds[*spd_index]),
-                 " -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 0.0 0 0 0 0 0 -1");
-        break;
-      } else {
-        /* There is something to read, so get it from the pktpair child.  If an
-         * interrupt occurs, just skip the read and go on
-         * RAC 2/8/10
-         */
-        if ((msgretvalue = read(mon_pipe[0], spds[*spd_index],
-                                sizeof(spds[*spd_index]))) < 0) {
-          snprintf(
-              spds[*spd_index],
-              sizeof(spds[*spd_index]),
-              " -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 0.0 0 0 0 0 0 -1");
-        }
-        log_println(1, "%d bytes read '%s' from C2S monitor pipe",
-                    msgretvalue, spds[*spd_index]);
-        (*spd_index)++;
-        if (i++ == 1) break;
-      }
-    }
+    stop_pkttrace(&pkttrace, spds[*spd_index], spds[*spd_index + 1],
+                  sizeof(spds[*spd_index]));
+    log_println(1, "C2S pkt-pair data '%s' '%s'", spds[*spd_index],
+                spds[*spd_index + 1]);
+    *spd_index += 2;
+    packet_trace_running = 0;
   }
 
   // An empty TEST_FINALIZE message is sent to conclude the test
   send_json_message_any(ctl, TEST_FINALIZE, "", 0,
                         testOptions->connection_flags, JSON_SINGLE_VALUE);
 
-  //  Close opened resources for packet capture
-  if (packet_trace_running) {
-    // TODO: Determine whether this shutdown can be performed in a non-blocking
-    // manner, and if so then refactor packet_trace_emergency_shutdown to have
-    // better error handling and use that refactored and renamed function here.
-    stop_packet_trace(mon_pipe);
-    packet_trace_running = 0;
-  }
-
   // log end of C->S test
   log_println(1, " <----------- %d -------------->", testOptions->child0);
   // protocol logs
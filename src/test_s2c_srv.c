@@ -9,6 +9,8 @@
  */
 #include  <syslog.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <sys/times.h>
 #include <ctype.h>
 #include "tests_srv.h"
@@ -25,14 +27,16 @@
 #include "jsonutils.h"
 #include "websocket.h"
 
-extern pthread_mutex_t mainmutex;
-extern pthread_cond_t maincond;
-
 typedef struct s2cWriteWorkerArgs {
   int connectionId;
   Connection* connection;
   double stopTime;
   char* buff;
+  int writeSize;  // the size of buff, written in one go
+  int avoidSndBlockUp;  // wait for the send queue to drain before writing
+  int payloadFd;  // file to send with sendfile(), or -1 to write() buff
+  struct s2cFramePool* frames;  // websocket frames to write, or NULL for buff
+  double bytes;  // bytes sent so far, read by the test thread atomically
 } S2CWriteWorkerArgs;
 
 typedef struct s2cServerStream {
@@ -48,11 +52,265 @@ typedef struct s2cServerStream {
   S2CWriteWorkerArgs writeWorkerArgs;
   pthread_t writeWorkerIds;
   SnapArgs snapArgs;
-  pthread_t workerThreadId;
 } S2CServerStream;
 
 void* s2cWriteWorker(void* arg);
 
+// The zero-copy S2C test sends from a file of about S2C_PAYLOAD_SIZE bytes (but
+// at least one send buffer), handing S2C_ZEROCOPY_CHUNK bytes or one send
+// buffer, whichever is bigger, to each sendfile() call.
+#define S2C_PAYLOAD_SIZE (128 * RECLTH)
+#define S2C_ZEROCOPY_CHUNK (8 * RECLTH)
+
+// The most websocket frames of the S2C test sent by one writev(), which takes
+// two pieces of data for each frame.
+#define S2C_MAX_FRAMES 512
+
+// Websocket frames of the S2C test, made once per process.  Every frame has
+// the same header and payload, so a write of many frames is a writev() of the
+// same two pieces over and over, and nothing is framed while sending.
+typedef struct s2cFramePool {
+  int frameSize;  // size of each frame, header included
+  int frames;  // frames in each write
+  unsigned char header[WEBSOCKET_MAX_HEADER];  // header of every frame
+  char* payload;  // printable payload of every frame
+  struct iovec iov[2 * S2C_MAX_FRAMES];  // the frames of one write
+} S2CFramePool;
+
+static S2CFramePool s2cFramePool;
+
+/**
+ * Picks the size of the writes of one S2C test.  Without a configured ceiling
+ * the server keeps writing RECLTH bytes at a time.  With one, it writes as much
+ * as the ceiling allows, unless the send buffer was fixed with --buffer, in
+ * which case there is no point in writing more than fits in that buffer.
+ * @param ceiling The configured largest write size (0 if unset)
+ * @param set_buff Whether the send buffer size was fixed
+ * @param window The fixed send buffer size
+ * @return The write size, a multiple of RECLTH
+ */
+int choose_s2c_write_size(int ceiling, int set_buff, int window) {
+  int size = ceiling;
+  if (set_buff && window > 0 && window < size) size = window;
+  if (size > S2C_MAX_WRITE_SIZE) size = S2C_MAX_WRITE_SIZE;
+  size -= size % RECLTH;
+  if (size < RECLTH) size = RECLTH;
+  return size;
+}
+
+/**
+ * Returns the length of the header of a websocket frame of the S2C test.  RFC
+ * 6455 requires the shortest encoding of the payload length, so a few frame
+ * sizes can't be framed at all: the payload of a 128 byte frame is too long for
+ * a 2 byte header, and too short for a 4 byte one.
+ * @param size The size of the frame, header included
+ * @return The length of the header, or -1 if no header fits the size
+ */
+int s2c_frame_header_length(int size) {
+  if (size >= 2 && size - 2 < 126) return 2;
+  if (size - 4 >= 126 && size - 4 < 65536) return 4;
+  if (size - WEBSOCKET_MAX_HEADER >= 65536) return WEBSOCKET_MAX_HEADER;
+  return -1;
+}
+
+/**
+ * Fills the S2C send buffer with printable data.  For websocket clients the
+ * buffer is turned into a single binary frame, with the header made by
+ * websocket_frame_header().
+ * @param buff The buffer
+ * @param size The size of the buffer (and of each write), which for websocket
+ *             clients must have a header, see s2c_frame_header_length()
+ * @param websocket Whether the buffer must be a websocket frame
+ */
+void fill_s2c_buffer(char* buff, int size, int websocket) {
+  int j, k = 0;
+  int headerLen;
+  for (j = 0; j < size; j++) {
+    while (!isprint(k & 0x7f))
+      k++;
+    buff[j] = (k++ & 0x7f);
+  }
+  if (websocket && (headerLen = s2c_frame_header_length(size)) > 0) {
+    websocket_frame_header((unsigned char*) buff, size - headerLen);
+  }
+}
+
+/**
+ * Picks the size of the websocket frames of one S2C test.  By default each
+ * write is a single frame; a configured frame size smaller than the writes
+ * splits them into frames of that size, at least RECLTH bytes.
+ * @param frameSize The configured frame size (0 if unset)
+ * @param writeSize The size of the writes
+ * @return The frame size, writeSize for one frame per write
+ */
+int choose_s2c_frame_size(int frameSize, int writeSize) {
+  if (frameSize <= 0) return writeSize;
+  if (frameSize < RECLTH) frameSize = RECLTH;
+  return frameSize < writeSize ? frameSize : writeSize;
+}
+
+/**
+ * Returns the websocket frames for S2C writes of up to writeSize bytes, as
+ * many frames of frameSize bytes as fit (at most S2C_MAX_FRAMES).  The frames
+ * are only made again when the frame size changes, and are never changed
+ * while a test sends them.
+ * @param frameSize The size of each frame, header included
+ * @param writeSize The largest size of a write
+ * @return The frames, or NULL if no websocket header fits frameSize or they
+ *         could not be allocated
+ */
+S2CFramePool* get_s2c_frame_pool(int frameSize, int writeSize) {
+  S2CFramePool* pool = &s2cFramePool;
+  int headerLen, i;
+  if ((headerLen = s2c_frame_header_length(frameSize)) < 0) return NULL;
+  if (pool->payload == NULL || pool->frameSize != frameSize) {
+    free(pool->payload);
+    pool->frameSize = 0;
+    websocket_frame_header(pool->header, frameSize - headerLen);
+    if ((pool->payload = malloc(frameSize - headerLen)) == NULL) return NULL;
+    fill_s2c_buffer(pool->payload, frameSize - headerLen, 0);
+    for (i = 0; i < S2C_MAX_FRAMES; i++) {
+      pool->iov[2 * i].iov_base = pool->header;
+      pool->iov[2 * i].iov_len = headerLen;
+      pool->iov[2 * i + 1].iov_base = pool->payload;
+      pool->iov[2 * i + 1].iov_len = frameSize - headerLen;
+    }
+    pool->frameSize = frameSize;
+  }
+  pool->frames = writeSize / frameSize;
+  if (pool->frames > S2C_MAX_FRAMES) pool->frames = S2C_MAX_FRAMES;
+  return pool;
+}
+
+/**
+ * Writes one write worth of websocket frames from the frame pool.
+ * @param conn The Connection to send on
+ * @param pool The frames made by get_s2c_frame_pool()
+ * @return The number of bytes sent, or -1 on an unrecoverable error
+ */
+int send_s2c_frames(Connection* conn, const S2CFramePool* pool) {
+  struct iovec iov[2 * S2C_MAX_FRAMES];
+  // writev_any() moves through the pieces as they are written
+  memcpy(iov, pool->iov, 2 * pool->frames * sizeof(struct iovec));
+  return writev_any(conn, iov, 2 * pool->frames);
+}
+
+// In the avoidSndBlockUp mode, a stream only gets more data once less than
+// this many bytes of earlier data are still waiting to be sent.
+#define S2C_NOTSENT_LOWAT (RECLTH << 2)
+
+/**
+ * Prepares a stream for the avoidSndBlockUp mode.  With TCP_NOTSENT_LOWAT the
+ * kernel reports the socket as writable only once its queue of unsent data has
+ * drained below S2C_NOTSENT_LOWAT, so the sender doesn't have to watch the
+ * sequence numbers of the connection.  Without it, the socket is writable
+ * whenever its send buffer has room.
+ * @param socketfd The socket of the stream
+ */
+static void setup_s2c_send_pacing(int socketfd) {
+#ifdef TCP_NOTSENT_LOWAT
+  int lowat = S2C_NOTSENT_LOWAT;
+  if (setsockopt(socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                 sizeof(lowat)) != 0) {
+    log_println(1, "Unable to set TCP_NOTSENT_LOWAT on socket %d: %s",
+                socketfd, strerror(errno));
+  }
+#endif
+}
+
+/**
+ * Waits, at most until stopTime, for a stream to be ready for more data in the
+ * avoidSndBlockUp mode.
+ * @param socketfd The socket of the stream
+ * @param stopTime The time when the test ends
+ * @param draining Incremented when the stream was clogged, and so had to wait
+ *                 for its queue to drain
+ * @return 1 if the stream can take more data, 0 if it is still clogged, and -1
+ *         on an unrecoverable error
+ */
+static int wait_for_s2c_send_space(int socketfd, double stopTime,
+                                   int* draining) {
+  struct pollfd pfd;
+  int timeout, ret;
+  pfd.fd = socketfd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  // Look without waiting first, to count only the times the stream blocks.
+  ret = poll(&pfd, 1, 0);
+  if (ret == 0) {
+    (*draining)++;
+    timeout = (stopTime - secs()) * 1000;
+    if (timeout < 0) timeout = 0;
+    ret = poll(&pfd, 1, timeout);
+  }
+  if (ret == -1) {
+    return (errno == EINTR) ? 0 : -1;
+  }
+  // Errors on the socket are left for the next write to report.
+  return ret > 0;
+}
+
+/**
+ * Returns the size of the zero-copy payload file for the given write size.
+ */
+static off_t s2c_payload_file_size(int writeSize) {
+  int copies = S2C_PAYLOAD_SIZE / writeSize;
+  if (copies < 1) copies = 1;
+  return (off_t) copies * writeSize;
+}
+
+/**
+ * Creates an in-memory file holding copies of the data of one write (with
+ * its websocket framing, if it has any), for the zero-copy S2C test.  Falls
+ * back to an unlinked temporary file when memfd_create() is not available.
+ * @param iov The data of one write
+ * @param iovcnt The number of pieces of the data
+ * @param writeSize The size of the data
+ * @return The file descriptor, or -1 on error
+ */
+static int create_s2c_payload_file(const struct iovec* iov, int iovcnt,
+                                   int writeSize) {
+  char tmpname[] = "/tmp/ndt_s2c_payload-XXXXXX";
+  off_t written;
+  int fd = -1;
+#ifdef SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "ndt_s2c_payload", 0);
+#endif
+  if (fd == -1) {
+    fd = mkstemp(tmpname);
+    if (fd == -1) return -1;
+    unlink(tmpname);
+  }
+  for (written = 0; written < s2c_payload_file_size(writeSize);
+       written += writeSize) {
+    if (writev(fd, iov, iovcnt) != writeSize) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/**
+ * Sends the next part of the S2C test data from the payload file, which is
+ * sent over and over again.  The file only holds whole copies of the data of
+ * a write, so every websocket frame in the stream stays intact.
+ * @param conn The Connection to send on, which must not use TLS
+ * @param payloadFd The file made by create_s2c_payload_file()
+ * @param writeSize The size of the data of a write
+ * @param offset The position in the file, kept by the caller between calls
+ * @return The number of bytes sent, or -1 on an unrecoverable error
+ */
+static int send_s2c_payload(Connection* conn, int payloadFd, int writeSize,
+                            off_t* offset) {
+  const off_t fileSize = s2c_payload_file_size(writeSize);
+  int amount;
+  if (*offset >= fileSize) *offset = 0;
+  amount = writeSize > S2C_ZEROCOPY_CHUNK ? writeSize : S2C_ZEROCOPY_CHUNK;
+  if (fileSize - *offset < amount) amount = fileSize - *offset;
+  return sendfile_raw(conn->socket, payloadFd, offset, amount);
+}
+
 const char RESULTS_KEYS[] = "ThroughputValue UnsentDataAmount TotalSentByte";
 
 /**
@@ -84,6 +342,7 @@ const char RESULTS_KEYS[] = "ThroughputValue UnsentDataAmount TotalSentByte";
  * @param count_vars count of web100 variables
  * @param peaks Cwnd peaks structure pointer
  * @param s2c_ThroughputSnapshots Variable used to set s2c throughput snapshots
+ * @param s2c_series Set to the bytes sent on each stream in each interval
  * @param extended indicates if extended s2c test should be performed
  *
  * @return 0 on success, error code otherwise.
@@ -106,27 +365,23 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
              int conn_options, double *s2cspd, int set_buff, int window,
              int autotune, char* device, Options *options, char spds[4][256],
              int *spd_index, int count_vars, CwndPeaks *peaks, SSL_CTX *ctx,
-             struct throughputSnapshot **s2c_ThroughputSnapshots, int extended) {
+             struct throughputSnapshot **s2c_ThroughputSnapshots,
+             StreamSeries* s2c_series, int extended) {
 #if USE_WEB100
   web100_snapshot* tsnap[MAX_STREAMS];
   web100_snapshot* rsnap[MAX_STREAMS];
-  web100_var* var;
 #elif USE_WEB10G
   estats_val_data* snap[MAX_STREAMS];
 #endif
   /* Just a holder for web10g */
   tcp_stat_group* group = NULL;
-  /* Pipe that handles returning packet pair timing */
-  int mon_pipe[2];
+  PktTrace pkttrace;  // packet pair capture
   Connection xmitsfd[MAX_STREAMS];
   int ret;  // ctrl protocol read/write return status
-  int j, k, n;
+  int j, n;
   int streamsNum = 1;
   int stream, attempts;
-  pid_t s2c_childpid = 0;  // s2c_childpid
 
-  char tmpstr[256];  // string array used for temp storage of many char*
-  size_t tmpstr_len = 0;
   struct sockaddr_storage cli_addr[MAX_STREAMS];
   struct throughputSnapshot *lastThroughputSnapshot;
 
@@ -136,6 +391,8 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   double tmptime;  // temporary time store
   double testDuration = 10; // default test duration
   double x2cspd;  // s->c test throughput
+  double streamBytes[MAX_STREAMS];  // bytes written on each stream
+  double now, wakeup;  // times used to sample the streams
   struct timeval sel_tv;  // time
   fd_set rfd;  // receive file descriptor
   char buff[BUFFSIZE + 1];  // message payload buffer
@@ -151,10 +408,11 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   struct sigaction new, old;
   char *jsonMsgValue, *tempStr;
 
-  int nextseqtosend = 0, lastunackedseq = 0;
   int drainingqueuecount = 0, bufctlrnewdata = 0;
 
   S2CServerStream streams[MAX_STREAMS];
+  SnapArgs* snapStreams[MAX_STREAMS];
+  SnapScheduler snapScheduler;
 
   // variables used for protocol validation logs
   enum TEST_STATUS_INT teststatuses = TEST_NOT_STARTED;
@@ -162,6 +420,13 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
   char snaplogsuffix[256] = "s2c_snaplog";
 
   int packet_trace_running = 0;
+  int payloadFd = -1;  // file sent by the zero-copy test, if enabled
+  char* sendBuff = NULL;  // the data sent in the throughput test
+  S2CFramePool* framePool = NULL;  // websocket frames sent instead, if any
+  struct iovec payloadIov;  // sendBuff, to fill the zero-copy payload file
+  int frameSize;  // the size of the websocket frames
+  int writeSize = RECLTH;  // the size of each write in the throughput test
+  off_t payloadOffset = 0;
 
   memset(xmitsfd, 0, sizeof(xmitsfd));
   for (i = 0; i < MAX_STREAMS; i++) {
@@ -171,7 +436,7 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
     rsnap[i] = NULL;
     streams[i].snapArgs.log = NULL;
 #endif
-    streams[i].snapArgs.delay = options->snapDelay;
+    snapStreams[i] = &streams[i].snapArgs;
   }
 
   log_println(1, "test client version: %s", testOptions->client_version);
@@ -365,66 +630,20 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
     // set up packet capture. The data collected is used for bottleneck link
     // calculations
     if (xmitsfd[0].socket > 0) {
-      log_println(6, "S2C child %d, ready to fork()",
+      log_println(6, "S2C child %d, starting packet capture",
                   testOptions->child0);
       if (getuid() == 0) {
-        if (pipe(mon_pipe) != 0) {
-          log_println(0, "S2C test error: can't create pipe.");
-        } else {
-          if ((s2c_childpid = fork()) == 0) {
-            // Don't capture more than 12 seconds of packet traces:
-            //   10 second test + 2 seconds of slop
-            // Causes a call to cleanup() if allowed to run for too long.
-            alarm(testDuration + 2);
-            close(testOptions->s2csockfd);
-            for (i = 0; i < streamsNum; i++) {
-              close(xmitsfd[i].socket);
-            }
-            log_println(
-                5,
-                "S2C test Child thinks pipe() returned fd0=%d, fd1=%d",
-                mon_pipe[0], mon_pipe[1]);
-            log_println(2, "S2C test calling init_pkttrace() with pd=%p",
-                        &cli_addr[0]);
-            init_pkttrace(src_addr, cli_addr, streamsNum,
-                          clilen, mon_pipe, device, &pair, "s2c",
-                          options->s2c_duration / 1000.0);
-            log_println(6,
-                        "S2C test ended, why is timer still running?");
-            /* Close the pipe */
-            close(mon_pipe[0]);
-            close(mon_pipe[1]);
-            exit(0); /* Packet trace finished, terminate gracefully */
-          } else if (s2c_childpid < 0) {
-            log_println(0, "S2C test error: can't create child process.");
-          }
-        }
-
-        packet_trace_running = wait_for_readable_fd(mon_pipe[0]);
+        packet_trace_running = start_pkttrace(&pkttrace, src_addr, cli_addr,
+                                              streamsNum, clilen, device,
+                                              &pair, "s2c",
+                                              options->compress) == 0;
         if (packet_trace_running) {
-          memset(tmpstr, 0, 256);
-          tmpstr_len = 0;
-          for (i = 0; i < 5; i++) {  // read nettrace file name into "tmpstr"
-            ret = read(mon_pipe[0], tmpstr, 128);
-            // socket interrupted, try reading again
-            if ((ret == -1) && (errno == EINTR)) {
-              continue;
-            } else if (ret == 128) { 
-              tmpstr[127] = '\0';  // ensure the string is well-terminated.
-              tmpstr_len = 128;
-            } else if (ret > 0) {
-              tmpstr_len = ret;
-            }
-            break;
-          }
-
-          if (tmpstr_len > 5)
-            memcpy(meta.s2c_ndttrace, tmpstr, tmpstr_len);
-          // name of nettrace file passed back from pcap child copied into meta
-          // structure
+          // name of nettrace file copied into meta structure
+          if (strlen(pkttrace.tracefile) > 0)
+            strlcpy(meta.s2c_ndttrace, pkttrace.tracefile,
+                    sizeof(meta.s2c_ndttrace));
         } else {
           log_println(0, "Packet trace was unable to be created");
-          packet_trace_emergency_shutdown(mon_pipe);
         }
       }
 
@@ -464,33 +683,62 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
 
       // fill send buffer with random printable data for throughput test
       bytes_written = 0;
-      k = 0;
-      for (j = 0; j <= BUFFSIZE; j++) {
-        while (!isprint(k & 0x7f))
-          k++;
-        buff[j] = (k++ & 0x7f);
+      writeSize = RECLTH;
+      if (options->s2c_writesize > 0) {
+        writeSize = choose_s2c_write_size(options->s2c_writesize, set_buff,
+                                          window);
       }
-      if (testOptions->connection_flags & WEBSOCKET_SUPPORT) {
-        // Make sure the data has a websocket header
-        ((unsigned char*)buff)[0] = 0x82;  // One frame of binary data
-        // Depending on BUFFSIZE, the websocket header will be 2, 4, or 10
-        // bytes big.  This header is constructed to comply with RFC 6455.
-        if (BUFFSIZE < 126) {
-          buff[1] = (BUFFSIZE-2) & 0x7F;
-        } else if (BUFFSIZE < 65536) {
-          buff[1] = 126;
-          ((unsigned char*)buff)[2] = ((BUFFSIZE - 4) >> 8) & 0xFF;
-          ((unsigned char*)buff)[3] = (BUFFSIZE - 4) & 0xFF;
-        } else {
-          buff[1] = 127;
-          ((unsigned char*)buff)[2] = (((long long)BUFFSIZE - 10) >> 56) & 0xFF;
-          ((unsigned char*)buff)[3] = (((long long)BUFFSIZE - 10) >> 48) & 0xFF;
-          ((unsigned char*)buff)[4] = (((long long)BUFFSIZE - 10) >> 40) & 0xFF;
-          ((unsigned char*)buff)[5] = (((long long)BUFFSIZE - 10) >> 32) & 0xFF;
-          ((unsigned char*)buff)[6] = (((long long)BUFFSIZE - 10) >> 24) & 0xFF;
-          ((unsigned char*)buff)[7] = (((long long)BUFFSIZE - 10) >> 16) & 0xFF;
-          ((unsigned char*)buff)[8] = (((long long)BUFFSIZE - 10) >> 8) & 0xFF;
-          ((unsigned char*)buff)[9] = (BUFFSIZE - 10) & 0xFF;
+      // websocket clients may get several frames in each write
+      frameSize = choose_s2c_frame_size(options->s2c_framesize, writeSize);
+      if ((testOptions->connection_flags & WEBSOCKET_SUPPORT) &&
+          frameSize < writeSize) {
+        framePool = get_s2c_frame_pool(frameSize, writeSize);
+        if (framePool == NULL)
+          log_println(0, "Unable to make the S2C websocket frames, "
+                      "sending one frame per write");
+      }
+      if (framePool != NULL) {
+        writeSize = framePool->frames * frameSize;
+        sendBuff = buff;
+        log_println(5, "S2C test writing %d websocket frames of %d bytes at a "
+                    "time", framePool->frames, frameSize);
+        addAdditionalMetaIntEntry("s2c.framesize", frameSize);
+      } else {
+        sendBuff = malloc(writeSize);
+        if (sendBuff == NULL) {
+          log_println(0, "Unable to allocate a %d byte S2C send buffer, "
+                      "using %d bytes", writeSize, RECLTH);
+          writeSize = RECLTH;
+          sendBuff = buff;
+        }
+        fill_s2c_buffer(sendBuff, writeSize,
+                        testOptions->connection_flags & WEBSOCKET_SUPPORT);
+      }
+      log_println(5, "S2C test writing %d bytes at a time", writeSize);
+      addAdditionalMetaIntEntry("s2c.writesize", writeSize);
+
+      // The zero-copy mode can't be used with TLS, which has to encrypt the
+      // data in userspace.
+      if (options->s2c_zerocopy) {
+        for (i = 0; i < streamsNum; i++) {
+          if (xmitsfd[i].ssl != NULL) break;
+        }
+        if (i == streamsNum) {
+          if (framePool != NULL) {
+            payloadFd = create_s2c_payload_file(framePool->iov,
+                                                2 * framePool->frames,
+                                                writeSize);
+          } else {
+            payloadIov.iov_base = sendBuff;
+            payloadIov.iov_len = writeSize;
+            payloadFd = create_s2c_payload_file(&payloadIov, 1, writeSize);
+          }
+          if (payloadFd == -1) {
+            log_println(0, "Unable to create the zero-copy S2C payload (%s), "
+                        "falling back to write()", strerror(errno));
+          } else {
+            log_println(5, "S2C test sending with sendfile()");
+          }
         }
       }
 
@@ -499,7 +747,7 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
                                 JSON_SINGLE_VALUE) < 0)
         log_println(6,
                     "S2C test - Test-start message failed for pid=%d",
-                    s2c_childpid);
+                    testOptions->child0);
 
       // capture current values (i.e take snap shot) of web_100 variables
       // Write snap logs if option is enabled. update meta log to point to
@@ -518,59 +766,62 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
         conn, group);*///new file changes
       if (options->snapshots) {
         for (i = 0; i < streamsNum; ++i) {
-            start_snap_worker(&streams[i].snapArgs, agent, peaks, options->snaplog,
-                              &streams[i].workerThreadId, options->s2c_logname[i],
-                              streams[i].conn, group);
+          open_snap_stream(&streams[i].snapArgs, agent, options->snaplog,
+                           options->binarySnaplog, options->s2c_logname[i],
+                           streams[i].conn, group);
         }
+        start_snap_scheduler(&snapScheduler, snapStreams, streamsNum, agent,
+                             peaks, options->snaplog, options->snapDelay);
       }
       tmptime = secs();  // current time
       tx_duration = tmptime + testDuration;  // set timeout to test duration s in future
+      stream_series_free(s2c_series);
+      if (stream_series_init(s2c_series, streamsNum, testDuration, tmptime) != 0)
+        log_println(0, "Cannot allocate the S2C time series");
 
       for (i = 0; i < streamsNum; ++i) {
         streams[i].writeWorkerArgs.connectionId = i + 1;
         streams[i].writeWorkerArgs.connection = &xmitsfd[i];
         streams[i].writeWorkerArgs.stopTime = tx_duration;
-        streams[i].writeWorkerArgs.buff = buff;
+        streams[i].writeWorkerArgs.buff = sendBuff;
+        streams[i].writeWorkerArgs.writeSize = writeSize;
+        streams[i].writeWorkerArgs.payloadFd = payloadFd;
+        streams[i].writeWorkerArgs.frames = framePool;
+        streams[i].writeWorkerArgs.avoidSndBlockUp = options->avoidSndBlockUp;
+        streams[i].writeWorkerArgs.bytes = 0;
+        if (options->avoidSndBlockUp) {
+          setup_s2c_send_pacing(xmitsfd[i].socket);
+        }
       }
 
 
       log_println(6, "S2C child %d beginning test", testOptions->child0);
 
       if (streamsNum == 1) {
-        while (secs() < tx_duration) {
+        while ((now = secs()) < tx_duration) {
+          if (s2c_series->streamsNum > 0)
+            stream_series_update(s2c_series, &bytes_written, now);
           // Increment total attempts at sending-> buffer control
           bufctrlattempts++;
           if (options->avoidSndBlockUp) {  // Do not block send buffers
-            pthread_mutex_lock(&mainmutex);
-
-            // get details of next sequence # to be sent and fetch value from snap file
-#if USE_WEB100
-            web100_agent_find_var_and_group(agent, "SndNxt", &group, &var);
-            web100_snap_read(var, streams[0].snapArgs.snap, tmpstr);
-            nextseqtosend = atoi(web100_value_to_text(web100_get_var_type(var), tmpstr));
-            // get oldest un-acked sequence number
-            web100_agent_find_var_and_group(agent, "SndUna", &group, &var);
-            web100_snap_read(var, streams[0].snapArgs.snap, tmpstr);
-            lastunackedseq = atoi(web100_value_to_text(web100_get_var_type(var), tmpstr));
-#elif USE_WEB10G
-            struct estats_val value;
-            web10g_find_val(streams[0].snapArgs.snap, "SndNxt", &value);
-            nextseqtosend = value.uv32;
-            web10g_find_val(streams[0].snapArgs.snap, "SndUna", &value);
-            lastunackedseq = value.uv32;
-#endif
-            pthread_mutex_unlock(&mainmutex);
-
-            // Temporarily stop sending data if you sense that the buffer is overwhelmed
-            // This is calculated by checking if (8192 * 4) < ((Next Sequence Number To Be Sent) - (Oldest Unacknowledged Sequence Number) - 1)
-            if (is_buffer_clogged(nextseqtosend, lastunackedseq)) {
-              // Increment draining queue value
-              drainingqueuecount++;
+            // Temporarily stop sending data while the unsent data queued on
+            // the socket is above the low-water mark.
+            // Increments the draining queue value when it has to wait
+            ret = wait_for_s2c_send_space(xmitsfd[0].socket, tx_duration,
+                                          &drainingqueuecount);
+            if (ret < 0)
+              break;
+            if (ret == 0)
               continue;
-            }
           }
 
-          n = writen_any(&xmitsfd[0], buff, RECLTH);
+          if (payloadFd != -1)
+            n = send_s2c_payload(&xmitsfd[0], payloadFd, writeSize,
+                                 &payloadOffset);
+          else if (framePool != NULL)
+            n = send_s2c_frames(&xmitsfd[0], framePool);
+          else
+            n = writen_any(&xmitsfd[0], sendBuff, writeSize);
           if (n < 0)
             break;  // writen_any returned a fatal error.
           bytes_written += n;
@@ -585,14 +836,41 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
           if (pthread_create(&streams[i].writeWorkerIds, NULL, s2cWriteWorker, (void*) &streams[i].writeWorkerArgs)) {
             log_println(0, "Cannot create write worker thread for throughput download test!");
             streams[i].writeWorkerIds = 0;
+            if (sendBuff != buff) free(sendBuff);
             return -4;
           }
         }
 
+        // Sample the stream counters at the end of each interval while
+        // the workers write
+        while (s2c_series->streamsNum > 0 && (now = secs()) < tx_duration) {
+          wakeup = stream_series_next(s2c_series);
+          if (wakeup > tx_duration)
+            wakeup = tx_duration;
+          if (wakeup > now)
+            mysleep(wakeup - now);
+          for (i = 0; i < streamsNum; ++i) {
+            __atomic_load(&streams[i].writeWorkerArgs.bytes, &streamBytes[i],
+                          __ATOMIC_RELAXED);
+          }
+          stream_series_update(s2c_series, streamBytes, secs());
+        }
         for (i = 0; i < streamsNum; ++i) {
           pthread_join(streams[i].writeWorkerIds, NULL);
+          streamBytes[i] = streams[i].writeWorkerArgs.bytes;
+          bytes_written += streamBytes[i];
         }
       }
+      if (s2c_series->streamsNum > 0)
+        stream_series_finish(s2c_series,
+                             streamsNum == 1 ? &bytes_written : streamBytes);
+
+      if (payloadFd != -1) {
+        close(payloadFd);
+      }
+      if (sendBuff != buff) {
+        free(sendBuff);
+      }
 
       sndqueue = sndq_len(xmitsfd[0].socket);
 
@@ -611,8 +889,9 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
 
       // Release semaphore, and close snaplog file.  finalize other data
       if (options->snapshots) {
+        stop_snap_scheduler(&snapScheduler, "s2c");
         for (i = 0; i < streamsNum; i++) {
-          stop_snap_worker(&streams[i].workerThreadId, options->snaplog, &streams[i].snapArgs);
+          close_snap_stream(&streams[i].snapArgs, options->snaplog);
         }
       }
 
@@ -627,14 +906,14 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
                               JSON_MULTIPLE_VALUES, RESULTS_KEYS, " ", buff, " ") < 0)
             log_println(6,
                 "S2C test - failed to send test message to pid=%d",
-                s2c_childpid);
+                testOptions->child0);
       }
       else {
         if (send_json_message_any(ctl, TEST_MSG, buff, strlen(buff),
                                   testOptions->connection_flags, JSON_SINGLE_VALUE) < 0)
           log_println(6,
               "S2C test - failed to send test message to pid=%d",
-              s2c_childpid);
+              testOptions->child0);
       }
 
       for (i = 0; i < streamsNum; ++i) {
@@ -659,70 +938,19 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
        */
 
       if (packet_trace_running) {
-        log_println(1, "Signal USR2(%d) sent to child [%d]", SIGUSR2,
-                    s2c_childpid);
-        testOptions->child2 = s2c_childpid;
-        kill(s2c_childpid, SIGUSR2);
-        FD_ZERO(&rfd);
-        FD_SET(mon_pipe[0], &rfd);
-        sel_tv.tv_sec = 1;
-        sel_tv.tv_usec = 100000;
-        i = 0;
-
-        for (;;) {
-          ret = select(mon_pipe[0] + 1, &rfd, NULL, NULL, &sel_tv);
-          if ((ret == -1) && (errno == EINTR)) {
-            log_println(
-                6,
-                "Interrupt received while waiting for s2c select90 to finish, "
-                "continuing");
-            continue;
-          }
-          if (((ret == -1) && (errno != EINTR)) || (ret == 0)) {
-            log_println(
-                4,
-                "Failed to read pkt-pair data from S2C flow, retcode=%d, "
-                "reason=%d, EINTR=%d",
-                ret, errno, EINTR);
-            snprintf(
-                spds[(*spd_index)++],
-                sizeof(spds[*spd_index]),
-                " -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 0.0 0 0 0 0 0 -1");
-            snprintf(
-                spds[(*spd_index)++],
-                sizeof(spds[*spd_index]),
-                " -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 0.0 0 0 0 0 0 -1");
-            break;
-          }
-          /* There is something to read, so get it from the pktpair child.  If an interrupt occurs,
-           * just skip the read and go on
-           * RAC 2/8/10
-           */
-          if (ret > 0) {
-            if ((ret = read(mon_pipe[0], spds[*spd_index], 128))
-                < 0)
-              snprintf(
-                  spds[*spd_index],
-                  sizeof(spds[*spd_index]),
-                  " -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 0.0 0 0 0 0 0 -1");
-            log_println(1,
-                        "%d bytes read '%s' from S2C monitor pipe", ret,
-                        spds[*spd_index]);
-            (*spd_index)++;
-            if (i++ == 1)
-              break;
-            sel_tv.tv_sec = 1;
-            sel_tv.tv_usec = 100000;
-            continue;
-          }
-        }
+        stop_pkttrace(&pkttrace, spds[*spd_index], spds[*spd_index + 1],
+                      sizeof(spds[*spd_index]));
+        log_println(1, "S2C pkt-pair data '%s' '%s'", spds[*spd_index],
+                    spds[*spd_index + 1]);
+        *spd_index += 2;
+        packet_trace_running = 0;
       }
 
-      log_println(1, "%6.0f kbps inbound pid-%d", x2cspd, s2c_childpid);
+      log_println(1, "%6.0f kbps inbound pid-%d", x2cspd, testOptions->child0);
     }
     // Get web100 variables from snapshot taken earlier and send to client
     log_println(6, "S2C-Send web100 data vars to client pid=%d",
-                s2c_childpid);
+                testOptions->child0);
 
 #if USE_WEB100
     // send web100 data to client
@@ -745,7 +973,7 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
     // If sending web100 variables above failed, indicate to client
     if (ret < 0) {
       log_println(6, "S2C - No web100 data received for pid=%d",
-                  s2c_childpid);
+                  testOptions->child0);
       snprintf(buff, sizeof(buff), "No Data Collected: 000000");
       send_json_message_any(ctl, TEST_MSG, buff, strlen(buff), testOptions->connection_flags,
                             JSON_SINGLE_VALUE);
@@ -815,11 +1043,7 @@ int test_s2c(Connection *ctl, tcp_stat_agent *agent, TestOptions *testOptions,
                               testOptions->connection_flags, JSON_SINGLE_VALUE) < 0)
       log_println(6,
                   "S2C test - failed to send finalize message to pid=%d",
-                  s2c_childpid);
-
-    if (packet_trace_running) {
-      stop_packet_trace(mon_pipe);
-    }
+                  testOptions->child0);
 
     // log end of test (generic and protocol logs)
     log_println(1, " <------------ %d ------------->", testOptions->child0);
@@ -838,21 +1062,41 @@ void* s2cWriteWorker(void* arg) {
   Connection* conn = workerArgs->connection;
   double stopTime = workerArgs->stopTime;
   char* threadBuff = workerArgs->buff;
+  int writeSize = workerArgs->writeSize;
+  int payloadFd = workerArgs->payloadFd;
+  S2CFramePool* frames = workerArgs->frames;
+  off_t payloadOffset = 0;
   double threadBytes = 0;
-  int threadPackets = 0, n;
+  int threadPackets = 0, threadDraining = 0, n;
   double threadTime = secs();
 
 
   while (secs() < stopTime) {
-    // attempt to write random data into the client socket
-    n = writen_any(conn, threadBuff, RECLTH); // TODO avoid snd block
-    if (n <= 0) break;  // writen_any has failed unrecoverably
+    if (workerArgs->avoidSndBlockUp) {
+      n = wait_for_s2c_send_space(conn->socket, stopTime, &threadDraining);
+      if (n < 0) break;
+      if (n == 0) continue;
+    }
+    if (payloadFd != -1) {
+      // send the next part of the payload file straight from the page cache
+      n = send_s2c_payload(conn, payloadFd, writeSize, &payloadOffset);
+      if (n < 0) break;  // sendfile has failed unrecoverably
+    } else if (frames != NULL) {
+      // write the websocket frames, which are never framed again
+      n = send_s2c_frames(conn, frames);
+      if (n <= 0) break;  // writev_any has failed unrecoverably
+    } else {
+      // attempt to write random data into the client socket
+      n = writen_any(conn, threadBuff, writeSize); // TODO avoid snd block
+      if (n <= 0) break;  // writen_any has failed unrecoverably
+    }
     threadPackets++;
     threadBytes += n;
+    __atomic_store(&workerArgs->bytes, &threadBytes, __ATOMIC_RELAXED);
   }
 
-  log_println(6, " ---S->C thread %d (sc %d): speed=%0.0f, bytes=%0.0f, pkts=%d, lth=%d, time=%0.0f", connectionId, conn->socket,
-                 ((BITS_8_FLOAT * threadBytes) / KILO) / (secs() - threadTime), threadBytes, threadPackets, RECLTH, secs() - threadTime);
+  log_println(6, " ---S->C thread %d (sc %d): speed=%0.0f, bytes=%0.0f, pkts=%d, lth=%d, draining=%d, time=%0.0f", connectionId, conn->socket,
+                 ((BITS_8_FLOAT * threadBytes) / KILO) / (secs() - threadTime), threadBytes, threadPackets, writeSize, threadDraining, secs() - threadTime);
 
   return NULL;
 }
@@ -6,9 +6,15 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
 #include <string.h>
 // #include <ctype.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 #include "testoptions.h"
 #include "network.h"
@@ -23,17 +29,6 @@
 #include "websocket.h"
 
 
-// Worker thread characteristics used to record snaplog and Cwnd peaks
-typedef struct workerArgs {
-  SnapArgs* snapArgs;  // snapArgs struct pointer
-  tcp_stat_agent* agent;  // tcp_stat agent pointer
-  CwndPeaks* peaks;  // data indicating Cwnd values
-  int writeSnap;  // enable writing snaplog
-} WorkerArgs;
-
-int workerLoop = 0;
-pthread_mutex_t mainmutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t maincond = PTHREAD_COND_INITIALIZER;
 static int slowStart = 1;
 static int prevCWNDval = -1;
 static int decreasing = 0;
@@ -49,22 +44,11 @@ static int decreasing = 0;
 void findCwndPeaks(tcp_stat_agent* agent, CwndPeaks* peaks,
                    tcp_stat_snap* snap) {
   int CurCwnd;
-#if USE_WEB100
-  web100_group* group;
-  web100_var* var;
-  char tmpstr[256];
-#elif USE_WEB10G
-  struct estats_val value;
-#endif
+  int64_t value;
 
-#if USE_WEB100
-  web100_agent_find_var_and_group(agent, "CurCwnd", &group, &var);
-  web100_snap_read(var, snap, tmpstr);
-  CurCwnd = atoi(web100_value_to_text(web100_get_var_type(var), tmpstr));
-#elif USE_WEB10G
-  web10g_find_val(snap, "CurCwnd", &value);
-  CurCwnd = value.uv32;
-#endif
+  if (tcp_stat_snap_read_var(agent, snap, TCP_STAT_CUR_CWND, &value) != 0)
+    return;
+  CurCwnd = (int) value;
 
   if (slowStart) {
     if (CurCwnd < prevCWNDval) {
@@ -98,63 +82,240 @@ void findCwndPeaks(tcp_stat_agent* agent, CwndPeaks* peaks,
 
 
 /**
- * Write the snap logs with fixed time intervals in a separate
- *              thread, locking and releasing resources as necessary.
- * @param arg pointer to the snapshot structure
- * @return void pointer null
+ * Read the monotonic clock.
+ * @return the time in seconds
  */
+static double monotonic_secs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1.e9;
+}
 
-void*
-snapWorker(void* arg) {
-  /* WARNING void* arg (workerArgs) is on the stack of the function below and
-   * doesn't exist forever. */
-  WorkerArgs *workerArgs = (WorkerArgs*) arg;
-  SnapArgs *snapArgs = workerArgs->snapArgs;
-  tcp_stat_agent* agent = workerArgs->agent;
-  CwndPeaks* peaks = workerArgs->peaks;
-  int writeSnap = workerArgs->writeSnap;
+static void free_snaplog_ring(SnapLogRing* ring);
+static void stop_snaplog_writer(SnapScheduler* sched);
 
-  // snap log written into every "delay" milliseconds
-  double delay = ((double) snapArgs->delay) / 1000.0;
+/**
+ * Append a snapshot to the snap log of a stream, in its format.
+ * @param snapArgs the stream
+ * @param snap the snapshot
+ */
+static void write_snaplog_record(SnapArgs* snapArgs, tcp_stat_snap* snap) {
+  if (snapArgs->binlog != NULL) {
+    tcp_stat_ndtsnap_write(snapArgs->binlog, snap);
+    return;
+  }
+#if USE_WEB100
+  web100_log_write(snapArgs->log, snap);
+#elif USE_WEB10G
+  estats_record_write_data(snapArgs->log, snap);
+#endif
+}
 
-  while (1) {
-    pthread_mutex_lock(&mainmutex);
-    if (workerLoop) {
-      pthread_cond_broadcast(&maincond);
-      pthread_mutex_unlock(&mainmutex);
+/**
+ * Allocate the ring of snapshot copies waiting for the snap log writer.
+ * @param conn tcp_stat_connection the snapshots are taken of
+ * @param group web100_group the snapshots are taken of
+ * @return the ring, or NULL if it could not be allocated
+ */
+static SnapLogRing* alloc_snaplog_ring(tcp_stat_connection conn,
+                                       tcp_stat_group* group) {
+  SnapLogRing* ring;
+  int i;
+
+  if ((ring = (SnapLogRing*) calloc(1, sizeof(SnapLogRing))) == NULL)
+    return NULL;
+  for (i = 0; i < SNAPLOG_RING_SLOTS; i++) {
+#if USE_WEB100
+    ring->slots[i] = web100_snapshot_alloc(group, conn);
+#elif USE_WEB10G
+    estats_val_data_new(&ring->slots[i]);
+#endif
+    if (ring->slots[i] == NULL)
       break;
-    }
-    pthread_mutex_unlock(&mainmutex);
-    mysleep(0.01);
   }
+  if (i < SNAPLOG_RING_SLOTS) {
+    free_snaplog_ring(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+/**
+ * Free a ring allocated by alloc_snaplog_ring().
+ * @param ring the ring to free
+ */
+static void free_snaplog_ring(SnapLogRing* ring) {
+  int i;
+
+  for (i = 0; i < SNAPLOG_RING_SLOTS && ring->slots[i] != NULL; i++) {
+#if USE_WEB100
+    web100_snapshot_free(ring->slots[i]);
+#elif USE_WEB10G
+    estats_val_data_free(&ring->slots[i]);
+#endif
+  }
+  free(ring);
+}
+
+/**
+ * Copy the current snapshot of a stream into its ring.  Only the snapshot
+ * scheduler thread calls this.
+ * @param snapArgs the stream
+ * @return 1 if the snapshot was queued, 0 if the ring was full
+ */
+static int queue_snaplog_record(SnapArgs* snapArgs) {
+  SnapLogRing* ring = snapArgs->ring;
+  unsigned int head = ring->head;
+  tcp_stat_snap* slot;
+
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      SNAPLOG_RING_SLOTS) {
+    ring->overflows++;
+    return 0;
+  }
+  slot = ring->slots[head % SNAPLOG_RING_SLOTS];
+#if USE_WEB100
+  web100_snap_data_copy(slot, snapArgs->snap);
+#elif USE_WEB10G
+  memcpy(slot, snapArgs->snap, sizeof(struct estats_val_data) +
+         (sizeof(struct estats_val) * snapArgs->snap->length));
+#endif
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * Write the queued snapshots of a stream to its snap log.  Only the snap log
+ * writer thread calls this.
+ * @param snapArgs the stream
+ */
+static void drain_snaplog_ring(SnapArgs* snapArgs) {
+  SnapLogRing* ring = snapArgs->ring;
+  unsigned int tail = ring->tail;
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  while (tail != head) {
+    write_snaplog_record(snapArgs, ring->slots[tail % SNAPLOG_RING_SLOTS]);
+    tail++;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Write the snapshots queued by the scheduler to the snap logs, whenever the
+ * scheduler signals the writer eventfd, until told to stop.  Keeps the disk
+ * latency of the snap logs out of the sampling thread.
+ * @param arg pointer to the SnapScheduler
+ * @return void pointer null
+ */
+static void* snapLogWriter(void* arg) {
+  SnapScheduler* sched = (SnapScheduler*) arg;
+  uint64_t count;
+  int i, stopping;
 
-  // Find Congestion window peaks from a web_100 snapshot, if enabled
-  // Write snap log , if enabled, all in a synchronous manner.
   while (1) {
-    pthread_mutex_lock(&mainmutex);
-    if (!workerLoop) {
-      pthread_mutex_unlock(&mainmutex);
-      break;
+    if (read(sched->writerfd, &count, sizeof(count)) == -1 && errno == EINTR)
+      continue;
+    stopping = __atomic_load_n(&sched->writerStop, __ATOMIC_ACQUIRE);
+    for (i = 0; i < sched->streamsNum; i++) {
+      if (sched->streams[i]->ring != NULL)
+        drain_snaplog_ring(sched->streams[i]);
     }
+    if (stopping)
+      break;
+  }
+  return NULL;
+}
+
+/**
+ * Take a snapshot of every stream of the test in one pass, finding the
+ * Congestion window peaks and queueing the snapshots for the snap log writer
+ * if enabled.  Streams without a ring, or a test without a writer thread,
+ * write their snap logs right away.
+ * @param sched the scheduler of the test
+ */
+static void take_snapshots(SnapScheduler* sched) {
+  int i, queued = 0;
+  uint64_t one = 1;
+  SnapArgs* snapArgs;
+
+  for (i = 0; i < sched->streamsNum; i++) {
+    snapArgs = sched->streams[i];
 #if USE_WEB100
     web100_snap(snapArgs->snap);
-    if (peaks) {
-      findCwndPeaks(agent, peaks, snapArgs->snap);
-    }
-    if (writeSnap) {
-      web100_log_write(snapArgs->log, snapArgs->snap);
-    }
 #elif USE_WEB10G
-    estats_read_vars(snapArgs->snap, snapArgs->conn, agent);
-    if (peaks) {
-      findCwndPeaks(agent, peaks, snapArgs->snap);
+    estats_read_vars(snapArgs->snap, snapArgs->conn, sched->agent);
+#endif
+    if (sched->peaks) {
+      findCwndPeaks(sched->agent, sched->peaks, snapArgs->snap);
     }
-    if (writeSnap) {
-      estats_record_write_data(snapArgs->log, snapArgs->snap);
+    if (!sched->writeSnap)
+      continue;
+    if (snapArgs->ring != NULL && sched->writerfd != -1) {
+      queued += queue_snaplog_record(snapArgs);
+      continue;
     }
-#endif
-    pthread_mutex_unlock(&mainmutex);
-    mysleep(delay);
+    write_snaplog_record(snapArgs, snapArgs->snap);
+  }
+  if (queued && write(sched->writerfd, &one, sizeof(one)) != sizeof(one))
+    log_println(0, "Cannot wake up the snap log writer: %s", strerror(errno));
+}
+
+/**
+ * Take the snapshots of a test every time its timer expires, until the stop
+ * eventfd is written.  The timer runs on absolute deadlines, so the time the
+ * snapshots take does not add to the sampling period; how late each pass
+ * starts, and how many deadlines pass without one, is recorded instead.
+ * @param arg pointer to the SnapScheduler
+ * @return void pointer null
+ */
+void*
+snapWorker(void* arg) {
+  SnapScheduler* sched = (SnapScheduler*) arg;
+  struct pollfd pfds[2];
+  uint64_t expirations;
+  double period = sched->delay / 1000.0;
+  double deadline = sched->start;
+  double late;
+
+  pfds[0].fd = sched->timerfd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = sched->stopfd;
+  pfds[1].events = POLLIN;
+
+  // Let start_snap_scheduler() return, the test can start
+  pthread_mutex_lock(&sched->readyLock);
+  sched->ready = 1;
+  pthread_cond_broadcast(&sched->readyCond);
+  pthread_mutex_unlock(&sched->readyLock);
+
+  while (1) {
+    if (poll(pfds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      log_println(0, "Snapshot scheduler poll() failed: %s", strerror(errno));
+      break;
+    }
+    if (pfds[1].revents)
+      break;
+    if (read(sched->timerfd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+      continue;
+
+    // The deadline of the last expiration; any before it were missed
+    deadline += expirations * period;
+    sched->missed += expirations - 1;
+    late = monotonic_secs() - deadline;
+    if (late < 0)
+      late = 0;
+
+    take_snapshots(sched);
+
+    sched->samples++;
+    sched->lateSum += late;
+    sched->lateSqSum += late * late;
+    if (late > sched->lateMax)
+      sched->lateMax = late;
   }
 
   return NULL;
@@ -392,28 +553,42 @@ int initialize_tests(Connection *ctl, TestOptions *options, char *buff,
   return useropt;
 }
 
-/** Method to start snap worker thread that collects snap logs
- * @param snaparg object
- * @param tcp_stat_agent Agent
+/**
+ * Open the snap log of a stream in the format of the tcp_stat library.
+ * @param snaparg the stream's SnapArgs
+ * @param metafilename name of the snap log
+ * @param conn tcp_stat_connection connection pointer
+ * @param group group web100_group pointer
+ */
+static void open_native_snaplog(SnapArgs *snaparg, char *metafilename,
+                                tcp_stat_connection conn,
+                                tcp_stat_group* group) {
+#if USE_WEB100
+  snaparg->log = web100_log_open_write(metafilename, conn, group);
+#elif USE_WEB10G
+  estats_record_open(&snaparg->log, metafilename, "w");
+#endif
+}
+
+/**
+ * Prepare the snapshots of one stream: allocate the snapshot, open the snap
+ * log if enabled, and take and log the first snapshot.
+ * @param snaparg the stream's SnapArgs
+ * @param agentarg tcp_stat Agent
  * @param snaplogenabled Is snap logging enabled?
- * @param workerlooparg integer used to syncronize writing/reading from snaplog/tcp_stat snapshot
- * @param wrkrthreadidarg Thread Id of workera
+ * @param snaplogbinary Write the snap log in the binary columnar format?
  * @param metafilename	value of metafile name
- * @param tcp_stat_connection connection pointer
- * @param tcp_stat_group group web100_group pointer
+ * @param conn tcp_stat_connection connection pointer
+ * @param group group web100_group pointer
  */
-void start_snap_worker(SnapArgs *snaparg, tcp_stat_agent* agentarg,
-                       CwndPeaks* peaks, char snaplogenabled,
-                       pthread_t *wrkrthreadidarg, char *metafilename,
-                       tcp_stat_connection conn, tcp_stat_group* group) {
+void open_snap_stream(SnapArgs *snaparg, tcp_stat_agent* agentarg,
+                      char snaplogenabled, char snaplogbinary,
+                      char *metafilename,
+                      tcp_stat_connection conn, tcp_stat_group* group) {
   FILE *fplocal;
 
-  WorkerArgs workerArgs;
-  workerArgs.snapArgs = snaparg;
-  workerArgs.agent = agentarg;
-  workerArgs.peaks = peaks;
-  workerArgs.writeSnap = snaplogenabled;
-
+  snaparg->ring = NULL;
+  snaparg->binlog = NULL;
 #if USE_WEB100
   group = web100_group_find(agentarg, "read");
   snaparg->snap = web100_snapshot_alloc(group, conn);
@@ -429,11 +604,10 @@ void start_snap_worker(SnapArgs *snaparg, tcp_stat_agent* agentarg,
 
     fplocal = fopen(get_logfile(), "a");
 
-#if USE_WEB100
-    snaparg->log = web100_log_open_write(metafilename, conn, group);
-#elif USE_WEB10G
-    estats_record_open(&snaparg->log, metafilename, "w");
-#endif
+    // The binary snap log needs a snapshot for the endpoints, so it is
+    // created below
+    if (!snaplogbinary)
+      open_native_snaplog(snaparg, metafilename, conn, group);
     if (fplocal == NULL) {
       log_println(
           0,
@@ -444,79 +618,234 @@ void start_snap_worker(SnapArgs *snaparg, tcp_stat_agent* agentarg,
       fprintf(fplocal, "Snaplog file: %s\n", metafilename);
       fclose(fplocal);
     }
+    if ((snaparg->ring = alloc_snaplog_ring(conn, group)) == NULL)
+      log_println(0, "Cannot allocate the snap log ring, writing the snap "
+                  "log from the snapshot thread");
   }
 
-  if (pthread_create(wrkrthreadidarg, NULL, snapWorker,
-                     (void*) &workerArgs)) {
-    log_println(1, "Cannot create worker thread for writing snap log!");
-    *wrkrthreadidarg = 0;
-  }
-
-  pthread_mutex_lock(&mainmutex);
-  workerLoop= 1;
   // obtain web100 snap into "snaparg.snap"
 #if USE_WEB100
   web100_snap(snaparg->snap);
-  if (snaplogenabled) {
-    web100_log_write(snaparg->log, snaparg->snap);
-  }
 #elif USE_WEB10G
   estats_read_vars(snaparg->snap, conn, agentarg);
+#endif
+  if (snaplogenabled && snaplogbinary &&
+      (snaparg->binlog = tcp_stat_ndtsnap_open(metafilename, agentarg, group,
+                                               snaparg->snap)) == NULL) {
+    log_println(0, "Cannot create the binary snap log %s (%s), writing a "
+                "%s one instead", metafilename, strerror(errno),
+                TCP_STAT_NAME);
+    open_native_snaplog(snaparg, metafilename, conn, group);
+  }
   if (snaplogenabled) {
-    estats_record_write_data(snaparg->log, snaparg->snap);
+    write_snaplog_record(snaparg, snaparg->snap);
   }
-#endif
-  pthread_cond_wait(&maincond, &mainmutex);
-  pthread_mutex_unlock(&mainmutex);
 }
 
 /**
- * Stop snapWorker
- * @param workerThreadId Worker Thread's ID
- * @param snaplogenabled boolean indication whether snap logging is enabled
+ * Release the snapshot of one stream, closing its snap log if enabled.
  * @param snapArgs_ptr  pointer to a snapArgs object
+ * @param snaplogenabled boolean indication whether snap logging is enabled
  * */
-void stop_snap_worker(pthread_t *workerThreadId, char snaplogenabled,
-                      SnapArgs* snapArgs_ptr) {
-  if (*workerThreadId) {
-    pthread_mutex_lock(&mainmutex);
-    workerLoop = 0;
-    pthread_mutex_unlock(&mainmutex);
-    pthread_join(*workerThreadId, NULL);
+void close_snap_stream(SnapArgs* snapArgs_ptr, char snaplogenabled) {
+  if (snapArgs_ptr->ring != NULL) {
+    free_snaplog_ring(snapArgs_ptr->ring);
+    snapArgs_ptr->ring = NULL;
   }
   // close writing snaplog, if snaplog recording is enabled
+  if (snapArgs_ptr->binlog != NULL) {
+    if (ndtsnap_close_write(snapArgs_ptr->binlog) != 0)
+      log_println(0, "Cannot write the binary snap log: %s", strerror(errno));
+    snapArgs_ptr->binlog = NULL;
+  } else if (snaplogenabled) {
 #if USE_WEB100
-  if (snaplogenabled) {
     web100_log_close_write(snapArgs_ptr->log);
-  }
-  web100_snapshot_free(snapArgs_ptr->snap);
 #elif USE_WEB10G
-  if (snaplogenabled) {
     estats_record_close(&snapArgs_ptr->log);
+#endif
   }
+#if USE_WEB100
+  web100_snapshot_free(snapArgs_ptr->snap);
+#elif USE_WEB10G
   estats_val_data_free(&snapArgs_ptr->snap);
 #endif
 }
 
 /**
- * Stop packet tracing activity.
- * @param monpipe_arr pointer to the monitor pipe file-descriptor array
- *
- * */
-void stop_packet_trace(int *monpipe_arr) {
-  int retval;
-  int i;
+ * Start the thread that snapshots all the streams of a test every "delay"
+ * milliseconds, driven by a timerfd.
+ * @param sched the scheduler to start
+ * @param streams the streams, already prepared with open_snap_stream()
+ * @param streamsNum the number of streams
+ * @param agentarg tcp_stat Agent
+ * @param peaks Cwnd peaks to update from the snapshots, or NULL
+ * @param snaplogenabled Is snap logging enabled?
+ * @param delay the sampling period, in milliseconds
+ * @return 0 on success, -1 if the scheduler could not be started (the
+ *         streams then keep only their first snapshot)
+ */
+int start_snap_scheduler(SnapScheduler* sched, SnapArgs** streams,
+                         int streamsNum, tcp_stat_agent* agentarg,
+                         CwndPeaks* peaks, char snaplogenabled, int delay) {
+  struct itimerspec timer;
+  struct timespec now, readyDeadline;
+  int i, ready, error = 0;
+
+  memset(sched, 0, sizeof(*sched));
+  for (i = 0; i < streamsNum && i < MAX_STREAMS; i++)
+    sched->streams[i] = streams[i];
+  sched->streamsNum = i;
+  sched->agent = agentarg;
+  sched->peaks = peaks;
+  sched->writeSnap = snaplogenabled;
+  sched->delay = (delay > 0) ? delay : 1;
+  sched->stopfd = -1;
+  sched->writerfd = -1;
+
+  if ((sched->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 ||
+      (sched->stopfd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    log_println(0, "Cannot create the snapshot scheduler: %s",
+                strerror(errno));
+    goto fail;
+  }
 
-  for (i = 0; i < RETRY_COUNT; i++) {
-    // retval = write(mon_pipe1[1], "c", 1);
-    retval = write(monpipe_arr[1], "c", 1);
-    if (retval == 1)
-      break;
-    if ((retval == -1) && (errno == EINTR))
-      continue;
+  // The first deadline is one period from now, then every period after it
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sched->start = now.tv_sec + now.tv_nsec / 1.e9;
+  timer.it_interval.tv_sec = sched->delay / 1000;
+  timer.it_interval.tv_nsec = (sched->delay % 1000) * 1000000L;
+  timer.it_value.tv_sec = now.tv_sec + timer.it_interval.tv_sec;
+  timer.it_value.tv_nsec = now.tv_nsec + timer.it_interval.tv_nsec;
+  if (timer.it_value.tv_nsec >= 1000000000L) {
+    timer.it_value.tv_sec++;
+    timer.it_value.tv_nsec -= 1000000000L;
+  }
+  if (timerfd_settime(sched->timerfd, TFD_TIMER_ABSTIME, &timer, NULL) == -1) {
+    log_println(0, "Cannot arm the snapshot timer: %s", strerror(errno));
+    goto fail;
+  }
+
+  // Snap logs are written by a thread of their own, fed through the rings
+  if (snaplogenabled) {
+    if ((sched->writerfd = eventfd(0, EFD_CLOEXEC)) == -1 ||
+        pthread_create(&sched->writer, NULL, snapLogWriter, (void*) sched)) {
+      log_println(0, "Cannot start the snap log writer, writing the snap log "
+                  "from the snapshot thread");
+      if (sched->writerfd != -1)
+        close(sched->writerfd);
+      sched->writerfd = -1;
+    }
+  }
+
+  pthread_mutex_init(&sched->readyLock, NULL);
+  pthread_cond_init(&sched->readyCond, NULL);
+  if (pthread_create(&sched->thread, NULL, snapWorker, (void*) sched)) {
+    log_println(1, "Cannot create worker thread for writing snap log!");
+    pthread_cond_destroy(&sched->readyCond);
+    pthread_mutex_destroy(&sched->readyLock);
+    goto fail;
+  }
+
+  // Wait for the thread to be running, so that the test does not start
+  // before its snapshots do
+  clock_gettime(CLOCK_REALTIME, &readyDeadline);
+  readyDeadline.tv_sec += SNAP_READY_TIMEOUT;
+  pthread_mutex_lock(&sched->readyLock);
+  while (!sched->ready && error == 0)
+    error = pthread_cond_timedwait(&sched->readyCond, &sched->readyLock,
+                                   &readyDeadline);
+  ready = sched->ready;
+  pthread_mutex_unlock(&sched->readyLock);
+  if (!ready)
+    log_println(0, "The snapshot scheduler is not ready after %d s, "
+                "starting the test anyway", SNAP_READY_TIMEOUT);
+  return 0;
+
+fail:
+  stop_snaplog_writer(sched);
+  if (sched->timerfd != -1)
+    close(sched->timerfd);
+  if (sched->stopfd != -1)
+    close(sched->stopfd);
+  sched->timerfd = sched->stopfd = -1;
+  return -1;
+}
+
+/**
+ * Stop the snap log writer of a scheduler, once it has written everything
+ * queued.  The snapshot thread must not be running any more.
+ * @param sched the scheduler
+ */
+static void stop_snaplog_writer(SnapScheduler* sched) {
+  uint64_t one = 1;
+
+  if (sched->writerfd == -1)
+    return;
+  __atomic_store_n(&sched->writerStop, 1, __ATOMIC_RELEASE);
+  if (write(sched->writerfd, &one, sizeof(one)) != sizeof(one))
+    log_println(0, "Cannot stop the snap log writer: %s", strerror(errno));
+  pthread_join(sched->writer, NULL);
+  close(sched->writerfd);
+  sched->writerfd = -1;
+}
+
+/**
+ * Stop the snapshot scheduler of a test and report the jitter of its
+ * sampling period, and the snapshots dropped from full snap log rings.
+ * @param sched the scheduler to stop
+ * @param name the test name, prefixed to the meta entries ("c2s.snapsamples"
+ *        etc.), or NULL to only log the statistics
+ */
+void stop_snap_scheduler(SnapScheduler* sched, const char* name) {
+  uint64_t one = 1;
+  double avg = 0, stddev = 0;
+  char key[64];
+  int i, overflows = 0;
+
+  if (sched->timerfd == -1)
+    return;
+  if (write(sched->stopfd, &one, sizeof(one)) != sizeof(one))
+    log_println(0, "Cannot stop the snapshot scheduler: %s", strerror(errno));
+  pthread_join(sched->thread, NULL);
+  pthread_cond_destroy(&sched->readyCond);
+  pthread_mutex_destroy(&sched->readyLock);
+  close(sched->timerfd);
+  close(sched->stopfd);
+  sched->timerfd = sched->stopfd = -1;
+  stop_snaplog_writer(sched);
+
+  for (i = 0; i < sched->streamsNum; i++) {
+    if (sched->streams[i]->ring != NULL)
+      overflows += sched->streams[i]->ring->overflows;
+  }
+  if (overflows > 0)
+    log_println(0, "%s snap log: %d snapshots dropped, the writer fell behind",
+                name ? name : "Test", overflows);
+
+  if (sched->samples > 0) {
+    avg = sched->lateSum / sched->samples;
+    stddev = sched->lateSqSum / sched->samples - avg * avg;
+    stddev = (stddev > 0) ? sqrt(stddev) : 0;
+  }
+  log_println(1, "%s snapshots: %d taken every %d ms, %d missed, jitter "
+              "avg %.0f us, max %.0f us, stddev %.0f us",
+              name ? name : "Test", sched->samples, sched->delay,
+              sched->missed, avg * 1.e6, sched->lateMax * 1.e6,
+              stddev * 1.e6);
+  if (name == NULL)
+    return;
+  snprintf(key, sizeof(key), "%s.snapsamples", name);
+  addAdditionalMetaIntEntry(key, sched->samples);
+  snprintf(key, sizeof(key), "%s.snapmissed", name);
+  addAdditionalMetaIntEntry(key, sched->missed);
+  snprintf(key, sizeof(key), "%s.snapjitteravg", name);
+  addAdditionalMetaIntEntry(key, (int) (avg * 1.e6));
+  snprintf(key, sizeof(key), "%s.snapjittermax", name);
+  addAdditionalMetaIntEntry(key, (int) (sched->lateMax * 1.e6));
+  if (sched->writeSnap) {
+    snprintf(key, sizeof(key), "%s.snaplogoverflows", name);
+    addAdditionalMetaIntEntry(key, overflows);
   }
-  close(monpipe_arr[0]);
-  close(monpipe_arr[1]);
 }
 
 /**
@@ -527,12 +856,7 @@ void stop_packet_trace(int *monpipe_arr) {
  * */
 void setCwndlimit(tcp_stat_connection connarg, tcp_stat_group* grouparg,
                   tcp_stat_agent* agentarg, Options* optionsarg) {
-#if USE_WEB100
-  web100_var *LimRwin, *yar;
-#elif USE_WEB10G
-  struct estats_val yar;
-#endif
-
+  int64_t mss;
   u_int32_t limrwin_val;
 
   if (optionsarg->limit > 0) {
@@ -542,53 +866,24 @@ void setCwndlimit(tcp_stat_connection connarg, tcp_stat_group* grouparg,
     if (connarg != NULL) {
       log_println(1,
                   "Got web100 connection pointer for recvsfd socket\n");
-      char yuff[32];
-      web100_agent_find_var_and_group(agentarg, "CurMSS", &grouparg,
-                                      &yar);
-      web100_raw_read(yar, connarg, yuff);
-      log_println(1, "MSS = %s, multiplication factor = %d",
-                  web100_value_to_text(web100_get_var_type(yar), yuff),
-                  optionsarg->limit);
-      limrwin_val = optionsarg->limit
-          * (atoi(
-              web100_value_to_text(web100_get_var_type(yar),
-                                   yuff)));
-      web100_agent_find_var_and_group(agentarg, "LimRwin", &grouparg,
-                                      &LimRwin);
-      log_print(1, "now write %d to limit the Receive window",
-                limrwin_val);
-      web100_raw_write(LimRwin, connarg, &limrwin_val);
 #elif USE_WEB10G
     if (connarg != -1) {
       log_println(1,
                   "Got web10g connection for recvsfd socket\n");
-      web10g_get_val(agentarg, connarg, "CurMSS", &yar);
-      log_println(1, "MSS = %s, multiplication factor = %d",
-                  yar.uv32, optionsarg->limit);
-      limrwin_val = optionsarg->limit * yar.uv32;
-      log_print(1, "now write %d to limit the Receive window", limrwin_val);
-      estats_write_var("LimRwin", limrwin_val, connarg, agentarg);
 #endif
+      if (tcp_stat_read_var(agentarg, connarg, TCP_STAT_CUR_MSS, &mss) != 0)
+        mss = 0;
+      log_println(1, "MSS = %"PRId64", multiplication factor = %d",
+                  mss, optionsarg->limit);
+      limrwin_val = optionsarg->limit * mss;
+      log_print(1, "now write %d to limit the Receive window",
+                limrwin_val);
+      tcp_stat_write_var(agentarg, connarg, TCP_STAT_LIM_RWIN, limrwin_val);
       log_println(1, "  ---  Done");
     }
   }
 }
 
-/**
- * Check if receiver is clogged and use decision to temporarily
- * stop sending packets.
- * @param nextseqtosend integer indicating the Next Sequence Number To Be Sent
- * @param lastunackedseq integer indicating the oldest un-acked sequence number
- * @return integer indicating whether buffer is clogged
- * */
-int is_buffer_clogged(int nextseqtosend, int lastunackedseq) {
-  int recclog = 0;
-  if ((RECLTH << 2) < (nextseqtosend - lastunackedseq - 1)) {
-    recclog = 1;
-  }
-  return recclog;
-}
-
 /**
  * Adds data to the `meta` global variable.  All meta entries are key: value
  * pairs mapping strings to strings.
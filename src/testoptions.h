@@ -9,9 +9,12 @@
 #ifndef SRC_TESTOPTIONS_H_
 #define SRC_TESTOPTIONS_H_
 
+#include <pthread.h>
+
 #include "web100srv.h"
 #include "protocol.h"
 #include "connection.h"
+#include "ndtsnap.h"
 
 #define LISTENER_SOCKET_CREATE_FAILED  -1
 #define SOCKET_CONNECT_TIMEOUT  -100
@@ -40,10 +43,8 @@ typedef struct testoptions {
   int s2csockfd;  // socket fd for S2C test
   int s2csockport;  // port used for S2C test
 
-  // child pids
+  // child pid
   pid_t child0;
-  pid_t child1;
-  pid_t child2;
 
   int sfwopt;  // Is firewall test to be performed?
   int metaopt;  // meta test to be perfomed?
@@ -51,14 +52,55 @@ typedef struct testoptions {
   int s2cextopt; // extended S2C test to be performed?
 } TestOptions;
 
+// Number of snapshots of a stream that can wait for the snap log writer
+#define SNAPLOG_RING_SLOTS 512
+
+// Longest wait, in seconds, for the snapshot thread to report it is running
+#define SNAP_READY_TIMEOUT 2
+
+// Single-producer single-consumer ring of snapshot copies, filled by the
+// snapshot scheduler and emptied into the snap log by the writer thread
+typedef struct snapLogRing {
+  tcp_stat_snap* slots[SNAPLOG_RING_SLOTS];  // preallocated snapshots
+  unsigned int head;  // next slot to fill, only written by the scheduler
+  unsigned int tail;  // next slot to log, only written by the writer
+  int overflows;  // snapshots dropped because the ring was full
+} SnapLogRing;
+
 // Snap log characteristics
 typedef struct snapArgs {
   tcp_stat_connection conn;
   tcp_stat_snap* snap;
   tcp_stat_log* log;
-  int delay;  // periodicity, in ms, of collecting snap
+  NdtSnapWriter* binlog;  // snap log in the binary format, NULL if native
+  SnapLogRing* ring;  // snapshots waiting to be logged, NULL to log directly
 } SnapArgs;
 
+// Snapshot scheduler, sampling all the streams of a test in one pass
+typedef struct snapScheduler {
+  SnapArgs* streams[MAX_STREAMS];  // the streams to snapshot
+  int streamsNum;  // number of streams
+  tcp_stat_agent* agent;  // tcp_stat agent pointer
+  CwndPeaks* peaks;  // data indicating Cwnd values, or NULL
+  int writeSnap;  // enable writing snaplog
+  int delay;  // periodicity, in ms, of collecting snap
+  int timerfd;  // timer expiring every delay ms, -1 if not running
+  int stopfd;  // eventfd written to stop the scheduler thread
+  pthread_t thread;  // the scheduler thread
+  pthread_mutex_t readyLock;  // protects ready
+  pthread_cond_t readyCond;  // signalled when the thread sets ready
+  int ready;  // set by the scheduler thread once it is waiting on the timer
+  int writerfd;  // eventfd waking up the snap log writer, -1 if none
+  int writerStop;  // set when the snap log writer should finish
+  pthread_t writer;  // the snap log writer thread
+  double start;  // CLOCK_MONOTONIC time the timer was armed
+  int samples;  // number of passes taken
+  int missed;  // number of deadlines passed without a snapshot
+  double lateSum;  // sum of the delays of the passes past their deadline
+  double lateSqSum;  // sum of the squares of those delays
+  double lateMax;  // largest of those delays
+} SnapScheduler;
+
 int initialize_tests(Connection* ctl, TestOptions* testOptions,
                      char* test_suite, size_t test_suite_strlen);
 
@@ -71,21 +113,20 @@ int test_meta_srv(Connection* ctl, tcp_stat_agent* agent,
 int getCurrentTest();
 void setCurrentTest(int testId);
 
-// void start_snap_worker(SnapArgs *snaparg, tcp_stat_agent *agentarg,
-void start_snap_worker(SnapArgs *snaparg, tcp_stat_agent *agentarg,
-                       CwndPeaks* peaks, char snaplogenabled,
-                       pthread_t *wrkrthreadidarg, char *metafilename,
-                       tcp_stat_connection conn, tcp_stat_group* group);
+void open_snap_stream(SnapArgs *snaparg, tcp_stat_agent *agentarg,
+                      char snaplogenabled, char snaplogbinary,
+                      char *metafilename,
+                      tcp_stat_connection conn, tcp_stat_group* group);
+void close_snap_stream(SnapArgs* snapArgs_ptr, char snaplogenabled);
 
-void stop_snap_worker(pthread_t *workerThreadId, char snaplogenabled,
-                      SnapArgs* snapArgs_ptr);
+int start_snap_scheduler(SnapScheduler* sched, SnapArgs** streams,
+                         int streamsNum, tcp_stat_agent* agentarg,
+                         CwndPeaks* peaks, char snaplogenabled, int delay);
+void stop_snap_scheduler(SnapScheduler* sched, const char* name);
 
 void setCwndlimit(tcp_stat_connection connarg, tcp_stat_group* grouparg,
                   tcp_stat_agent* agentarg, Options* optionsarg);
 
-int is_buffer_clogged(int nextseqtosend, int lastunackedseq);
-void stop_packet_trace(int *monpipe_arr);
-
 void addAdditionalMetaEntry(char* key, char* value);
 void addAdditionalMetaIntEntry(char* key, int value);
 void addAdditionalMetaBoolEntry(char* key, int value);
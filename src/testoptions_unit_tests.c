@@ -169,9 +169,32 @@ void test_initialize_websocket_tests() {
   CHECK(test_options.connection_flags & WEBSOCKET_SUPPORT);
 }
 
+/**
+ * Runs the snapshot scheduler without any streams and checks that it keeps to
+ * its period and stops when asked to.
+ */
+void test_snap_scheduler_period() {
+  SnapScheduler sched;
+  CHECK(start_snap_scheduler(&sched, NULL, 0, NULL, NULL, 0, 5) == 0);
+  // The thread is running by the time the scheduler is started.
+  CHECK(sched.ready);
+  usleep(200000);
+  stop_snap_scheduler(&sched, NULL);
+  CHECK(sched.timerfd == -1);
+  // 40 deadlines passed; a loaded machine may miss or delay some of them.
+  ASSERT(sched.samples + sched.missed >= 35 && sched.samples + sched.missed <= 41,
+         "%d samples and %d missed deadlines in 200ms", sched.samples,
+         sched.missed);
+  CHECK(sched.samples > 0);
+  CHECK(sched.lateMax >= 0 && sched.lateMax < 0.2);
+  // Stopping a stopped scheduler does nothing.
+  stop_snap_scheduler(&sched, NULL);
+}
+
 int main() {
   set_debuglvl(-1);
   return RUN_TEST(test_initialize_MSG_LOGIN_tests) |
          RUN_TEST(test_initialize_MSG_EXTENDED_LOGIN_tests) |
-         RUN_TEST(test_initialize_websocket_tests);
+         RUN_TEST(test_initialize_websocket_tests) |
+         RUN_TEST(test_snap_scheduler_period);
 }
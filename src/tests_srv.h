@@ -10,20 +10,52 @@
 #define SRC_TESTS_SRV_H_
 
 #include "testoptions.h"
+#include "testutils.h"
 #include "logging.h"
+#include "websocket.h"
+
+// Size of the scratch buffer the C2S test data is read into and discarded
+#define C2S_RECV_BUFFER_SIZE (1 << 20)
+
+// Receive side of the C2S test, draining the test streams as epoll reports
+// them readable
+typedef struct c2sReceiver {
+  int epfd;  // epoll instance watching the streams
+  Connection* conns;  // the streams
+  int streamsNum;  // number of streams
+  int active;  // number of streams not closed by the client yet
+  char closed[MAX_STREAMS];  // set for the streams closed by the client
+  double bytes[MAX_STREAMS];  // bytes received on each stream
+  char* buff;  // C2S_RECV_BUFFER_SIZE bytes of scratch space
+  int pipefd[2];  // pipe the data is spliced through, -1 if not splicing
+  int devnull;  // /dev/null, where the spliced data ends up
+  int pipeSize;  // capacity of the pipe
+  WebsocketSink* sinks;  // framing of the websocket streams, NULL if raw
+} C2SReceiver;
+
+int c2s_receiver_init(C2SReceiver* receiver, Connection* conns,
+                      int streamsNum);
+int c2s_receiver_wait(C2SReceiver* receiver, int timeout_ms,
+                      double* bytes_read);
+int c2s_receiver_enable_splice(C2SReceiver* receiver);
+int c2s_receiver_enable_websocket(C2SReceiver* receiver);
+void c2s_receiver_close(C2SReceiver* receiver);
 
 int test_c2s(Connection* ctl, tcp_stat_agent* agent, TestOptions* testOptions,
              int conn_options, double* c2sspd, int set_buff, int window,
              int autotune, char* device, Options* options, int record_reverse,
              int count_vars, char spds[4][256], int* spd_index, SSL_CTX* ctx,
-             struct throughputSnapshot **c2s_ThroughputSnapshots, int extended);
+             struct throughputSnapshot **c2s_ThroughputSnapshots,
+             StreamSeries* c2s_series, int extended);
 
 // S2C test
+int s2c_frame_header_length(int size);
 int test_s2c(Connection* ctl, tcp_stat_agent* agent, TestOptions* testOptions,
              int conn_options, double* s2cspd, int set_buff, int window,
              int autotune, char* device, Options* options, char spds[4][256],
              int* spd_index, int count_vars, CwndPeaks* peaks, SSL_CTX* ctx,
-             struct throughputSnapshot **s2c_ThroughputSnapshots, int extended);
+             struct throughputSnapshot **s2c_ThroughputSnapshots,
+             StreamSeries* s2c_series, int extended);
 
 // the middlebox test
 int test_mid(Connection* ctl, tcp_stat_agent* agent, TestOptions* testOptions,
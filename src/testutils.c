@@ -1,8 +1,14 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "logging.h"
 #include "testoptions.h"
 #include "testutils.h"
+#include "utils.h"
 
 /** Makes the passed-in file descriptor into one that will not block.
  * @param fd the file descriptor
@@ -15,34 +21,172 @@ int make_non_blocking(int fd) {
   return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
 }
 
-/** Attempts to use the pipe to shutdown packet tracing. Will not block. After
- * this function the file descriptors of the pipe are likely set to
- * non-blocking. This should not affect any code because any shutdown messages
- * sent should be the last usage of the pipe anyway.
- * @param mon_pipe the pipe on which to send shutdown messages.
- */
-void packet_trace_emergency_shutdown(int *mon_pipe) {
-  // Attempt to shut down the trace, but only after making sure that all
-  // attempts to write to the pipe will never block.
-  if (make_non_blocking(mon_pipe[1]) && make_non_blocking(mon_pipe[0])) {
-    stop_packet_trace(mon_pipe);
-  } else {
-    log_println(0,
-                "Couldn't make pipe non-blocking (errno=%d) and so was "
-                "unable to safely call stop_packet_trace",
-                errno);
-  }
-}
-
 /** Waits up to one second for the passed-in fd to become readable.
  * @param fd the file descriptor to wait for
  * @returns true if the fd is readable, false otherwise
  */
 int wait_for_readable_fd(int fd) {
-  fd_set rfd;
-  struct timeval sel_tv = {0};
-  FD_ZERO(&rfd);
-  FD_SET(fd, &rfd);
-  sel_tv.tv_sec = 1;  // Wait for up to 1 second
-  return (1 == select(fd + 1, &rfd, NULL, NULL, &sel_tv));
+  return wait_for_readable_fd_timeout(fd, 1);  // Wait for up to 1 second
+}
+
+/** Waits up to timeout seconds for the passed-in fd to become readable,
+ * carrying on after signals.
+ * @param fd the file descriptor to wait for
+ * @param timeout the longest time to wait, in seconds
+ * @returns true if the fd is readable, false otherwise
+ */
+int wait_for_readable_fd_timeout(int fd, double timeout) {
+  struct pollfd pfd;
+  double deadline = secs() + timeout, left;
+  int ret;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while ((left = deadline - secs()) > 0) {
+    ret = poll(&pfd, 1, (int) (left * 1000) + 1);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    return ret == 1;
+  }
+  return 0;
+}
+
+/** Prepares a time series for a throughput test.
+ * @param series the series to set up
+ * @param streamsNum the number of streams of the test
+ * @param duration the planned length of the test, in seconds
+ * @param start the time the test starts, as returned by secs()
+ * @returns 0 on success, ENOMEM if the series cannot be allocated
+ */
+int stream_series_init(StreamSeries* series, int streamsNum, double duration,
+                       double start) {
+  double interval = STREAM_SERIES_INTERVAL / 1000.0;
+  // Room for the last, partial interval and for a test that runs late
+  int maxIntervals = (int) (duration / interval) + 2;
+
+  memset(series, 0, sizeof(*series));
+  series->bytes = (double*) calloc(maxIntervals * streamsNum, sizeof(double));
+  if (series->bytes == NULL)
+    return ENOMEM;
+  series->streamsNum = streamsNum;
+  series->maxIntervals = maxIntervals;
+  series->interval = interval;
+  series->start = start;
+  return 0;
+}
+
+/** Gives the end of the interval being measured.
+ * @param series the series
+ * @returns the time the current interval ends, as returned by secs()
+ */
+double stream_series_next(const StreamSeries* series) {
+  return series->start + (series->intervals + 1) * series->interval;
+}
+
+/** Records the intervals which have ended.  The bytes counted since the
+ * last update all go to the first of them.
+ * @param series the series
+ * @param totals the number of bytes moved by each stream so far
+ * @param now the current time, as returned by secs()
+ */
+void stream_series_update(StreamSeries* series, const double* totals,
+                          double now) {
+  double* row;
+  int i;
+
+  while (series->intervals < series->maxIntervals &&
+         now >= stream_series_next(series)) {
+    row = &series->bytes[series->intervals * series->streamsNum];
+    for (i = 0; i < series->streamsNum; i++) {
+      row[i] = totals[i] - series->totals[i];
+      series->totals[i] = totals[i];
+    }
+    series->intervals++;
+  }
+}
+
+/** Records the bytes counted since the last interval ended, if any, as one
+ * last partial interval.
+ * @param series the series
+ * @param totals the number of bytes moved by each stream during the test
+ */
+void stream_series_finish(StreamSeries* series, const double* totals) {
+  double* row;
+  int i;
+
+  for (i = 0; i < series->streamsNum; i++) {
+    if (totals[i] != series->totals[i])
+      break;
+  }
+  if (i == series->streamsNum || series->intervals == series->maxIntervals)
+    return;
+  row = &series->bytes[series->intervals * series->streamsNum];
+  for (i = 0; i < series->streamsNum; i++) {
+    row[i] = totals[i] - series->totals[i];
+    series->totals[i] = totals[i];
+  }
+  series->intervals++;
+}
+
+/** Formats the total of a stream followed by its bytes in each interval,
+ * separated by spaces.  Intervals that do not fit are left out.
+ * @param series the series
+ * @param stream the index of the stream
+ * @param buf the buffer to fill
+ * @param len the size of buf
+ * @returns the number of intervals formatted
+ */
+int stream_series_format(const StreamSeries* series, int stream, char* buf,
+                         size_t len) {
+  size_t used;
+  int i, n;
+
+  used = snprintf(buf, len, "%0.0f", series->totals[stream]);
+  for (i = 0; i < series->intervals && used < len; i++) {
+    n = snprintf(buf + used, len - used, " %0.0f",
+                 series->bytes[i * series->streamsNum + stream]);
+    if (used + n >= len) {
+      buf[used] = '\0';  // drop the partial number
+      break;
+    }
+    used += n;
+  }
+  return i;
+}
+
+/** Adds a series to the meta file, and formats it as "key: value" lines for
+ * the results message, one line per stream after the interval length.
+ * @param series the series
+ * @param name the name of the test, such as "c2s"
+ * @param buf the buffer to fill with the lines, or NULL
+ * @param len the size of buf
+ */
+void stream_series_report(const StreamSeries* series, const char* name,
+                          char* buf, size_t len) {
+  char key[64], value[1024];
+  size_t used = 0;
+  int i;
+
+  if (buf != NULL && len > 0) {
+    buf[0] = '\0';
+    used = snprintf(buf, len, "%sSeriesInterval: %d\n", name,
+                    STREAM_SERIES_INTERVAL);
+  }
+  for (i = 0; i < series->streamsNum; i++) {
+    stream_series_format(series, i, value, sizeof(value));
+    snprintf(key, sizeof(key), "%s.stream.%d.bytes", name, i);
+    addAdditionalMetaEntry(key, value);
+    if (buf != NULL && used < len)
+      used += snprintf(buf + used, len - used, "%sStream%d: %s\n", name, i,
+                       value);
+  }
+}
+
+/** Releases the memory of a series.
+ * @param series the series
+ */
+void stream_series_free(StreamSeries* series) {
+  free(series->bytes);
+  series->bytes = NULL;
+  series->streamsNum = series->intervals = 0;
 }
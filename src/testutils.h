@@ -1,5 +1,42 @@
 /* These are helper methods which are used in multiple test_XXX_srv.c files. */
 
+#ifndef SRC_TESTUTILS_H_
+#define SRC_TESTUTILS_H_
+
+#include <stddef.h>
+
+#include "ndtptestconstants.h"
+
+// Length, in ms, of the intervals of the per-stream throughput time series
+#define STREAM_SERIES_INTERVAL 500
+
+// Bytes moved by each stream of a throughput test in each fixed interval.
+// The array is allocated for the whole test up front, so recording an
+// interval never allocates.
+typedef struct streamSeries {
+  int streamsNum;  // number of streams, 0 if no test filled the series
+  int intervals;  // number of intervals recorded
+  int maxIntervals;  // number of intervals allocated
+  double interval;  // length of an interval, in seconds
+  double start;  // time the first interval started
+  double totals[MAX_STREAMS];  // stream totals at the end of the last interval
+  double* bytes;  // maxIntervals rows of streamsNum counts
+} StreamSeries;
+
 int make_non_blocking(int fd);
 int wait_for_readable_fd(int fd);
-void packet_trace_emergency_shutdown(int *mon_pipe);
+int wait_for_readable_fd_timeout(int fd, double timeout);
+
+int stream_series_init(StreamSeries* series, int streamsNum, double duration,
+                       double start);
+double stream_series_next(const StreamSeries* series);
+void stream_series_update(StreamSeries* series, const double* totals,
+                          double now);
+void stream_series_finish(StreamSeries* series, const double* totals);
+int stream_series_format(const StreamSeries* series, int stream, char* buf,
+                         size_t len);
+void stream_series_report(const StreamSeries* series, const char* name,
+                          char* buf, size_t len);
+void stream_series_free(StreamSeries* series);
+
+#endif  // SRC_TESTUTILS_H_
@@ -0,0 +1,382 @@
+/**
+ * This file contains the functions to resume TLS sessions across the forked
+ * processes of the server, described in tlssession.h.
+ *
+ * Everything lives in one shared anonymous mapping, made before the server
+ * forks.  A robust process-shared mutex protects the ticket keys and the
+ * session cache, so that a child dying while it holds the lock doesn't
+ * block the others; the counters are only ever added to atomically.
+ */
+
+#include <errno.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include "logging.h"
+#include "tlssession.h"
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketHmacCtx;
+#else
+typedef HMAC_CTX TicketHmacCtx;
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SESSION_ID_CONST
+#else
+#define SESSION_ID_CONST const
+#endif
+
+// Keys of the session tickets, in the layout OpenSSL uses for its own
+typedef struct tlsTicketKey {
+  unsigned char name[16];  // sent in the clear with the ticket, to find the key
+  unsigned char aesKey[32];  // AES-256-CBC key encrypting the ticket
+  unsigned char hmacKey[32];  // HMAC-SHA256 key authenticating the ticket
+} TlsTicketKey;
+
+// A session of the shared cache, which is direct-mapped on the session id
+typedef struct tlsSessionSlot {
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned int idLength;  // 0 if the slot is free
+  time_t expires;  // time after which the session can't be resumed
+  unsigned int length;  // length of the encoded session
+  unsigned char session[TLS_SESSION_MAX_LENGTH];  // the session, DER encoded
+} TlsSessionSlot;
+
+typedef struct tlsSessionShared {
+  pthread_mutex_t lock;  // protects the keys and the cache
+  TlsTicketKey keys[2];  // the current key, and the one it replaced
+  time_t rotated;  // time the current key was made
+  TlsSessionStats stats;  // counters, only added to atomically
+  int slots;  // size of the cache, 0 if there is none
+  TlsSessionSlot cache[];
+} TlsSessionShared;
+
+static TlsSessionShared* shared = NULL;
+static int counted_index = -1;  // ex_data of the handshakes already counted
+
+/**
+ * Take the lock of the shared memory.  A process which died holding it has
+ * left at worst a half-written key or cache slot, which only makes the
+ * tickets or the session under it fail to resume, so the state is marked
+ * consistent and used as it is.
+ */
+static void lock_shared(void) {
+  if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&shared->lock);
+}
+
+static void unlock_shared(void) {
+  pthread_mutex_unlock(&shared->lock);
+}
+
+/**
+ * Make a new ticket key, keeping the current one to decrypt the tickets it
+ * encrypted until the next rotation.  Must be called with the lock held.
+ * @param now the time of the rotation
+ */
+static void rotate_keys_locked(time_t now) {
+  shared->keys[1] = shared->keys[0];
+  if (RAND_bytes(shared->keys[0].name, sizeof(shared->keys[0].name)) != 1 ||
+      RAND_bytes(shared->keys[0].aesKey, sizeof(shared->keys[0].aesKey)) !=
+          1 ||
+      RAND_bytes(shared->keys[0].hmacKey, sizeof(shared->keys[0].hmacKey)) !=
+          1) {
+    // Without a fresh key, don't issue tickets under a stale one either
+    log_println(0, "Unable to make a new TLS session ticket key");
+    shared->keys[0] = shared->keys[1];
+  }
+  shared->rotated = now;
+}
+
+/**
+ * Set up the HMAC of a session ticket.
+ * @param hctx the HMAC context given by OpenSSL
+ * @param key the ticket key
+ * @return 1 on success, 0 on failure
+ */
+static int init_ticket_hmac(TicketHmacCtx* hctx, const TlsTicketKey* key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[2];
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                               (char*) "SHA256", 0);
+  params[1] = OSSL_PARAM_construct_end();
+  return EVP_MAC_init(hctx, key->hmacKey, sizeof(key->hmacKey), params) == 1;
+#else
+  return HMAC_Init_ex(hctx, key->hmacKey, sizeof(key->hmacKey), EVP_sha256(),
+                      NULL) == 1;
+#endif
+}
+
+/**
+ * Called by OpenSSL to encrypt a new session ticket, or to find the key of
+ * a ticket sent by a client.
+ * @param ssl the connection
+ * @param name the name of the key, filled in when encrypting
+ * @param iv the IV of the ticket, filled in when encrypting
+ * @param ctx the cipher context to set up
+ * @param hctx the HMAC context to set up
+ * @param enc 1 to encrypt a new ticket, 0 to decrypt one
+ * @return when encrypting, 1 on success and -1 on failure; when decrypting,
+ *         0 if the key is gone, 1 if the ticket is good, and 2 if it is good
+ *         but should be replaced by one under the current key
+ */
+static int ticket_key_cb(SSL* ssl, unsigned char name[16],
+                         unsigned char iv[EVP_MAX_IV_LENGTH],
+                         EVP_CIPHER_CTX* ctx, TicketHmacCtx* hctx, int enc) {
+  TlsTicketKey key;
+  int i;
+
+  lock_shared();
+  if (enc) {
+    key = shared->keys[0];
+    unlock_shared();
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+      return -1;
+    memcpy(name, key.name, sizeof(key.name));
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1 ||
+        !init_ticket_hmac(hctx, &key))
+      return -1;
+    return 1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (memcmp(name, shared->keys[i].name, sizeof(key.name)) == 0) break;
+  }
+  if (i == 2) {
+    unlock_shared();
+    return 0;
+  }
+  key = shared->keys[i];
+  unlock_shared();
+  if (!init_ticket_hmac(hctx, &key) ||
+      EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1)
+    return -1;
+  return i == 0 ? 1 : 2;
+}
+
+/**
+ * Find the slot of a session id in the shared cache.
+ */
+static TlsSessionSlot* session_slot(const unsigned char* id,
+                                    unsigned int idLength) {
+  uint32_t hash = 2166136261u;
+  unsigned int i;
+  for (i = 0; i < idLength; i++) hash = (hash ^ id[i]) * 16777619u;
+  return &shared->cache[hash % shared->slots];
+}
+
+/**
+ * Called by OpenSSL to store a new session in the shared cache, replacing
+ * whichever session had the same slot.
+ * @param ssl the connection
+ * @param session the session
+ * @return 0, as no reference to the session is kept
+ */
+static int new_session_cb(SSL* ssl, SSL_SESSION* session) {
+  unsigned char encoded[TLS_SESSION_MAX_LENGTH];
+  unsigned char* p = encoded;
+  const unsigned char* id;
+  unsigned int idLength;
+  TlsSessionSlot* slot;
+  int length;
+
+  id = SSL_SESSION_get_id(session, &idLength);
+  length = i2d_SSL_SESSION(session, NULL);
+  if (idLength == 0 || length <= 0 || length > TLS_SESSION_MAX_LENGTH)
+    return 0;
+  i2d_SSL_SESSION(session, &p);
+  slot = session_slot(id, idLength);
+  lock_shared();
+  memcpy(slot->id, id, idLength);
+  slot->idLength = idLength;
+  slot->expires = SSL_SESSION_get_time(session) +
+                  SSL_SESSION_get_timeout(session);
+  slot->length = length;
+  memcpy(slot->session, encoded, length);
+  unlock_shared();
+  return 0;
+}
+
+/**
+ * Called by OpenSSL to find the session a client asks to resume in the
+ * shared cache.
+ * @param ssl the connection
+ * @param id the session id
+ * @param idLength the length of the id
+ * @param copy set to 0, as the session returned is a new one
+ * @return the session, or NULL if it is not in the cache
+ */
+static SSL_SESSION* get_session_cb(SSL* ssl, SESSION_ID_CONST unsigned char* id,
+                                   int idLength, int* copy) {
+  unsigned char encoded[TLS_SESSION_MAX_LENGTH];
+  const unsigned char* p = encoded;
+  TlsSessionSlot* slot = session_slot(id, idLength);
+  unsigned int length = 0;
+
+  *copy = 0;
+  lock_shared();
+  if (slot->idLength == idLength && memcmp(slot->id, id, idLength) == 0 &&
+      slot->expires > time(0)) {
+    length = slot->length;
+    memcpy(encoded, slot->session, length);
+  }
+  unlock_shared();
+  if (length == 0) return NULL;
+  __sync_fetch_and_add(&shared->stats.cacheHits, 1);
+  return d2i_SSL_SESSION(NULL, &p, length);
+}
+
+/**
+ * Called by OpenSSL as a handshake goes along, to count the handshakes
+ * once they are done.  OpenSSL may report a handshake of TLS 1.3 as done
+ * more than once, so each connection is only counted the first time.
+ * @param ssl the connection
+ * @param where what happened
+ * @param ret the result of what happened
+ */
+static void info_cb(const SSL* ssl, int where, int ret) {
+  int resumed;
+  if (!(where & SSL_CB_HANDSHAKE_DONE) ||
+      SSL_get_ex_data(ssl, counted_index) != NULL)
+    return;
+  SSL_set_ex_data((SSL*) ssl, counted_index, (void*) 1);
+  resumed = SSL_session_reused((SSL*) ssl);
+  __sync_fetch_and_add(&shared->stats.handshakes, 1);
+  if (resumed) __sync_fetch_and_add(&shared->stats.resumed, 1);
+  log_println(6, "TLS handshake done, session %s",
+              resumed ? "resumed" : "new");
+}
+
+/**
+ * Set up a server TLS context to resume sessions across the processes
+ * forked after this call: session tickets under keys shared by all of
+ * them, and optionally a shared session cache.  Must be called once, before
+ * forking.
+ * @param ctx the TLS context
+ * @param cacheSize the number of sessions of the shared cache (0 for none,
+ *                  at most TLS_SESSION_CACHE_MAX)
+ * @return 0 on success, else an errno value
+ */
+int tls_session_setup(SSL_CTX* ctx, int cacheSize) {
+  pthread_mutexattr_t attr;
+  size_t size;
+  int rc;
+
+  if (cacheSize < 0 || cacheSize > TLS_SESSION_CACHE_MAX) return EINVAL;
+  size = sizeof(TlsSessionShared) + cacheSize * sizeof(TlsSessionSlot);
+  shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                -1, 0);
+  if (shared == MAP_FAILED) {
+    rc = errno;
+    shared = NULL;
+    return rc;
+  }
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  rc = pthread_mutex_init(&shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (rc != 0) {
+    munmap(shared, size);
+    shared = NULL;
+    return rc;
+  }
+  shared->slots = cacheSize;
+  // Rotate twice, so that the zeroed key isn't kept as the previous one:
+  // anybody could make tickets under it.
+  rotate_keys_locked(time(0));
+  rotate_keys_locked(shared->rotated);
+  counted_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+  // A ticket is only decrypted by the key it was made with or the next one,
+  // so it is never older than two rotations.
+  SSL_CTX_set_timeout(ctx, TLS_TICKET_KEY_LIFETIME);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char*) "ndt", 3);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+  if (cacheSize > 0) {
+    // Each process would only ever find its own sessions in OpenSSL's cache
+    SSL_CTX_set_session_cache_mode(
+        ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    // Sessions aren't dropped from the cache when OpenSSL gives up on them
+    // because the connection was closed without a close_notify, as the
+    // server mostly does: TLS no longer requires it to resume the session,
+    // and the sessions of the cache expire on their own.
+    SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+    SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+  } else {
+    // Tickets don't need a cache
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+  SSL_CTX_set_info_callback(ctx, info_cb);
+  return 0;
+}
+
+/**
+ * Rotate the session ticket keys now.  Tickets made before the previous
+ * rotation can no longer be decrypted.
+ */
+void tls_session_rotate_keys(void) {
+  if (shared == NULL) return;
+  lock_shared();
+  rotate_keys_locked(time(0));
+  unlock_shared();
+}
+
+/**
+ * Rotate the session ticket keys when they have been used for
+ * TLS_TICKET_KEY_LIFETIME seconds, and log the counts of the handshakes
+ * when they are.  Every acceptor may call this, the keys are only rotated
+ * once.
+ * @param now the current time
+ * @return the number of seconds until the next rotation, or -1 if sessions
+ *         are not set up
+ */
+int tls_session_maintain(time_t now) {
+  TlsSessionStats stats;
+  int rotated = 0;
+  time_t due;
+
+  if (shared == NULL) return -1;
+  lock_shared();
+  if (now - shared->rotated >= TLS_TICKET_KEY_LIFETIME) {
+    rotate_keys_locked(now);
+    rotated = 1;
+  }
+  due = shared->rotated + TLS_TICKET_KEY_LIFETIME - now;
+  unlock_shared();
+  if (rotated) {
+    tls_session_get_stats(&stats);
+    log_println(1, "TLS session ticket key rotated: %lu handshakes, %lu "
+                "resumed (%.1f%%), %lu from the session cache",
+                stats.handshakes, stats.resumed,
+                stats.handshakes ? 100.0 * stats.resumed / stats.handshakes : 0,
+                stats.cacheHits);
+  }
+  return due > 0 ? due : 0;
+}
+
+/**
+ * Read the counts of the handshakes of all the processes of the server.
+ * @param stats filled with the counts, all 0 if sessions are not set up
+ */
+void tls_session_get_stats(TlsSessionStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (shared == NULL) return;
+  stats->handshakes = __sync_fetch_and_add(&shared->stats.handshakes, 0);
+  stats->resumed = __sync_fetch_and_add(&shared->stats.resumed, 0);
+  stats->cacheHits = __sync_fetch_and_add(&shared->stats.cacheHits, 0);
+}
@@ -0,0 +1,35 @@
+/*
+ * This file contains the definitions and function declarations to resume
+ * TLS sessions across the forked processes of the server.
+ *
+ * The keys encrypting the session tickets live in memory shared by every
+ * process forked after the TLS context was set up, so a ticket issued by
+ * one child is accepted by any other, and the acceptors rotate them.  For
+ * clients without tickets, an optional fixed-size session cache lives in
+ * the same memory.  The handshakes, and how many of them resumed a session,
+ * are counted there too.
+ */
+
+#ifndef SRC_TLSSESSION_H_
+#define SRC_TLSSESSION_H_
+
+#include <openssl/ssl.h>
+#include <time.h>
+
+#define TLS_TICKET_KEY_LIFETIME 3600  // seconds a key encrypts new tickets
+#define TLS_SESSION_CACHE_MAX 65536  // most sessions of the shared cache
+#define TLS_SESSION_MAX_LENGTH 1024  // largest encoded session of the cache
+
+// Counts of the TLS handshakes of all the processes of the server
+typedef struct tlsSessionStats {
+  unsigned long handshakes;  // completed handshakes
+  unsigned long resumed;  // handshakes which resumed an earlier session
+  unsigned long cacheHits;  // sessions found in the shared session cache
+} TlsSessionStats;
+
+int tls_session_setup(SSL_CTX* ctx, int cacheSize);
+void tls_session_rotate_keys(void);
+int tls_session_maintain(time_t now);
+void tls_session_get_stats(TlsSessionStats* stats);
+
+#endif  // SRC_TLSSESSION_H_
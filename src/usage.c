@@ -48,6 +48,10 @@ void srv_long_usage(char* info) {
   printf("  -t, --tcpdump          - write tcpdump formatted file to disk\n");
   printf("  -v, --version          - print version number\n");
   printf("  -x, --max_clients      - maximum numbers of clients permited in FIFO queue (default=50)\n");
+  printf("  --prefork_workers #num - keep #num pre-forked worker processes ready for new clients (default 0, disabled)\n");
+  printf("  --acceptor_shards #num - accept clients in #num processes sharing the port with SO_REUSEPORT (default 1)\n");
+  printf("  --capturethreads #num  - capture the packets of concurrent tests with #num shared threads (default 1, 0 disables)\n");
+  printf("  --tracesnaplen #bytes  - keep #bytes of each packet captured, instead of just its headers (default 0, headers)\n");
   printf("  -z, --gzip             - disable compression of tcptrace, snaplog, and cputime files\n\n");
   printf(" Configuration:\n\n");
   printf("  -c, --config #filename - specify the name of the file with configuration\n");
@@ -61,6 +65,10 @@ void srv_long_usage(char* info) {
   printf("  --midport #port        - specify Middlebox test port number (default 3003)\n");
   printf("  --c2sport #port        - specify C2S throughput test port number (default 3002)\n");
   printf("  --s2cport #port        - specify S2C throughput test port number (default 3003)\n");
+  printf("  --s2czerocopy          - send the S2C test data with sendfile() instead of write() (non-TLS only)\n");
+  printf("  --c2szerocopy          - discard the C2S test data with splice() instead of read() (non-TLS only)\n");
+  printf("  --s2cwritesize #bytes  - largest size of each S2C test write (default 8192, maximum 16MB)\n");
+  printf("  --s2cframesize #bytes  - size of the S2C test websocket frames (default: one frame per write)\n");
   printf("  -T, --refresh #time    - specify the refresh time of the admin page\n");
   printf("  --mrange #range        - set the port range used in multi-test mode\n");
   printf("                           Note: this enables multi-test mode\n");
@@ -78,11 +86,15 @@ void srv_long_usage(char* info) {
   printf("                           server to open a socket to the client (MID, SFW),\n");
   printf("  --private_key          - the private key (.pem format) to use for TLS/SSL\n");
   printf("  --certificate          - the certificate (.pem format) to use for TLS/SSL\n");
+  printf("  --tls_session_cache #n - keep up to n TLS sessions in a cache shared by the server\n");
+  printf("                           processes, for clients without session tickets (default 0)\n");
   printf("  --savewebvalues        - enable web values writing to a separate file\n\n");
 #ifdef EXPERIMENTAL_ENABLED
   printf(" Experimental code:\n\n");
   printf("  --avoidsndblockup      - enable code to avoid send buffers blocking in the S2C test\n");
   printf("  --snaplog              - enable the snaplog writing\n");
+  printf("  --binarysnaplog        - write the snaplogs in the compact binary columnar format\n");
+  printf("                           Note: this automatically enables 'snaplog'\n");
   printf("  --disablesnaps         - disable snapshotting\n");
   printf("  --snapdelay #msec      - specify the delay in the snaplog thread (default 5 msec)\n");
   printf("                           Note: this doesn't enable 'snaplog'\n");
@@ -294,3 +306,23 @@ void genplot_long_usage(char* info, char* argv0) {
 
   exit(0);
 }
+
+/**
+ * Print the long usage of the ndtsnapconv.
+ * @param info text printed in the first line
+ * @param argv0 Process name
+ */
+
+void ndtsnapconv_long_usage(char* info, char* argv0) {
+  assert(info != NULL);
+  printf("\n%s\n\n\n", info);
+  printf("Usage: %s [options] filelist\n", argv0);
+  printf("This program converts snaplogs to the compact binary columnar format\n\n");
+  printf(" Basic options:\n\n");
+  printf("  -o, --output fn        - name of the converted file (single snaplog only,\n");
+  printf("                           default: the snaplog name followed by .ndtsnap)\n");
+  printf("  -h, --help             - print this help message\n");
+  printf("  -v, --version          - print version number\n\n");
+
+  exit(0);
+}
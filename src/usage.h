@@ -17,5 +17,6 @@ void analyze_long_usage(char* info);
 void mkmap_long_usage(char* info);
 void vt_long_usage(char* info);
 void genplot_long_usage(char* info, char* argv0);
+void ndtsnapconv_long_usage(char* info, char* argv0);
 
 #endif  // SRC_USAGE_H_
@@ -16,10 +16,24 @@
 #include "web100srv.h"
 #include "network.h"
 #include "logging.h"
+#include "ndttrace.h"
 #include <net/if.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
 #include <linux/sockios.h>
+#include <net/if_arp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <time.h>
 #include "strlutils.h"
+#include "testoptions.h"
+#include "testutils.h"
 #include "utils.h"
 
 static struct iflists {
@@ -27,14 +41,104 @@ static struct iflists {
   u_int16_t speed[32];
 } iflist;
 
-static pcap_t *pd;
-static pcap_dumper_t *pdump;
-static int* mon_pipe;
-static int sigj = 0, sigk = 0;
+// Geometry of the TPACKET_V3 ring of the packet-pair capture.  By default
+// only the headers of a packet are copied, so the 4 MB ring holds about
+// 30000 packets, some tens of milliseconds of a 10 Gb/s test.
+#define PKTTRACE_BLOCK_SIZE (1 << 18)
+#define PKTTRACE_BLOCK_NUM 16
+#define PKTTRACE_FRAME_SIZE 2048
+// Longest time, in ms, a partly filled block waits before the kernel hands
+// it to the capture thread
+#define PKTTRACE_BLOCK_TIMEOUT 10
+
+// IPv6 extension headers the header only capture filter steps over to find
+// the TCP header, and the instructions it adds to the compiled filter
+#define PKTTRACE_IPV6_EXTENSIONS 4
+#define PKTTRACE_CUT_INSNS (7 + 20 * PKTTRACE_IPV6_EXTENSIONS + 11)
+
+// Bytes of the TCP header read by the analysis, up to the window
+#define PKTTRACE_TCP_FIELDS 16
+
+// Number of ring blocks of each capture thread of the shared capture service
+#define PKTTRACE_SERVICE_BLOCK_NUM 64
+// Longest wait, in seconds, for the shared capture service to start, to arm
+// a test or to finish with it
+#define PKTTRACE_SERVICE_TIMEOUT 2
+
+// States of a slot of the shared capture service
+#define PKTTRACE_SLOT_FREE 0  // unused
+#define PKTTRACE_SLOT_CLAIMED 1  // being filled by a test process
+#define PKTTRACE_SLOT_ACTIVE 2  // the test is captured
+#define PKTTRACE_SLOT_STOPPING 3  // captured until every thread is done
+#define PKTTRACE_SLOT_DONE 4  // the results wait for the test process
+
+// Addresses and ports of a flow, as seen in a packet
+typedef struct pktTraceKey {
+  u_int32_t saddr[4];
+  u_int32_t daddr[4];
+  u_int16_t sport;
+  u_int16_t dport;
+  int family;  // 4 or 6
+} PktTraceKey;
+
+// A test registered with the shared capture service, in shared memory
+typedef struct pktTraceSlot {
+  int state;  // PKTTRACE_SLOT_*
+  unsigned int serial;  // incremented every time the slot is claimed
+  pid_t owner;  // test process that claimed the slot
+  int family;  // 4 or 6
+  u_int32_t serverAddr[4];
+  u_int32_t clientAddr[4];
+  u_int16_t serverPort;
+  u_int16_t clientPorts[MAX_STREAMS];
+  int streamsNum;
+  char dumpfile[256];  // ndttrace file to write, empty if none
+  int dumpCompress;  // compress the ndttrace file with gzip
+  int armed;  // capture threads that see the test
+  int pending;  // capture threads yet to finish with the stopped test
+  int abandoned;  // set when the test no longer waits for the results
+  sem_t ready;  // posted once every capture thread sees the test
+  sem_t done;  // posted once every capture thread is done with the test
+  PktAnalyzer analyzer;  // packet-pair state of the test
+} PktTraceSlot;
+
+// Shared capture service, in memory shared by all the server processes
+typedef struct pktTraceService {
+  pid_t pid;  // the capture process
+  int slotsNum;  // number of slots
+  int threadsNum;  // number of capture threads
+  unsigned int generation;  // incremented when a slot is armed or stopped
+  PktTraceSlot slots[];
+} PktTraceService;
+
+// An entry of the flow lookup table of a capture thread
+typedef struct pktTraceFlow {
+  PktTraceKey key;
+  int slot;  // slot of the test, -1 if the entry is empty
+} PktTraceFlow;
+
+// A capture thread of the shared capture service
+typedef struct pktTraceWorker {
+  int id;  // index of the thread
+  PktRing ring;  // receives the flows fanned out to this thread
+  PktTraceFlow* flows;  // open addressing table of the flows of the tests
+  unsigned int flowsMask;  // size of flows minus one, a power of two
+  unsigned int generation;  // service generation the table was built for
+  unsigned int* serials;  // serial of each slot when last seen
+  int* armed;  // the thread counted itself in the armed count of the slot
+  int* finished;  // the thread is done with the stopped slot
+  double* stopAt;  // time the thread can be done with the stopped slot
+} PktTraceWorker;
+
+static pcap_t *pd;  // compiles the capture filter
 static int ifspeed;
 
-static struct spdpair fwd, rev;
-static uint16_t firstTcpStreamPort;
+static PktTraceService* service;  // NULL if the tests capture on their own
+static int serviceWakefds[MAX_CAPTURE_THREADS];  // wake the capture threads
+// Writers of the ndttrace files of the slots, in the capture process
+static NdtTraceWriter** serviceDumpers;
+static pthread_mutex_t* serviceDumpLocks;
+static unsigned int* serviceDumpSerials;
 
 /** Scan through interface device list and get names/speeds of each interface.
  *
@@ -100,58 +204,6 @@ void init_iflist(void) {
                 iflist.name[i], iflist.speed[i]);
 }
 
-/**
- * Force the pcap_loop to return, this is safe to call from a signal handler.
- * Note this will break the loop without a packet being received if
- * used from a signal handler due to the EINTR interrupting pcaps 'read'.
- * 
- * This calls pcap_breakloop with the correct capture.
- */
-void force_breakloop() {
-  if (pd != NULL) {
-    pcap_breakloop(pd);
-  }
-}
-
-/** 
- *  Send the packet-pair speed bins over pipe to parent.
- */
-static void send_bins() {
-  log_println(
-      5,
-      "Received SIGUSRx signal terminating data collection loop for pid=%d",
-      getpid());
-  log_println(4,
-              "Sending pkt-pair data back to parent on pipe %d, %d",
-              mon_pipe[0], mon_pipe[1]);
-  if (get_debuglvl() > 3) {
-    if (fwd.family == 4) {
-      fprintf(stderr, "fwd.saddr = %x:%d, rev.saddr = %x:%d\n",
-              fwd.saddr[0], fwd.sport, rev.saddr[0], rev.sport);
-    } else if (fwd.family == 6) {
-      char str[136];
-      memset(str, 0, 136);
-      inet_ntop(AF_INET6, (void *) fwd.saddr, str, sizeof(str));
-      fprintf(stderr, "fwd.saddr = %s:%d", str, fwd.sport);
-      memset(str, 0, 136);
-      inet_ntop(AF_INET6, (void *) rev.saddr, str, sizeof(str));
-      fprintf(stderr, ", rev.saddr = %s:%d\n", str, rev.sport);
-    } else {
-      fprintf(stderr, "check_signal_flags: Unknown IP family (%d)\n",
-              fwd.family);
-    }
-  }
-  print_bins(&fwd, mon_pipe);
-  usleep(30000); /* wait here 30 msec, for parent to read this data */
-  print_bins(&rev, mon_pipe);
-  usleep(30000); /* wait here 30 msec, for parent to read this data */
-  if (dumptrace == 1)
-    pcap_dump_close(pdump);
-  
-  log_println(6, "Finished reading pkt-pair data from network, process %d "
-              "should terminate now", getpid());
-}
-
 /**
  * Initialize variables before starting to accumulate data
  * @param cur SpdPair struct instance
@@ -178,17 +230,34 @@ void init_vars(struct spdpair *cur) {
 }
 
 /**
- *  This routine prints details of data about speed bins. It also writes the
- *  data into a pipe created to pass this speed bin data among processes
+ * Formats the speed bins of a flow into the string sent to the client with
+ * the test results.
+ * @param cur the flow
+ * @param buff filled with the speed bins
+ * @param len size of buff
+ */
+static void format_bins(const struct spdpair *cur, char *buff, size_t len) {
+  snprintf(buff,
+           len,
+           "  %d %d %d %d %d %d %d %d %d %d %d %d %0.2f %d %d %d %d %d %d",
+           cur->links[0], cur->links[1], cur->links[2], cur->links[3],
+           cur->links[4], cur->links[5], cur->links[6], cur->links[7],
+           cur->links[8], cur->links[9], cur->links[10], cur->links[11],
+           cur->totalspd2, cur->inc_cnt, cur->dec_cnt, cur->same_cnt,
+           cur->timeout, cur->dupack, ifspeed);
+}
+
+/**
+ *  This routine prints details of data about speed bins. It also formats the
+ *  data into the string sent to the client with the test results
  *  @param cur current speed pair
- *  @param monitor_pipe array used to store file descriptors of pipes
+ *  @param buff filled with the speed bins
+ *  @param len size of buff
  *   */
-void print_bins(struct spdpair *cur, int monitor_pipe[2]) {
+void print_bins(struct spdpair *cur, char *buff, size_t len) {
   int i, total = 0, max = 0, s, index = -1;
-  char buff[256];
   int tzoffset = 6;
   FILE * fp;
-  int j;
 
   assert(cur);
 
@@ -340,23 +409,9 @@ void print_bins(struct spdpair *cur, int monitor_pipe[2]) {
     fclose(fp);
   }
 
-  // make speed bin available to other processes
-  snprintf(buff,
-           sizeof(buff),
-           "  %d %d %d %d %d %d %d %d %d %d %d %d %0.2f %d %d %d %d %d %d",
-           cur->links[0], cur->links[1], cur->links[2], cur->links[3],
-           cur->links[4], cur->links[5], cur->links[6], cur->links[7],
-           cur->links[8], cur->links[9], cur->links[10], cur->links[11],
-           cur->totalspd2, cur->inc_cnt, cur->dec_cnt, cur->same_cnt,
-           cur->timeout, cur->dupack, ifspeed);
-  for (j = 0; j < 5; j++) {
-    i = write(monitor_pipe[1], buff, strlen(buff));
-    if (i == strlen(buff))
-      break;
-    if ((i == -1) && (errno == EINTR))
-      continue;
-  }
-  log_println(6, "wrote %d bytes: link counters are '%s'", i, buff);
+  // make speed bin available to the test
+  format_bins(cur, buff, len);
+  log_println(6, "link counters are '%s'", buff);
   log_println(
       6,
       "#$#$#$#$ pcap routine says window increases = %d, decreases = %d, "
@@ -461,39 +516,246 @@ void calculate_spd(struct spdpair *cur, struct spdpair *cur2, int portA,
   log_println(8, "totalspd2 in the end=%f, spd=%f",  cur2->totalspd2, spd);
 }
 
+/**
+ * Hash bucket of a stream of a packet-pair analysis.
+ * @param key the client port xor the server port of the stream
+ * @return the first bucket to probe for the stream
+ */
+static inline unsigned int pkttrace_stream_bucket(uint16_t key) {
+  return ((key * 40503u) >> 8) & (PKTTRACE_STREAM_BUCKETS - 1);
+}
+
+/**
+ * Adds a stream to the packet-pair analysis of a test.
+ * @param a the analyzer of the test, with its server port set
+ * @param port the client port of the stream
+ * @param index the number of the stream in the test
+ * @return 0 on success, EEXIST if the stream is already analyzed, EINVAL
+ *         if the port is the server port, ENOSPC if the table is full
+ */
+static int add_pkttrace_stream(PktAnalyzer* a, uint16_t port, int index) {
+  uint16_t key = port ^ a->serverPort;
+  unsigned int i = pkttrace_stream_bucket(key);
+
+  if (key == 0)
+    return EINVAL;
+  // Keep a free bucket, which ends the probes of the unknown streams
+  if (a->streamsNum >= PKTTRACE_STREAM_BUCKETS - 1)
+    return ENOSPC;
+  while (a->streams[i].key != 0) {
+    if (a->streams[i].key == key)
+      return EEXIST;
+    i = (i + 1) & (PKTTRACE_STREAM_BUCKETS - 1);
+  }
+  a->streams[i].key = key;
+  a->streams[i].index = index;
+  init_vars(&a->streams[i].fwd);
+  init_vars(&a->streams[i].rev);
+  a->streamsNum++;
+  return 0;
+}
+
+/**
+ * Finds the stream of a packet in the packet-pair analysis of a test.
+ * @param a the analyzer of the test
+ * @param key the source port xor the destination port of the packet
+ * @return the stream, or NULL if the packet belongs to none
+ */
+static inline PktStream* find_pkttrace_stream(PktAnalyzer* a, uint16_t key) {
+  unsigned int i = pkttrace_stream_bucket(key);
+
+  while (a->streams[i].key != key && a->streams[i].key != 0)
+    i = (i + 1) & (PKTTRACE_STREAM_BUCKETS - 1);
+  return a->streams[i].key != 0 ? &a->streams[i] : NULL;
+}
+
+/**
+ * Starts the counters of both flows of a stream at the time of a packet.
+ * @param st the stream
+ * @param current the packet
+ */
+static void start_pkttrace_stream(PktStream* st,
+                                  const struct spdpair *current) {
+  st->fwd.st_sec = current->sec;
+  st->fwd.st_usec = current->usec;
+  st->rev.st_sec = current->sec;
+  st->rev.st_usec = current->usec;
+  st->fwd.dec_cnt = 0;
+  st->fwd.inc_cnt = 0;
+  st->fwd.same_cnt = 0;
+  st->fwd.timeout = 0;
+  st->fwd.dupack = 0;
+  st->rev.dec_cnt = 0;
+  st->rev.inc_cnt = 0;
+  st->rev.same_cnt = 0;
+  st->rev.timeout = 0;
+  st->rev.dupack = 0;
+}
+
+/**
+ * Adds the counters of the flow of one stream to those of all the streams.
+ * @param total the flow of all the streams
+ * @param cur the flow of the stream
+ * @return 1 if the stream gave a running average of the speed, else 0
+ */
+static int merge_spdpair(struct spdpair *total, const struct spdpair *cur) {
+  int i;
+
+  for (i = 0; i < 16; i++)
+    total->links[i] += cur->links[i];
+  total->inc_cnt += cur->inc_cnt;
+  total->dec_cnt += cur->dec_cnt;
+  total->same_cnt += cur->same_cnt;
+  total->timeout += cur->timeout;
+  total->dupack += cur->dupack;
+  total->totalspd += cur->totalspd;
+  total->totalcount += cur->totalcount;
+  if (cur->family != 0 &&
+      (total->family == 0 || cur->st_sec < total->st_sec ||
+       (cur->st_sec == total->st_sec && cur->st_usec < total->st_usec))) {
+    total->family = cur->family;
+    total->st_sec = cur->st_sec;
+    total->st_usec = cur->st_usec;
+  }
+  if (cur->totalcount == 0)
+    return 0;
+  total->totalspd2 += cur->totalspd2;
+  return 1;
+}
+
+/**
+ * Aggregates the speed bins of the streams of a test into its forward and
+ * reverse flows.  The running averages of the speed are averaged over the
+ * streams that gave one, as every stream sees the same bottleneck link.
+ * @param a the analyzer of the test
+ */
+static void merge_pkttrace_streams(PktAnalyzer* a) {
+  int i, fwdNum = 0, revNum = 0;
+
+  a->fwd.totalspd2 = 0;
+  a->rev.totalspd2 = 0;
+  for (i = 0; i < PKTTRACE_STREAM_BUCKETS; i++) {
+    if (a->streams[i].key == 0)
+      continue;
+    fwdNum += merge_spdpair(&a->fwd, &a->streams[i].fwd);
+    revNum += merge_spdpair(&a->rev, &a->streams[i].rev);
+  }
+  if (fwdNum > 0)
+    a->fwd.totalspd2 /= fwdNum;
+  if (revNum > 0)
+    a->rev.totalspd2 /= revNum;
+}
+
+/**
+ * Find the TCP header of a captured packet, past the IPv6 extension headers
+ * if there are any.
+ * @param p the packet, starting with its Ethernet header
+ * @param caplen number of bytes of the packet captured
+ * @param family set to 4 or 6
+ * @return the TCP header, or NULL if the packet is not a TCP segment or
+ *         was cut before the fields read by the analysis
+ */
+static const struct tcphdr* pkttrace_tcp_header(const u_char *p,
+                                                unsigned int caplen,
+                                                int *family) {
+  const struct ether_header *eth = (const struct ether_header *) p;
+  const struct ip *ip;
+#if defined(AF_INET6)
+  const struct ip6_hdr *ip6;
+  const u_char *ext;
+  int i, nxt;
+#endif
+  unsigned int hl;
+
+  if (caplen < sizeof(struct ether_header))
+    return NULL;
+  p += sizeof(struct ether_header);
+  caplen -= sizeof(struct ether_header);
+  switch (ntohs(eth->ether_type)) {
+    case ETHERTYPE_IP:
+      ip = (const struct ip *) p;
+      hl = ip->ip_hl * 4;
+      if (caplen < sizeof(struct ip) || ip->ip_p != IPPROTO_TCP ||
+          (ntohs(ip->ip_off) & IP_OFFMASK) != 0)
+        return NULL;
+      *family = 4;
+      break;
+#if defined(AF_INET6)
+    case ETHERTYPE_IPV6:
+      ip6 = (const struct ip6_hdr *) p;
+      hl = sizeof(struct ip6_hdr);
+      if (caplen < hl)
+        return NULL;
+      nxt = ip6->ip6_nxt;
+      for (i = 0; i < PKTTRACE_IPV6_EXTENSIONS && nxt != IPPROTO_TCP; i++) {
+        ext = p + hl;
+        if (caplen < hl + 8)
+          return NULL;
+        switch (nxt) {
+          case IPPROTO_HOPOPTS:
+          case IPPROTO_ROUTING:
+          case IPPROTO_DSTOPTS:
+            hl += (ext[1] + 1) * 8;
+            break;
+          case IPPROTO_FRAGMENT:
+            // Only the first fragment holds the TCP header
+            if ((((ext[2] << 8) | ext[3]) & 0xfff8) != 0)
+              return NULL;
+            hl += 8;
+            break;
+          default:
+            return NULL;
+        }
+        nxt = ext[0];
+      }
+      if (nxt != IPPROTO_TCP)
+        return NULL;
+      *family = 6;
+      break;
+#endif
+    default:
+      return NULL;
+  }
+  if (caplen < hl + PKTTRACE_TCP_FIELDS)
+    return NULL;
+  return (const struct tcphdr *) (p + hl);
+}
+
 /**
  * Read packets received from the network interface. Step through the input file and calculate
  * the link speed between each packet pair. Increment the proper link
  * bin by calling function calculate_spd.
  * "print_speed" seems to be a misnomer.
+ * Each stream of the test keeps its own packet pairs, found from the ports
+ * of the packet with a lookup in the stream table of the analyzer.  The
+ * threads of the shared capture get every packet of a stream on the same
+ * thread, so that a stream is only ever updated by one of them.
  * For more information on the parameters, see the pcap library/ pcap manual pages
- * @param user PortPair indicating source/destination ports
+ * @param user PktAnalyzer of the test
  * @param h pcap_pkthdr type packet header information
  * @param p u_char that could point to ethernet/TCP header data
  */
 
 void print_speed(u_char *user, const struct pcap_pkthdr *h, const u_char *p) {
   const struct ip *ip = NULL;
-  PortPair* pair = (PortPair*) user;
+  PktAnalyzer* a = (PktAnalyzer*) user;
 #if defined(AF_INET6)
   const struct ip6_hdr *ip6;
 #endif
   const struct tcphdr *tcp;
   struct spdpair current;
-  int port2 = pair->port1;
-  int port4 = pair->port2;
+  PktStream* st;
+  int port2 = a->pair.port1;
+  int port4 = a->pair.port2;
+  int family, fwdHost, revHost;
 
   assert(user);
 
-  if (dumptrace == 1)
-    pcap_dump((u_char *) pdump, h, p);
+  if (a->dump != NULL)
+    ndttrace_write(a->dump, &h->ts, h->caplen, h->len, p);
 
-  if (pd == NULL) {
-    fprintf(
-        stderr,
-        "!#!#!#!# Error, trying to process IF data, but pcap fd closed\n");
+  if ((tcp = pkttrace_tcp_header(p, h->caplen, &family)) == NULL)
     return;
-  }
 
   current.sec = h->ts.tv_sec;
   current.usec = h->ts.tv_usec;
@@ -502,254 +764,115 @@ void print_speed(u_char *user, const struct pcap_pkthdr *h, const u_char *p) {
   p += sizeof(struct ether_header);  // move packet pointer past ethernet fields
 
   ip = (const struct ip *) p;
-  if (ip->ip_v == 4) {
-    /* This section grabs the IP & TCP header values from an IPv4 packet and loads the various
+  if (family == 4) {
+    /* This section grabs the IP header values from an IPv4 packet and loads the various
      * variables with the packet's values.  
      */
-    p += (ip->ip_hl) * 4;
-    tcp = (const struct tcphdr *) p;
     current.saddr[0] = ip->ip_src.s_addr;
     current.daddr[0] = ip->ip_dst.s_addr;
-
-    current.sport = ntohs(tcp->source);
-    current.dport = ntohs(tcp->dest);
-    current.seq = ntohl(tcp->seq);
-    current.ack = ntohl(tcp->ack_seq);
-    current.win = ntohs(tcp->window);
-
-    /* currently only packets from first stream are being considered when calculating values,
-     * so if current packet is from different stream then just return */
-
-    if (current.sport != firstTcpStreamPort && current.dport != firstTcpStreamPort)
-      return;
-
-    /* the current structure now has copies of the IP/TCP header values, if this is the
-     * first packet, then there is nothing to compare them to, so just finish the initialization
-     * step and return.
-     */
-
-    if (fwd.seq == 0) {
-      log_println(1,
-                  "New IPv4 packet trace started -- initializing counters");
-      fwd.seq = current.seq;
-
-      fwd.st_sec = current.sec;
-      fwd.st_usec = current.usec;
-      rev.st_sec = current.sec;
-      rev.st_usec = current.usec;
-      fwd.dec_cnt = 0;
-      fwd.inc_cnt = 0;
-      fwd.same_cnt = 0;
-      fwd.timeout = 0;
-      fwd.dupack = 0;
-      rev.dec_cnt = 0;
-      rev.inc_cnt = 0;
-      rev.same_cnt = 0;
-      rev.timeout = 0;
-      rev.dupack = 0;
-      fwd.family = 4;
-      rev.family = 4;
-      return;
-    }
-
-    /* a new IPv4 packet has been received and it isn't the 1st one, so calculate the bottleneck link
-     * capacity based on the times between this packet and the previous one.
-     */
-
-    if (fwd.saddr[0] == current.saddr[0]) {
-      if (current.dport == port2) {
-        calculate_spd(&current, &fwd, port2, port4);
-        return;
-      }
-      if (current.sport == port4) {
-        calculate_spd(&current, &fwd, port2, port4);
-        return;
-      }
-    }
-    if (rev.saddr[0] == current.saddr[0]) {
-      if (current.sport == port2) {
-        calculate_spd(&current, &rev, port2, port4);
-        return;
-      }
-      if (current.dport == port4) {
-        calculate_spd(&current, &rev, port2, port4);
-        return;
-      }
-    }
+    fwdHost = a->fwd.saddr[0] == current.saddr[0];
+    revHost = a->rev.saddr[0] == current.saddr[0];
   } else { /*  IP header value is not = 4, so must be IPv6 */
 #if defined(AF_INET6)
-    // This is an IPv6 packet, grab the IP & TCP header values for further
-    // use.
+    // This is an IPv6 packet, grab the IP header values for further use.
 
     ip6 = (const struct ip6_hdr *)p;
 
-    p += 40;
-    tcp = (const struct tcphdr *)p;
     memcpy(current.saddr, (void *) &ip6->ip6_src, 16);
     memcpy(current.daddr, (void *) &ip6->ip6_dst, 16);
+    fwdHost = memcmp(a->fwd.saddr, current.saddr, 16) == 0;
+    revHost = memcmp(a->rev.saddr, current.saddr, 16) == 0;
+#else
+    return;
+#endif
+  }
 
-    current.sport = ntohs(tcp->source);
-    current.dport = ntohs(tcp->dest);
-    current.seq = ntohl(tcp->seq);
-    current.ack = ntohl(tcp->ack_seq);
-    current.win = ntohs(tcp->window);
-
-    /* currently only packets from first stream are being considered when calculating values,
-     * so if current packet is from different stream then just return */
-
-    if (current.sport != firstTcpStreamPort && current.dport != firstTcpStreamPort)
-      return;
-
-    // The 1st packet has been received, finish the initialization process
-    // and return.
-
-    if (fwd.seq == 0) {
-      log_println(4, "New IPv6 packet trace started -- "
-                  "initializing counters");
-      fwd.seq = current.seq;
-      fwd.st_sec = current.sec;
-      fwd.st_usec = current.usec;
-      rev.st_sec = current.sec;
-      rev.st_usec = current.usec;
-      fwd.dec_cnt = 0;
-      fwd.inc_cnt = 0;
-      fwd.same_cnt = 0;
-      fwd.timeout = 0;
-      fwd.dupack = 0;
-      rev.dec_cnt = 0;
-      rev.inc_cnt = 0;
-      rev.same_cnt = 0;
-      rev.timeout = 0;
-      rev.dupack = 0;
-      fwd.family = 6;
-      rev.family = 6;
-      return;
-    }
+  current.sport = ntohs(tcp->source);
+  current.dport = ntohs(tcp->dest);
+  current.seq = ntohl(tcp->seq);
+  current.ack = ntohl(tcp->ack_seq);
+  current.win = ntohs(tcp->window);
 
-    /* A new packet has been recieved, and it's not the 1st.  Use it to calculate the
-     * bottleneck link capacity for this flow.
-     */
+  // The server port is the same for all the streams, so the ports of the
+  // packet xor-ed together name the stream in both directions
+  if ((st = find_pkttrace_stream(a, current.sport ^ current.dport)) == NULL)
+    return;
 
-    if ((fwd.saddr[0] == current.saddr[0]) &&
-        (fwd.saddr[1] == current.saddr[1]) &&
-        (fwd.saddr[2] == current.saddr[2]) &&
-        (fwd.saddr[3] == current.saddr[3])) {
-      if (current.dport == port2) {
-        calculate_spd(&current, &fwd, port2, port4);
-        return;
-      }
-      if (current.sport == port4) {
-        calculate_spd(&current, &fwd, port2, port4);
-        return;
-      }
-    }
-    if ((rev.saddr[0] == current.saddr[0]) &&
-        (rev.saddr[1] == current.saddr[1]) &&
-        (rev.saddr[2] == current.saddr[2]) &&
-        (rev.saddr[3] == current.saddr[3])) {
-      if (current.sport == port2) {
-        calculate_spd(&current, &rev, port2, port4);
-        return;
-      }
-      if (current.dport == port4) {
-        calculate_spd(&current, &rev, port2, port4);
-        return;
-      }
-    }
-#endif
+  /* the current structure now has copies of the IP/TCP header values, if this is the
+   * first packet of the stream, then there is nothing to compare them to, so just finish
+   * the initialization step and return.
+   */
+
+  if (st->fwd.seq == 0) {
+    log_println(4, "New IPv%d packet trace of stream %d started -- "
+                "initializing counters", family, st->index);
+    st->fwd.seq = current.seq;
+    start_pkttrace_stream(st, &current);
+    st->fwd.family = family;
+    st->rev.family = family;
+    return;
+  }
+
+  /* a new packet has been received and it isn't the 1st one, so calculate the bottleneck link
+   * capacity based on the times between this packet and the previous one of its stream.
+   */
+
+  if (fwdHost && (current.dport == port2 || current.sport == port4)) {
+    calculate_spd(&current, &st->fwd, port2, port4);
+    return;
+  }
+  if (revHost && (current.sport == port2 || current.dport == port4)) {
+    calculate_spd(&current, &st->rev, port2, port4);
+    return;
   }
 
   /* a packet has been received, so it matched the filter, but the src/dst ports are backward for some reason.
    * Need to fix this by reversing the values.
    */
 
-  if (sigk == 0) {
-    sigk++;
+  if (a->sigk == 0) {
+    a->sigk++;
     log_println(6,
                 "Fault: unknown packet received with src/dst port = %d/%d",
                 current.sport, current.dport);
   }
-  if (sigj == 0) {
+  // Several capture threads may get here at once, only one reverses them
+  if (__atomic_exchange_n(&a->sigj, 1, __ATOMIC_SEQ_CST) == 0) {
     log_println(6, "Ports need to be reversed now port1/port2 = %d/%d",
-                pair->port1, pair->port2);
-    int tport = pair->port1;
-    pair->port1 = pair->port2;
-    pair->port2 = tport;
-    fwd.st_sec = current.sec;
-    fwd.st_usec = current.usec;
-    rev.st_sec = current.sec;
-    rev.st_usec = current.usec;
-    fwd.dec_cnt = 0;
-    fwd.inc_cnt = 0;
-    fwd.same_cnt = 0;
-    fwd.timeout = 0;
-    fwd.dupack = 0;
-    rev.dec_cnt = 0;
-    rev.inc_cnt = 0;
-    rev.same_cnt = 0;
-    rev.timeout = 0;
-    rev.dupack = 0;
+                a->pair.port1, a->pair.port2);
+    int tport = a->pair.port1;
+    a->pair.port1 = a->pair.port2;
+    a->pair.port2 = tport;
+    start_pkttrace_stream(st, &current);
     log_println(6,
                 "Ports should have been reversed now port1/port2 = %d/%d",
-                pair->port1, pair->port2);
-    sigj = 1;
+                a->pair.port1, a->pair.port2);
   }
 }
 
 /**
- * Perform opening and initialization functions needed
- * by the libpcap routines.  The print_speed function above, is passed
- * to the pcap_open_live() function as the pcap_handler.
- * @param srcAddr 	Source address
- * @param sock_addr array of socket addresses used to determine client addresses
- * @param sockaddrArrayLength number of elements in sock_addr array
- * @param saddrlen  socket address length
- * @param monitor_pipe socket file descriptors used to read/write data (for interprocess communication)
- * @param device devive detail string
- * @param pair PortPair strcuture
+ * Find the interface carrying the test and record the endpoints of the
+ * flows in each direction.
+ * @param a analyzer of the test, given the endpoints
+ * @param srcAddr local address of the test
+ * @param sock_address address of the client
  * @param direction string indicating C2S/S2c test
- * @param expectedTestTime expected test time duration + 50seconds
+ * @param device interface to capture on, or NULL to look it up
+ * @param devname filled with the name of the interface
+ * @param devnameLen size of devname
+ * @return 0 on success, ENODEV if no interface could be found
  */
-
-void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sockaddrArrayLength,
-                   socklen_t saddrlen, int monitor_pipe[2], char *device,
-                   PortPair* pair, const char *direction, int expectedTestTime) {
-  char cmdbuf[256], dir[256];
-  pcap_handler printer;
-  u_char * pcap_userdata = (u_char*) pair;
-  uint16_t port;
-  struct bpf_program fcode;
+static int find_pkttrace_device(PktAnalyzer* a, I2Addr srcAddr,
+                                struct sockaddr* sock_address,
+                                const char *direction, char *device,
+                                char *devname, size_t devnameLen) {
   char errbuf[PCAP_ERRBUF_SIZE];
-  int cnt, pflag = 0, i;
-  char namebuf[200], isoTime[64];
-  size_t nameBufLen = 199;
-  struct sockaddr *sock_address, *sock_address_temp;
-  I2Addr sockAddr = NULL, sockAddrTemp = NULL;
+  char namebuf[200];
   struct sockaddr *src_addr;
-  pcap_if_t *alldevs, *dp;
+  pcap_if_t *alldevs = NULL, *dp;
   pcap_addr_t *curAddr;
-  int rc;
-
-  char logdir[256];
-
-  cnt = -1; /* read forever, or until end of file */
-
-  /* Store the monitor pipe as a static global for this file
-   * so we can stop the trace later */
-  mon_pipe = monitor_pipe;
-  init_vars(&fwd);
-  init_vars(&rev);
-
-  // scan through the interface device list and get the names/speeds of each
-  //  if.  The speed data can be used to cap the search for the bottleneck link
-  //  capacity.  The intent is to reduce the impact of interrupt coalescing on
-  //  the bottleneck link detection algorithm
-  //  RAC 7/14/09
-  init_iflist();
+  int i;
 
-  sock_address = (struct sockaddr*) &sock_addr[0];
-  sockAddr = I2AddrBySAddr(get_errhandle(), sock_address, saddrlen, 0, 0);
-  sock_address = I2AddrSAddr(sockAddr, 0);
   src_addr = I2AddrSAddr(srcAddr, 0);
 
   // Disable, device can be NULL trying to copy "lo" into
@@ -786,7 +909,7 @@ void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sock
                     dp->name);
                 device = dp->name;
                 ifspeed = -1;
-                for (i = 0; iflist.name[0][i] != '0'; i++) {
+                for (i = 0; i < 8 && iflist.name[i][0] != '\0'; i++) {
                   if (strncmp((char *) iflist.name[i], device, 4)
                       == 0) {
                     ifspeed = iflist.speed[i];
@@ -795,47 +918,47 @@ void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sock
                 }
 
                 if (direction[0] == 's') {
-                  fwd.saddr[0] =
+                  a->fwd.saddr[0] =
                       ((struct sockaddr_in *)src_addr)->sin_addr.s_addr;
-                  fwd.daddr[0] =
+                  a->fwd.daddr[0] =
                       ((struct sockaddr_in *)sock_address)->sin_addr.s_addr;
-                  rev.saddr[0] =
+                  a->rev.saddr[0] =
                       ((struct sockaddr_in *)sock_address)->sin_addr.s_addr;
-                  rev.daddr[0] =
+                  a->rev.daddr[0] =
                       ((struct sockaddr_in *)src_addr)->sin_addr.s_addr;
 
-                  fwd.sport =
+                  a->fwd.sport =
                       ntohs(
                           ((struct sockaddr_in *) src_addr)->sin_port);
-                  fwd.dport =
+                  a->fwd.dport =
                       ntohs(
                           ((struct sockaddr_in *) sock_address)->sin_port);
-                  rev.sport =
+                  a->rev.sport =
                       ntohs(
                           ((struct sockaddr_in *) sock_address)->sin_port);
-                  rev.dport =
+                  a->rev.dport =
                       ntohs(
                           ((struct sockaddr_in *) src_addr)->sin_port);
                 } else {
-                  rev.saddr[0] =
+                  a->rev.saddr[0] =
                       ((struct sockaddr_in *)src_addr)->sin_addr.s_addr;
-                  rev.daddr[0] =
+                  a->rev.daddr[0] =
                       ((struct sockaddr_in *)sock_address)->sin_addr.s_addr;
-                  fwd.saddr[0] =
+                  a->fwd.saddr[0] =
                       ((struct sockaddr_in *)sock_address)->sin_addr.s_addr;
-                  fwd.daddr[0] =
+                  a->fwd.daddr[0] =
                       ((struct sockaddr_in *)src_addr)->sin_addr.s_addr;
 
-                  rev.sport =
+                  a->rev.sport =
                       ntohs(
                           ((struct sockaddr_in *) src_addr)->sin_port);
-                  rev.dport =
+                  a->rev.dport =
                       ntohs(
                           ((struct sockaddr_in *) sock_address)->sin_port);
-                  fwd.sport =
+                  a->fwd.sport =
                       ntohs(
                           ((struct sockaddr_in *) sock_address)->sin_port);
-                  fwd.dport =
+                  a->fwd.dport =
                       ntohs(
                           ((struct sockaddr_in *) src_addr)->sin_port);
                 }
@@ -865,23 +988,23 @@ void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sock
                     (struct sockaddr_in6*)sock_address;
 
                 if (direction[0] == 's') {
-                  memcpy(fwd.saddr, src_addr6->sin6_addr.s6_addr, 16);
-                  memcpy(fwd.daddr, sock_addr6->sin6_addr.s6_addr, 16);
-                  memcpy(rev.saddr, sock_addr6->sin6_addr.s6_addr, 16);
-                  memcpy(rev.daddr, src_addr6->sin6_addr.s6_addr, 16);
-                  fwd.sport = ntohs(src_addr6->sin6_port);
-                  fwd.dport = ntohs(sock_addr6->sin6_port);
-                  rev.sport = ntohs(sock_addr6->sin6_port);
-                  rev.dport = ntohs(src_addr6->sin6_port);
+                  memcpy(a->fwd.saddr, src_addr6->sin6_addr.s6_addr, 16);
+                  memcpy(a->fwd.daddr, sock_addr6->sin6_addr.s6_addr, 16);
+                  memcpy(a->rev.saddr, sock_addr6->sin6_addr.s6_addr, 16);
+                  memcpy(a->rev.daddr, src_addr6->sin6_addr.s6_addr, 16);
+                  a->fwd.sport = ntohs(src_addr6->sin6_port);
+                  a->fwd.dport = ntohs(sock_addr6->sin6_port);
+                  a->rev.sport = ntohs(sock_addr6->sin6_port);
+                  a->rev.dport = ntohs(src_addr6->sin6_port);
                 } else {
-                  memcpy(rev.saddr, src_addr6->sin6_addr.s6_addr, 16);
-                  memcpy(rev.daddr, sock_addr6->sin6_addr.s6_addr, 16);
-                  memcpy(fwd.saddr, sock_addr6->sin6_addr.s6_addr, 16);
-                  memcpy(fwd.daddr, src_addr6->sin6_addr.s6_addr, 16);
-                  rev.sport = ntohs(src_addr6->sin6_port);
-                  rev.dport = ntohs(sock_addr6->sin6_port);
-                  fwd.sport = ntohs(sock_addr6->sin6_port);
-                  fwd.dport = ntohs(src_addr6->sin6_port);
+                  memcpy(a->rev.saddr, src_addr6->sin6_addr.s6_addr, 16);
+                  memcpy(a->rev.daddr, sock_addr6->sin6_addr.s6_addr, 16);
+                  memcpy(a->fwd.saddr, sock_addr6->sin6_addr.s6_addr, 16);
+                  memcpy(a->fwd.daddr, src_addr6->sin6_addr.s6_addr, 16);
+                  a->rev.sport = ntohs(src_addr6->sin6_port);
+                  a->rev.dport = ntohs(sock_addr6->sin6_port);
+                  a->fwd.sport = ntohs(sock_addr6->sin6_port);
+                  a->fwd.dport = ntohs(src_addr6->sin6_port);
                 }
                 goto endLoop;
               }
@@ -897,19 +1020,1031 @@ void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sock
   }
  endLoop:
 
-  /*  device = pcap_lookupdev(errbuf); */
   if (device == NULL) {
-    fprintf(stderr, "pcap_lookupdev failed\n");
+    log_println(0, "No network interface found for packet-pair timing");
+    if (alldevs != NULL)
+      pcap_freealldevs(alldevs);
+    return ENODEV;
   }
+  strlcpy(devname, device, devnameLen);
+  if (alldevs != NULL)
+    pcap_freealldevs(alldevs);
+  return 0;
+}
 
-  log_println(1, "Opening network interface '%s' for packet-pair timing",
-              device);
+/**
+ * The snap length of the packet-pair capture.
+ * @return the bytes kept of each packet, MAX_TRACE_SNAPLEN when only the
+ *         headers are kept
+ */
+static int pkttrace_snaplen(void) {
+  return trace_snaplen > 0 ? trace_snaplen : MAX_TRACE_SNAPLEN;
+}
+
+/**
+ * Make a capture filter cut the packets it accepts to their Ethernet, IP
+ * and TCP headers.  Every "ret #snaplen" of the filter becomes a jump to
+ * instructions appended to it, which return the length of the headers of
+ * the packet, TCP options and up to PKTTRACE_IPV6_EXTENSIONS IPv6
+ * extension headers included.  The kernel then copies just that much of
+ * the packet into the ring.
+ * @param fcode the filter compiled by libpcap
+ * @param prog filled with the new filter, to be freed by the caller
+ * @return 0 on success, an errno value otherwise
+ */
+static int cut_pkttrace_filter(const struct bpf_program* fcode,
+                               struct sock_fprog* prog) {
+  const struct sock_filter* in = (const struct sock_filter *) fcode->bf_insns;
+  struct sock_filter* f;
+  unsigned int n = fcode->bf_len, i, b, e, tcp, done, full;
+
+  if (n + PKTTRACE_CUT_INSNS > BPF_MAXINSNS)
+    return E2BIG;
+  if ((f = calloc(n + PKTTRACE_CUT_INSNS, sizeof(*f))) == NULL)
+    return ENOMEM;
+  for (i = 0; i < n; i++) {
+    f[i] = in[i];
+    if (in[i].code == (BPF_RET | BPF_K) && in[i].k != 0)
+      f[i] = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA, n - (i + 1));
+  }
+
+  // Jump offsets count from the next instruction, and all of them fit in
+  // the 8 bits of a conditional jump
+  e = n + 7 + 20 * PKTTRACE_IPV6_EXTENSIONS;
+  tcp = e + 1;
+  done = e + 7;
+  full = e + 10;
+  f[n] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12);
+  f[n + 1] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           ETHERTYPE_IPV6, 3, 0);
+  f[n + 2] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           ETHERTYPE_IP, 0, full - (n + 3));
+  // X = length of the IPv4 header
+  f[n + 3] = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14);
+  f[n + 4] = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA, tcp - (n + 5));
+  // X = length of the IPv6 headers so far, A = their next header
+  f[n + 5] = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 40);
+  f[n + 6] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 20);
+  for (b = n + 7; b < e; b += 20) {
+    f[b] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                         IPPROTO_TCP, tcp - (b + 1), 0);
+    f[b + 1] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                             IPPROTO_FRAGMENT, 3, 0);
+    f[b + 2] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                             IPPROTO_HOPOPTS, 9, 0);
+    f[b + 3] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                             IPPROTO_ROUTING, 8, 0);
+    f[b + 4] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                             IPPROTO_DSTOPTS, 7,
+                                             done - (b + 5));
+    // A fragment header is 8 bytes long
+    f[b + 5] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_IND, 14);
+    f[b + 6] = (struct sock_filter) BPF_STMT(BPF_ST, 0);
+    f[b + 7] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TXA, 0);
+    f[b + 8] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 8);
+    f[b + 9] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    f[b + 10] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_MEM, 0);
+    f[b + 11] = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA, 8);
+    // The others give their length in units of 8 bytes, the first excluded
+    f[b + 12] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_IND, 14);
+    f[b + 13] = (struct sock_filter) BPF_STMT(BPF_ST, 0);
+    f[b + 14] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_IND, 15);
+    f[b + 15] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 1);
+    f[b + 16] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 3);
+    f[b + 17] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+    f[b + 18] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    f[b + 19] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_MEM, 0);
+  }
+  f[e] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP,
+                                       0, done - (e + 1));
+  // Ethernet, IP and TCP headers, the TCP data offset being 12 bytes in
+  f[tcp] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_IND, 26);
+  f[tcp + 1] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0);
+  f[tcp + 2] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 2);
+  f[tcp + 3] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+  f[tcp + 4] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 14);
+  f[tcp + 5] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+  // Not TCP after all, keep the headers stepped over
+  f[done] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TXA, 0);
+  f[done + 1] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 14);
+  f[done + 2] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+  f[full] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, MAX_TRACE_SNAPLEN);
+
+  prog->len = n + PKTTRACE_CUT_INSNS;
+  prog->filter = f;
+  return 0;
+}
+
+/**
+ * Open an AF_PACKET socket, map its TPACKET_V3 receive ring and install a
+ * filter.  The filter is compiled by libpcap and truncates the packets to
+ * the snap length, or to their headers, so that only what the analysis and
+ * the ndttrace files need is copied into the ring.
+ * @param ring the ring to open
+ * @param device name of the interface to capture on, NULL for all of them
+ * @param filter pcap filter expression
+ * @param blockNum number of blocks of the ring
+ * @param fanout PACKET_FANOUT group to join, 0 for none
+ * @return 0 on success, an errno value otherwise
+ */
+static int open_pkttrace_ring(PktRing* ring, const char *device,
+                              const char *filter, unsigned int blockNum,
+                              int fanout) {
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct sock_fprog prog;
+  struct bpf_program fcode;
+  int version = TPACKET_V3;
+  int ifindex = 0, rc;
+
+  ring->fd = -1;
+  ring->ring = NULL;
+  ring->current = 0;
+  ring->loIndex = if_nametoindex("lo");
+  if (device != NULL && (ifindex = if_nametoindex(device)) == 0) {
+    log_println(0, "Unknown network interface '%s'", device);
+    return ENODEV;
+  }
+  if ((ring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+    log_println(0, "Unable to create packet socket: %s", strerror(errno));
+    return errno;
+  }
+
+  log_println(1, "installing pkt filter for '%s'", filter);
+  if (pcap_compile(pd, &fcode, (char *) filter, 0, 0xFFFFFF00) < 0) {
+    log_println(0, "pcap_compile failed %s", pcap_geterr(pd));
+    return EINVAL;
+  }
+  prog.len = fcode.bf_len;
+  prog.filter = (struct sock_filter *) fcode.bf_insns;
+  if (trace_snaplen == 0 && (rc = cut_pkttrace_filter(&fcode, &prog)) != 0) {
+    log_println(0, "Unable to cut the packets to their headers: %s",
+                strerror(rc));
+    pcap_freecode(&fcode);
+    return rc;
+  }
+  rc = setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                  sizeof(prog));
+  if (prog.filter != (struct sock_filter *) fcode.bf_insns)
+    free(prog.filter);
+  pcap_freecode(&fcode);
+  if (rc != 0) {
+    log_println(0, "Unable to attach pkt filter: %s", strerror(errno));
+    return errno;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = PKTTRACE_BLOCK_SIZE;
+  req.tp_block_nr = blockNum;
+  req.tp_frame_size = PKTTRACE_FRAME_SIZE;
+  req.tp_frame_nr = req.tp_block_size / req.tp_frame_size * req.tp_block_nr;
+  req.tp_retire_blk_tov = PKTTRACE_BLOCK_TIMEOUT;
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) != 0 ||
+      setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req,
+                 sizeof(req)) != 0) {
+    log_println(0, "Unable to set up the TPACKET_V3 ring: %s",
+                strerror(errno));
+    return errno;
+  }
+  ring->blockSize = req.tp_block_size;
+  ring->blockNum = req.tp_block_nr;
+  ring->ringSize = (size_t) req.tp_block_size * req.tp_block_nr;
+  ring->ring = mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, ring->fd, 0);
+  if (ring->ring == MAP_FAILED) {
+    ring->ring = NULL;
+    log_println(0, "Unable to map the TPACKET_V3 ring: %s", strerror(errno));
+    return errno;
+  }
+
+  // Nothing is received before the bind, so the filter and the ring are in
+  // place for the first packet
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind(ring->fd, (struct sockaddr *) &sll, sizeof(sll)) != 0) {
+    log_println(0, "Unable to bind packet socket to '%s': %s",
+                device != NULL ? device : "all interfaces", strerror(errno));
+    return errno;
+  }
+  // The fanout hash is the same for both directions of a flow, so a flow is
+  // always read by the same socket
+  if (fanout != 0) {
+    fanout = (fanout & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                   sizeof(fanout)) != 0) {
+      log_println(0, "Unable to join packet fanout group: %s",
+                  strerror(errno));
+      return errno;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Unmap and close a ring opened by open_pkttrace_ring().
+ * @param ring the ring
+ */
+static void close_pkttrace_ring(PktRing* ring) {
+  if (ring->ring != NULL)
+    munmap(ring->ring, ring->ringSize);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  ring->ring = NULL;
+  ring->fd = -1;
+}
+
+/**
+ * Release the resources of a test capturing on its own.
+ * @param trace the capture
+ */
+static void close_pkttrace(PktTrace* trace) {
+  if (trace->analyzer.dump != NULL) {
+    ndttrace_close(trace->analyzer.dump, NULL);
+    trace->analyzer.dump = NULL;
+  }
+  if (pd != NULL) {
+    pcap_close(pd);
+    pd = NULL;
+  }
+  close_pkttrace_ring(&trace->ring);
+  if (trace->stopfd >= 0)
+    close(trace->stopfd);
+  trace->stopfd = -1;
+}
+
+/**
+ * Hand the packets of the next ring block to a handler, if the kernel has
+ * released it.  Only the packets of Ethernet and loopback interfaces are
+ * read, since the analysis expects an Ethernet header.
+ * @param ring the ring
+ * @param handler called for each packet, with arg
+ * @param arg argument of the handler
+ * @return 1 if a block was read, 0 if the next block is still being filled
+ */
+static int read_pkttrace_block(PktRing* ring, pcap_handler handler,
+                               u_char *arg) {
+  struct tpacket_block_desc* block;
+  struct tpacket3_hdr* hdr;
+  struct sockaddr_ll* sll;
+  struct pcap_pkthdr h;
+  uint32_t i;
+
+  block = (struct tpacket_block_desc *) (ring->ring +
+                                         ring->current * ring->blockSize);
+  if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+        TP_STATUS_USER))
+    return 0;
+  hdr = (struct tpacket3_hdr *) ((char *) block +
+                                 block->hdr.bh1.offset_to_first_pkt);
+  for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+    sll = (struct sockaddr_ll *) ((char *) hdr +
+                                  TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    // A looped back packet is seen leaving and entering the interface, only
+    // the copy coming in is counted, as pcap does
+    if ((sll->sll_hatype == ARPHRD_ETHER ||
+         sll->sll_hatype == ARPHRD_LOOPBACK) &&
+        (sll->sll_ifindex != ring->loIndex ||
+         sll->sll_pkttype != PACKET_OUTGOING)) {
+      h.ts.tv_sec = hdr->tp_sec;
+      h.ts.tv_usec = hdr->tp_nsec / 1000;
+      h.caplen = hdr->tp_snaplen;
+      h.len = hdr->tp_len;
+      handler(arg, &h, (u_char *) hdr + hdr->tp_mac);
+    }
+    hdr = (struct tpacket3_hdr *) ((char *) hdr + hdr->tp_next_offset);
+  }
+  __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                   __ATOMIC_RELEASE);
+  ring->current = (ring->current + 1) % ring->blockNum;
+  return 1;
+}
+
+/**
+ * Analyze a packet of a test capturing on its own.
+ * @param user the PktTrace of the test
+ * @param h packet header information
+ * @param p the packet
+ */
+static void pkttrace_packet(u_char *user, const struct pcap_pkthdr *h,
+                            const u_char *p) {
+  PktTrace* trace = (PktTrace*) user;
+
+  trace->analyzer.packets++;
+  print_speed((u_char *) &trace->analyzer, h, p);
+}
+
+/**
+ * The capture thread of a test capturing on its own.  It walks the ring
+ * blocks as the kernel releases them until stop_pkttrace() writes to the
+ * stop eventfd, and then waits for the block being filled to be retired so
+ * no packet of the test is missed.
+ * @param arg the PktTrace of the capture
+ * @return NULL
+ */
+static void* pkttrace_worker(void* arg) {
+  PktTrace* trace = (PktTrace*) arg;
+  struct pollfd pfd[2];
+  double deadline = 0;
+  int timeout;
+
+  pfd[0].fd = trace->ring.fd;
+  pfd[0].events = POLLIN | POLLERR;
+  pfd[1].fd = trace->stopfd;
+  pfd[1].events = POLLIN;
+  for (;;) {
+    if (read_pkttrace_block(&trace->ring, pkttrace_packet, (u_char *) trace))
+      continue;
+    timeout = -1;
+    if (deadline > 0) {
+      timeout = (int) ((deadline - secs()) * 1000);
+      if (timeout <= 0)
+        break;
+    }
+    pfd[0].revents = pfd[1].revents = 0;
+    if (poll(pfd, deadline > 0 ? 1 : 2, timeout) < 0 && errno != EINTR) {
+      log_println(0, "Packet-pair capture poll failed: %s", strerror(errno));
+      break;
+    }
+    if (deadline == 0 && (pfd[1].revents & POLLIN))
+      deadline = secs() + 2 * PKTTRACE_BLOCK_TIMEOUT / 1000.0;
+  }
+  return NULL;
+}
+
+/**
+ * Build the key of the flow of a packet.
+ * @param p the packet, starting with its Ethernet header
+ * @param caplen number of bytes of the packet captured
+ * @param key filled with the addresses and ports of the packet
+ * @return 1 if the packet is a TCP segment, 0 otherwise
+ */
+static int pkttrace_packet_key(const u_char *p, unsigned int caplen,
+                               PktTraceKey* key) {
+  const struct ip *ip = (const struct ip *) (p + sizeof(struct ether_header));
+#if defined(AF_INET6)
+  const struct ip6_hdr *ip6 = (const struct ip6_hdr *) ip;
+#endif
+  const struct tcphdr *tcp;
+
+  memset(key, 0, sizeof(*key));
+  if ((tcp = pkttrace_tcp_header(p, caplen, &key->family)) == NULL)
+    return 0;
+  if (key->family == 4) {
+    key->saddr[0] = ip->ip_src.s_addr;
+    key->daddr[0] = ip->ip_dst.s_addr;
+  } else {
+#if defined(AF_INET6)
+    memcpy(key->saddr, &ip6->ip6_src, 16);
+    memcpy(key->daddr, &ip6->ip6_dst, 16);
+#endif
+  }
+  key->sport = ntohs(tcp->source);
+  key->dport = ntohs(tcp->dest);
+  return 1;
+}
+
+/**
+ * Hash the key of a flow.
+ * @param key the key
+ * @return the hash
+ */
+static unsigned int pkttrace_key_hash(const PktTraceKey* key) {
+  const u_int32_t *w = (const u_int32_t *) key;
+  u_int32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < sizeof(*key) / sizeof(*w); i++)
+    h = (h ^ w[i]) * 16777619u;
+  return h ^ (h >> 16);
+}
+
+/**
+ * Add a flow of a test to the lookup table of a capture thread.
+ * @param w the capture thread
+ * @param key the flow
+ * @param slot the slot of the test
+ */
+static void add_pkttrace_flow(PktTraceWorker* w, const PktTraceKey* key,
+                              int slot) {
+  unsigned int i = pkttrace_key_hash(key) & w->flowsMask;
+
+  while (w->flows[i].slot >= 0)
+    i = (i + 1) & w->flowsMask;
+  w->flows[i].key = *key;
+  w->flows[i].slot = slot;
+}
+
+/**
+ * Find the test a packet belongs to.
+ * @param w the capture thread
+ * @param key the flow of the packet
+ * @return the slot of the test, -1 if the packet is not part of a test
+ */
+static int find_pkttrace_flow(PktTraceWorker* w, const PktTraceKey* key) {
+  unsigned int i = pkttrace_key_hash(key) & w->flowsMask;
+
+  while (w->flows[i].slot >= 0) {
+    if (memcmp(&w->flows[i].key, key, sizeof(*key)) == 0)
+      return w->flows[i].slot;
+    i = (i + 1) & w->flowsMask;
+  }
+  return -1;
+}
+
+/**
+ * Wake up the capture threads, after a slot was armed or stopped.
+ */
+static void wake_pkttrace_service(void) {
+  uint64_t one = 1;
+  int i;
+
+  __atomic_add_fetch(&service->generation, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < service->threadsNum; i++)
+    if (write(serviceWakefds[i], &one, sizeof(one)) != sizeof(one))
+      log_println(4, "Unable to wake up capture thread %d", i);
+}
+
+/**
+ * Mark a slot done once every capture thread has finished with it, and
+ * release it if its test no longer waits for the results.
+ * @param slot the slot
+ * @param serial serial of the test that used the slot
+ */
+static void complete_pkttrace_slot(int slot, unsigned int serial) {
+  PktTraceSlot* s = &service->slots[slot];
+  int done = PKTTRACE_SLOT_DONE;
+
+  pthread_mutex_lock(&serviceDumpLocks[slot]);
+  if (serviceDumpers[slot] != NULL && serviceDumpSerials[slot] == serial) {
+    ndttrace_close(serviceDumpers[slot], &s->analyzer.dumpStats);
+    serviceDumpers[slot] = NULL;
+  }
+  pthread_mutex_unlock(&serviceDumpLocks[slot]);
+  __atomic_store_n(&s->state, PKTTRACE_SLOT_DONE, __ATOMIC_SEQ_CST);
+  sem_post(&s->done);
+  if (__atomic_load_n(&s->abandoned, __ATOMIC_SEQ_CST) ||
+      (kill(s->owner, 0) != 0 && errno == ESRCH))
+    __atomic_compare_exchange_n(&s->state, &done, PKTTRACE_SLOT_FREE, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Rebuild the lookup table of a capture thread from the slots in use, and
+ * arm the slots it has not seen yet.
+ * @param w the capture thread
+ */
+static void refresh_pkttrace_worker(PktTraceWorker* w) {
+  PktTraceSlot* s;
+  PktTraceKey key;
+  unsigned int k;
+  int i, j, state;
+
+  for (k = 0; k <= w->flowsMask; k++)
+    w->flows[k].slot = -1;
+  for (i = 0; i < service->slotsNum; i++) {
+    s = &service->slots[i];
+    state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    if (state != PKTTRACE_SLOT_ACTIVE && state != PKTTRACE_SLOT_STOPPING)
+      continue;
+    if (w->serials[i] != s->serial) {
+      w->serials[i] = s->serial;
+      w->armed[i] = 0;
+      w->finished[i] = 0;
+      w->stopAt[i] = 0;
+    }
+    if (w->finished[i])
+      continue;
+    for (j = 0; j < s->streamsNum; j++) {
+      memset(&key, 0, sizeof(key));
+      key.family = s->family;
+      memcpy(key.saddr, s->serverAddr, sizeof(key.saddr));
+      memcpy(key.daddr, s->clientAddr, sizeof(key.daddr));
+      key.sport = s->serverPort;
+      key.dport = s->clientPorts[j];
+      add_pkttrace_flow(w, &key, i);
+      memcpy(key.saddr, s->clientAddr, sizeof(key.saddr));
+      memcpy(key.daddr, s->serverAddr, sizeof(key.daddr));
+      key.sport = s->clientPorts[j];
+      key.dport = s->serverPort;
+      add_pkttrace_flow(w, &key, i);
+    }
+    if (!w->armed[i]) {
+      w->armed[i] = 1;
+      pthread_mutex_lock(&serviceDumpLocks[i]);
+      if (s->dumpfile[0] != '\0' && serviceDumpSerials[i] != s->serial) {
+        serviceDumpSerials[i] = s->serial;
+        serviceDumpers[i] = ndttrace_open(s->dumpfile, pkttrace_snaplen(),
+                                          s->dumpCompress);
+        if (serviceDumpers[i] == NULL)
+          log_println(0, "Unable to create trace file '%s'", s->dumpfile);
+      }
+      pthread_mutex_unlock(&serviceDumpLocks[i]);
+      if (__atomic_add_fetch(&s->armed, 1, __ATOMIC_SEQ_CST) ==
+          service->threadsNum)
+        sem_post(&s->ready);
+    }
+    // The block being filled is retired within PKTTRACE_BLOCK_TIMEOUT, the
+    // packets of the test are all read after twice that time
+    if (state == PKTTRACE_SLOT_STOPPING && w->stopAt[i] == 0)
+      w->stopAt[i] = secs() + 2 * PKTTRACE_BLOCK_TIMEOUT / 1000.0;
+  }
+}
 
-  if ((pd = pcap_open_live(device, 68, !pflag, 1000, errbuf)) == NULL) {
-    fprintf(stderr, "pcap_open_live failed: %s\n", errbuf);
+/**
+ * Finish with the stopped slots whose packets have all been read.
+ * @param w the capture thread
+ * @return the time the next stopped slot can be finished, 0 if none
+ */
+static double finish_pkttrace_slots(PktTraceWorker* w) {
+  double now = 0, next = 0;
+  int i, finished = 0;
+
+  for (i = 0; i < service->slotsNum; i++) {
+    if (w->stopAt[i] == 0 || w->finished[i])
+      continue;
+    if (now == 0)
+      now = secs();
+    if (now < w->stopAt[i]) {
+      if (next == 0 || w->stopAt[i] < next)
+        next = w->stopAt[i];
+      continue;
+    }
+    w->finished[i] = 1;
+    finished = 1;
+    if (__atomic_sub_fetch(&service->slots[i].pending, 1,
+                           __ATOMIC_SEQ_CST) == 0)
+      complete_pkttrace_slot(i, w->serials[i]);
   }
+  if (finished)
+    refresh_pkttrace_worker(w);
+  return next;
+}
 
-  log_println(2, "pcap_open_live() returned pointer %p", pd);
+/**
+ * Stop the slots of the tests that exited without stopping their capture.
+ */
+static void reap_pkttrace_slots(void) {
+  PktTraceSlot* s;
+  int i, state;
+
+  for (i = 0; i < service->slotsNum; i++) {
+    s = &service->slots[i];
+    state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    if ((state != PKTTRACE_SLOT_CLAIMED && state != PKTTRACE_SLOT_ACTIVE) ||
+        kill(s->owner, 0) == 0 || errno != ESRCH)
+      continue;
+    log_println(4, "Test process %d exited without stopping its capture",
+                s->owner);
+    if (state == PKTTRACE_SLOT_CLAIMED) {
+      __atomic_compare_exchange_n(&s->state, &state, PKTTRACE_SLOT_FREE, 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    s->abandoned = 1;
+    s->pending = service->threadsNum;
+    if (__atomic_compare_exchange_n(&s->state, &state,
+                                    PKTTRACE_SLOT_STOPPING, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      wake_pkttrace_service();
+  }
+}
+
+/**
+ * Analyze a packet read by the shared capture service.
+ * @param user the PktTraceWorker that read the packet
+ * @param h packet header information
+ * @param p the packet
+ */
+static void pkttrace_service_packet(u_char *user,
+                                    const struct pcap_pkthdr *h,
+                                    const u_char *p) {
+  PktTraceWorker* w = (PktTraceWorker*) user;
+  PktTraceSlot* s;
+  PktTraceKey key;
+  int slot;
+
+  if (!pkttrace_packet_key(p, h->caplen, &key) ||
+      (slot = find_pkttrace_flow(w, &key)) < 0)
+    return;
+  s = &service->slots[slot];
+  if (s->dumpfile[0] != '\0') {
+    pthread_mutex_lock(&serviceDumpLocks[slot]);
+    if (serviceDumpers[slot] != NULL)
+      ndttrace_write(serviceDumpers[slot], &h->ts, h->caplen, h->len, p);
+    pthread_mutex_unlock(&serviceDumpLocks[slot]);
+  }
+  __atomic_add_fetch(&s->analyzer.packets, 1, __ATOMIC_RELAXED);
+  print_speed((u_char *) &s->analyzer, h, p);
+}
+
+/**
+ * A capture thread of the shared capture service.  It reads the packets of
+ * all the running tests from its ring, and hands them to the analyzer of
+ * their test.  The first thread also looks for tests that died.
+ * @param arg the PktTraceWorker of the thread
+ * @return never returns
+ */
+static void* pkttrace_service_worker(void* arg) {
+  PktTraceWorker* w = (PktTraceWorker*) arg;
+  struct pollfd pfd[2];
+  unsigned int generation;
+  double next, reapAt = secs() + 1, now;
+  uint64_t count;
+  int timeout;
+
+  pfd[0].fd = w->ring.fd;
+  pfd[0].events = POLLIN | POLLERR;
+  pfd[1].fd = serviceWakefds[w->id];
+  pfd[1].events = POLLIN;
+  for (;;) {
+    generation = __atomic_load_n(&service->generation, __ATOMIC_ACQUIRE);
+    if (generation != w->generation) {
+      w->generation = generation;
+      refresh_pkttrace_worker(w);
+    }
+    if (read_pkttrace_block(&w->ring, pkttrace_service_packet, (u_char *) w)) {
+      finish_pkttrace_slots(w);
+      continue;
+    }
+    next = finish_pkttrace_slots(w);
+    if (w->id == 0) {
+      if ((now = secs()) >= reapAt) {
+        reap_pkttrace_slots();
+        reapAt = now + 1;
+      }
+      if (next == 0 || reapAt < next)
+        next = reapAt;
+    }
+    timeout = -1;
+    if (next > 0) {
+      timeout = (int) ((next - secs()) * 1000) + 1;
+      if (timeout < 0)
+        timeout = 0;
+    }
+    pfd[0].revents = pfd[1].revents = 0;
+    if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+      log_println(0, "Packet-pair capture poll failed: %s", strerror(errno));
+    if (pfd[1].revents & POLLIN)
+      read(pfd[1].fd, &count, sizeof(count));
+  }
+  return NULL;
+}
+
+/**
+ * The capture process of the shared capture service.  It opens one ring per
+ * capture thread, tells the server it is ready and then captures until the
+ * server exits.
+ * @param device name of the interface to capture on, NULL for all of them
+ * @param readyfd pipe written to once the rings are open
+ */
+static void run_pkttrace_service(char *device, int readyfd) {
+  PktTraceWorker* workers;
+  pthread_t thread;
+  unsigned int flowsNum = 1;
+  int i, fanout = 0;
+
+  signal(SIGPIPE, SIG_IGN);
+  while (flowsNum < 4 * MAX_STREAMS * service->slotsNum)
+    flowsNum <<= 1;
+  if ((pd = pcap_open_dead(DLT_EN10MB, pkttrace_snaplen())) == NULL ||
+      (workers = calloc(service->threadsNum, sizeof(*workers))) == NULL ||
+      (serviceDumpers = calloc(service->slotsNum,
+                               sizeof(*serviceDumpers))) == NULL ||
+      (serviceDumpLocks = calloc(service->slotsNum,
+                                 sizeof(*serviceDumpLocks))) == NULL ||
+      (serviceDumpSerials = calloc(service->slotsNum,
+                                   sizeof(*serviceDumpSerials))) == NULL)
+    exit(1);
+  for (i = 0; i < service->slotsNum; i++)
+    pthread_mutex_init(&serviceDumpLocks[i], NULL);
+  if (service->threadsNum > 1)
+    fanout = getpid();
+  for (i = 0; i < service->threadsNum; i++) {
+    workers[i].id = i;
+    workers[i].flowsMask = flowsNum - 1;
+    if ((workers[i].flows = calloc(flowsNum, sizeof(PktTraceFlow))) == NULL ||
+        (workers[i].serials = calloc(service->slotsNum,
+                                     sizeof(unsigned int))) == NULL ||
+        (workers[i].armed = calloc(service->slotsNum, sizeof(int))) == NULL ||
+        (workers[i].finished = calloc(service->slotsNum,
+                                      sizeof(int))) == NULL ||
+        (workers[i].stopAt = calloc(service->slotsNum,
+                                    sizeof(double))) == NULL ||
+        open_pkttrace_ring(&workers[i].ring, device, "tcp",
+                           PKTTRACE_SERVICE_BLOCK_NUM, fanout) != 0)
+      exit(1);
+    refresh_pkttrace_worker(&workers[i]);
+  }
+  if (write(readyfd, "1", 1) != 1)
+    exit(1);
+  close(readyfd);
+  for (i = 1; i < service->threadsNum; i++) {
+    if (pthread_create(&thread, NULL, pkttrace_service_worker,
+                       &workers[i]) != 0) {
+      log_println(0, "Unable to start capture thread %d", i);
+      exit(1);
+    }
+  }
+  pkttrace_service_worker(&workers[0]);
+  exit(0);
+}
+
+/**
+ * Start the shared capture service, so the concurrent tests of a multi-client
+ * server share one capture instead of each opening its own.  A capture
+ * process reads all the TCP packets of the interface with one ring per
+ * capture thread, the threads splitting the flows with PACKET_FANOUT, and
+ * hands each packet to the analyzer of its test, found from its addresses
+ * and ports.  The tests register in slots kept in shared memory, so the
+ * service has to be started before the processes running the tests are
+ * forked.
+ * @param device name of the interface to capture on, NULL for all of them
+ * @param threads number of capture threads, 0 to leave each test capturing
+ *               on its own
+ * @param slots most tests captured at the same time
+ * @return 0 on success, an errno value otherwise
+ */
+int start_pkttrace_service(char *device, int threads, int slots) {
+  size_t size;
+  int readyfds[2], i;
+  char c;
+  pid_t pid;
+
+  if (threads <= 0)
+    return 0;
+  if (threads > MAX_CAPTURE_THREADS)
+    threads = MAX_CAPTURE_THREADS;
+  if (slots < 1)
+    slots = 1;
+  size = sizeof(PktTraceService) + slots * sizeof(PktTraceSlot);
+  service = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (service == MAP_FAILED) {
+    service = NULL;
+    return errno;
+  }
+  memset(service, 0, size);
+  service->slotsNum = slots;
+  service->threadsNum = threads;
+  for (i = 0; i < slots; i++) {
+    sem_init(&service->slots[i].ready, 1, 0);
+    sem_init(&service->slots[i].done, 1, 0);
+  }
+  for (i = 0; i < threads; i++) {
+    if ((serviceWakefds[i] = eventfd(0, EFD_NONBLOCK)) < 0) {
+      log_println(0, "Unable to create the capture service wakeup: %s",
+                  strerror(errno));
+      threads = i;
+      goto failed;
+    }
+  }
+  if (pipe(readyfds) != 0)
+    goto failed;
+
+  if ((pid = fork()) == 0) {
+    // The capture process must not outlive the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    close(readyfds[0]);
+    run_pkttrace_service(device, readyfds[1]);
+  }
+  close(readyfds[1]);
+  if (pid < 0 ||
+      !wait_for_readable_fd_timeout(readyfds[0], PKTTRACE_SERVICE_TIMEOUT) ||
+      read(readyfds[0], &c, 1) != 1) {
+    log_println(0, "The shared packet-pair capture did not start, the tests "
+                "will capture on their own");
+    if (pid > 0)
+      kill(pid, SIGTERM);
+    close(readyfds[0]);
+    goto failed;
+  }
+  close(readyfds[0]);
+  service->pid = pid;
+  log_println(1, "Shared packet-pair capture (pid %d) on %s with %d threads "
+              "and %d test slots", pid, device != NULL ? device : "all "
+              "interfaces", threads, slots);
+  return 0;
+
+ failed:
+  for (i = 0; i < threads; i++)
+    close(serviceWakefds[i]);
+  munmap(service, size);
+  service = NULL;
+  return ECHILD;
+}
+
+/**
+ * Return the pid of the shared capture process.
+ * @return the pid, or -1 if the tests capture on their own
+ */
+pid_t pkttrace_service_pid(void) {
+  return service != NULL ? service->pid : -1;
+}
+
+/**
+ * Wait for a semaphore of a slot of the shared capture service.
+ * @param sem the semaphore
+ * @return 0 if it was posted, -1 after PKTTRACE_SERVICE_TIMEOUT seconds
+ */
+static int wait_pkttrace_slot(sem_t *sem) {
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += PKTTRACE_SERVICE_TIMEOUT;
+  while (sem_timedwait(sem, &deadline) != 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Give up on a slot whose capture threads did not answer in time.
+ * @param s the slot
+ */
+static void abandon_pkttrace_slot(PktTraceSlot* s) {
+  int done = PKTTRACE_SLOT_DONE;
+
+  __atomic_store_n(&s->abandoned, 1, __ATOMIC_SEQ_CST);
+  __atomic_compare_exchange_n(&s->state, &done, PKTTRACE_SLOT_FREE, 0,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Stop the capture of a slot of the shared capture service.
+ * @param slot the slot
+ * @return 0 once the capture threads are done with it, -1 on timeout
+ */
+static int stop_pkttrace_slot(int slot) {
+  PktTraceSlot* s = &service->slots[slot];
+
+  s->pending = service->threadsNum;
+  __atomic_store_n(&s->state, PKTTRACE_SLOT_STOPPING, __ATOMIC_RELEASE);
+  wake_pkttrace_service();
+  if (wait_pkttrace_slot(&s->done) != 0) {
+    abandon_pkttrace_slot(s);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Register a test with the shared capture service.
+ * @param trace the capture of the test, with its analyzer set up
+ * @param srcAddr local address of the test
+ * @param sock_addr array of socket addresses of the client streams
+ * @param sockaddrArrayLength number of elements in sock_addr array
+ * @param dumpfile full name of the ndttrace file to write, NULL for none
+ * @param compress 1 to compress the ndttrace file with gzip
+ * @return 0 once the capture threads see the test, an errno value otherwise
+ */
+static int start_shared_pkttrace(PktTrace* trace, I2Addr srcAddr,
+                                 struct sockaddr_storage sock_addr[],
+                                 int sockaddrArrayLength,
+                                 const char *dumpfile, int compress) {
+  struct sockaddr *server = I2AddrSAddr(srcAddr, 0);
+  struct sockaddr *client;
+  PktTraceSlot* s = NULL;
+  int i, state;
+
+  if (service == NULL ||
+      (kill(service->pid, 0) != 0 && errno == ESRCH))
+    return ECHILD;
+  for (i = 0; i < service->slotsNum; i++) {
+    state = PKTTRACE_SLOT_FREE;
+    if (__atomic_compare_exchange_n(&service->slots[i].state, &state,
+                                    PKTTRACE_SLOT_CLAIMED, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      s = &service->slots[i];
+      break;
+    }
+  }
+  if (s == NULL) {
+    log_println(1, "No free slot in the shared packet-pair capture");
+    return EBUSY;
+  }
+
+  s->owner = getpid();
+  s->serial++;
+  s->armed = 0;
+  s->abandoned = 0;
+  s->pending = 0;
+  memset(s->serverAddr, 0, sizeof(s->serverAddr));
+  memset(s->clientAddr, 0, sizeof(s->clientAddr));
+  s->family = server->sa_family == AF_INET ? 4 : 6;
+  if (server->sa_family == AF_INET) {
+    s->serverAddr[0] = ((struct sockaddr_in *) server)->sin_addr.s_addr;
+    s->serverPort = ntohs(((struct sockaddr_in *) server)->sin_port);
+#if defined(AF_INET6)
+  } else {
+    memcpy(s->serverAddr, &((struct sockaddr_in6 *) server)->sin6_addr, 16);
+    s->serverPort = ntohs(((struct sockaddr_in6 *) server)->sin6_port);
+#endif
+  }
+  s->streamsNum = 0;
+  for (i = 0; i < sockaddrArrayLength && i < MAX_STREAMS; i++) {
+    client = (struct sockaddr *) &sock_addr[i];
+    if (client->sa_family == AF_INET) {
+      s->clientAddr[0] = ((struct sockaddr_in *) client)->sin_addr.s_addr;
+      s->clientPorts[s->streamsNum++] =
+          ntohs(((struct sockaddr_in *) client)->sin_port);
+#if defined(AF_INET6)
+    } else if (client->sa_family == AF_INET6) {
+      memcpy(s->clientAddr, &((struct sockaddr_in6 *) client)->sin6_addr,
+             16);
+      s->clientPorts[s->streamsNum++] =
+          ntohs(((struct sockaddr_in6 *) client)->sin6_port);
+#endif
+    }
+  }
+  strlcpy(s->dumpfile, dumpfile != NULL ? dumpfile : "",
+          sizeof(s->dumpfile));
+  s->dumpCompress = compress;
+  s->analyzer = trace->analyzer;
+  s->analyzer.dump = NULL;
+  while (sem_trywait(&s->ready) == 0 || sem_trywait(&s->done) == 0)
+    continue;
+  __atomic_store_n(&s->state, PKTTRACE_SLOT_ACTIVE, __ATOMIC_RELEASE);
+  wake_pkttrace_service();
+
+  trace->slot = s - service->slots;
+  if (wait_pkttrace_slot(&s->ready) != 0) {
+    log_println(0, "The shared packet-pair capture did not arm the test");
+    s->abandoned = 1;
+    s->pending = service->threadsNum;
+    __atomic_store_n(&s->state, PKTTRACE_SLOT_STOPPING, __ATOMIC_RELEASE);
+    wake_pkttrace_service();
+    trace->slot = -1;
+    return ETIMEDOUT;
+  }
+  return 0;
+}
+
+/**
+ * Start the packet-pair capture of a throughput test.  The test is handed to
+ * the shared capture service if it is running, otherwise its packets are
+ * received in a memory mapped ring of its own and analyzed by a thread of
+ * the test process.  The function returns once the capture is armed, so the
+ * test can start right away.
+ * @param trace filled with the state of the capture
+ * @param srcAddr 	Source address
+ * @param sock_addr array of socket addresses used to determine client addresses
+ * @param sockaddrArrayLength number of elements in sock_addr array
+ * @param saddrlen  socket address length
+ * @param device devive detail string
+ * @param pair PortPair strcuture
+ * @param direction string indicating C2S/S2c test
+ * @param compress 1 to compress the ndttrace file with gzip as it is written
+ * @return 0 on success, an errno value otherwise
+ */
+int start_pkttrace(PktTrace* trace, I2Addr srcAddr,
+                   struct sockaddr_storage sock_addr[],
+                   int sockaddrArrayLength, socklen_t saddrlen, char *device,
+                   PortPair* pair, const char *direction, int compress) {
+  static int iflistReady = 0;
+  char cmdbuf[256], dir[256], devname[IFNAMSIZ];
+  uint16_t port;
+  int i, rc;
+  char namebuf[200], isoTime[64];
+  size_t nameBufLen = 199;
+  struct sockaddr *sock_address, *sock_address_temp;
+  I2Addr sockAddr = NULL, sockAddrTemp = NULL;
+  char logdir[256];
+
+  memset(trace, 0, sizeof(*trace));
+  trace->ring.fd = -1;
+  trace->stopfd = -1;
+  trace->slot = -1;
+  trace->analyzer.pair = *pair;
+  strlcpy(trace->direction, direction, sizeof(trace->direction));
+  init_vars(&trace->analyzer.fwd);
+  init_vars(&trace->analyzer.rev);
+
+  // scan through the interface device list and get the names/speeds of each
+  //  if.  The speed data can be used to cap the search for the bottleneck link
+  //  capacity.  The intent is to reduce the impact of interrupt coalescing on
+  //  the bottleneck link detection algorithm
+  //  RAC 7/14/09
+  // The list does not change during a client session, so it is only built
+  // for the first test
+  if (!iflistReady) {
+    init_iflist();
+    iflistReady = 1;
+  }
+
+  sock_address = (struct sockaddr*) &sock_addr[0];
+  sockAddr = I2AddrBySAddr(get_errhandle(), sock_address, saddrlen, 0, 0);
+  sock_address = I2AddrSAddr(sockAddr, 0);
+
+  if ((rc = find_pkttrace_device(&trace->analyzer, srcAddr, sock_address,
+                                 direction, device, devname,
+                                 sizeof(devname))) != 0) {
+    free(sockAddr);
+    return rc;
+  }
 
   switch(sock_address->sa_family) {
       case AF_INET:
@@ -928,98 +2063,180 @@ void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sock
           I2AddrNodeName(sockAddr, namebuf, &nameBufLen);
   }
 
-  firstTcpStreamPort = I2AddrPort(sockAddr);
+  port = I2AddrPort(sockAddr);
+  trace->analyzer.serverPort = pair->port1 > 0 ? pair->port1 : pair->port2;
+  add_pkttrace_stream(&trace->analyzer, port, 0);
   memset(cmdbuf, 0, sizeof(cmdbuf));
-  snprintf(cmdbuf, sizeof(cmdbuf), "host %s and (port %d", namebuf, firstTcpStreamPort);
+  snprintf(cmdbuf, sizeof(cmdbuf), "host %s and (port %d", namebuf, port);
 
   // append remaining ports (from other opened streams)
   for (i = 1; i < sockaddrArrayLength; i++) {
     sock_address_temp = (struct sockaddr*) &sock_addr[i];
     sockAddrTemp = I2AddrBySAddr(get_errhandle(), sock_address_temp, saddrlen, 0, 0);
     port = I2AddrPort(sockAddrTemp);
-    if (port > 0)
-      snprintf(cmdbuf + strlen(cmdbuf), sizeof(cmdbuf), " or port %d", port);
+    if (port > 0) {
+      snprintf(cmdbuf + strlen(cmdbuf), sizeof(cmdbuf) - strlen(cmdbuf),
+               " or port %d", port);
+      if (add_pkttrace_stream(&trace->analyzer, port, i) != 0)
+        log_println(1, "Stream %d on port %d is left out of the packet-pair "
+                    "timing", i, port);
+    }
 
     free(sockAddrTemp);
   }
-  snprintf(cmdbuf + strlen(cmdbuf), sizeof(cmdbuf), ")");
+  snprintf(cmdbuf + strlen(cmdbuf), sizeof(cmdbuf) - strlen(cmdbuf), ")");
+  free(sockAddr);
 
-  log_println(1, "installing pkt filter for '%s'", cmdbuf);
-  log_println(1, "Initial pkt src data = %p", fwd.saddr);
+  log_println(1, "Initial pkt src data = %p", trace->analyzer.fwd.saddr);
 
-  if (pcap_compile(pd, &fcode, cmdbuf, 0, 0xFFFFFF00) < 0) {
-    fprintf(stderr, "pcap_compile failed %s\n", pcap_geterr(pd));
-    return;
+  if (dumptrace == 1) {
+    // Create log file
+    snprintf(dir, sizeof(dir), "%s_%s.%s_ndttrace%s",
+             get_ISOtime(isoTime, sizeof(isoTime)), namebuf, direction,
+             compress ? ".gz" : "");
+    create_named_logdir(logdir, sizeof(logdir), dir, 0);
+    log_println(1, "Opening '%s' log file", logdir);
+    strlcpy(trace->tracefile, dir, sizeof(trace->tracefile));
   }
 
-  if (pcap_setfilter(pd, &fcode) < 0) {
-    fprintf(stderr, "pcap_setfiler failed %s\n", pcap_geterr(pd));
-    return;
+  if (start_shared_pkttrace(trace, srcAddr, sock_addr, sockaddrArrayLength,
+                            dumptrace == 1 ? logdir : NULL, compress) == 0) {
+    log_println(1, "Packet-pair timing of the %s test by the shared capture",
+                direction);
+    return 0;
+  }
+
+  log_println(1, "Opening network interface '%s' for packet-pair timing",
+              devname);
+  // The handle is never read from, it only compiles the filter for an
+  // Ethernet link
+  if ((pd = pcap_open_dead(DLT_EN10MB, pkttrace_snaplen())) == NULL)
+    return ENOMEM;
+  if ((rc = open_pkttrace_ring(&trace->ring, devname, cmdbuf,
+                               PKTTRACE_BLOCK_NUM, 0)) != 0) {
+    close_pkttrace(trace);
+    return rc;
   }
 
   if (dumptrace == 1) {
-    // Create log file
-    snprintf(dir, sizeof(dir), "%s_%s.%s_ndttrace",
-             get_ISOtime(isoTime, sizeof(isoTime)), namebuf, direction);
-    create_named_logdir(logdir, sizeof(logdir), dir, 0);
-    pdump = pcap_dump_open(pd, logdir);
-    log_println(1, "Opening '%s' log file", logdir);
-    if (pdump == NULL) {
+    trace->analyzer.dump = ndttrace_open(logdir, pkttrace_snaplen(),
+                                         compress);
+    if (trace->analyzer.dump == NULL) {
       fprintf(stderr, "Unable to create trace file '%s'\n", logdir);
+      trace->tracefile[0] = '\0';
       dumptrace = 0;
     }
   }
 
-  printer = (pcap_handler) print_speed;
-  if (dumptrace == 0) {
-    for (i = 0; i < 5; i++) {
-      rc = write(monitor_pipe[1], "Ready", 6);
-      if (rc == 6)
-        break;
-      if ((rc == -1) && (errno == EINTR))
-        continue;
-    }
+  if ((trace->stopfd = eventfd(0, 0)) < 0) {
+    rc = errno;
+    close_pkttrace(trace);
+    return rc;
+  }
+  if ((rc = pthread_create(&trace->thread, NULL, pkttrace_worker,
+                           trace)) != 0) {
+    log_println(0, "Unable to start the packet-pair capture thread: %s",
+                strerror(rc));
+    close_pkttrace(trace);
+    return rc;
+  }
+  return 0;
+}
+
+/**
+ * Stop the packet-pair capture of a throughput test and get its results.
+ * @param trace the capture, started by start_pkttrace()
+ * @param fwdbins filled with the speed bins of the forward flow
+ * @param revbins filled with the speed bins of the reverse flow
+ * @param len size of each of fwdbins and revbins
+ */
+void stop_pkttrace(PktTrace* trace, char *fwdbins, char *revbins,
+                   size_t len) {
+  struct tpacket_stats_v3 stats;
+  socklen_t statslen = sizeof(stats);
+  struct spdpair *fwd = &trace->analyzer.fwd, *rev = &trace->analyzer.rev;
+  char key[64], bins[256];
+  PktStream* st;
+  PktTraceSlot* s;
+  int i, rc;
+  int done = PKTTRACE_SLOT_DONE;
+  uint64_t one = 1;
+
+  memset(&stats, 0, sizeof(stats));
+  if (trace->slot >= 0) {
+    s = &service->slots[trace->slot];
+    if (stop_pkttrace_slot(trace->slot) != 0)
+      log_println(0, "The shared packet-pair capture did not finish the "
+                  "test in time");
+    trace->analyzer = s->analyzer;
+    __atomic_compare_exchange_n(&s->state, &done, PKTTRACE_SLOT_FREE, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
   } else {
-    for (i = 0; i < 5; i++) {
-      rc = write(monitor_pipe[1], dir, strlen(dir));
-      if (rc == strlen(dir))
-        break;
-      if ((rc == -1) && (errno == EINTR))
-        continue;
+    if (write(trace->stopfd, &one, sizeof(one)) != sizeof(one))
+      log_println(0, "Unable to stop the packet-pair capture: %s",
+                  strerror(errno));
+    pthread_join(trace->thread, NULL);
+    getsockopt(trace->ring.fd, SOL_PACKET, PACKET_STATISTICS, &stats,
+               &statslen);
+    if (trace->analyzer.dump != NULL) {
+      if ((rc = ndttrace_close(trace->analyzer.dump,
+                               &trace->analyzer.dumpStats)) != 0)
+        log_println(0, "Unable to write trace file '%s': %s",
+                    trace->tracefile, strerror(rc));
+      trace->analyzer.dump = NULL;
     }
   }
 
-  /* kill process off via cleanup() if parent doesn't send a signal. */
-  alarm(50 + expectedTestTime);
-
-  if (pcap_loop(pd, cnt, printer, pcap_userdata) < 0) {
-    log_println(5, "pcap_loop exited %s", pcap_geterr(pd));
+  log_println(4, "Packet-pair capture analyzed %d packets, %u dropped",
+              trace->analyzer.packets, stats.tp_drops);
+  if (trace->tracefile[0] != '\0') {
+    log_println(4, "Trace file '%s' got %d packets, %d dropped",
+                trace->tracefile, trace->analyzer.dumpStats.packets,
+                trace->analyzer.dumpStats.dropped);
+    snprintf(key, sizeof(key), "%s.ndttrace.packets", trace->direction);
+    addAdditionalMetaIntEntry(key, trace->analyzer.dumpStats.packets);
+    snprintf(key, sizeof(key), "%s.ndttrace.dropped", trace->direction);
+    addAdditionalMetaIntEntry(key, trace->analyzer.dumpStats.dropped);
   }
 
-  /* Send back results to our parent */
-  send_bins();
-
-  pcap_close(pd);
-
-  log_println(
-      5,
-      "Pkt-Pair data collection ended, waiting for signal to terminate "
-      "process");
-  /*    Temporarily remove these free statements, The memory should be free'd when
-   *      the child process terminates, so we don't have a leak.  There might be a bug in
-   *      the pcap lib (on-line reference found from 2003) and on 10/14/09 I was seeing
-   *      child crashes with a traceback pointing to the freecode() routine inside the pcap-lib
-   *      as the culprit.  RAC 10/15/09
-   *
-   * if (alldevs != NULL)
-   *    pcap_freealldevs(alldevs);
-   *  if (&fcode != NULL)
-   *    pcap_freecode(&fcode);
-   */
-  free(sockAddr);
+  // The bins of every stream go to the meta file, next to its byte counts
+  for (i = 0; i < PKTTRACE_STREAM_BUCKETS; i++) {
+    st = &trace->analyzer.streams[i];
+    if (st->key == 0)
+      continue;
+    format_bins(&st->fwd, bins, sizeof(bins));
+    snprintf(key, sizeof(key), "%s.stream.%d.fwdbins", trace->direction,
+             st->index);
+    addAdditionalMetaEntry(key, bins);
+    log_println(3, "%s stream %d forward pkt-pair data '%s'",
+                trace->direction, st->index, bins);
+    format_bins(&st->rev, bins, sizeof(bins));
+    snprintf(key, sizeof(key), "%s.stream.%d.revbins", trace->direction,
+             st->index);
+    addAdditionalMetaEntry(key, bins);
+    log_println(3, "%s stream %d reverse pkt-pair data '%s'",
+                trace->direction, st->index, bins);
+  }
+  merge_pkttrace_streams(&trace->analyzer);
 
-  log_println(
-      8,
-      "Finally Finished reading data from network, process %d should "
-      "terminate now", getpid());
+  if (get_debuglvl() > 3) {
+    if (fwd->family == 4) {
+      fprintf(stderr, "fwd.saddr = %x:%d, rev.saddr = %x:%d\n",
+              fwd->saddr[0], fwd->sport, rev->saddr[0], rev->sport);
+    } else if (fwd->family == 6) {
+      char str[136];
+      memset(str, 0, 136);
+      inet_ntop(AF_INET6, (void *) fwd->saddr, str, sizeof(str));
+      fprintf(stderr, "fwd.saddr = %s:%d", str, fwd->sport);
+      memset(str, 0, 136);
+      inet_ntop(AF_INET6, (void *) rev->saddr, str, sizeof(str));
+      fprintf(stderr, ", rev.saddr = %s:%d\n", str, rev->sport);
+    } else {
+      fprintf(stderr, "stop_pkttrace: Unknown IP family (%d)\n",
+              fwd->family);
+    }
+  }
+  print_bins(fwd, fwdbins, len);
+  print_bins(rev, revbins, len);
+  close_pkttrace(trace);
 }
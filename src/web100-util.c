@@ -18,6 +18,7 @@
 #include "web100srv.h"
 #include "jsonutils.h"
 #include "testoptions.h"
+#include "ndtsnap.h"
 
 struct tcp_name {
   char* web100_name;
@@ -96,6 +97,18 @@ static struct tcp_name tcp_names[] = {
   {"ThruBytesAcked", "ThruOctetsAcked"}, /* ThruBytesAcked */
 };
 
+/* The agent the cached variable lookups belong to, NULL if not resolved yet */
+static tcp_stat_agent* resolved_agent = NULL;
+#if USE_WEB10G
+static int tcp_stat_var_indices[TCP_STAT_NUM_VAR_IDS];
+#elif USE_WEB100
+/* Number of variables read from the web100 variables file */
+static int web_vars_count = 0;
+static web100_var* tcp_stat_var_handles[TCP_STAT_NUM_VAR_IDS];
+/* Handles of the variables from the web100 variables file, see web_vars */
+static web100_var* web_var_handles[WEB100_VARS];
+#endif
+
 /**
  * set up the necessary structures for monitoring connections at the
  * beginning
@@ -133,17 +146,209 @@ int tcp_stat_init(char *VarFileName) {
   }
   fclose(fp);
   log_println(1, "web100_init() read %d variables from file", count_vars);
+  web_vars_count = count_vars;
+  // the variable list changed, look the handles up again
+  resolved_agent = NULL;
 
   return (count_vars);
 #elif USE_WEB10G
-  #ifdef ESTATS_MIB_VAR_H
-    return TOTAL_NUM_VARS;
-  #else
-    return TOTAL_INDEX_MAX;
-  #endif
+  return WEB10G_NUM_VARS;
+#endif
+}
+
+/* Names of the variables in enum tcp_stat_var_id, in the same order */
+static struct tcp_name tcp_stat_var_names[TCP_STAT_NUM_VAR_IDS] = {
+/* {"WEB100", "WEB10G" } / tcp_stat_var_id / */
+  {"CurCwnd", "CurCwnd"}, /* TCP_STAT_CUR_CWND */
+  {"CurMSS", "CurMSS"}, /* TCP_STAT_CUR_MSS */
+  {"CountRTT", "CountRTT"}, /* TCP_STAT_COUNT_RTT */
+  {"SumRTT", "SumRTT"}, /* TCP_STAT_SUM_RTT */
+  {"SndNxt", "SndNxt"}, /* TCP_STAT_SND_NXT */
+  {"SndUna", "SndUna"}, /* TCP_STAT_SND_UNA */
+  {"LimCwnd", "LimCwnd"}, /* TCP_STAT_LIM_CWND */
+  {"LimRwin", "LimRwin"}, /* TCP_STAT_LIM_RWIN */
+  {"X_SBufMode", NULL}, /* TCP_STAT_X_SBUF_MODE - autotuning is not in web10g */
+  {"X_RBufMode", NULL}, /* TCP_STAT_X_RBUF_MODE - autotuning is not in web10g */
+};
+
+/**
+ * Look up the variables of enum tcp_stat_var_id (and, for web100, the
+ * variables of the web100 variables file) once, so that later reads and
+ * writes are done by handle or index instead of by name. The result is
+ * cached until a different agent is passed in, and is inherited by the
+ * child processes forked after the agent was attached.
+ *
+ * @param agent pointer to the tcp_stat_agent the handles belong to
+ * @return the number of the enum tcp_stat_var_id variables found
+ */
+int tcp_stat_resolve_vars(tcp_stat_agent* agent) {
+  int i, found = 0;
+#if USE_WEB100
+  web100_group* group;
+#elif USE_WEB10G
+  int j;
+#endif
+
+  if (agent == NULL)
+    return 0;
+
+  for (i = 0; i < TCP_STAT_NUM_VAR_IDS; i++) {
+#if USE_WEB100
+    if (web100_agent_find_var_and_group(agent, tcp_stat_var_names[i].web100_name,
+                                        &group, &tcp_stat_var_handles[i])
+        != WEB100_ERR_SUCCESS) {
+      tcp_stat_var_handles[i] = NULL;
+      log_println(1, "Variable %s not found in KIS",
+                  tcp_stat_var_names[i].web100_name);
+      continue;
+    }
+    found++;
+#elif USE_WEB10G
+    tcp_stat_var_indices[i] = -1;
+    if (tcp_stat_var_names[i].web10g_name == NULL)
+      continue;
+    for (j = 0; j < WEB10G_NUM_VARS; j++) {
+      if (strcmp(estats_var_array[j].name,
+                 tcp_stat_var_names[i].web10g_name) == 0) {
+        tcp_stat_var_indices[i] = j;
+        found++;
+        break;
+      }
+    }
+    if (tcp_stat_var_indices[i] == -1)
+      log_println(1, "WARNING: Web10G failed to find name=%s",
+                  tcp_stat_var_names[i].web10g_name);
+#endif
+  }
+
+#if USE_WEB100
+  for (i = 0; i < web_vars_count && i < WEB100_VARS; i++) {
+    if (web100_agent_find_var_and_group(agent, web_vars[0][i].name, &group,
+                                        &web_var_handles[i])
+        != WEB100_ERR_SUCCESS)
+      web_var_handles[i] = NULL;
+  }
+#endif
+
+  resolved_agent = agent;
+  log_println(5, "Resolved %d of %d cached %s variables", found,
+              TCP_STAT_NUM_VAR_IDS, TCP_STAT_NAME);
+  return found;
+}
+
+/**
+ * Read a variable from a snapshot taken earlier, by its cached handle.
+ * @param agent pointer to a tcp_stat_agent
+ * @param snap pointer to the snapshot
+ * @param id the variable to read
+ * @param value the value is stored here on success
+ * @return 0 on success, -1 if the variable is unknown or cannot be read
+ */
+int tcp_stat_snap_read_var(tcp_stat_agent* agent, tcp_stat_snap* snap,
+                           enum tcp_stat_var_id id, int64_t* value) {
+#if USE_WEB100
+  char buf[32];
+#endif
+
+  assert(id >= 0 && id < TCP_STAT_NUM_VAR_IDS);
+  if (snap == NULL)
+    return -1;
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
+
+#if USE_WEB100
+  if (tcp_stat_var_handles[id] == NULL ||
+      web100_snap_read(tcp_stat_var_handles[id], snap, buf)
+      != WEB100_ERR_SUCCESS)
+    return -1;
+  *value = web100_value_to_int64(web100_get_var_type(tcp_stat_var_handles[id]),
+                                 buf);
+  return 0;
+#elif USE_WEB10G
+  return web10g_value_at(snap, tcp_stat_var_indices[id], value);
+#endif
+}
+
+/**
+ * Read the current value of a variable of a connection, by its cached handle.
+ * @param agent pointer to a tcp_stat_agent
+ * @param cn the tcp_stat_connection
+ * @param id the variable to read
+ * @param value the value is stored here on success
+ * @return 0 on success, -1 if the variable is unknown or cannot be read
+ */
+int tcp_stat_read_var(tcp_stat_agent* agent, tcp_stat_connection cn,
+                      enum tcp_stat_var_id id, int64_t* value) {
+#if USE_WEB100
+  char buf[32];
+#elif USE_WEB10G
+  estats_val_data* data = NULL;
+  estats_error* err;
+  int ret;
+#endif
+
+  assert(id >= 0 && id < TCP_STAT_NUM_VAR_IDS);
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
+
+#if USE_WEB100
+  if (cn == NULL || tcp_stat_var_handles[id] == NULL ||
+      web100_raw_read(tcp_stat_var_handles[id], cn, buf) != WEB100_ERR_SUCCESS)
+    return -1;
+  *value = web100_value_to_int64(web100_get_var_type(tcp_stat_var_handles[id]),
+                                 buf);
+  return 0;
+#elif USE_WEB10G
+  if (cn == -1 || tcp_stat_var_indices[id] == -1)
+    return -1;
+  if ((err = estats_val_data_new(&data)) != NULL) {
+    estats_error_print(stderr, err);
+    estats_error_free(&err);
+    return -1;
+  }
+  if ((err = estats_read_vars(data, cn, agent)) != NULL) {
+    estats_error_print(stderr, err);
+    estats_error_free(&err);
+    estats_val_data_free(&data);
+    return -1;
+  }
+  ret = web10g_value_at(data, tcp_stat_var_indices[id], value);
+  estats_val_data_free(&data);
+  return ret;
+#endif
+}
+
+/**
+ * Write a variable of a connection, by its cached handle.
+ * @param agent pointer to a tcp_stat_agent
+ * @param cn the tcp_stat_connection
+ * @param id the variable to write
+ * @param value the new value
+ * @return 0 on success, -1 if the variable is unknown or cannot be written
+ */
+int tcp_stat_write_var(tcp_stat_agent* agent, tcp_stat_connection cn,
+                       enum tcp_stat_var_id id, u_int32_t value) {
+  assert(id >= 0 && id < TCP_STAT_NUM_VAR_IDS);
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
+
+#if USE_WEB100
+  if (cn == NULL || tcp_stat_var_handles[id] == NULL ||
+      web100_raw_write(tcp_stat_var_handles[id], cn, &value)
+      != WEB100_ERR_SUCCESS)
+    return -1;
+  return 0;
+#elif USE_WEB10G
+  /* estats looks the variable up by name itself */
+  if (cn == -1 || tcp_stat_var_names[id].web10g_name == NULL ||
+      estats_write_var(tcp_stat_var_names[id].web10g_name, value, cn, agent)
+      != NULL)
+    return -1;
+  return 0;
 #endif
 }
 
+
 /**
  * Performs part of the middlebox test.
  * The server sets the maximum value of the
@@ -169,7 +374,6 @@ void tcp_stat_middlebox(int sock, tcp_stat_agent* agent, tcp_stat_connection cn,
   web100_var* var;
   web100_group* group;
   web100_snapshot* snap;
-  web100_var* LimCwnd;
 #elif USE_WEB10G
   struct estats_val value;
   estats_val_data* data = NULL;
@@ -179,6 +383,7 @@ void tcp_stat_middlebox(int sock, tcp_stat_agent* agent, tcp_stat_connection cn,
   char* sndbuff;
   int i, j, k, currentMSSval = 0;
   int SndMax = 0, SndUna = 0;
+  int64_t mss, nxt, una;
   fd_set wfd;
   struct timeval sel_tv;
   int ret;
@@ -248,31 +453,13 @@ void tcp_stat_middlebox(int sock, tcp_stat_agent* agent, tcp_stat_connection cn,
   strlcat(results_keys, ";", results_keys_strlen);
   strlcat(results_values, line, results_strlen);
 
-  // get current MSS value
-#if USE_WEB100
-    // read web100_group and web100_var of CurMSS into group and var
-    web100_agent_find_var_and_group(agent, "CurMSS", &group, &var);
-    // read variable value from web100 connection
-    web100_raw_read(var, cn, buff);
-
-    // get current MSS in textual format and append to results
-
-    // get current MSS value and append to "results"
-      currentMSSval = atoi(
-          web100_value_to_text(web100_get_var_type(var), buff));
-    snprintf(line, sizeof(line), "%s;",
-          web100_value_to_text(web100_get_var_type(var), buff));
-#elif USE_WEB10G
-    int type;
-    type = web10g_get_val(agent, cn, "CurMSS", &value);
-    if (type == -1) {
-      log_println(0, "Middlebox: Failed to read the value of CurMSS");
-      return;
-    } else {
-        currentMSSval = value.uv32;
-      snprintf(line, sizeof(line), "%u;", value.uv32);
-    }
-#endif
+  // get current MSS value and append to "results"
+  if (tcp_stat_read_var(agent, cn, TCP_STAT_CUR_MSS, &mss) == -1) {
+    log_println(0, "Middlebox: Failed to read the value of CurMSS");
+    return;
+  }
+  currentMSSval = (int) mss;
+  snprintf(line, sizeof(line), "%d;", currentMSSval);
 
   strlcat(results_keys, "CurMSS;", results_keys_strlen);
   strlcat(results_values, line, results_strlen);
@@ -290,15 +477,8 @@ void tcp_stat_middlebox(int sock, tcp_stat_agent* agent, tcp_stat_connection cn,
 
   limcwnd_val = 2 * currentMSSval;
 
-#if USE_WEB100
-  // get web100_var and web100_group
-  web100_agent_find_var_and_group(agent, "LimCwnd", &group, &LimCwnd);
-
-  // set TCP CWND web100 variable to twice the current MSS Value
-  web100_raw_write(LimCwnd, cn, &limcwnd_val);
-#elif USE_WEB10G
-  estats_write_var("LimCwnd", (uint32_t)limcwnd_val, cn, agent);
-#endif
+  // set TCP CWND variable to twice the current MSS Value
+  tcp_stat_write_var(agent, cn, TCP_STAT_LIM_CWND, limcwnd_val);
 
   log_println(5, "Setting Cwnd Limit to %d octets", limcwnd_val);
 
@@ -342,22 +522,17 @@ void tcp_stat_middlebox(int sock, tcp_stat_agent* agent, tcp_stat_connection cn,
 
 #if USE_WEB100
     web100_snap(snap);
-
-    // get next sequence # to be sent
-    web100_agent_find_var_and_group(agent, "SndNxt", &group, &var);
-    web100_snap_read(var, snap, line);
-    SndMax = atoi(web100_value_to_text(web100_get_var_type(var), line));
-    // get oldest un-acked sequence number
-    web100_agent_find_var_and_group(agent, "SndUna", &group, &var);
-    web100_snap_read(var, snap, line);
-    SndUna = atoi(web100_value_to_text(web100_get_var_type(var), line));
+    // get next sequence # to be sent and oldest un-acked sequence number
+    if (tcp_stat_snap_read_var(agent, snap, TCP_STAT_SND_NXT, &nxt) == 0 &&
+        tcp_stat_snap_read_var(agent, snap, TCP_STAT_SND_UNA, &una) == 0) {
 #elif USE_WEB10G
     estats_read_vars(data, cn, agent);
-    web10g_find_val(data, "SndNxt", &value);
-    SndMax = value.uv32;
-    web10g_find_val(data, "SndUna", &value);
-    SndUna = value.uv32;
+    if (tcp_stat_snap_read_var(agent, data, TCP_STAT_SND_NXT, &nxt) == 0 &&
+        tcp_stat_snap_read_var(agent, data, TCP_STAT_SND_UNA, &una) == 0) {
 #endif
+      SndMax = (int) nxt;
+      SndUna = (int) una;
+    }
 
     // stop sending data if (buf size * 16) <
     // [ (Next Sequence # To Be Sent) - (Oldest Unacknowledged Sequence #) - 1 ]
@@ -468,8 +643,10 @@ void tcp_stat_get_data_recv(int sock, tcp_stat_agent* agent,
 
 #if USE_WEB100
   int ok = 1;
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
   for (i = 0; i < count_vars; i++) {
-    if ((web100_agent_find_var_and_group(agent, web_vars[0][i].name, &group, &var)) != WEB100_ERR_SUCCESS) {
+    if ((var = web_var_handles[i]) == NULL) {
       log_println(1, "Variable %d (%s) not found in KIS", i, web_vars[0][i].name);
       ok = 0;
       continue;
@@ -539,7 +716,8 @@ static int X_RcvBuf[MAX_STREAMS] = {-1, -1, -1, -1, -1, -1, -1};
 
 /**
  * Print a web10g variable to a line using the new name and then write 
- * this line to the test socket. Used by tcp_stat_get_data().
+ * this line to the batch of messages to the client. Used by
+ * tcp_stat_get_data().
  * i.e. 
  * <org_name>: <value>
  * 
@@ -549,16 +727,15 @@ static int X_RcvBuf[MAX_STREAMS] = {-1, -1, -1, -1, -1, -1, -1};
  * @param snap A web10g snapshot
  * @param line A char* to write the line to
  * @param line_size Size of line in bytes
- * @param ctlsock The socket to write to
- * @param testoptions the options that determine how the data should be sent
+ * @param batch The messages to the client
  *
- * If this fails nothing is sent on the cltsocket and the error will
+ * If this fails nothing is added to the batch and the error will
  * be logged.
  * 
  */
 static void print_10gvar_renamed(const char * old_name,
       const char * new_name, const tcp_stat_snap* snap, char * line,
-      int line_size, int ctlsock, const struct testoptions* const testoptions) {
+      int line_size, MsgBatch* batch) {
   int type;
   struct estats_val val;
   estats_error* err;
@@ -576,7 +753,7 @@ static void print_10gvar_renamed(const char * old_name,
       estats_error_free(&err);
     } else {
       snprintf(line, line_size, "%s: %s\n", new_name, str);
-      send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(batch, TEST_MSG, line, strlen(line));
       free(str);
       str = NULL;
     }
@@ -588,8 +765,9 @@ static void print_10gvar_renamed(const char * old_name,
 
 /**
  * Collect Web100 stats from a snapshot and transmit to a receiver.
- * The transmission is done using a TEST_MSG type message and sent to
- * client reachable via the Connection
+ * The transmission is done using a TEST_MSG type message per variable,
+ * batched into as few writes as possible to the client reachable via the
+ * Connection
  *
  * @param snap pointer to a tcp_stat_snapshot taken earlier
  * @param ctl Connection indicating data recipient
@@ -601,20 +779,24 @@ static void print_10gvar_renamed(const char * old_name,
 int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum, Connection* ctl,
                       tcp_stat_agent* agent, int count_vars, const struct testoptions* const testoptions) {
   char line[256];
+  MsgBatch batch;
 #if USE_WEB100
   int i, t;
   web100_var* var;
-  web100_group* group;
   char buf[32];
 
   assert(snap);
   assert(agent);
 
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
+
+  msg_batch_init(&batch, ctl, testoptions->connection_flags);
   for (t = 0; t < streamsNum; ++t) {
     assert(snap[t]);
 
     for (i = 0; i < count_vars; i++) {
-      if ((web100_agent_find_var_and_group(agent, web_vars[t][i].name, &group, &var)) != WEB100_ERR_SUCCESS) {
+      if ((var = web_var_handles[i]) == NULL) {
         log_println(9, "Variable %d (%s) not found in KIS: ", i, web_vars[t][i].name);
         continue;
       }
@@ -623,6 +805,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
       if (snap[t] == NULL) {
         fprintf(stderr, "Web100_get_data() failed, return to testing routine\n");
         log_println(6, "Web100_get_data() failed, return to testing routine\n");
+        msg_batch_flush(&batch);
         return (-1);
       }
 
@@ -640,11 +823,12 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
       /* Why do we atoi after getting as text anyway ?? */
       if (t == 0) {
         snprintf(line, sizeof(line), "%s: %d\n", web_vars[t][i].name, atoi(web_vars[t][i].value));
-        send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+        msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
         log_print(9, "%s", line);
       }
     }
   }
+  msg_batch_flush(&batch);
   log_println(6, "S2C test - Send web100 data to client pid=%d", getpid());
   return (0);
 #elif USE_WEB10G
@@ -655,6 +839,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
 
   assert(snap);
 
+  msg_batch_init(&batch, ctl, testoptions->connection_flags);
   for (t = 0; t < streamsNum; ++t) {
     xbuf_size = sizeof(X_RcvBuf[t]);
     if (getsockopt(testsock[t].socket, SOL_SOCKET, SO_RCVBUF, (void *)&X_RcvBuf[t], &xbuf_size) != 0) {
@@ -683,7 +868,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
           continue;
         }
         snprintf(line, sizeof(line), "%s: %s\n", estats_var_array[j].name, str);
-        send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+        msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
         log_print(9, "%s", line);
         free(str);
         str = NULL;
@@ -712,7 +897,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
       static const char* frame_web100 = "-~~~Web100_old_var_names~~~-: 1\n";
       int type;
       char *str = NULL;
-      send_json_message_any(ctl, TEST_MSG, (const void *)frame_web100, strlen(frame_web100), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(&batch, TEST_MSG, frame_web100, strlen(frame_web100));
 
     /* ECNEnabled -> ECN */
     type = web10g_find_val(snap[t], "ECN", &val);
@@ -720,7 +905,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
       log_println(0, "In tcp_stat_get_data(), web10g_find_val() failed to find ECN bad type=%d", type);
     } else {
       snprintf(line, sizeof(line), "ECNEnabled: %"PRId32"\n", (val.sv32 == 1) ? 1 : 0);
-      send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
     }
 
     /* NagleEnabled -> Nagle */
@@ -729,7 +914,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
       log_println(0, "In tcp_stat_get_data(), web10g_find_val() failed to find Nagle bad type=%d", type);
     } else {
       snprintf(line, sizeof(line), "NagleEnabled: %"PRId32"\n", (val.sv32 == 2) ? 1 : 0);
-      send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
     }
 
     /* SACKEnabled -> WillUseSACK & WillSendSACK */
@@ -739,7 +924,7 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
     } else {
     /* Yes this comes through as 3 from web100 */
       snprintf(line, sizeof(line), "SACKEnabled: %d\n", (val.sv32 == 1) ? 3 : 0);
-      send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
     }
 
     /* TimestampsEnabled -> TimeStamps */
@@ -748,32 +933,32 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
       log_println(0, "In tcp_stat_get_data(), web10g_find_val() failed to find TimeStamps bad type=%d", type);
     } else {
       snprintf(line, sizeof(line), "TimestampsEnabled: %"PRId32"\n", (val.sv32 == 1) ? 1 : 0);
-      send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
     }
 
     /* PktsRetrans -> SegsRetrans */
-    print_10gvar_renamed("SegsRetrans", "PktsRetrans", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("SegsRetrans", "PktsRetrans", snap[t], line, sizeof(line), &batch);
 
     /* DataPktsOut -> DataSegsOut */
-    print_10gvar_renamed("DataSegsOut", "DataPktsOut", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("DataSegsOut", "DataPktsOut", snap[t], line, sizeof(line), &batch);
 
     /* MaxCwnd -> MAX(MaxSsCwnd, MaxCaCwnd) */
-    print_10gvar_renamed("MaxCwnd", "MaxCwnd", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("MaxCwnd", "MaxCwnd", snap[t], line, sizeof(line), &batch);
 
     /* SndLimTimeSender -> SndLimTimeSnd */
-    print_10gvar_renamed("SndLimTimeSnd", "SndLimTimeSender", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("SndLimTimeSnd", "SndLimTimeSender", snap[t], line, sizeof(line), &batch);
 
     /* DataBytesOut -> DataOctetsOut */
-    print_10gvar_renamed("HCDataOctetsOut", "DataBytesOut", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("HCDataOctetsOut", "DataBytesOut", snap[t], line, sizeof(line), &batch);
 
     /* SndLimTransSender -> SndLimTransSnd */
-    print_10gvar_renamed("SndLimTransSnd", "SndLimTransSender", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("SndLimTransSnd", "SndLimTransSender", snap[t], line, sizeof(line), &batch);
 
     /* PktsOut -> SegsOut */
-    print_10gvar_renamed("SegsOut", "PktsOut", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("SegsOut", "PktsOut", snap[t], line, sizeof(line), &batch);
 
     /* CongestionSignals -> CongSignals */
-    print_10gvar_renamed("CongSignals", "CongestionSignals", snap[t], line, sizeof(line), ctlsock, testoptions);
+    print_10gvar_renamed("CongSignals", "CongestionSignals", snap[t], line, sizeof(line), &batch);
 
     /* RcvWinScale -> Same as WinScaleSent if WinScaleSent != -1 */
     type = web10g_find_val(snap[t], "WinScaleSent", &val);
@@ -784,16 +969,17 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
         snprintf(line, sizeof(line), "RcvWinScale: %u\n", 0);
       else
         snprintf(line, sizeof(line), "RcvWinScale: %d\n", val.sv32);
-      send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+      msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
     }
 
     /* X_Rcvbuf & X_Sndbuf */
     snprintf(line, sizeof(line), "X_Rcvbuf: %d\n", X_RcvBuf[t]);
-    send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+    msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
     snprintf(line, sizeof(line), "X_Sndbuf: %d\n", X_SndBuf[t]);
-    send_json_message_any(ctl, TEST_MSG, line, strlen(line), testoptions->connection_flags, JSON_SINGLE_VALUE);
+    msg_batch_add_json(&batch, TEST_MSG, line, strlen(line));
 
-    send_json_message_any(ctl, TEST_MSG, frame_web100, strlen(frame_web100), testoptions->connection_flags, JSON_SINGLE_VALUE);
+    msg_batch_add_json(&batch, TEST_MSG, frame_web100, strlen(frame_web100));
+    msg_batch_flush(&batch);
 
     log_println(6, "S2C test - Send web100 data to client pid=%d", getpid());
     }
@@ -822,30 +1008,20 @@ int tcp_stat_get_data(tcp_stat_snap** snap, Connection* testsock, int streamsNum
  *
  */
 int web100_rtt(int sock, web100_agent* agent, web100_connection* cn) {
-  web100_var* var;
-  char buf[32];
-  web100_group* group;
-  double count, sum;
+  int64_t count, sum;
 
   if (cn == NULL)
     return (-10);
 
-  if ((web100_agent_find_var_and_group(agent, "CountRTT", &group, &var))
-      != WEB100_ERR_SUCCESS)
-    return (-24);
-  if ((web100_raw_read(var, cn, buf)) != WEB100_ERR_SUCCESS) {
-    return (-25);
-  }
-  count = atoi(web100_value_to_text(web100_get_var_type(var), buf));
-
-  if ((web100_agent_find_var_and_group(agent, "SumRTT", &group, &var))
-      != WEB100_ERR_SUCCESS)
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
+  if (tcp_stat_var_handles[TCP_STAT_COUNT_RTT] == NULL ||
+      tcp_stat_var_handles[TCP_STAT_SUM_RTT] == NULL)
     return (-24);
-  if ((web100_raw_read(var, cn, buf)) != WEB100_ERR_SUCCESS) {
+  if (tcp_stat_read_var(agent, cn, TCP_STAT_COUNT_RTT, &count) != 0 ||
+      tcp_stat_read_var(agent, cn, TCP_STAT_SUM_RTT, &sum) != 0)
     return (-25);
-  }
-  sum = atoi(web100_value_to_text(web100_get_var_type(var), buf));
-  return (sum / count);
+  return ((double) sum / count);
 }
 #endif
 
@@ -868,23 +1044,21 @@ int web100_rtt(int sock, web100_agent* agent, web100_connection* cn) {
 
 int tcp_stat_autotune(int sock, tcp_stat_agent* agent, tcp_stat_connection cn) {
 #if USE_WEB100
-  web100_var* var;
-  char buf[32];
-  web100_group* group;
-  int i, j = 0;
+  int64_t i;
+  int j = 0;
 
   if (cn == NULL)
     return (10);
 
-  if ((web100_agent_find_var_and_group(agent, "X_SBufMode", &group, &var))
-      != WEB100_ERR_SUCCESS)
+  if (agent != resolved_agent)
+    tcp_stat_resolve_vars(agent);
+  if (tcp_stat_var_handles[TCP_STAT_X_SBUF_MODE] == NULL)
     return (22);
-  if ((web100_raw_read(var, cn, buf)) != WEB100_ERR_SUCCESS) {
+  if (tcp_stat_read_var(agent, cn, TCP_STAT_X_SBUF_MODE, &i) != 0) {
     log_println(4, "Web100_raw_read(X_SBufMode) failed with errorno=%d",
                 errno);
     return (23);
   }
-  i = atoi(web100_value_to_text(web100_get_var_type(var), buf));
 
   /* OK, the variable i now holds the value of the sbufmode autotune parm.  If it
    * is 0, autotuning is turned off, so we turn it on for this socket.
@@ -895,15 +1069,13 @@ int tcp_stat_autotune(int sock, tcp_stat_agent* agent, tcp_stat_connection cn) {
   /* OK, the variable i now holds the value of the rbufmode autotune parm.  If it
    * is 0, autotuning is turned off, so we turn it on for this socket.
    */
-  if ((web100_agent_find_var_and_group(agent, "X_RBufMode", &group, &var))
-      != WEB100_ERR_SUCCESS)
+  if (tcp_stat_var_handles[TCP_STAT_X_RBUF_MODE] == NULL)
     return (22);
-  if ((web100_raw_read(var, cn, buf)) != WEB100_ERR_SUCCESS) {
+  if (tcp_stat_read_var(agent, cn, TCP_STAT_X_RBUF_MODE, &i) != 0) {
     log_println(4, "Web100_raw_read(X_RBufMode) failed with errorno=%d",
                 errno);
     return (23);
   }
-  i = atoi(web100_value_to_text(web100_get_var_type(var), buf));
 
   if (i == 0)
     j |= 0x02;
@@ -1197,6 +1369,53 @@ void tcp_stat_log_agg_vars_to_file(char* webVarsValuesLog, int connNum, struct t
   fclose(file);
 }
 
+/**
+ * CwndDecrease() for a snaplog in the binary columnar format, which only
+ * has to decode the CurCwnd column.
+ *
+ * @param logname pointer to name of logfile
+ * @param *dec_cnt pointer to integer indicating number of times decreased
+ * @param *same_cnt pointer to integer indicating number of times kept same
+ * @param *inc_cnt pointer to integer indicating number of times incremented
+ * @return Integer, 0 on success, -1 on failure
+ */
+static int CwndDecreaseBinary(char* logname, u_int32_t *dec_cnt,
+                              u_int32_t *same_cnt, u_int32_t *inc_cnt) {
+  NdtSnapReader* reader;
+  const int64_t* cwnd;
+  int64_t s1, s2;
+  int i;
+
+  if ((reader = ndtsnap_open_read(logname)) == NULL)
+    return (0);
+  if ((cwnd = ndtsnap_column(
+      reader, ndtsnap_find_column(reader, "CurCwnd"))) == NULL) {
+    ndtsnap_close_read(reader);
+    return (-1);
+  }
+
+  // Count like the native snaplogs do: the first snapshot is skipped and
+  // the second one compared to 0
+  s2 = 0;
+  for (i = 1; i < ndtsnap_rows(reader); i++) {
+    s1 = s2;
+    s2 = cwnd[i];
+    if (s2 < s1)
+      (*dec_cnt)++;
+    if (s2 == s1)
+      (*same_cnt)++;
+    if (s2 > s1)
+      (*inc_cnt)++;
+  }
+  ndtsnap_close_read(reader);
+  log_println(
+      2,
+      "-=-=-=- CWND window report: increases = %d, decreases = %d, "
+      "no change = %d",
+      *inc_cnt, *dec_cnt, *same_cnt);
+  return (0);
+}
+
 /**
  * Routine to read snaplog file and determine the number of times the
  * congestion window is reduced.
@@ -1228,6 +1447,9 @@ int CwndDecrease(char* logname, u_int32_t *dec_cnt,
   estats_record* log;
 #endif
 
+  if (ndtsnap_probe(logname) == 1)
+    return CwndDecreaseBinary(logname, dec_cnt, same_cnt, inc_cnt);
+
 #if USE_WEB100
   // open snaplog file to read values
   if ((log = web100_log_open_read(logname)) == NULL)
@@ -73,6 +73,10 @@ as Operator of Argonne National Laboratory (http://miranda.ctd.anl.gov:7123/).
 #define SYSLOG_NAMES
 #include <pthread.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/times.h>
 
 #include "web100srv.h"
@@ -92,6 +96,7 @@ as Operator of Argonne National Laboratory (http://miranda.ctd.anl.gov:7123/).
 #include "tests_srv.h"
 #include "jsonutils.h"
 #include "websocket.h"
+#include "tlssession.h"
 
 static char lgfn[FILENAME_SIZE];  // log file name
 static char wvfn[FILENAME_SIZE];  // file name of web100-variables list
@@ -108,6 +113,8 @@ static char dbPWDbuf[256];        // DB Password
 static int window = 64000;  // TCP buffer size
 static int count_vars = 0;
 int dumptrace = 0;
+// bytes kept of each packet by the packet-pair capture, 0 to keep the headers
+int trace_snaplen = 0;
 static int usesyslog = 0;
 static int multiple = 0;
 static int compress = 1;
@@ -163,6 +170,46 @@ static int global_signalfd_write;
 // Whether extended c2s and s2c tests should be allowed.
 static int global_extended_tests_allowed = 1;
 
+// Upper bound on the size of the pre-forked worker pool
+#define MAX_PREFORK_WORKERS 256
+
+// The number of idle pre-forked workers to keep around (0 disables the pool).
+static int prefork_workers = 0;
+
+// The pool of idle pre-forked workers waiting to be handed a connection.
+static ndtworker worker_pool[MAX_PREFORK_WORKERS];
+static int worker_pool_size = 0;
+
+// The server sockets of the main loop.
+static int global_listenfd = -1;
+static int global_tls_listenfd = -1;
+
+// The number of processes accepting clients, each with its own SO_REUSEPORT
+// listener and its own slice of the queue (1 keeps a single server process).
+static int acceptor_shards = 1;
+
+// The number of sessions of the TLS session cache shared by all the processes
+// (0 to only resume sessions with tickets).
+static int tls_session_cache = 0;
+
+// The number of threads of the packet-pair capture shared by the tests of a
+// multi-client server (0 lets every test capture on its own).
+static int capture_threads = 1;
+
+// The index of this acceptor shard, and the state shared by all of the shards
+// (NULL unless the server is sharded).
+static int shard_id = 0;
+static ndtshards *shard_state = NULL;
+
+// Written to whenever a shard gives back a test slot, to wake up every shard
+static int global_slot_eventfd = -1;
+
+// How often (in seconds) clients waiting in the queue get a heartbeat
+#define HEARTBEAT_INTERVAL 3
+
+// The most events handled by a single call to epoll_wait()
+#define MAX_EPOLL_EVENTS 64
+
 // When we support multiple clients, grow the queue by a constant factor
 #define QUEUE_SIZE_MULTIPLIER 4
 
@@ -188,6 +235,7 @@ static struct option long_options[] = {{"adminview", 0, 0, 'a'},
 #ifdef EXPERIMENTAL_ENABLED
                                        {"avoidsndblockup", 0, 0, 306},
                                        {"snaplog", 0, 0, 307},
+                                       {"binarysnaplog", 0, 0, 333},
                                        {"snapdelay", 1, 0, 305},
                                        {"cwnddecrease", 0, 0, 308},
                                        {"cputime", 0, 0, 309},
@@ -223,6 +271,10 @@ static struct option long_options[] = {{"adminview", 0, 0, 'a'},
                                        {"s2csnapsdelay", 1, 0, 320},
                                        {"s2csnapsoffset", 1, 0, 321},
                                        {"s2cstreamsnum", 1, 0, 323},
+                                       {"s2czerocopy", 0, 0, 331},
+                                       {"c2szerocopy", 0, 0, 334},
+                                       {"s2cwritesize", 1, 0, 332},
+                                       {"s2cframesize", 1, 0, 337},
                                        {"savewebvalues", 0, 0, 324},
 #ifdef AF_INET6
                                        {"ipv4", 0, 0, '4'},
@@ -230,8 +282,13 @@ static struct option long_options[] = {{"adminview", 0, 0, 'a'},
 #endif
                                        {"tls_port", 1, 0, 325},
                                        {"private_key", 1, 0, 326},
+                                       {"tls_session_cache", 1, 0, 338},
                                        {"certificate", 1, 0, 327},
                                        {"disable_extended_tests", 0, 0, 328},
+                                       {"prefork_workers", 1, 0, 329},
+                                       {"acceptor_shards", 1, 0, 330},
+                                       {"capturethreads", 1, 0, 335},
+                                       {"tracesnaplen", 1, 0, 336},
                                        {0, 0, 0, 0}};
 
 /** Writes a number (up to 16 digits) to a file pointer. Safe to be called
@@ -321,18 +378,6 @@ void cleanup(int signo) {
         sigsafe_debug_log(0, signo, "SERVER caught SIGSEGV signal.");
       }
       break;
-    case SIGUSR1:
-      /* SIGUSR1 is used exclusively by C2S, to interrupt the pcap capture*/
-      sigsafe_debug_log(6, signo, "caught SIGUSR1, setting sig1 flag and calling force_breakloop");
-      force_breakloop();
-      break;
-
-    case SIGUSR2:
-      /* SIGUSR2 is used exclusively by S2C, to interrupt the pcap capture*/
-      sigsafe_debug_log(6, signo, "caught SIGUSR2, setting sig2 flag and calling force_breakloop");
-      force_breakloop();
-      break;
-
     case SIGALRM:
       // Receipt of SIGALRM means that the watchdog timer has gone off. We
       // assume that this process is stuck in a hung state, and should
@@ -402,15 +447,17 @@ void cleanup(int signo) {
       break;
     case SIGCHLD:
       // When a child exits, send a message to global_signalfd_write that will
-      // cause the server's select() to wake up.  Only send this message in the
-      // server process.
+      // cause the server's epoll_wait() to wake up.  The server process then
+      // wait()s on every exited child itself, so that it knows which clients
+      // left the queue.
       if (ndtpid == getpid()) {
         msg = '0';  // garbage value, never examined at the other end.
         write(global_signalfd_write, &msg, sizeof(ServerWakeupMessage));
         sigsafe_debug_log(5, signo, "Signal 17 (SIGCHLD) received - completed tests");
+      } else {
+        // To prevent zombies, make sure every child process is wait()ed upon.
+        waitpid(-1, &status, WNOHANG);
       }
-      // To prevent zombies, make sure every child process is wait()ed upon.
-      waitpid(-1, &status, WNOHANG);
       break;
   }
 }
@@ -531,6 +578,10 @@ static void LoadConfig(char *name, char **lbuf, size_t *lbuf_max) {
     } else if (strncasecmp(key, "snaplog", 5) == 0) {
       options.snaplog = 1;
       continue;
+    } else if (strncasecmp(key, "binarysnaplog", 13) == 0) {
+      options.binarySnaplog = 1;
+      options.snaplog = 1;
+      continue;
     } else if (strncasecmp(key, "disablesnaps", 5) == 0) {
       options.snapshots = 0;
       continue;
@@ -567,6 +618,28 @@ static void LoadConfig(char *name, char **lbuf, size_t *lbuf_max) {
     } else if (strncasecmp(key, "s2cthroughputsnaps", 16) == 0) {
       options.s2c_throughputsnaps = 1;
       continue;
+    } else if (strncasecmp(key, "s2cwritesize", 12) == 0) {
+      if (check_rint(val, &options.s2c_writesize, 0, S2C_MAX_WRITE_SIZE)) {
+        char tmpText[200];
+        snprintf(tmpText, sizeof(tmpText), "Invalid S2C write size: %s", val);
+        short_usage(name, tmpText);
+      }
+      continue;
+    } else if (strncasecmp(key, "s2cframesize", 12) == 0) {
+      if (check_rint(val, &options.s2c_framesize, 0, S2C_MAX_WRITE_SIZE) ||
+          (options.s2c_framesize > 0 &&
+           s2c_frame_header_length(options.s2c_framesize) < 0)) {
+        char tmpText[200];
+        snprintf(tmpText, sizeof(tmpText), "Invalid S2C frame size: %s", val);
+        short_usage(name, tmpText);
+      }
+      continue;
+    } else if (strncasecmp(key, "s2czerocopy", 11) == 0) {
+      options.s2c_zerocopy = 1;
+      continue;
+    } else if (strncasecmp(key, "c2szerocopy", 11) == 0) {
+      options.c2s_zerocopy = 1;
+      continue;
     } else if (strncasecmp(key, "s2csnapsdelay", 11) == 0) {
       options.s2c_snapsdelay = atoi(val);
       continue;
@@ -602,6 +675,39 @@ static void LoadConfig(char *name, char **lbuf, size_t *lbuf_max) {
         short_usage(name, tmpText);
       }
       continue;
+    } else if (strncasecmp(key, "prefork_workers", 15) == 0) {
+      if (check_rint(val, &prefork_workers, 0, MAX_PREFORK_WORKERS)) {
+        char tmpText[200];
+        snprintf(tmpText, sizeof(tmpText),
+                 "Invalid number of pre-forked workers: %s", val);
+        short_usage(name, tmpText);
+      }
+      continue;
+    } else if (strncasecmp(key, "acceptor_shards", 15) == 0) {
+      if (check_rint(val, &acceptor_shards, 1, MAX_ACCEPTOR_SHARDS)) {
+        char tmpText[200];
+        snprintf(tmpText, sizeof(tmpText),
+                 "Invalid number of acceptor shards: %s", val);
+        short_usage(name, tmpText);
+      }
+      continue;
+    } else if (strncasecmp(key, "capturethreads", 14) == 0) {
+      if (check_rint(val, &capture_threads, 0, MAX_CAPTURE_THREADS)) {
+        char tmpText[200];
+        snprintf(tmpText, sizeof(tmpText),
+                 "Invalid number of capture threads: %s", val);
+        short_usage(name, tmpText);
+      }
+      continue;
+    } else if (strncasecmp(key, "tracesnaplen", 12) == 0) {
+      if (check_rint(val, &trace_snaplen, 0, MAX_TRACE_SNAPLEN) ||
+          (trace_snaplen > 0 && trace_snaplen < MIN_TRACE_SNAPLEN)) {
+        char tmpText[200];
+        snprintf(tmpText, sizeof(tmpText), "Invalid trace snap length: %s",
+                 val);
+        short_usage(name, tmpText);
+      }
+      continue;
     } else if (strncasecmp(key, "s2cport", 7) == 0) {
       if (check_int(val, &testopt.s2csockport)) {
         char tmpText[200];
@@ -678,6 +784,7 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
   // int n;  // temporary iterator variable --// commented out -> calc_linkspeed
   struct tcp_vars vars[MAX_STREAMS];
   struct throughputSnapshot *s2c_ThroughputSnapshots = NULL, *c2s_ThroughputSnapshots = NULL;
+  StreamSeries c2s_series, s2c_series;  // bytes per stream per interval
 
   int link = CANNOT_DETERMINE_LINK;  // local temporary variable indicative of
   // link speed. Transmitted but unused at client end , which has a similar
@@ -743,6 +850,8 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
     for (ret = 0; ret < 256; ret++)
       spds[spd_index][ret] = 0x00;
   spd_index = 0;
+  memset(&c2s_series, 0, sizeof(c2s_series));
+  memset(&s2c_series, 0, sizeof(s2c_series));
 
   // obtain web100 connection and check auto-tune status
   conn = tcp_stat_connection_from_socket(agent, ctl->socket);
@@ -805,7 +914,7 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
   if ((ret = test_c2s(ctl, agent, testopt, conn_options, &c2sspd, set_buff,
                       window, autotune, device, &options, record_reverse,
                       count_vars, spds, &spd_index, ssl_context,
-                      &c2s_ThroughputSnapshots, 0)) != 0) {
+                      &c2s_ThroughputSnapshots, &c2s_series, 0)) != 0) {
     if (ret < 0)
       log_println(6, "C2S test failed with rc=%d", ret);
     log_println(0, "C2S throughput test FAILED!, rc=%d", ret);
@@ -818,7 +927,8 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
   if ((ret = test_c2s(ctl, agent, testopt, conn_options, &c2sspd,
                       set_buff, window, autotune, device, &options,
                       record_reverse, count_vars, spds, &spd_index,
-                      ssl_context, &c2s_ThroughputSnapshots, 1)) != 0) {
+                      ssl_context, &c2s_ThroughputSnapshots, &c2s_series,
+                      1)) != 0) {
     if (ret < 0)
       log_println(6, "Extended C2S test failed with rc=%d", ret);
     log_println(0, "Extended C2S throughput test FAILED!, rc=%d", ret);
@@ -830,7 +940,8 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
   alarm(MAX_TEST_TIME);  // Kick the watchdog to prevent calls to cleanup.
   if ((ret = test_s2c(ctl, agent, testopt, conn_options, &s2cspd,
                       set_buff, window, autotune, device, &options, spds,
-                      &spd_index, count_vars, &peaks, ssl_context, &s2c_ThroughputSnapshots, 0)) != 0) {
+                      &spd_index, count_vars, &peaks, ssl_context, &s2c_ThroughputSnapshots,
+                      &s2c_series, 0)) != 0) {
     if (ret < 0)
       log_println(6, "S2C test failed with rc=%d", ret);
     log_println(0, "S2C throughput test FAILED!, rc=%d", ret);
@@ -843,7 +954,7 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
   if ((ret = test_s2c(ctl, agent, testopt, conn_options, &s2cspd,
                       set_buff, window, autotune, device, &options, spds,
                       &spd_index, count_vars, &peaks, ssl_context,
-                      &s2c_ThroughputSnapshots, 1)) != 0) {
+                      &s2c_ThroughputSnapshots, &s2c_series, 1)) != 0) {
     if (ret < 0)
       log_println(6, "Extended S2C test failed with rc=%d", ret);
     log_println(0, "Extended S2C throughput test FAILED!, rc=%d", ret);
@@ -1072,6 +1183,21 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
   send_json_message_any(ctl, MSG_RESULTS, buff, strlen(buff),
                         testopt->connection_flags, JSON_SINGLE_VALUE);
 
+  // Bytes of each stream in each interval of the throughput tests, which
+  // also go to the meta file
+  if (c2s_series.streamsNum > 0) {
+    stream_series_report(&c2s_series, "c2s", buff, sizeof(buff));
+    send_json_message_any(ctl, MSG_RESULTS, buff, strlen(buff),
+                          testopt->connection_flags, JSON_SINGLE_VALUE);
+  }
+  if (s2c_series.streamsNum > 0) {
+    stream_series_report(&s2c_series, "s2c", buff, sizeof(buff));
+    send_json_message_any(ctl, MSG_RESULTS, buff, strlen(buff),
+                          testopt->connection_flags, JSON_SINGLE_VALUE);
+  }
+  stream_series_free(&c2s_series);
+  stream_series_free(&s2c_series);
+
   // Signal end of test results to client
   send_json_message_any(ctl, MSG_LOGOUT, "", 0, testopt->connection_flags,
                         JSON_SINGLE_VALUE);
@@ -1133,7 +1259,7 @@ int run_test(tcp_stat_agent *agent, Connection *ctl, TestOptions *testopt,
            peaks.amount);
 
   strlcat(meta.summary, tmpstr, sizeof(meta.summary));
-  writeMeta(options.compress, cputime, options.snapshots, options.snaplog, dumptrace, s2c_ThroughputSnapshots, c2s_ThroughputSnapshots);
+  writeMeta(options.compress, cputime, options.snapshots, options.snaplog, s2c_ThroughputSnapshots, c2s_ThroughputSnapshots);
 
   // Write into log files, DB
   fp = fopen(get_logfile(), "a");
@@ -1344,6 +1470,9 @@ void check_heartbeat(Connection *conn, TestOptions *testopt) {
  */
 void process_parent_message(int parent_message, Connection *ctl,
                             TestOptions *testopt, int t_opts) {
+  // The most recent wait time (in minutes) announced by the parent.
+  static int queue_wait_minutes = 1;
+
   if (parent_message < 0) {
     if (parent_message == -EINTR) {
       // EINTR means that a signal handler fired or some other interruption
@@ -1377,6 +1506,10 @@ void process_parent_message(int parent_message, Connection *ctl,
       exit(0);
       break;
     case SRV_QUEUE_HEARTBEAT:
+      // The parent only sends a new wait time when the child's place in the
+      // queue changes, so the heartbeat re-arms the watchdog for the most
+      // recently announced wait.
+      alarm((queue_wait_minutes + 1) * 60);
       break;
     case SRV_QUEUE_SERVER_BUSY_60s:
       // The SRV_QUEUE_SERVER_BUSY_60s message is not emitted by any
@@ -1390,11 +1523,35 @@ void process_parent_message(int parent_message, Connection *ctl,
       // of minutes to wait until the test starts.  Set the watchdog alarm
       // for that many minutes, plus a little bit extra to avoid race
       // conditions and prevent spurious calls to cleanup().
+      queue_wait_minutes = parent_message;
       alarm((parent_message + 1) * 60);
       break;
   }
 }
 
+/**
+ * Attach to the local tcp_stat (web100 or web10g) agent. Calls exit() on
+ * failure, as no test can be run without it.
+ * @return The newly attached agent
+ */
+static tcp_stat_agent *attach_tcp_stat_agent_or_die() {
+  tcp_stat_agent *agent;
+#if USE_WEB100
+  if ((agent = web100_attach(WEB100_AGENT_TYPE_LOCAL, NULL)) == NULL) {
+    web100_perror("web100_attach");
+    exit(1);
+  }
+#elif USE_WEB10G
+  if (estats_nl_client_init(&agent) != NULL) {
+    log_println(0, "Error: estats_client_init failed. Unable to use web10g.");
+    exit(1);
+  }
+#endif
+  // Look the hot variables up once instead of by name on every read
+  tcp_stat_resolve_vars(agent);
+  return agent;
+}
+
 /**
  * The code run by the child process. This function never returns, it only
  * calls exit().  It also has an alarm() timer which functions as a watchdog,
@@ -1406,8 +1563,14 @@ void process_parent_message(int parent_message, Connection *ctl,
  * client).  Only the child process can communicate to the client (OpenSSL
  * connections can only be used by one process), so the child should pass along
  * any queueing messages received from the parent.
+ * @param parent_pipe The pipe on which the parent sends queue messages
+ * @param ssl_context The ssl_context for the connection - may be NULL
+ * @param ctlsockfd The accepted control connection
+ * @param agent An already attached tcp_stat agent, or NULL to attach one once
+ *              the client has logged in
  */
-void child_process(int parent_pipe, SSL_CTX *ssl_context, int ctlsockfd) {
+void child_process(int parent_pipe, SSL_CTX *ssl_context, int ctlsockfd,
+                   tcp_stat_agent *agent) {
   FILE *fp;
   time_t tt;
   char isoTime[64], dir[256];
@@ -1416,7 +1579,6 @@ void child_process(int parent_pipe, SSL_CTX *ssl_context, int ctlsockfd) {
   char test_suite[256];
   // Initial length (in seconds) of the child's watchdog timer.
   int alarm_time = 120;
-  tcp_stat_agent *agent;
   Connection ctl = {-1, NULL};
   ctl.socket = ctlsockfd;
 
@@ -1437,17 +1599,7 @@ void child_process(int parent_pipe, SSL_CTX *ssl_context, int ctlsockfd) {
     exit(-1);
   }
 
-#if USE_WEB100
-  if ((agent = web100_attach(WEB100_AGENT_TYPE_LOCAL, NULL)) == NULL) {
-    web100_perror("web100_attach");
-    exit(1);
-  }
-#elif USE_WEB10G
-  if (estats_nl_client_init(&agent) != NULL) {
-    log_println(0, "Error: estats_client_init failed. Unable to use web10g.");
-    exit(1);
-  }
-#endif
+  if (agent == NULL) agent = attach_tcp_stat_agent_or_die();
   // Wait in the queue until the child process is told to start
   while ((parent_message = read_from_parent(parent_pipe)) !=
          SRV_QUEUE_TEST_STARTS_NOW) {
@@ -1563,70 +1715,144 @@ void child_process(int parent_pipe, SSL_CTX *ssl_context, int ctlsockfd) {
 static int max(int a, int b) { return (a > b) ? a : b; }
 
 /**
- * Waits for a new client to connect, for one of the child processes to die, or
- * (optionally) until a timeout occurs.
- * @param fds A pointer to the set of file descriptors for the client sockets.
- *            This argument is modified in place, and so should be reset for
- *            every call to this function.
- * @param fd_max The value of the largest descriptor in the set
- * @param signalfd The pipe which will be written to upon receipt of SIGCHILD
- * @param wait_forever True if the server should wait forever
+ * Registers a file descriptor with the server's epoll instance.  The
+ * descriptor is edge-triggered, so every event must be handled until the
+ * descriptor returns EAGAIN.
+ * @param epollfd The epoll instance
+ * @param fd The file descriptor to watch for readability
+ * @return 0 on success, -1 on failure
  */
-void wait_for_wakeup(fd_set *fds, int fd_max, int signalfd, int wait_forever) {
-  int retcode;
-  ServerWakeupMessage signal_value;
-  struct timeval sel_tv, *psel_tv = NULL;
-
-  FD_SET(signalfd, fds);
-  if (!wait_forever) {
-    sel_tv.tv_sec = 3;  // Timeout after 3 seconds
-    sel_tv.tv_usec = 0;
-    psel_tv = &sel_tv;
-  }
-  retcode = select(max(fd_max, signalfd) + 1, fds, NULL, NULL, psel_tv);
-  if (retcode == -1) {
-    if (errno != EINTR) {
-      // EINTR is expected every now and then due to signal handling.
-      log_println(0, "Error in server's select call: %d (%s)", errno,
-                  strerror(errno));
-    }
-    FD_ZERO(fds);
-    return;
+static int add_to_epoll(int epollfd, int fd) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = fd;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    log_println(0, "epoll_ctl() failed for fd %d: %s (%d)", fd,
+                strerror(errno), errno);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Empties the pipe which the SIGCHLD handler writes to in order to wake up the
+ * server.  The pipe must be non-blocking.
+ * @param signalfd The readable end of the pipe
+ */
+static void drain_wakeup_pipe(int signalfd) {
+  ServerWakeupMessage signal_values[64];
+  while (read(signalfd, signal_values, sizeof(signal_values)) > 0) {
+  }
+}
+
+/**
+ * Set up a freshly accepted control connection inside the process that will
+ * serve it: set the socket timeouts and copy the client's address details into
+ * the global variables used by run_test(). Calls exit() on failure.
+ * @param ctlsockfd The accepted control connection
+ */
+static void record_new_connection(int ctlsockfd) {
+  I2Addr cli_I2Addr;
+  size_t rmt_host_strlen;
+  struct sockaddr_storage cli_addr;
+  socklen_t cli_addr_len = sizeof(cli_addr);
+
+  if (getpeername(ctlsockfd, (struct sockaddr *)&cli_addr, &cli_addr_len) !=
+      0) {
+    log_println(1, "getpeername() on ctlsockfd failed: %s (%d)",
+                strerror(errno), errno);
+    log_println(0, "Child terminating.");
+    exit(-1);
   }
-  // If we woke up due to data on the signalfd, then clear the buffer.
-  if (FD_ISSET(signalfd, fds)) {
-    read(signalfd, &signal_value, sizeof(ServerWakeupMessage));
+  if (cli_addr_len > sizeof(meta.c_addr)) {
+    log_println(0, "cli_addr_len > sizeof(meta.c_addr). Should never happen");
+    log_println(0, "Child terminating.");
+    exit(-1);
   }
+  set_socket_timeout_or_die(ctlsockfd);
+  // Copy connection data into global variables for the run_test() function.
+  // Get meta test details copied into results.
+  memcpy(&meta.c_addr, &cli_addr, cli_addr_len);
+  meta.family = ((struct sockaddr *)&cli_addr)->sa_family;
+
+  memset(rmt_addr, 0, sizeof(rmt_addr));
+  addr2a(&cli_addr, rmt_addr, sizeof(rmt_addr));
+
+  // Get addr details based on socket info available.
+  cli_I2Addr = I2AddrBySockFD(get_errhandle(), ctlsockfd, False);
+  rmt_host_strlen = sizeof(rmt_host);
+  memset(rmt_host, 0, rmt_host_strlen);
+  I2AddrNodeName(cli_I2Addr, rmt_host, &rmt_host_strlen);
+  log_println(4, "New connection received from 0x%x [%s] sockfd=%d.",
+              cli_I2Addr, rmt_host, ctlsockfd);
+  I2AddrFree(cli_I2Addr);
+  protolog_procstatus(getpid(), getCurrentTest(), CONNECT_TYPE, PROCESS_STARTED,
+                      ctlsockfd);
+}
+
+/**
+ * Allocates and initializes the parent's record of a new child process. If the
+ * allocation fails, the child is killed and its pipe is closed.
+ * @param child_pid The process id of the child
+ * @param child_pipe The writeable end of the pipe to the child
+ * @return A newly initialized ndtchild struct - the calling function
+ *         owns the struct and its memory; NULL on error
+ */
+static ndtchild *new_ndtchild(pid_t child_pid, int child_pipe) {
+  ndtchild *new_child;
+  new_child = (ndtchild *)calloc(1, sizeof(ndtchild));
+  if (new_child == NULL) {
+    log_println(1, "calloc() failed errno=%d", errno);
+    close(child_pipe);
+    kill(child_pid, SIGKILL);
+    return NULL;
+  }
+  new_child->pid = child_pid;
+  new_child->pipe = child_pipe;
+  new_child->qtime = time(0);
+  new_child->running = 0;
+  new_child->position = -1;
+  new_child->next = NULL;
+  return new_child;
+}
+
+/**
+ * Makes a child of an acceptor shard die with the shard.  The supervisor gives
+ * back the test slots of a shard that died, so its tests must not keep running
+ * past the server-wide limit.  Does nothing if the server isn't sharded.
+ * @param shard The pid of the shard, taken before the fork
+ */
+static void die_with_shard(pid_t shard) {
+  if (shard_state == NULL) return;
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  // The shard may have died before the signal was asked for.
+  if (getppid() != shard) exit(0);
 }
 
 /**
- * There is a new client waiting to start on the listenfd socket. Accept the
- * connection, and fork off a new process to run all the associated tests.
+ * A new client has connected on the listenfd socket and the parent has
+ * accepted the connection. Fork off a new process to run all the associated
+ * tests.
  * @param listenfd The file descriptor which listens to the network
+ * @param ctlsockfd The accepted connection.  It is always closed in the parent.
  * @param ssl_context The ssl_context for any new connections
  * @return A newly initialized ndtchild struct - the calling function
  *         owns the struct and its memory; NULL on error
  */
-ndtchild *spawn_new_child(int listenfd, SSL_CTX *ssl_context) {
+ndtchild *spawn_new_child(int listenfd, int ctlsockfd, SSL_CTX *ssl_context) {
   int child_pipe[2];
   pid_t child_pid;
-  int ctlsockfd;
-  I2Addr cli_I2Addr;
-  socklen_t cli_addr_len;
-  struct sockaddr_storage cli_addr;
-  size_t rmt_host_strlen;
-  ndtchild *new_child = NULL;
-  int accept_errno;
   int pipe_success;
-  // Fire up the new child, accept the connection, initialize variables.
+  int i;
+  pid_t parent_pid = getpid();
+  // Fire up the new child, initialize variables.
   // Set up communication channel to the new child
   do {
     pipe_success = pipe(child_pipe);
   } while (pipe_success == -1 && errno == EINTR);
   if (pipe_success == -1) {
     log_println(0, "CHILD COULD NOT SPAWN: pipe() failed errno=%d", errno);
-    // Accept the incoming connection to prevent listenfd from queueing
-    ctlsockfd = accept(listenfd, (struct sockaddr *)&cli_addr, &cli_addr_len);
     close(ctlsockfd);
     return NULL;
   }
@@ -1636,8 +1862,6 @@ ndtchild *spawn_new_child(int listenfd, SSL_CTX *ssl_context) {
     // An error occurred, log it and return.
     log_println(0, "CHILD COULD NOT SPAWN: fork() failed, errno = %d (%s)",
                 errno, strerror(errno));
-    // Accept the incoming connection to prevent listenfd from queueing
-    ctlsockfd = accept(listenfd, (struct sockaddr *)&cli_addr, &cli_addr_len);
     close(ctlsockfd);
     close(child_pipe[0]);
     close(child_pipe[1]);
@@ -1652,45 +1876,8 @@ ndtchild *spawn_new_child(int listenfd, SSL_CTX *ssl_context) {
     // no client can livelock or deadlock for too long without causing a call
     // to cleanup().
     alarm(300);
-    cli_addr_len = sizeof(cli_addr);
-  
-    do {
-      accept_errno = 0;
-      ctlsockfd = accept(listenfd, (struct sockaddr *)&cli_addr, &cli_addr_len);
-      if (ctlsockfd < 0) {
-        accept_errno = errno;
-        log_println(1, "accept() on ctlsockfd failed");
-        log_println(1, "Error was: %s (%d)", strerror(accept_errno), accept_errno);
-        if (accept_errno != EINTR) {
-          log_println(1, "accept() failed unrecoverably. Child terminating.");
-          exit(-1);
-        }
-      }
-    } while (accept_errno == EINTR);
-    if (cli_addr_len > sizeof(meta.c_addr)) {
-      log_println(0, "cli_addr_len > sizeof(meta.c_addr). Should never happen");
-      log_println(0, "Child terminating.");
-      exit(-1);
-    }
-    set_socket_timeout_or_die(ctlsockfd);
-    // Copy connection data into global variables for the run_test() function.
-    // Get meta test details copied into results.
-    memcpy(&meta.c_addr, &cli_addr, cli_addr_len);
-    meta.family = ((struct sockaddr *)&cli_addr)->sa_family;
-  
-    memset(rmt_addr, 0, sizeof(rmt_addr));
-    addr2a(&cli_addr, rmt_addr, sizeof(rmt_addr));
-
-    // Get addr details based on socket info available.
-    cli_I2Addr = I2AddrBySockFD(get_errhandle(), ctlsockfd, False);
-    rmt_host_strlen = sizeof(rmt_host);
-    memset(rmt_host, 0, rmt_host_strlen);
-    I2AddrNodeName(cli_I2Addr, rmt_host, &rmt_host_strlen);
-    log_println(4, "New connection received from 0x%x [%s] sockfd=%d.",
-                cli_I2Addr, rmt_host, ctlsockfd);
-    I2AddrFree(cli_I2Addr);
-    protolog_procstatus(getpid(), getCurrentTest(), CONNECT_TYPE, PROCESS_STARTED,
-                        ctlsockfd);
+    die_with_shard(parent_pid);
+    record_new_connection(ctlsockfd);
 
     // At this point we have received a connection from a client, meaning that
     // a test is being requested.  At this point we should apply any policy or
@@ -1703,9 +1890,17 @@ ndtchild *spawn_new_child(int listenfd, SSL_CTX *ssl_context) {
 
     log_println(4, "Child thinks pipe() returned fd0=%d, fd1=%d for pid=%d",
                 child_pipe[0], child_pipe[1], child_pid);
+    // Close both server sockets, and the parent's end of the socket of every
+    // idle worker, which must see EOF as soon as the parent goes away.
     close(listenfd);
+    if (global_listenfd != -1 && global_listenfd != listenfd)
+      close(global_listenfd);
+    if (global_tls_listenfd != -1 && global_tls_listenfd != listenfd)
+      close(global_tls_listenfd);
+    for (i = 0; i < worker_pool_size; i++) close(worker_pool[i].sock);
+    worker_pool_size = 0;
     close(child_pipe[1]);
-    child_process(child_pipe[0], ssl_context, ctlsockfd);
+    child_process(child_pipe[0], ssl_context, ctlsockfd, NULL);
     log_println(1, "The child returned! This should never happen.");
     exit(1);
   }
@@ -1717,23 +1912,56 @@ ndtchild *spawn_new_child(int listenfd, SSL_CTX *ssl_context) {
               child_pipe[1]);
 
   // Close the open resources that should only be used by the child.
+  close(ctlsockfd);
   close(child_pipe[0]);
 
-  // Initialize the members of new_child
-  new_child = (ndtchild *)calloc(1, sizeof(ndtchild));
-  if (new_child == NULL) {
-    log_println(1, "calloc() failed errno=%d", errno);
-    close(child_pipe[1]);
-    kill(child_pid, SIGKILL);
-    return NULL;
+  return new_ndtchild(child_pid, child_pipe[1]);
+}
+
+/**
+ * Returns the number of tests that may be run at the same time.
+ */
+int max_simultaneous_tests() {
+  if (!queue || !multiple) {
+    return 1;
+  } else {
+    return max_clients;
   }
-  new_child->pid = child_pid;
-  new_child->pipe = child_pipe[1];
-  new_child->qtime = time(0);
-  new_child->running = 0;
-  new_child->next = NULL;
+}
 
-  return new_child;
+/**
+ * Claims a slot for one more running test.  A single server just compares its
+ * own count of running children with the limit, but sharded servers count the
+ * running tests in shared memory so that the limit holds across every shard.
+ * @param child_queue The client queue of this process
+ * @return 1 if another test may start now, 0 if the server is full
+ */
+int acquire_test_slot(ndtqueue *child_queue) {
+  int running;
+  if (shard_state == NULL) {
+    return child_queue->running < max_simultaneous_tests();
+  }
+  for (;;) {
+    running = shard_state->running;
+    if (running >= max_simultaneous_tests()) return 0;
+    if (__sync_bool_compare_and_swap(&shard_state->running, running,
+                                     running + 1)) {
+      __sync_fetch_and_add(&shard_state->shard_running[shard_id], 1);
+      return 1;
+    }
+  }
+}
+
+/**
+ * Gives back the slot of a test that has finished.  Sharded servers also wake
+ * up every other shard, because one of them may have a client waiting for it.
+ */
+void release_test_slot() {
+  uint64_t one = 1;
+  if (shard_state == NULL) return;
+  __sync_fetch_and_sub(&shard_state->shard_running[shard_id], 1);
+  __sync_fetch_and_sub(&shard_state->running, 1);
+  write(global_slot_eventfd, &one, sizeof(one));
 }
 
 /**
@@ -1741,51 +1969,66 @@ ndtchild *spawn_new_child(int listenfd, SSL_CTX *ssl_context) {
  * overload the server.
  */
 int server_queue_is_full(int queue_size) {
+  int limit;
   if (queue) {
     if (multiple) {
-      return queue_size >= QUEUE_SIZE_MULTIPLIER * max_clients;
+      limit = QUEUE_SIZE_MULTIPLIER * max_clients;
     } else {
-      return queue_size >= max_clients;
+      limit = max_clients;
     }
   } else {
-    return queue_size >= 1;
+    limit = 1;
   }
+  // Each acceptor shard only holds its own slice of the queue.
+  limit = (limit + acceptor_shards - 1) / acceptor_shards;
+  return queue_size >= limit;
 }
 
 /**
- * Removes the element after okay_child from the list.  The calling function
+ * Removes the element after okay_child from the queue.  The calling function
  * owns the memory containing the removed element.
- * @param head The head of the list - may not be NULL or point to NULL
+ * @param child_queue The queue - may not be empty
  * @param okay_child The element before the element to remove - may be NULL if
  *                   the head of the list is the element to be removed.
  */
-void remove_next_child(ndtchild **head, ndtchild *okay_child) {
+void remove_next_child(ndtqueue *child_queue, ndtchild *okay_child) {
+  ndtchild *removed;
   if (okay_child == NULL) {
     // We are removing the head
-    *head = (*head)->next;
+    removed = child_queue->head;
+    child_queue->head = removed->next;
   } else {
     // We are removing a non-head element
-    okay_child->next = okay_child->next->next;
+    removed = okay_child->next;
+    okay_child->next = removed->next;
+  }
+  if (child_queue->tail == removed) child_queue->tail = okay_child;
+  child_queue->size--;
+  if (removed->running) {
+    child_queue->running--;
+    release_test_slot();
   }
+  // Everyone behind the removed child moved up in the queue.
+  child_queue->changed = 1;
 }
 
 /**
- * Enqueues a new child onto the list.
- * @param head The head of the list
+ * Enqueues a new child onto the end of the queue.
+ * @param child_queue The queue
  * @param new_child The child to enqueue
  */
-void enqueue_child(ndtchild **head, ndtchild *new_child) {
-  ndtchild *current;
-  if (*head == NULL) {
+void enqueue_child(ndtqueue *child_queue, ndtchild *new_child) {
+  new_child->next = NULL;
+  if (child_queue->tail == NULL) {
     // Enqueue onto the empty list
-    *head = new_child;
+    child_queue->head = new_child;
   } else {
     // Enqueue onto the end of a non-empty list
-    current = *head;
-    while (current->next != NULL) current = current->next;
-    current->next = new_child;
+    child_queue->tail->next = new_child;
   }
-  new_child->next = NULL;
+  child_queue->tail = new_child;
+  child_queue->size++;
+  child_queue->changed = 1;
 }
 
 /**
@@ -1801,22 +2044,14 @@ void send_message_to_child(int child_pipe, ParentChildSignal message) {
  * Attempts to enqueue a new ndtchild struct onto the queue of clients to be
  * run. This will not enqueue the child unless the server has spare capacity.
  * This function takes ownership of the memory pointed to by new_child, and
- * either frees that memory or passes ownership to the linked list that starts
- * at *head.
+ * either frees that memory or passes ownership to the queue.
  * @param new_child The new client
- * @param head The head of the client queue
+ * @param child_queue The client queue
  */
-void attempt_enqueue(ndtchild *new_child, ndtchild **head) {
-  ndtchild *current;
-  int client_count = 0;
-  // Count the number of connected clients
-  for (current = *head; current != NULL; current = current->next) {
-    client_count++;
-  }
-
-  if (!server_queue_is_full(client_count)) {
+void attempt_enqueue(ndtchild *new_child, ndtqueue *child_queue) {
+  if (!server_queue_is_full(child_queue->size)) {
     // The server is not overloaded, so queue up the new client.
-    enqueue_child(head, new_child);
+    enqueue_child(child_queue, new_child);
   } else {
     // The server is overloaded. Reject the client and discard it.
     log_println(0,
@@ -1848,57 +2083,71 @@ int is_child_process_alive(pid_t child_pid) {
 }
 
 /**
- * Walk the list of connected clients, reaping those clients with dead PIDs.
- * @param head The head of the list of clients
+ * Removes the child with the given pid from the queue and frees it.
+ * @param child_queue The client queue
+ * @param child_pid The pid of the child that exited
+ * @return 1 if the child was found in the queue, 0 otherwise
  */
-void reap_dead_clients(ndtchild **head) {
-  ndtchild *current, *previous, *client_to_free;
-  current = *head;
-  previous = NULL;
-  while (current != NULL) {
-    if (is_child_process_alive(current->pid)) {
-      previous = current;
-      current = current->next;
-    } else {
-      // Free the dead client and set *current to the next unexamined element
-      // in the list.
-      client_to_free = current;
-      current = current->next;
-      remove_next_child(head, previous);
-      free_ndtchild(&client_to_free);
+static int remove_exited_child(ndtqueue *child_queue, pid_t child_pid) {
+  ndtchild *current, *previous = NULL;
+  for (current = child_queue->head; current != NULL;
+       previous = current, current = current->next) {
+    if (current->pid == child_pid) {
+      remove_next_child(child_queue, previous);
+      free_ndtchild(&current);
+      return 1;
     }
   }
+  return 0;
 }
 
 /**
- * Returns the number of tests that may be run at the same time.
+ * Removes an idle worker that exited from the pool of pre-forked workers.
+ * @param worker_pid The pid of the worker that exited
  */
-int max_simultaneous_tests() {
-  if (!queue || !multiple) {
-    return 1;
-  } else {
-    return max_clients;
+static void remove_exited_worker(pid_t worker_pid) {
+  int i;
+  for (i = 0; i < worker_pool_size; i++) {
+    if (worker_pool[i].pid == worker_pid) {
+      log_println(1, "Idle worker %d died, replacing it", worker_pid);
+      close(worker_pool[i].sock);
+      worker_pool[i] = worker_pool[--worker_pool_size];
+      return;
+    }
+  }
+}
+
+/**
+ * Waits on every child process that has exited and removes it from the client
+ * queue (or the worker pool).  This is called after SIGCHLD wakes up the
+ * server, so the queue never has to be polled for dead children.
+ * @param child_queue The client queue
+ */
+void reap_exited_children(ndtqueue *child_queue) {
+  pid_t child_pid;
+  int status;
+  while ((child_pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    log_println(6, "Child %d exited", child_pid);
+    if (!remove_exited_child(child_queue, child_pid)) {
+      remove_exited_worker(child_pid);
+    }
   }
 }
 
 /**
- * Reaps dead clients from the queue of clients and then updates all clients
- * regarding their (possibly new) queue position and starts any new clients for
- * whom capacity has opened up on the server.
+ * Sends messages to all clients whose queue position has changed and starts any
+ * new clients for whom capacity has opened up on the server.  Unless a
+ * heartbeat is due, nothing is done when the queue has not changed since the
+ * last call.
+ * @param child_queue The client queue
+ * @param heartbeat_due True if every waiting client should get a heartbeat
  */
-void perform_queue_maintenance(ndtchild **head) {
+void perform_queue_maintenance(ndtqueue *child_queue, int heartbeat_due) {
   int queue_position;
-  int running_count = 0;
   ndtchild *current;
 
-  reap_dead_clients(head);
-
-  // Count the number of clients and the number of running clients.
-  for (current = *head; current != NULL; current = current->next) {
-    if (current->running) {
-      running_count++;
-    }
-  }
+  if (!child_queue->changed && !heartbeat_due) return;
+  child_queue->changed = 0;
 
   // Walk the list of clients, sending the GO signal to clients that have
   // reached the front part of the queue.
@@ -1909,12 +2158,12 @@ void perform_queue_maintenance(ndtchild **head) {
   // the child watchdog and provide another layer of defense against buggy test
   // code.
   queue_position = 0;
-  for (current = *head; current != NULL; current = current->next) {
+  for (current = child_queue->head; current != NULL; current = current->next) {
     if (!current->running) {
-      if (running_count < max_simultaneous_tests()) {
+      if (acquire_test_slot(child_queue)) {
         send_message_to_child(current->pipe, SRV_QUEUE_TEST_STARTS_NOW);
         current->running = 1;
-        running_count++;
+        child_queue->running++;
       } else {
         // Assuming we can service max_simultaneous_tests per minute, then the
         // amount of time (in minutes) that the child should expect to wait is
@@ -1922,19 +2171,275 @@ void perform_queue_maintenance(ndtchild **head) {
         // tests we can service per minute. If the children are receiving too
         // many updates, don't change the update frequency here. Instead,
         // change how the children respond to updates in child_process().
-        send_message_to_child(
-            current->pipe, max(queue_position / max_simultaneous_tests(), 1));
-        send_message_to_child(current->pipe, SRV_QUEUE_HEARTBEAT);
+        // Every acceptor shard gets about its share of the tests.
+        if (current->position != queue_position) {
+          send_message_to_child(
+              current->pipe,
+              max(queue_position * acceptor_shards / max_simultaneous_tests(),
+                  1));
+          current->position = queue_position;
+        }
+        if (heartbeat_due) {
+          send_message_to_child(current->pipe, SRV_QUEUE_HEARTBEAT);
+        }
       }
     }
     queue_position++;
   }
 }
 
+/**
+ * Hands an accepted control connection, along with the end of the queue pipe
+ * that the child reads from, to a pre-forked worker using SCM_RIGHTS.
+ * @param worker_sock The UNIX socket connected to the worker
+ * @param ctlsockfd The accepted control connection
+ * @param parent_pipe The readable end of the pipe to the child
+ * @param use_tls True if the worker should set up TLS on the connection
+ * @return 0 on success, -1 on failure (with errno set)
+ */
+int send_connection_to_worker(int worker_sock, int ctlsockfd, int parent_pipe,
+                              int use_tls) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  int fds[2];
+  ssize_t retcode;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = &use_tls;
+  iov.iov_len = sizeof(use_tls);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  fds[0] = ctlsockfd;
+  fds[1] = parent_pipe;
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  do {
+    retcode = sendmsg(worker_sock, &msg, MSG_NOSIGNAL);
+  } while (retcode == -1 && errno == EINTR);
+  return (retcode == sizeof(use_tls)) ? 0 : -1;
+}
+
+/**
+ * Receives a control connection and a queue pipe from the parent process.
+ * Blocks until the parent sends a connection or closes its end of the socket.
+ * @param parent_sock The UNIX socket connected to the parent
+ * @param ctlsockfd Where to store the accepted control connection
+ * @param parent_pipe Where to store the readable end of the pipe to the parent
+ * @param use_tls Where to store whether TLS should be used
+ * @return 0 on success, -1 on failure or when the parent closed the socket
+ */
+int receive_connection_from_parent(int parent_sock, int *ctlsockfd,
+                                   int *parent_pipe, int *use_tls) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  int fds[2];
+  ssize_t retcode;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = use_tls;
+  iov.iov_len = sizeof(*use_tls);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  do {
+    retcode = recvmsg(parent_sock, &msg, 0);
+  } while (retcode == -1 && errno == EINTR);
+  if (retcode != sizeof(*use_tls) || (msg.msg_flags & MSG_CTRUNC)) return -1;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  *ctlsockfd = fds[0];
+  *parent_pipe = fds[1];
+  return 0;
+}
+
+/**
+ * The code run by a pre-forked worker process.  The worker attaches to the
+ * tcp_stat agent ahead of time and then sleeps until the parent hands it a
+ * connection, at which point it turns into an ordinary child process.  Like
+ * child_process(), this function never returns, it only calls exit().
+ * @param parent_sock The UNIX socket connected to the parent
+ * @param ssl_context The ssl_context for TLS connections - may be NULL
+ */
+static void worker_process(int parent_sock, SSL_CTX *ssl_context) {
+  int ctlsockfd, parent_pipe, use_tls;
+  tcp_stat_agent *agent;
+
+  agent = attach_tcp_stat_agent_or_die();
+  if (receive_connection_from_parent(parent_sock, &ctlsockfd, &parent_pipe,
+                                     &use_tls) != 0) {
+    // The parent went away or gave up on this worker.
+    log_println(5, "Worker %d exiting without a client", getpid());
+    exit(0);
+  }
+  close(parent_sock);
+  // Now that there is a client, start the watchdog timer (see
+  // spawn_new_child).
+  alarm(300);
+  record_new_connection(ctlsockfd);
+  child_process(parent_pipe, use_tls ? ssl_context : NULL, ctlsockfd, agent);
+  log_println(1, "The child returned! This should never happen.");
+  exit(1);
+}
+
+/**
+ * Forks a new worker process and adds it to the pool of idle workers.
+ * @param listenfd The non-TLS server socket, closed in the worker
+ * @param tls_listenfd The TLS server socket (or -1), closed in the worker
+ * @param ssl_context The ssl_context for TLS connections - may be NULL
+ * @return 0 on success, -1 on failure
+ */
+static int spawn_worker(int listenfd, int tls_listenfd, SSL_CTX *ssl_context) {
+  int worker_socks[2];
+  pid_t worker_pid;
+  pid_t parent_pid = getpid();
+  int i;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, worker_socks) == -1) {
+    log_println(0, "WORKER COULD NOT SPAWN: socketpair() failed errno=%d",
+                errno);
+    return -1;
+  }
+  worker_pid = fork();
+  if (worker_pid == -1) {
+    log_println(0, "WORKER COULD NOT SPAWN: fork() failed, errno = %d (%s)",
+                errno, strerror(errno));
+    close(worker_socks[0]);
+    close(worker_socks[1]);
+    return -1;
+  } else if (worker_pid == 0) {
+    // This is the worker.  It only needs its own end of its own socket.
+    die_with_shard(parent_pid);
+    close(listenfd);
+    if (tls_listenfd != -1) close(tls_listenfd);
+    for (i = 0; i < worker_pool_size; i++) close(worker_pool[i].sock);
+    worker_pool_size = 0;
+    close(worker_socks[0]);
+    worker_process(worker_socks[1], ssl_context);
+  }
+  close(worker_socks[1]);
+  worker_pool[worker_pool_size].pid = worker_pid;
+  worker_pool[worker_pool_size].sock = worker_socks[0];
+  worker_pool_size++;
+  log_println(5, "Parent process pre-forked worker = %d", worker_pid);
+  return 0;
+}
+
+/**
+ * Forks new workers until the pool holds prefork_workers idle processes again.
+ * Workers that die while idle are removed by reap_exited_children().
+ * @param listenfd The non-TLS server socket
+ * @param tls_listenfd The TLS server socket, or -1
+ * @param ssl_context The ssl_context for TLS connections - may be NULL
+ */
+void fill_worker_pool(int listenfd, int tls_listenfd, SSL_CTX *ssl_context) {
+  while (worker_pool_size < prefork_workers) {
+    if (spawn_worker(listenfd, tls_listenfd, ssl_context) != 0) break;
+  }
+}
+
+/**
+ * Passes a connection accepted by the parent on to an idle pre-forked worker.
+ * The worker then behaves exactly like a child created by spawn_new_child().
+ * @param ctlsockfd The accepted connection.  It is always closed in the parent.
+ * @param use_tls True if the connection should be set up with TLS
+ * @return A newly initialized ndtchild struct - the calling function
+ *         owns the struct and its memory; NULL on error
+ */
+ndtchild *dispatch_to_worker(int ctlsockfd, int use_tls) {
+  int child_pipe[2];
+  int pipe_success;
+  ndtworker worker;
+
+  do {
+    pipe_success = pipe(child_pipe);
+  } while (pipe_success == -1 && errno == EINTR);
+  if (pipe_success == -1) {
+    log_println(0, "CHILD COULD NOT SPAWN: pipe() failed errno=%d", errno);
+    close(ctlsockfd);
+    return NULL;
+  }
+
+  worker.pid = -1;
+  while (worker_pool_size > 0 && worker.pid == -1) {
+    worker = worker_pool[--worker_pool_size];
+    if (send_connection_to_worker(worker.sock, ctlsockfd, child_pipe[0],
+                                  use_tls) != 0) {
+      log_println(1, "Could not pass the connection to worker %d: %s",
+                  worker.pid, strerror(errno));
+      kill(worker.pid, SIGKILL);
+      worker.pid = -1;
+    }
+    close(worker.sock);
+  }
+  // The worker has its own copies of these now.
+  close(ctlsockfd);
+  close(child_pipe[0]);
+  if (worker.pid == -1) {
+    log_println(0, "CHILD COULD NOT SPAWN: no idle worker available");
+    close(child_pipe[1]);
+    return NULL;
+  }
+  log_println(5, "Parent passed connection to worker = %d", worker.pid);
+  return new_ndtchild(worker.pid, child_pipe[1]);
+}
+
+/**
+ * Accepts every client waiting on the (non-blocking) listenfd socket and
+ * starts a child for each of them, either by forking or by handing the
+ * connection to a pre-forked worker.
+ * @param listenfd The server socket with waiting clients
+ * @param ssl_context The ssl_context for new connections - NULL for non-TLS
+ * @param child_queue The client queue
+ */
+void accept_new_clients(int listenfd, SSL_CTX *ssl_context,
+                        ndtqueue *child_queue) {
+  int ctlsockfd;
+  ndtchild *new_child;
+  for (;;) {
+    ctlsockfd = accept(listenfd, NULL, NULL);
+    if (ctlsockfd == -1) {
+      // The client went away before we got to it; try the next one.
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_println(0, "accept() on listenfd failed: %s (%d)",
+                    strerror(errno), errno);
+      }
+      return;
+    }
+    // The pool is only refilled by the main loop once every waiting client
+    // got its place in the queue; until then, clients beyond the idle workers
+    // get a child forked for them as before.
+    if (worker_pool_size > 0) {
+      new_child = dispatch_to_worker(ctlsockfd, ssl_context != NULL);
+    } else {
+      new_child = spawn_new_child(listenfd, ctlsockfd, ssl_context);
+    }
+    if (new_child != NULL) attempt_enqueue(new_child, child_queue);
+  }
+}
+
 /**
  * The server's main loop.  This is the function that, once all arguments are
  * processed and the server environment has been set up, will keep waiting for
- * new connections and then forking off children to handle those connections.
+ * new connections and then forking off children (or handing the connections to
+ * pre-forked workers) to handle those connections.  The loop sleeps in
+ * epoll_wait() until a client connects, a child exits (SIGCHLD writes to
+ * signalfd), or a heartbeat is due for the clients waiting in the queue.
  * @param ssl_context The context to create new TLS connections - may be NULL
  * @param tls_listenfd The server socket on which to listen for new TLS
  *                     clients. Ignored when ssl_context is NULL.
@@ -1944,34 +2449,268 @@ void perform_queue_maintenance(ndtchild **head) {
  */
 void NDT_server_main_loop(SSL_CTX *ssl_context, int tls_listenfd, int listenfd,
                           int signalfd) {
-  ndtchild *queue_head = NULL, *new_child;
-  fd_set fds;
-  int fd_max;
+  ndtqueue child_queue = {NULL, NULL, 0, 0, 0};
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  int epollfd, nevents, i, timeout;
+  time_t now, last_heartbeat = 0;
+  int due;
 
-  fd_max = listenfd;
-  if (ssl_context != NULL) {
-    fd_max = max(listenfd, tls_listenfd);
+  if (ssl_context == NULL) tls_listenfd = -1;
+  global_listenfd = listenfd;
+  global_tls_listenfd = tls_listenfd;
+
+  // Every descriptor is edge-triggered, so each one must be non-blocking and
+  // be drained until EAGAIN.
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+  if (tls_listenfd != -1) {
+    fcntl(tls_listenfd, F_SETFL, fcntl(tls_listenfd, F_GETFL) | O_NONBLOCK);
+  }
+  fcntl(signalfd, F_SETFL, fcntl(signalfd, F_GETFL) | O_NONBLOCK);
+
+  epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollfd == -1) {
+    err_sys("server: epoll_create1 failed");
+  }
+  if (add_to_epoll(epollfd, listenfd) != 0 ||
+      add_to_epoll(epollfd, signalfd) != 0 ||
+      (tls_listenfd != -1 && add_to_epoll(epollfd, tls_listenfd) != 0) ||
+      (global_slot_eventfd != -1 &&
+       add_to_epoll(epollfd, global_slot_eventfd) != 0)) {
+    err_sys("server: epoll_ctl failed");
+  }
+
+  // Accept any clients that connected before the descriptors were registered.
+  accept_new_clients(listenfd, NULL, &child_queue);
+  if (tls_listenfd != -1) {
+    accept_new_clients(tls_listenfd, ssl_context, &child_queue);
+  }
+  for (;;) {
+    // Keep the pool of idle workers topped up (if there is one).  This runs
+    // after the queue maintenance of the previous round, so that the clients
+    // just accepted never wait for these forks.
+    fill_worker_pool(listenfd, tls_listenfd, ssl_context);
+    // Only wake up for heartbeats while some client is waiting in the queue.
+    timeout = -1;
+    if (child_queue.size > child_queue.running) {
+      now = time(0);
+      timeout = (last_heartbeat + HEARTBEAT_INTERVAL - now) * 1000;
+      if (timeout < 0) timeout = 0;
+    }
+    // Also wake up to rotate the TLS session ticket keys when they are due.
+    if (ssl_context != NULL && (due = tls_session_maintain(time(0))) >= 0) {
+      if (timeout == -1 || due * 1000 < timeout) timeout = due * 1000;
+    }
+    nevents = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, timeout);
+    if (nevents == -1) {
+      if (errno != EINTR) {
+        // EINTR is expected every now and then due to signal handling.
+        log_println(0, "Error in server's epoll_wait call: %d (%s)", errno,
+                    strerror(errno));
+      }
+      nevents = 0;
+    }
+    for (i = 0; i < nevents; i++) {
+      if (events[i].data.fd == signalfd) {
+        drain_wakeup_pipe(signalfd);
+        reap_exited_children(&child_queue);
+      } else if (events[i].data.fd == listenfd) {
+        accept_new_clients(listenfd, NULL, &child_queue);
+      } else if (events[i].data.fd == tls_listenfd) {
+        accept_new_clients(tls_listenfd, ssl_context, &child_queue);
+      } else if (events[i].data.fd == global_slot_eventfd) {
+        // Another shard finished a test, so one of our waiting clients may be
+        // able to start.  The eventfd is shared by all of the shards and is
+        // deliberately never read: draining it could hide the event from a
+        // shard that has not looked at it yet, and every write still wakes up
+        // every edge-triggered waiter.
+        child_queue.changed = 1;
+      }
+    }
+    // Send messages to the clients whose place in the queue changed, and a
+    // heartbeat to every waiting client every HEARTBEAT_INTERVAL seconds.
+    now = time(0);
+    if (child_queue.size > child_queue.running &&
+        now - last_heartbeat >= HEARTBEAT_INTERVAL) {
+      last_heartbeat = now;
+      perform_queue_maintenance(&child_queue, 1);
+    } else {
+      perform_queue_maintenance(&child_queue, 0);
+    }
+  }
+}
+
+/**
+ * Runs one acceptor shard.  The shard listens on SO_REUSEPORT sockets of its
+ * own, so that the kernel spreads new clients across the shards, and then
+ * serves its slice of the clients like a single server would.
+ * @param ssl_context The context to create new TLS connections - may be NULL
+ * @param listenfd A listener to use, or -1 to bind a new one
+ * @param tls_listenfd A TLS listener to use, or -1 to bind a new one
+ * @param tls_port The TLS port to listen on (ignored without ssl_context)
+ * @param socket_window The TCP buffer size of the listeners (0 for default)
+ */
+static void run_acceptor_shard(SSL_CTX *ssl_context, int listenfd,
+                               int tls_listenfd, char *tls_port,
+                               int socket_window) {
+  I2Addr listenaddr, tls_listenaddr;
+  int signalfd_pipe[2];
+
+  // This process is now the server for its slice of the clients.
+  ndtpid = getpid();
+  if (listenfd == -1) {
+    if ((listenaddr = CreateListenSocket(NULL, port,
+                                         conn_options | OPT_REUSEPORT,
+                                         socket_window)) == NULL) {
+      err_sys("server: CreateListenSocket failed");
+    }
+    listenfd = I2AddrFD(listenaddr);
+  }
+  if (ssl_context != NULL && tls_listenfd == -1) {
+    if ((tls_listenaddr = CreateListenSocket(NULL, tls_port,
+                                             conn_options | OPT_REUSEPORT,
+                                             socket_window)) == NULL) {
+      err_sys("server: CreateListenSocket failed");
+    }
+    tls_listenfd = I2AddrFD(tls_listenaddr);
+  }
+  // Each shard needs its own wakeup pipe, or the shards would steal each
+  // other's SIGCHLD notifications.
+  close(global_signalfd_write);
+  if (pipe(signalfd_pipe) != 0) {
+    err_sys("server: pipe failed");
   }
+  global_signalfd_write = signalfd_pipe[1];
+  fcntl(global_signalfd_write, F_SETFL,
+        fcntl(global_signalfd_write, F_GETFL) | O_NONBLOCK);
+  log_println(1, "Acceptor shard %d (pid %d) ready", shard_id, ndtpid);
+  NDT_server_main_loop(ssl_context, tls_listenfd, listenfd, signalfd_pipe[0]);
+  exit(0);
+}
+
+/**
+ * Forks the acceptor shard with the given index.  While the supervisor still
+ * holds its own listeners, shard 0 takes them over so that the ports are never
+ * left unbound; every other shard binds new ones.
+ * @param id The index of the shard
+ * @param ssl_context The context to create new TLS connections - may be NULL
+ * @param tls_port The TLS port to listen on (ignored without ssl_context)
+ * @param socket_window The TCP buffer size of the listeners (0 for default)
+ * @param signalfd The read end of the supervisor's wakeup pipe
+ * @return The pid of the shard, or -1 if fork() failed
+ */
+static pid_t spawn_acceptor_shard(int id, SSL_CTX *ssl_context, char *tls_port,
+                                  int socket_window, int signalfd) {
+  pid_t supervisor = getpid();
+  pid_t pid = fork();
+  int listenfd = -1, tls_listenfd = -1;
+  if (pid == 0) {
+    shard_id = id;
+    // Shards must not outlive their supervisor, or they would keep serving
+    // clients (and holding the ports) after the server was killed.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor) exit(0);
+    close(signalfd);
+    if (id == 0) {
+      listenfd = global_listenfd;
+      tls_listenfd = global_tls_listenfd;
+    } else {
+      if (global_listenfd != -1) close(global_listenfd);
+      if (global_tls_listenfd != -1) close(global_tls_listenfd);
+    }
+    run_acceptor_shard(ssl_context, listenfd, tls_listenfd, tls_port,
+                       socket_window);
+  }
+  return pid;
+}
+
+/**
+ * Splits the server into acceptor_shards acceptor processes, and then
+ * supervises them.  The shards share a count of running tests in anonymous
+ * shared memory, which keeps max_simultaneous_tests() a server-wide limit.
+ * When a shard dies, its tests die with it, their slots are given back and
+ * the shard is started again.  Never returns.
+ * @param ssl_context The context to create new TLS connections - may be NULL
+ * @param listenfd The supervisor's listener, handed over to shard 0
+ * @param tls_listenfd The supervisor's TLS listener (or -1), handed over too
+ * @param tls_port The TLS port to listen on (ignored without ssl_context)
+ * @param socket_window The TCP buffer size of the listeners (0 for default)
+ * @param signalfd The read end of the supervisor's wakeup pipe
+ */
+void run_acceptor_shards(SSL_CTX *ssl_context, int listenfd, int tls_listenfd,
+                         char *tls_port, int socket_window, int signalfd) {
+  pid_t shard_pids[MAX_ACCEPTOR_SHARDS];
+  time_t shard_started[MAX_ACCEPTOR_SHARDS];
+  pid_t pid;
+  int i, status;
+  uint64_t one = 1;
+
+  shard_state = mmap(NULL, sizeof(ndtshards), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shard_state == MAP_FAILED) {
+    err_sys("server: mmap of the shared shard state failed");
+  }
+  memset(shard_state, 0, sizeof(ndtshards));
+  global_slot_eventfd = eventfd(0, EFD_NONBLOCK);
+  if (global_slot_eventfd == -1) {
+    err_sys("server: eventfd failed");
+  }
+  fcntl(signalfd, F_SETFL, fcntl(signalfd, F_GETFL) | O_NONBLOCK);
+  global_listenfd = listenfd;
+  global_tls_listenfd = tls_listenfd;
+  for (i = 0; i < acceptor_shards; i++) {
+    shard_started[i] = time(0);
+    shard_pids[i] = spawn_acceptor_shard(i, ssl_context, tls_port,
+                                         socket_window, signalfd);
+    if (shard_pids[i] == -1) {
+      err_sys("server: fork of an acceptor shard failed");
+    }
+  }
+  // Shard 0 owns these listeners now.
+  close(listenfd);
+  if (tls_listenfd != -1) close(tls_listenfd);
+  global_listenfd = -1;
+  global_tls_listenfd = -1;
+  log_println(1, "Started %d acceptor shards", acceptor_shards);
+
   for (;;) {
-    // Set up the fd_set to contain the right sockets
-    FD_ZERO(&fds);
-    FD_SET(listenfd, &fds);
-    if (ssl_context != NULL) {
-      FD_SET(tls_listenfd, &fds);
+    pid = waitpid(-1, &status, 0);
+    if (pid == -1) {
+      if (errno == EINTR) continue;
+      err_sys("server: waitpid on the acceptor shards failed");
     }
-    // Wait for a new connection, an interruption, or a timeout.
-    wait_for_wakeup(&fds, fd_max, signalfd, (queue_head == NULL));
-    // After wakeup, check where there may be clients waiting
-    if (FD_ISSET(listenfd, &fds)) {
-      new_child = spawn_new_child(listenfd, NULL);
-      if (new_child != NULL) attempt_enqueue(new_child, &queue_head);
+    drain_wakeup_pipe(signalfd);
+    if (pid == pkttrace_service_pid()) {
+      // The capture's shared memory is only seen by the processes forked
+      // after it started, so a new capture would be of no use to the shards.
+      log_println(0, "The shared packet-pair capture (pid %d) exited with "
+                  "status %d, and is not restarted: every test now captures "
+                  "on its own", pid, status);
+      continue;
     }
-    if (ssl_context != NULL && FD_ISSET(tls_listenfd, &fds)) {
-      new_child = spawn_new_child(tls_listenfd, ssl_context);
-      if (new_child != NULL) attempt_enqueue(new_child, &queue_head);
+    for (i = 0; i < acceptor_shards; i++) {
+      if (shard_pids[i] == pid) break;
+    }
+    if (i == acceptor_shards) {
+      log_println(1, "Reaped process %d, which is not an acceptor shard, "
+                  "with status %d", pid, status);
+      continue;
+    }
+    log_println(0, "Acceptor shard %d (pid %d) exited with status %d, "
+                "restarting it", i, pid, status);
+    // The dead shard can no longer release its slots, so do it for it.  Its
+    // test children were killed along with it, see die_with_shard().
+    __sync_fetch_and_sub(&shard_state->running, shard_state->shard_running[i]);
+    shard_state->shard_running[i] = 0;
+    write(global_slot_eventfd, &one, sizeof(one));
+    // Don't spin if the shard dies right after it starts.
+    if (time(0) - shard_started[i] < 1) sleep(1);
+    shard_started[i] = time(0);
+    shard_pids[i] = spawn_acceptor_shard(i, ssl_context, tls_port,
+                                         socket_window, signalfd);
+    if (shard_pids[i] == -1) {
+      log_println(0, "Unable to restart acceptor shard %d: %s", i,
+                  strerror(errno));
     }
-    // Perform queue maintenance: send messages to clients and reap the dead.
-    perform_queue_maintenance(&queue_head);
   }
 }
 
@@ -1996,8 +2735,12 @@ void report_SSL_error(const char *prefix, const char *message) {
  * Set things up so that the server can accept incoming TLS connections.
  * @param certificate_file The filename containing the certificate (.pem)
  * @param private_key_file The filename containing the private key (.pem)
+ * @param session_cache The number of sessions of the session cache shared by
+ *                      the server processes (0 for none)
  */
-SSL_CTX *setup_SSL(const char *certificate_file, const char *private_key_file) {
+SSL_CTX *setup_SSL(const char *certificate_file, const char *private_key_file,
+                   int session_cache) {
+  int err;
   SSL_CTX *ssl_context;
 
   SSL_library_init();
@@ -2021,8 +2764,13 @@ SSL_CTX *setup_SSL(const char *certificate_file, const char *private_key_file) {
     report_SSL_error("SSL_CTX_check_private_key",
                      "Private key and certificate do not match");
   }
-  // In a server that forks, caching requires IPC. We avoid it for simplicity.
-  SSL_CTX_set_session_cache_mode(ssl_context, SSL_SESS_CACHE_OFF);
+  // In a server that forks, resuming sessions requires IPC: the ticket keys,
+  // and the session cache if there is one, are kept in shared memory.
+  if ((err = tls_session_setup(ssl_context, session_cache)) != 0) {
+    log_println(0, "TLS sessions can't be shared by the server processes: %s",
+                strerror(err));
+    exit(-1);
+  }
   // Work around every client bug that OpenSSL knows about:
   SSL_CTX_set_options(ssl_context, SSL_OP_ALL);
   // Don't ask the client to verify themselves
@@ -2075,6 +2823,7 @@ int main(int argc, char **argv) {
   int signalfd_read;
   int debug = 0;
   int socket_window;
+  int listen_options;
 
   // variables used for protocol validation logs
   // char startsrvmsg[256];  // used to log start of server process
@@ -2088,6 +2837,7 @@ int main(int argc, char **argv) {
   options.snapDelay = 5;
   options.avoidSndBlockUp = 0;
   options.snaplog = 0;
+  options.binarySnaplog = 0;
   options.snapshots = 1;
   options.cwndDecrease = 0;
   for (i = 0; i < MAX_STREAMS; i++)
@@ -2294,6 +3044,10 @@ int main(int argc, char **argv) {
       case 307:
         options.snaplog = 1;
         break;
+      case 333:
+        options.binarySnaplog = 1;
+        options.snaplog = 1;
+        break;
       case 309:
         cputime = 1;
         break;
@@ -2334,6 +3088,32 @@ int main(int argc, char **argv) {
       case 319:
         options.s2c_throughputsnaps = 1;
         break;
+      case 331:
+        options.s2c_zerocopy = 1;
+        break;
+      case 334:
+        options.c2s_zerocopy = 1;
+        break;
+      case 332:
+        if (check_rint(optarg, &options.s2c_writesize, 0,
+                       S2C_MAX_WRITE_SIZE)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText), "Invalid S2C write size: %s",
+                   optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
+      case 337:
+        if (check_rint(optarg, &options.s2c_framesize, 0,
+                       S2C_MAX_WRITE_SIZE) ||
+            (options.s2c_framesize > 0 &&
+             s2c_frame_header_length(options.s2c_framesize) < 0)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText), "Invalid S2C frame size: %s",
+                   optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
       case 320:
         options.s2c_snapsdelay = atoi(optarg);
         break;
@@ -2374,12 +3154,53 @@ int main(int argc, char **argv) {
       case 326:
         private_key_file = optarg;
         break;
+      case 338:
+        if (check_rint(optarg, &tls_session_cache, 0, TLS_SESSION_CACHE_MAX)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText),
+                   "Invalid size of the TLS session cache: %s", optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
       case 327:
         certificate_file = optarg;
         break;
       case 328:
         global_extended_tests_allowed = 0;
         break;
+      case 329:
+        if (check_rint(optarg, &prefork_workers, 0, MAX_PREFORK_WORKERS)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText),
+                   "Invalid number of pre-forked workers: %s", optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
+      case 330:
+        if (check_rint(optarg, &acceptor_shards, 1, MAX_ACCEPTOR_SHARDS)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText),
+                   "Invalid number of acceptor shards: %s", optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
+      case 335:
+        if (check_rint(optarg, &capture_threads, 0, MAX_CAPTURE_THREADS)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText),
+                   "Invalid number of capture threads: %s", optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
+      case 336:
+        if (check_rint(optarg, &trace_snaplen, 0, MAX_TRACE_SNAPLEN) ||
+            (trace_snaplen > 0 && trace_snaplen < MIN_TRACE_SNAPLEN)) {
+          char tmpText[200];
+          snprintf(tmpText, sizeof(tmpText), "Invalid trace snap length: %s",
+                   optarg);
+          short_usage(argv[0], tmpText);
+        }
+        break;
       case '?':
         short_usage(argv[0], "");
         break;
@@ -2391,7 +3212,8 @@ int main(int argc, char **argv) {
       short_usage(argv[0],
                   "TLS requires --tls_port, --private_key, and --certificate");
     }
-    ssl_context = setup_SSL(certificate_file, private_key_file);
+    ssl_context = setup_SSL(certificate_file, private_key_file,
+                            tls_session_cache);
   }
 
   if (optind < argc) {
@@ -2483,20 +3305,28 @@ int main(int argc, char **argv) {
   sigaction(SIGCHLD, &web100srv_sigaction, NULL);
   sigaction(SIGHUP, &web100srv_sigaction, NULL);
   sigaction(SIGPIPE, &web100srv_sigaction, NULL);
-  sigaction(SIGUSR1, &web100srv_sigaction, NULL);
-  sigaction(SIGUSR2, &web100srv_sigaction, NULL);
 
   // TODO: Remove support for SIGSEGV. We must preserve SIGSEGV now because
   // child processes receive SIGSEGV, indicating a bug that should be fixed.
   sigaction(SIGSEGV, &web100srv_sigaction, NULL);
 
+  // Concurrent tests share one packet-pair capture, which has to be started
+  // before the processes running the tests are forked.
+  if (multiple && getuid() == 0) {
+    start_pkttrace_service(device, capture_threads, max_clients);
+  }
+
   if (set_buff) {
     socket_window = window;
   } else {
     socket_window = 0;
   }
   // Bind our local address so that the client can send to us.
-  if ((listenaddr = CreateListenSocket(NULL, port, conn_options,
+  // When the server is sharded every listener has to allow SO_REUSEPORT, even
+  // this one (which only makes sure that the ports can be bound).
+  listen_options = conn_options;
+  if (acceptor_shards > 1) listen_options |= OPT_REUSEPORT;
+  if ((listenaddr = CreateListenSocket(NULL, port, listen_options,
                                        socket_window)) == NULL) {
     err_sys("server: CreateListenSocket failed");
   }
@@ -2504,7 +3334,7 @@ int main(int argc, char **argv) {
   // Bind the tls stuff
   if (options.tls) {
     if ((tls_listenaddr = CreateListenSocket(
-             NULL, tls_port_string, conn_options, socket_window)) == NULL) {
+             NULL, tls_port_string, listen_options, socket_window)) == NULL) {
       err_sys("server: CreateListenSocket failed");
     }
     tls_listenfd = I2AddrFD(tls_listenaddr);
@@ -2573,7 +3403,14 @@ int main(int argc, char **argv) {
   pipe(signalfd_pipe);
   signalfd_read = signalfd_pipe[0];
   global_signalfd_write = signalfd_pipe[1];
+  // The signal handler must never block on a full pipe.
+  fcntl(global_signalfd_write, F_SETFL,
+        fcntl(global_signalfd_write, F_GETFL) | O_NONBLOCK);
 
+  if (acceptor_shards > 1) {
+    run_acceptor_shards(ssl_context, listenfd, tls_listenfd, tls_port_string,
+                        socket_window, signalfd_read);
+  }
   NDT_server_main_loop(ssl_context, tls_listenfd, listenfd, signalfd_read);
   return 0;
 }
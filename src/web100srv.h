@@ -43,6 +43,7 @@
 #define   _USE_BSD
 #include <stdio.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
 #if USE_WEB100
 #include <web100.h>
@@ -81,11 +82,15 @@
 
 #include "connection.h"
 #include "ndtptestconstants.h"
+#include "ndttrace.h"
 
 /* move version to configure.ac file for package name */
 /* #define VERSION   "3.0.7" */  // version number
 #define RECLTH    8192
 
+// The largest S2C write (and websocket frame) the server will use
+#define S2C_MAX_WRITE_SIZE (16 * 1024 * 1024)
+
 #define WEB100_VARS 128  // number of web100 variables you want to access
 #define WEB100_FILE "web100_variables"  // names of the variables to access
 /* Move to logging.h
@@ -117,6 +122,7 @@ typedef struct options {
   int snapDelay;                        // frequency of snap log collection in milliseconds (i.e logged every snapDelay ms)
   char avoidSndBlockUp;                 // flag set to indicate avoiding send buffer blocking in the S2C test
   char snaplog;                         // enable collecting snap log
+  char binarySnaplog;                   // write the snap logs in the binary columnar format
   char snapshots;                       // enable snapshotting
   char cwndDecrease;                    // enable analysis of the cwnd changes (S2C test)
   char s2c_logname[MAX_STREAMS][256];   // S2C log file name - size changed to 256
@@ -133,6 +139,10 @@ typedef struct options {
   int s2c_snapsoffset;                  // specify the initial offset in the throughput snapshots thread for download test
   int s2c_streamsnum;                   // specify the number of streams (parallel TCP connections) for download test
   int tls;                              // true if we should communicate over SSL
+  char s2c_zerocopy;                    // send the S2C test data with sendfile() instead of write()
+  char c2s_zerocopy;                    // discard the C2S test data with splice() instead of read()
+  int s2c_writesize;                    // largest size of the S2C test writes (0 to always write RECLTH bytes)
+  int s2c_framesize;                    // size of the S2C test websocket frames (0 for one frame per write)
 } Options;
 
 typedef struct portpair {
@@ -147,10 +157,43 @@ typedef struct ndtchild_s {
   time_t qtime;  // time when queued
   int running;  // Was this told to start running tests?
   int pipe;  // The writeable end of the pipe to the child
+  int position;  // Queue position last sent to the child (-1 if none)
   char tests[24];  // What tests are scheduled?
   struct ndtchild_s *next;  // next process in queue
 } ndtchild;
 
+// Queue of NDT child processes
+typedef struct ndtqueue_s {
+  ndtchild *head;  // first process in queue
+  ndtchild *tail;  // last process in queue
+  int size;  // number of processes in queue
+  int running;  // number of processes told to start running tests
+  int changed;  // Did queue positions change since the last maintenance?
+} ndtqueue;
+
+// Structure defining an idle pre-forked worker process
+typedef struct ndtworker_s {
+  pid_t pid;  // process id
+  int sock;  // The parent's end of the UNIX socket used to pass connections
+} ndtworker;
+
+// Upper bound on the number of acceptor shards
+#define MAX_ACCEPTOR_SHARDS 64
+
+// Upper bound on the number of threads of the shared packet-pair capture
+#define MAX_CAPTURE_THREADS 16
+
+// Bounds of the snap length of the packet-pair capture, which must at least
+// hold the headers of an IPv6 TCP segment
+#define MIN_TRACE_SNAPLEN 74
+#define MAX_TRACE_SNAPLEN 65535
+
+// The state shared by every acceptor shard, kept in anonymous shared memory
+typedef struct ndtshards_s {
+  int running;  // Tests running across all of the shards
+  int shard_running[MAX_ACCEPTOR_SHARDS];  // Each shard's part of running
+} ndtshards;
+
 /* structure used to collect speed data in bins */
 struct spdpair {
   int family;  // Address family
@@ -273,14 +316,67 @@ struct throughputSnapshot;
 
 /* web100-pcap */
 #ifdef HAVE_LIBPCAP
+// Buckets of the stream table of a packet-pair analyzer, a power of two
+// well above MAX_STREAMS so that lookups rarely probe a second bucket
+#define PKTTRACE_STREAM_BUCKETS 16
+
+// Packet-pair state of one stream of a throughput test
+typedef struct pktStream {
+  uint16_t key;  // client port xor server port, 0 for a free bucket
+  int index;  // number of the stream in the test
+  struct spdpair fwd;  // forward flow of the stream
+  struct spdpair rev;  // reverse flow of the stream
+} PktStream;
+
+// Packet-pair analysis of the streams of a throughput test
+typedef struct pktAnalyzer {
+  struct spdpair fwd;  // forward flow, all the streams once stopped
+  struct spdpair rev;  // reverse flow, all the streams once stopped
+  PktStream streams[PKTTRACE_STREAM_BUCKETS];  // streams, hashed by key
+  int streamsNum;  // number of streams
+  PortPair pair;  // ports of the test
+  uint16_t serverPort;  // server port of the streams
+  int sigj;  // set once the ports were found reversed
+  int sigk;  // set once an unknown packet was logged
+  struct ndtTraceWriter* dump;  // writer of the ndttrace file, NULL if none
+  NdtTraceStats dumpStats;  // counts of the ndttrace file, once closed
+  int packets;  // packets analyzed
+} PktAnalyzer;
+
+// TPACKET_V3 receive ring of an AF_PACKET socket
+typedef struct pktRing {
+  int fd;  // AF_PACKET socket, -1 if not open
+  char* ring;  // blocks shared with the kernel
+  size_t ringSize;  // length of the ring mapping
+  unsigned int blockSize;  // length of a block
+  unsigned int blockNum;  // number of blocks
+  unsigned int current;  // next block to read
+  int loIndex;  // index of the loopback interface
+} PktRing;
+
+// Packet-pair capture of the streams of a throughput test
+typedef struct pktTrace {
+  int slot;  // slot of the shared capture service, -1 if not shared
+  PktRing ring;  // receive ring of the test, when it is not shared
+  int stopfd;  // eventfd written to stop the capture thread
+  pthread_t thread;  // the capture thread
+  PktAnalyzer analyzer;  // packet-pair state of the test
+  char tracefile[256];  // name of the ndttrace file, empty if none
+  char direction[4];  // "c2s" or "s2c", naming the results of the streams
+} PktTrace;
+
 void init_vars(struct spdpair *cur);
-void print_bins(struct spdpair *cur, int monitor_pipe[2]);
+void print_bins(struct spdpair *cur, char *buff, size_t len);
 void calculate_spd(struct spdpair *cur, struct spdpair *cur2, int port2,
                    int port3);
-void init_pkttrace(I2Addr srcAddr, struct sockaddr_storage sock_addr[], int sockaddrArrayLength,
-                   socklen_t saddrlen, int monitor_pipe[2], char *device,
-                   PortPair* pair, const char *direction, int expectedTestTime);
-void force_breakloop();
+int start_pkttrace(PktTrace* trace, I2Addr srcAddr,
+                   struct sockaddr_storage sock_addr[],
+                   int sockaddrArrayLength, socklen_t saddrlen, char *device,
+                   PortPair* pair, const char *direction, int compress);
+void stop_pkttrace(PktTrace* trace, char *fwdbins, char *revbins,
+                   size_t len);
+int start_pkttrace_service(char *device, int threads, int slots);
+pid_t pkttrace_service_pid(void);
 #endif
 
 /* web100-util */
@@ -297,6 +393,12 @@ typedef void tcp_stat_group;
 /* Log currently unimplemented in web10g */
 typedef estats_record tcp_stat_log;
 #define tcp_stat_connection_from_socket web10g_connection_from_socket
+/* Number of variables in estats_var_array */
+#ifdef ESTATS_MIB_VAR_H
+#define WEB10G_NUM_VARS TOTAL_NUM_VARS
+#else
+#define WEB10G_NUM_VARS TOTAL_INDEX_MAX
+#endif
 
 /* Extra Web10G functions web10g-util.c */
 int web10g_find_val(const tcp_stat_snap* data, const char* name,
@@ -319,6 +421,31 @@ typedef web100_log tcp_stat_log;
 
 #endif
 
+/* Variables read by name on the hot paths. The handles (Web100) or indices
+ * (Web10G) of these are looked up once by tcp_stat_resolve_vars() and then
+ * read through the tcp_stat_*_var() functions without a name search. */
+enum tcp_stat_var_id {
+  TCP_STAT_CUR_CWND,
+  TCP_STAT_CUR_MSS,
+  TCP_STAT_COUNT_RTT,
+  TCP_STAT_SUM_RTT,
+  TCP_STAT_SND_NXT,
+  TCP_STAT_SND_UNA,
+  TCP_STAT_LIM_CWND,
+  TCP_STAT_LIM_RWIN,
+  TCP_STAT_X_SBUF_MODE,  /* Web100 only */
+  TCP_STAT_X_RBUF_MODE,  /* Web100 only */
+  TCP_STAT_NUM_VAR_IDS
+};
+
+int tcp_stat_resolve_vars(tcp_stat_agent* agent);
+int tcp_stat_snap_read_var(tcp_stat_agent* agent, tcp_stat_snap* snap,
+                           enum tcp_stat_var_id id, int64_t* value);
+int tcp_stat_read_var(tcp_stat_agent* agent, tcp_stat_connection cn,
+                      enum tcp_stat_var_id id, int64_t* value);
+int tcp_stat_write_var(tcp_stat_agent* agent, tcp_stat_connection cn,
+                       enum tcp_stat_var_id id, u_int32_t value);
+
 int tcp_stat_autotune(int sock, tcp_stat_agent* agent, tcp_stat_connection cn);
 int tcp_stat_init(char *VarFileName);
 void tcp_stat_middlebox(int sock, tcp_stat_agent* agent, tcp_stat_connection cn, char *results_keys,
@@ -340,7 +467,7 @@ void tcp_stat_logvars_to_file(char* webVarsValuesLog, int connNum, struct tcp_va
 void tcp_stat_log_agg_vars_to_file(char* webVarsValuesLog, int connNum, struct tcp_vars* vars);
 
 int KillHung(void);
-void writeMeta(int compress, int cputime, int snapshotting, int snaplog, int tcpdump,
+void writeMeta(int compress, int cputime, int snapshotting, int snaplog,
                struct throughputSnapshot *s2c_ThroughputSnapshots, struct throughputSnapshot *c2s_ThroughputSnapshots);
 
 char *get_remotehostaddress();
@@ -352,5 +479,6 @@ pid_t sig17_pid[256];
 
 /* global variables shared with other source files */
 extern int dumptrace;
+extern int trace_snaplen;
 
 #endif  // SRC_WEB100SRV_H_
@@ -1,15 +1,30 @@
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "logging.h"
 #include "ndtptestconstants.h"
+#include "ndtsnap.h"
+#include "ndttrace.h"
+#include "network.h"
+#include "protocol.h"
+#include "testoptions.h"
+#include "tests_srv.h"
+#include "tlssession.h"
 #include "unit_testing.h"
+#include "utils.h"
 #include "web100srv.h"
 
 /* On some of Measurement Lab's test servers, the value returned by gethostname
@@ -278,6 +293,104 @@ void test_ssl_ndt() { run_ssl_test(&end_to_end_nodejs_ssl_test); }
 void test_ssl_meta_test() { run_ssl_test(&ndt_ssl_meta_test); }
 void test_ssl_c2s_test() { run_ssl_test(&ndt_ssl_c2s_test); }
 
+// A function in web100srv that we don't want to export, but we do want to test.
+SSL_CTX *setup_SSL(const char *certificate_file, const char *private_key_file,
+                   int session_cache);
+
+/* Makes a TLS connection to a new process, which serves it with the server
+ * context like a child of the server would.
+ * @param server_ctx The context of the server
+ * @param client_ctx The context of the client
+ * @param session The session to resume, or NULL
+ * @param resumed Set to whether the session was resumed
+ * @return The session of the client, to be freed
+ */
+SSL_SESSION* connect_to_tls_child(SSL_CTX* server_ctx, SSL_CTX* client_ctx,
+                                  SSL_SESSION* session, int* resumed) {
+  Connection conn = {-1, NULL};
+  SSL_SESSION* client_session;
+  SSL* ssl;
+  int sockets[2];
+  pid_t child_pid;
+  int child_exit_code;
+  char byte;
+
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  if ((child_pid = fork()) == 0) {
+    close(sockets[1]);
+    conn.socket = sockets[0];
+    CHECK(setup_SSL_connection(&conn, server_ctx) == 0);
+    CHECK(writen_any(&conn, "x", 1) == 1);
+    // Wait for the close_notify of the client.
+    CHECK(readn_any(&conn, &byte, 1) == 0);
+    close_connection(&conn);
+    exit(0);
+  }
+  close(sockets[0]);
+  CHECK((ssl = SSL_new(client_ctx)) != NULL);
+  CHECK(SSL_set_fd(ssl, sockets[1]) == 1);
+  if (session != NULL) CHECK(SSL_set_session(ssl, session) == 1);
+  CHECK(SSL_connect(ssl) == 1);
+  // The tickets of TLS 1.3 arrive after the handshake, ahead of the data.
+  CHECK(SSL_read(ssl, &byte, 1) == 1);
+  *resumed = SSL_session_reused(ssl);
+  client_session = SSL_get1_session(ssl);
+  // Without a close_notify, the client would not resume the session.
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(sockets[1]);
+  waitpid(child_pid, &child_exit_code, 0);
+  CHECK(WIFEXITED(child_exit_code) && WEXITSTATUS(child_exit_code) == 0);
+  return client_session;
+}
+
+void test_tls_session_resumption() {
+  char private_key_file[] = "/tmp/web100srv_test_key.pem-XXXXXX";
+  char certificate_file[] = "/tmp/web100srv_test_cert.pem-XXXXXX";
+  SSL_CTX *server_ctx, *client_ctx;
+  SSL_SESSION* session;
+  TlsSessionStats stats;
+  int resumed;
+
+  make_certificate_files(private_key_file, certificate_file);
+  server_ctx = setup_SSL(certificate_file, private_key_file, 16);
+  CHECK((client_ctx = SSL_CTX_new(SSLv23_client_method())) != NULL);
+  // A ticket of one child is good in another, until the keys have been
+  // rotated twice.
+  session = connect_to_tls_child(server_ctx, client_ctx, NULL, &resumed);
+  CHECK(!resumed);
+  SSL_SESSION_free(
+      connect_to_tls_child(server_ctx, client_ctx, session, &resumed));
+  CHECK(resumed);
+  tls_session_rotate_keys();
+  SSL_SESSION_free(
+      connect_to_tls_child(server_ctx, client_ctx, session, &resumed));
+  CHECK(resumed);
+  tls_session_rotate_keys();
+  SSL_SESSION_free(
+      connect_to_tls_child(server_ctx, client_ctx, session, &resumed));
+  CHECK(!resumed);
+  SSL_SESSION_free(session);
+  // Clients without tickets resume from the shared session cache.
+  SSL_CTX_set_options(client_ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+  session = connect_to_tls_child(server_ctx, client_ctx, NULL, &resumed);
+  CHECK(!resumed);
+  SSL_SESSION_free(
+      connect_to_tls_child(server_ctx, client_ctx, session, &resumed));
+  CHECK(resumed);
+  SSL_SESSION_free(session);
+  // The children counted their handshakes in the shared memory.
+  tls_session_get_stats(&stats);
+  CHECK(stats.handshakes == 6);
+  CHECK(stats.resumed == 3);
+  CHECK(stats.cacheHits == 1);
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+  unlink(private_key_file);
+  unlink(certificate_file);
+}
+
 // A function in web100srv that we don't want to export, but we do want to test.
 int is_child_process_alive(pid_t pid);
 
@@ -315,6 +428,661 @@ void test_is_child_process_alive_ignores_bad_pgid() {
   }
 }
 
+// Functions in web100srv that pass connections to pre-forked workers.
+int send_connection_to_worker(int worker_sock, int ctlsockfd, int parent_pipe,
+                              int use_tls);
+int receive_connection_from_parent(int parent_sock, int *ctlsockfd,
+                                   int *parent_pipe, int *use_tls);
+
+void test_pass_connection_to_worker() {
+  int worker_socks[2];
+  int client_socks[2];
+  int queue_pipe[2];
+  int received_sockfd, received_pipe, use_tls;
+  char buf[16];
+  CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, worker_socks) == 0);
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, client_socks) == 0);
+  CHECK(pipe(queue_pipe) == 0);
+  ASSERT(send_connection_to_worker(worker_socks[0], client_socks[0],
+                                   queue_pipe[0], 1) == 0,
+         "Could not send the connection");
+  ASSERT(receive_connection_from_parent(worker_socks[1], &received_sockfd,
+                                        &received_pipe, &use_tls) == 0,
+         "Could not receive the connection");
+  CHECK(use_tls == 1);
+  // The received descriptors must refer to the same socket and pipe.
+  CHECK(write(client_socks[1], "client", 6) == 6);
+  CHECK(read(received_sockfd, buf, sizeof(buf)) == 6);
+  CHECK(strncmp(buf, "client", 6) == 0);
+  CHECK(write(queue_pipe[1], "queue", 5) == 5);
+  CHECK(read(received_pipe, buf, sizeof(buf)) == 5);
+  CHECK(strncmp(buf, "queue", 5) == 0);
+  // Closing the parent's end must release the worker.
+  close(worker_socks[0]);
+  CHECK(receive_connection_from_parent(worker_socks[1], &received_sockfd,
+                                       &received_pipe, &use_tls) == -1);
+}
+
+// Functions in web100srv that manage the queue of children.
+void attempt_enqueue(ndtchild *new_child, ndtqueue *child_queue);
+void remove_next_child(ndtqueue *child_queue, ndtchild *okay_child);
+void perform_queue_maintenance(ndtqueue *child_queue, int heartbeat_due);
+
+// Returns the number of messages waiting on a non-blocking pipe, and stores
+// the last one in *last_message.
+int count_child_messages(int fd, int *last_message) {
+  int message, count = 0;
+  while (read(fd, &message, sizeof(message)) == sizeof(message)) {
+    *last_message = message;
+    count++;
+  }
+  return count;
+}
+
+void test_queue_updates_only_on_change() {
+  ndtqueue child_queue = {NULL, NULL, 0, 0, 0};
+  ndtchild children[3];
+  int pipes[3][2];
+  int i, message;
+  for (i = 0; i < 3; i++) {
+    CHECK(pipe(pipes[i]) == 0);
+    fcntl(pipes[i][0], F_SETFL, O_NONBLOCK);
+    memset(&children[i], 0, sizeof(children[i]));
+    children[i].pid = i + 1;
+    children[i].pipe = pipes[i][1];
+    children[i].position = -1;
+    attempt_enqueue(&children[i], &child_queue);
+  }
+  CHECK(child_queue.size == 3);
+  CHECK(child_queue.tail == &children[2]);
+  // By default only one test runs at a time: the first child starts and the
+  // others learn their position.
+  perform_queue_maintenance(&child_queue, 0);
+  CHECK(count_child_messages(pipes[0][0], &message) == 1);
+  CHECK(message == SRV_QUEUE_TEST_STARTS_NOW);
+  CHECK(count_child_messages(pipes[1][0], &message) == 1);
+  CHECK(count_child_messages(pipes[2][0], &message) == 1);
+  CHECK(child_queue.running == 1);
+  // Nothing changed, so nobody hears anything.
+  perform_queue_maintenance(&child_queue, 0);
+  for (i = 0; i < 3; i++) CHECK(count_child_messages(pipes[i][0], &message) == 0);
+  // A heartbeat goes only to the waiting children.
+  perform_queue_maintenance(&child_queue, 1);
+  CHECK(count_child_messages(pipes[0][0], &message) == 0);
+  CHECK(count_child_messages(pipes[1][0], &message) == 1);
+  CHECK(message == SRV_QUEUE_HEARTBEAT);
+  CHECK(count_child_messages(pipes[2][0], &message) == 1);
+  // When the running child leaves, the next one starts and the last one moves
+  // up in the queue.
+  remove_next_child(&child_queue, NULL);
+  CHECK(child_queue.size == 2 && child_queue.running == 0);
+  perform_queue_maintenance(&child_queue, 0);
+  CHECK(count_child_messages(pipes[1][0], &message) == 1);
+  CHECK(message == SRV_QUEUE_TEST_STARTS_NOW);
+  CHECK(count_child_messages(pipes[2][0], &message) == 1);
+  CHECK(children[2].position == 1);
+  remove_next_child(&child_queue, &children[1]);
+  CHECK(child_queue.tail == &children[1]);
+  for (i = 0; i < 3; i++) {
+    close(pipes[i][0]);
+    close(pipes[i][1]);
+  }
+}
+
+// Functions in test_s2c_srv that prepare the S2C send buffer.
+int choose_s2c_write_size(int ceiling, int set_buff, int window);
+void fill_s2c_buffer(char* buff, int size, int websocket);
+int choose_s2c_frame_size(int frameSize, int writeSize);
+struct s2cFramePool* get_s2c_frame_pool(int frameSize, int writeSize);
+int send_s2c_frames(Connection* conn, const struct s2cFramePool* pool);
+
+void test_s2c_write_size() {
+  CHECK(choose_s2c_write_size(0, 0, 0) == RECLTH);
+  CHECK(choose_s2c_write_size(1 << 20, 0, 0) == 1 << 20);
+  CHECK(choose_s2c_write_size(1 << 20, 1, 1 << 16) == 1 << 16);
+  CHECK(choose_s2c_write_size(1 << 20, 1, 100) == RECLTH);
+  CHECK(choose_s2c_write_size(3 * RECLTH + 5, 0, 0) == 3 * RECLTH);
+  CHECK(choose_s2c_write_size(1 << 30, 0, 0) == S2C_MAX_WRITE_SIZE);
+}
+
+void test_s2c_buffer_websocket_header() {
+  unsigned char *buff = malloc(1 << 20);
+  int i;
+  // Small frames fit their length in the second byte.
+  fill_s2c_buffer((char*) buff, 127, 1);
+  CHECK(buff[0] == 0x82);
+  CHECK(buff[1] == 125);
+  // Longer payloads need the 16 bit length, which must not be used for
+  // payloads of less than 126 bytes.
+  CHECK(s2c_frame_header_length(127) == 2);
+  CHECK(s2c_frame_header_length(128) == -1);
+  CHECK(s2c_frame_header_length(129) == -1);
+  CHECK(s2c_frame_header_length(130) == 4);
+  fill_s2c_buffer((char*) buff, 130, 1);
+  CHECK(buff[1] == 126);
+  CHECK(buff[2] == 0 && buff[3] == 126);
+  fill_s2c_buffer((char*) buff, RECLTH, 1);
+  CHECK(buff[1] == 126);
+  CHECK(buff[2] * 256 + buff[3] == RECLTH - 4);
+  fill_s2c_buffer((char*) buff, 65539, 1);
+  CHECK(buff[1] == 126);
+  CHECK(buff[2] == 0xFF && buff[3] == 0xFF);
+  // Payloads of 64k and more need the 64 bit length, which leaves no header
+  // for the frames in between.
+  CHECK(s2c_frame_header_length(65540) == -1);
+  CHECK(s2c_frame_header_length(65545) == -1);
+  CHECK(s2c_frame_header_length(65546) == 10);
+  fill_s2c_buffer((char*) buff, 65546, 1);
+  CHECK(buff[1] == 127);
+  for (i = 2; i < 7; i++) CHECK(buff[i] == 0);
+  CHECK(buff[7] == 0x01 && buff[8] == 0 && buff[9] == 0);
+  fill_s2c_buffer((char*) buff, 1 << 20, 1);
+  CHECK(buff[1] == 127);
+  for (i = 2; i < 7; i++) CHECK(buff[i] == 0);
+  CHECK(buff[7] == 0x0F && buff[8] == 0xFF && buff[9] == 0xF6);
+  // Without websockets it is all printable data.
+  fill_s2c_buffer((char*) buff, RECLTH, 0);
+  for (i = 0; i < RECLTH; i++) CHECK(isprint(buff[i]));
+  free(buff);
+}
+
+void test_s2c_frame_size() {
+  CHECK(choose_s2c_frame_size(0, 1 << 20) == 1 << 20);
+  CHECK(choose_s2c_frame_size(1 << 16, 1 << 20) == 1 << 16);
+  CHECK(choose_s2c_frame_size(100, 1 << 20) == RECLTH);
+  CHECK(choose_s2c_frame_size(1 << 22, 1 << 20) == 1 << 20);
+  // No frames are made of a size no header fits.
+  CHECK(get_s2c_frame_pool(65540, 1 << 20) == NULL);
+}
+
+// Checks that a write of the S2C frame pool is made of whole frames of the
+// given size, whose payload is printable data.
+void check_s2c_frames(int frameSize, int writeSize, int frames) {
+  struct s2cFramePool* pool;
+  unsigned char* received = malloc(writeSize);
+  int sockets[2], i, j, headerLen, writer_exit_code;
+  long long payload;
+  pid_t writer_pid;
+  Connection conn = {-1, NULL};
+
+  CHECK(received != NULL);
+  CHECK((pool = get_s2c_frame_pool(frameSize, writeSize)) != NULL);
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  if ((writer_pid = fork()) == 0) {
+    close(sockets[1]);
+    conn.socket = sockets[0];
+    CHECK(send_s2c_frames(&conn, pool) == frames * frameSize);
+    exit(0);
+  }
+  close(sockets[0]);
+  conn.socket = sockets[1];
+  CHECK(readn_any(&conn, received, frames * frameSize) == frames * frameSize);
+  close(sockets[1]);
+  waitpid(writer_pid, &writer_exit_code, 0);
+  CHECK(WIFEXITED(writer_exit_code) && WEXITSTATUS(writer_exit_code) == 0);
+  for (i = 0; i < frames; i++) {
+    unsigned char* frame = received + i * frameSize;
+    CHECK(frame[0] == 0x82);
+    if (frame[1] == 126) {
+      headerLen = 4;
+      payload = frame[2] * 256 + frame[3];
+    } else {
+      CHECK(frame[1] == 127);
+      headerLen = 10;
+      for (j = 2, payload = 0; j < 10; j++) payload = payload * 256 + frame[j];
+    }
+    CHECK(payload == frameSize - headerLen);
+    for (j = headerLen; j < frameSize; j++) CHECK(isprint(frame[j]));
+  }
+  free(received);
+}
+
+void test_s2c_frame_pool() {
+  check_s2c_frames(RECLTH, 4 * RECLTH, 4);
+  // Only whole frames go in a write.
+  check_s2c_frames(3 * RECLTH, 8 * RECLTH, 2);
+  check_s2c_frames(1 << 17, 1 << 20, 8);
+  // The payload of 65539 byte frames still fits the 16 bit length.
+  check_s2c_frames(65539, 1 << 20, 15);
+  check_s2c_frames(65546, 1 << 20, 15);
+  // The frames are made again for another size, and a write holds no more
+  // than 512 of them.
+  check_s2c_frames(RECLTH, S2C_MAX_WRITE_SIZE, 512);
+}
+
+// Opens a TCP connection over the loopback interface, and stores the
+// accepted end in *server and the connecting end in *client.
+void make_loopback_connection(int *client, int *server) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  int listener;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK((listener = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+  CHECK(bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  CHECK(listen(listener, 1) == 0);
+  CHECK(getsockname(listener, (struct sockaddr *) &addr, &addr_len) == 0);
+  CHECK((*client = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+  CHECK(connect(*client, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  CHECK((*server = accept(listener, NULL, NULL)) != -1);
+  close(listener);
+}
+
+/** Reads a snapshot variable by name and through the cached handle, and
+ * checks that both agree. */
+void test_tcp_stat_cached_reads() {
+  tcp_stat_agent *agent;
+  tcp_stat_connection cn;
+  web100_group *group;
+  web100_var *var;
+  web100_snapshot *snap;
+  char buf[32];
+  int client, server, by_name;
+  int64_t cached = 0, current;
+
+  CHECK((agent = web100_attach(WEB100_AGENT_TYPE_LOCAL, NULL)) != NULL);
+  // The X_ variables are extensions that not every kernel has.
+  CHECK(tcp_stat_resolve_vars(agent) >= TCP_STAT_X_SBUF_MODE);
+  make_loopback_connection(&client, &server);
+  CHECK(write(client, "cached", 6) == 6);
+  CHECK((cn = tcp_stat_connection_from_socket(agent, server)) != NULL);
+  CHECK((group = web100_group_find(agent, "read")) != NULL);
+  CHECK((snap = web100_snapshot_alloc(group, cn)) != NULL);
+  CHECK(web100_snap(snap) == WEB100_ERR_SUCCESS);
+
+  CHECK(web100_agent_find_var_and_group(agent, "CurMSS", &group, &var) ==
+        WEB100_ERR_SUCCESS);
+  CHECK(web100_snap_read(var, snap, buf) == WEB100_ERR_SUCCESS);
+  by_name = atoi(web100_value_to_text(web100_get_var_type(var), buf));
+  if (tcp_stat_snap_read_var(agent, snap, TCP_STAT_CUR_MSS, &cached) != 0)
+    FAIL("Could not read CurMSS through the cached handle");
+
+  ASSERT(cached == by_name, "Cached CurMSS %d differs from %d",
+         (int) cached, by_name);
+  CHECK(tcp_stat_read_var(agent, cn, TCP_STAT_CUR_MSS, &current) == 0);
+  CHECK(current == cached);
+
+  web100_snapshot_free(snap);
+  close(client);
+  close(server);
+}
+
+/** Times reading a snapshot variable by name and through the cached handle.
+ * Only run when NDT_BENCHMARKS is set. */
+void test_benchmark_tcp_stat_reads() {
+  const int reads = 100000;
+  tcp_stat_agent *agent;
+  tcp_stat_connection cn;
+  web100_group *group;
+  web100_var *var;
+  web100_snapshot *snap;
+  char buf[32];
+  int client, server, i, by_name = 0;
+  int64_t cached = 0;
+  double start, by_name_time, cached_time;
+
+  CHECK((agent = web100_attach(WEB100_AGENT_TYPE_LOCAL, NULL)) != NULL);
+  CHECK(tcp_stat_resolve_vars(agent) >= TCP_STAT_X_SBUF_MODE);
+  make_loopback_connection(&client, &server);
+  CHECK(write(client, "cached", 6) == 6);
+  CHECK((cn = tcp_stat_connection_from_socket(agent, server)) != NULL);
+  CHECK((group = web100_group_find(agent, "read")) != NULL);
+  CHECK((snap = web100_snapshot_alloc(group, cn)) != NULL);
+  CHECK(web100_snap(snap) == WEB100_ERR_SUCCESS);
+
+  start = secs();
+  for (i = 0; i < reads; i++) {
+    web100_agent_find_var_and_group(agent, "CurMSS", &group, &var);
+    web100_snap_read(var, snap, buf);
+    by_name = atoi(web100_value_to_text(web100_get_var_type(var), buf));
+  }
+  by_name_time = secs() - start;
+  start = secs();
+  for (i = 0; i < reads; i++) {
+    if (tcp_stat_snap_read_var(agent, snap, TCP_STAT_CUR_MSS, &cached) != 0)
+      FAIL("Could not read CurMSS through the cached handle");
+  }
+  cached_time = secs() - start;
+
+  ASSERT(cached == by_name, "Cached CurMSS %d differs from %d",
+         (int) cached, by_name);
+  fprintf(stderr, "%d CurMSS reads: %.2f ms by name, %.2f ms cached\n",
+          reads, by_name_time * 1000, cached_time * 1000);
+
+  web100_snapshot_free(snap);
+  close(client);
+  close(server);
+}
+
+/** Snapshots a connection every millisecond through the snap log ring and
+ * checks that every snapshot not dropped from the ring made it to the log. */
+void test_snaplog_ring() {
+  char logname[] = "/tmp/snaplog_ring_test_XXXXXX";
+  tcp_stat_agent *agent;
+  SnapArgs snapArgs;
+  SnapArgs *streams[1] = {&snapArgs};
+  SnapScheduler sched;
+  u_int32_t dec_cnt = 0, same_cnt = 0, inc_cnt = 0;
+  int client, server, i, fd, overflows;
+
+  CHECK((fd = mkstemp(logname)) != -1);
+  close(fd);
+  CHECK((agent = web100_attach(WEB100_AGENT_TYPE_LOCAL, NULL)) != NULL);
+  make_loopback_connection(&client, &server);
+  open_snap_stream(&snapArgs, agent, 1, 0, logname,
+                   tcp_stat_connection_from_socket(agent, server), NULL);
+  CHECK(snapArgs.ring != NULL);
+  CHECK(start_snap_scheduler(&sched, streams, 1, agent, NULL, 1, 1) == 0);
+  for (i = 0; i < 100; i++) {
+    CHECK(write(client, "ring", 4) == 4);
+    usleep(2000);
+  }
+  stop_snap_scheduler(&sched, NULL);
+  CHECK(sched.samples > 0);
+  overflows = snapArgs.ring->overflows;
+  close_snap_stream(&snapArgs, 1);
+  // The first snapshot is logged by open_snap_stream() and is not counted.
+  CHECK(CwndDecrease(logname, &dec_cnt, &same_cnt, &inc_cnt) == 0);
+  ASSERT(dec_cnt + same_cnt + inc_cnt == sched.samples - overflows,
+         "%u snapshots in the log, %d taken and %d dropped",
+         dec_cnt + same_cnt + inc_cnt, sched.samples, overflows);
+  close(client);
+  close(server);
+  unlink(logname);
+}
+
+/** Writes columns with small, large and wrapping deltas to a binary snap log
+ * and checks they read back unchanged. */
+void test_ndtsnap_round_trip() {
+  char logname[] = "/tmp/ndtsnap_test_XXXXXX";
+  const char* names[] = {"CurCwnd", "Duration", "Extremes"};
+  NdtSnapTuple tuple;
+  NdtSnapWriter* writer;
+  NdtSnapReader* reader;
+  const int64_t* column;
+  int64_t row[3], expected;
+  int i, fd;
+
+  CHECK((fd = mkstemp(logname)) != -1);
+  close(fd);
+  memset(&tuple, 0, sizeof(tuple));
+  strcpy(tuple.local_addr, "127.0.0.1");
+  strcpy(tuple.rem_port, "3010");
+  CHECK((writer = ndtsnap_open_write(logname, &tuple, 3, names)) != NULL);
+  for (i = 0; i < 1000; i++) {
+    row[0] = 14480 + (i % 40) * 1448;
+    row[1] = i * 5000LL;
+    row[2] = (i & 1) ? INT64_MIN : INT64_MAX;
+    CHECK(ndtsnap_write_row(writer, row) == 0);
+  }
+  CHECK(ndtsnap_close_write(writer) == 0);
+
+  CHECK(ndtsnap_probe(logname) == 1);
+  CHECK((reader = ndtsnap_open_read(logname)) != NULL);
+  ASSERT(ndtsnap_rows(reader) == 1000, "%d rows", ndtsnap_rows(reader));
+  CHECK(ndtsnap_columns(reader) == 3);
+  CHECK(strcmp(ndtsnap_tuple(reader)->local_addr, "127.0.0.1") == 0);
+  CHECK(strcmp(ndtsnap_tuple(reader)->rem_port, "3010") == 0);
+  CHECK(ndtsnap_find_column(reader, "Duration") == 1);
+  CHECK(ndtsnap_find_column(reader, "CurRwinRcvd") == -1);
+  CHECK((column = ndtsnap_column(reader, 0)) != NULL);
+  for (i = 0; i < 1000; i++) {
+    expected = 14480 + (i % 40) * 1448;
+    CHECK(column[i] == expected);
+  }
+  CHECK((column = ndtsnap_column(reader, 1)) != NULL);
+  for (i = 0; i < 1000; i++)
+    CHECK(column[i] == i * 5000LL);
+  CHECK((column = ndtsnap_column(reader, 2)) != NULL);
+  for (i = 0; i < 1000; i++)
+    CHECK(column[i] == ((i & 1) ? INT64_MIN : INT64_MAX));
+  ndtsnap_close_read(reader);
+
+  // A truncated file is rejected rather than misread
+  CHECK(truncate(logname, 64) == 0);
+  CHECK(ndtsnap_open_read(logname) == NULL);
+  unlink(logname);
+}
+
+/** Writes packets to a compressed ndttrace file and checks they read back
+ * in the tcpdump format, and that the packets beyond the blocks that can
+ * wait for the writer are dropped rather than waited for. */
+void test_ndttrace_writer() {
+  char tracename[] = "/tmp/ndttrace_test_XXXXXX";
+  unsigned char packet[68], data[68];
+  uint32_t header[6], record[4], usec;
+  struct timeval ts;
+  NdtTraceWriter* writer;
+  NdtTraceStats stats;
+  gzFile gz;
+  int i, fd, packets = 20000;
+
+  CHECK((fd = mkstemp(tracename)) != -1);
+  close(fd);
+  CHECK((writer = ndttrace_open(tracename, sizeof(packet), 1)) != NULL);
+  for (i = 0; i < packets; i++) {
+    ts.tv_sec = 1000 + i / 1000;
+    ts.tv_usec = (i % 1000) * 1000;
+    memset(packet, i & 0xff, sizeof(packet));
+    ndttrace_write(writer, &ts, sizeof(packet), 1514, packet);
+  }
+  CHECK(ndttrace_close(writer, &stats) == 0);
+  ASSERT(stats.packets == packets && stats.dropped == 0,
+         "%d packets written, %d dropped", stats.packets, stats.dropped);
+
+  CHECK((gz = gzopen(tracename, "rb")) != NULL);
+  CHECK(gzread(gz, header, sizeof(header)) == sizeof(header));
+  CHECK(header[0] == 0xa1b2c3d4);
+  CHECK(header[4] == sizeof(packet));
+  CHECK(header[5] == 1);
+  for (i = 0; i < packets; i++) {
+    CHECK(gzread(gz, record, sizeof(record)) == sizeof(record));
+    usec = (i % 1000) * 1000;
+    CHECK(record[0] == (uint32_t) (1000 + i / 1000));
+    CHECK(record[1] == usec);
+    CHECK(record[2] == sizeof(packet) && record[3] == 1514);
+    CHECK(gzread(gz, data, sizeof(data)) == sizeof(data));
+    CHECK(data[0] == (i & 0xff) && data[sizeof(data) - 1] == (i & 0xff));
+  }
+  CHECK(gzread(gz, data, 1) == 0);
+  gzclose(gz);
+
+  // A packet larger than a block can never be written
+  CHECK((writer = ndttrace_open(tracename, sizeof(packet), 0)) != NULL);
+  ndttrace_write(writer, &ts, NDTTRACE_BLOCK_SIZE, NDTTRACE_BLOCK_SIZE,
+                 packet);
+  CHECK(ndttrace_close(writer, &stats) == 0);
+  CHECK(stats.packets == 0 && stats.dropped == 1);
+  unlink(tracename);
+}
+
+/** Snapshots a connection into a binary snap log and checks that it holds
+ * every snapshot taken, and is smaller than the same log in the Web100
+ * format. */
+void test_binary_snaplog() {
+  char logname[] = "/tmp/binary_snaplog_test_XXXXXX";
+  char nativename[] = "/tmp/native_snaplog_test_XXXXXX";
+  tcp_stat_agent *agent;
+  SnapArgs snapArgs, nativeArgs;
+  SnapArgs *streams[2] = {&snapArgs, &nativeArgs};
+  SnapScheduler sched;
+  NdtSnapReader* reader;
+  struct stat binary, native;
+  u_int32_t dec_cnt = 0, same_cnt = 0, inc_cnt = 0;
+  int client, server, i, fd, rows;
+  tcp_stat_connection conn;
+
+  CHECK((fd = mkstemp(logname)) != -1);
+  close(fd);
+  CHECK((fd = mkstemp(nativename)) != -1);
+  close(fd);
+  CHECK((agent = web100_attach(WEB100_AGENT_TYPE_LOCAL, NULL)) != NULL);
+  make_loopback_connection(&client, &server);
+  conn = tcp_stat_connection_from_socket(agent, server);
+  open_snap_stream(&snapArgs, agent, 1, 1, logname, conn, NULL);
+  open_snap_stream(&nativeArgs, agent, 1, 0, nativename, conn, NULL);
+  CHECK(snapArgs.binlog != NULL);
+  CHECK(start_snap_scheduler(&sched, streams, 2, agent, NULL, 1, 5) == 0);
+  for (i = 0; i < 100; i++) {
+    CHECK(write(client, "binary snaplog", 14) == 14);
+    usleep(2000);
+  }
+  stop_snap_scheduler(&sched, NULL);
+  rows = 1 + sched.samples - snapArgs.ring->overflows;
+  close_snap_stream(&snapArgs, 1);
+  close_snap_stream(&nativeArgs, 1);
+
+  CHECK((reader = ndtsnap_open_read(logname)) != NULL);
+  ASSERT(ndtsnap_rows(reader) == rows, "%d snapshots in the log, %d expected",
+         ndtsnap_rows(reader), rows);
+  CHECK(ndtsnap_column(reader, ndtsnap_find_column(reader, "CurCwnd")) !=
+        NULL);
+  CHECK(strcmp(ndtsnap_tuple(reader)->local_addr, "127.0.0.1") == 0);
+  ndtsnap_close_read(reader);
+  // The first snapshot is not counted.
+  CHECK(CwndDecrease(logname, &dec_cnt, &same_cnt, &inc_cnt) == 0);
+  CHECK(dec_cnt + same_cnt + inc_cnt == rows - 1);
+  CHECK(stat(logname, &binary) == 0);
+  CHECK(stat(nativename, &native) == 0);
+  ASSERT(binary.st_size < native.st_size, "binary %ld bytes, native %ld",
+         (long) binary.st_size, (long) native.st_size);
+  close(client);
+  close(server);
+  unlink(logname);
+  unlink(nativename);
+}
+
+/** Waits on a pipe with a timeout. */
+void test_wait_for_readable_fd_timeout() {
+  int fds[2];
+  double start;
+
+  CHECK(pipe(fds) == 0);
+  start = secs();
+  CHECK(!wait_for_readable_fd_timeout(fds[0], 0.1));
+  CHECK(secs() - start >= 0.09);
+  CHECK(write(fds[1], "x", 1) == 1);
+  start = secs();
+  CHECK(wait_for_readable_fd_timeout(fds[0], 1));
+  CHECK(secs() - start < 0.1);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/** Records a two stream series and checks the intervals it reports. */
+void test_stream_series() {
+  StreamSeries series;
+  double totals[2] = {0, 0};
+  char buf[256];
+
+  CHECK(stream_series_init(&series, 2, 1.0, 100.0) == 0);
+  CHECK(series.maxIntervals == 4);
+  totals[0] = 1000;
+  totals[1] = 10;
+  stream_series_update(&series, totals, 100.2);
+  CHECK(series.intervals == 0);
+  stream_series_update(&series, totals, 100.5);
+  CHECK(series.intervals == 1);
+  // Two intervals end at once; the second one saw no bytes.
+  totals[0] = 3000;
+  stream_series_update(&series, totals, 101.6);
+  CHECK(series.intervals == 3);
+  CHECK(stream_series_next(&series) == 102.0);
+  totals[1] = 20;
+  stream_series_finish(&series, totals);
+  CHECK(series.intervals == 4);
+  CHECK(stream_series_format(&series, 0, buf, sizeof(buf)) == 4);
+  CHECK(strcmp(buf, "3000 1000 2000 0 0") == 0);
+  CHECK(stream_series_format(&series, 1, buf, sizeof(buf)) == 4);
+  CHECK(strcmp(buf, "20 10 0 0 10") == 0);
+  // Intervals that do not fit are dropped whole.
+  CHECK(stream_series_format(&series, 0, buf, 12) == 1);
+  CHECK(strcmp(buf, "3000 1000") == 0);
+  stream_series_report(&series, "c2s", buf, sizeof(buf));
+  CHECK(strcmp(buf, "c2sSeriesInterval: 500\nc2sStream0: 3000 1000 2000 0 0\n"
+                    "c2sStream1: 20 10 0 0 10\n") == 0);
+  stream_series_free(&series);
+  CHECK(series.bytes == NULL && series.streamsNum == 0);
+}
+
+/** Receives two C2S streams through the epoll receiver and checks that the
+ * bytes of each stream are counted and that a closed stream is dropped.
+ * @param splice whether the receiver splices the data instead of reading it
+ */
+void check_c2s_receiver(int splice) {
+  const int lengths[2] = {3 * C2S_RECV_BUFFER_SIZE / 2, 1000};
+  Connection conns[2];
+  C2SReceiver receiver;
+  int clients[2], i, written;
+  double bytes_read = 0, start;
+  char *data;
+
+  CHECK((data = (char*) calloc(lengths[0], 1)) != NULL);
+  memset(conns, 0, sizeof(conns));
+  for (i = 0; i < 2; i++) make_loopback_connection(&clients[i], &conns[i].socket);
+  CHECK(c2s_receiver_init(&receiver, conns, 2) == 0);
+  CHECK(receiver.active == 2);
+  if (splice) CHECK(c2s_receiver_enable_splice(&receiver) == 0);
+  if (fork() == 0) {
+    for (i = 0; i < 2; i++) {
+      for (written = 0; written < lengths[i];) {
+        int n = write(clients[i], data + written, lengths[i] - written);
+        if (n <= 0) exit(1);
+        written += n;
+      }
+    }
+    exit(0);
+  }
+  start = secs();
+  while (bytes_read < lengths[0] + lengths[1] && secs() - start < 5) {
+    CHECK(c2s_receiver_wait(&receiver, 100, &bytes_read) == 0);
+  }
+  wait(NULL);
+  for (i = 0; i < 2; i++) CHECK(receiver.bytes[i] == lengths[i]);
+  CHECK(bytes_read == lengths[0] + lengths[1]);
+
+  close(clients[1]);
+  start = secs();
+  while (receiver.active == 2 && secs() - start < 5) {
+    CHECK(c2s_receiver_wait(&receiver, 100, &bytes_read) == 0);
+  }
+  CHECK(receiver.active == 1);
+  CHECK(receiver.closed[1] && !receiver.closed[0]);
+  // The sockets were spliced, not read.
+  if (splice) CHECK(receiver.pipefd[0] != -1);
+  c2s_receiver_close(&receiver);
+  for (i = 0; i < 2; i++) close(conns[i].socket);
+  close(clients[0]);
+  free(data);
+}
+
+void test_c2s_receiver() {
+  check_c2s_receiver(0);
+}
+
+void test_c2s_receiver_splice() {
+  check_c2s_receiver(1);
+}
+
+/** Run an end-to-end test with a pool of pre-forked workers. */
+void test_e2e_prefork() {
+  char *server_args[] = {"--prefork_workers", "2", NULL};
+  run_client(NULL, server_args);
+}
+
+/** Run an end-to-end test against a server split into acceptor shards. */
+void test_e2e_sharded() {
+  char *server_args[] = {"--acceptor_shards", "2", NULL};
+  run_client(NULL, server_args);
+}
+
+/** Run an end-to-end test that sends the S2C data with sendfile(). */
+void test_e2e_s2c_zerocopy() {
+  char *server_args[] = {"--s2czerocopy", NULL};
+  run_client(NULL, server_args);
+}
+
 /** Runs 20 simultaneous tests, therefore exercising the queuing code. */
 void test_queuing() {
   char private_key_file[] = "/tmp/web100srv_test_key.pem-XXXXXX";
@@ -386,15 +1154,37 @@ int main() {
   return
       RUN_TEST(test_is_child_process_alive) ||
       RUN_TEST(test_is_child_process_alive_ignores_bad_pgid) ||
+      RUN_TEST(test_pass_connection_to_worker) ||
+      RUN_TEST(test_queue_updates_only_on_change) ||
+      RUN_TEST(test_s2c_write_size) ||
+      RUN_TEST(test_s2c_buffer_websocket_header) ||
+      RUN_TEST(test_s2c_frame_size) ||
+      RUN_TEST(test_s2c_frame_pool) ||
+      RUN_TEST(test_tcp_stat_cached_reads) ||
+      RUN_TEST(test_snaplog_ring) ||
+      RUN_TEST(test_ndtsnap_round_trip) ||
+      RUN_TEST(test_binary_snaplog) ||
+      RUN_TEST(test_ndttrace_writer) ||
+      RUN_TEST(test_wait_for_readable_fd_timeout) ||
+      RUN_TEST(test_stream_series) ||
+      RUN_TEST(test_c2s_receiver) ||
+      RUN_TEST(test_c2s_receiver_splice) ||
       RUN_TEST(test_node_meta_test) ||
       RUN_TEST(test_ssl_connection) ||
+      RUN_TEST(test_tls_session_resumption) ||
       RUN_TEST(test_ssl_meta_test) ||
       RUN_LONG_TEST(test_ssl_c2s_test, "15 seconds") ||
       RUN_LONG_TEST(test_run_all_tests_node, "30 seconds") ||
       RUN_LONG_TEST(test_ssl_ndt, "30 seconds") ||
       RUN_LONG_TEST(test_e2e, "30 seconds") ||
+      RUN_LONG_TEST(test_e2e_prefork, "30 seconds") ||
+      RUN_LONG_TEST(test_e2e_sharded, "30 seconds") ||
+      RUN_LONG_TEST(test_e2e_s2c_zerocopy, "30 seconds") ||
       //RUN_TEST(test_e2e_ext) ||
       RUN_LONG_TEST(test_run_two_tests_node, "30 seconds") ||
       RUN_LONG_TEST(test_queuing, "2 minutes") ||
+      // Benchmarks only report their timings, so they run only on request.
+      (getenv("NDT_BENCHMARKS") != NULL &&
+       RUN_TEST(test_benchmark_tcp_stat_reads)) ||
       0;
 }
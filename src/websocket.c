@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // strcasestr()
+#include <ctype.h>
 #include <errno.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
@@ -41,6 +43,36 @@ void websocket_close_response(Connection* conn) {
   writen_any(conn, close_packet, 2);
 }
 
+/**
+ * Unmask the payload of a websocket frame in place.  The payload is XORed
+ * with the mask eight bytes at a time, a loop which the compiler can further
+ * vectorize.
+ * @param data The part of the payload to unmask
+ * @param len The length of that part
+ * @param masking_key The mask of the frame
+ * @param offset The position of data in the payload, which decides the byte
+ *               of the mask it starts with
+ */
+void websocket_unmask(unsigned char* data, uint64_t len,
+                      const unsigned char masking_key[4], uint64_t offset) {
+  unsigned char key[8];
+  uint64_t key_word, word;
+  uint64_t i;
+
+  for (i = 0; i < 8; i++) {
+    key[i] = masking_key[(offset + i) % 4];
+  }
+  memcpy(&key_word, key, sizeof(key_word));
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&word, data + i, sizeof(word));
+    word ^= key_word;
+    memcpy(data + i, &word, sizeof(word));
+  }
+  for (; i < len; i++) {
+    data[i] ^= key[i % 8];
+  }
+}
+
 /**
  * Respond to a ping message.
  * @param conn The Connection to respond on
@@ -51,47 +83,30 @@ void websocket_close_response(Connection* conn) {
  */
 int websocket_ping_response(Connection* conn, uint64_t len, int mask,
                             unsigned char masking_key[4]) {
-  unsigned char scratch[8] = {0};
-  int i;
+  unsigned char scratch[CONNECTION_BUFFER_SIZE];
+  uint64_t sent = 0;
+  size_t hdr_len, n;
   // Immediately respond with a PONG containing the same data, but
-  // unmasked.
+  // unmasked.  The header goes out with the first part of the data.
+  hdr_len = websocket_frame_header(scratch, len);
   scratch[0] = FIN_BIT | OPCODE_PONG;
-  if (writen_any(conn, scratch, 1) != 1) return -EIO;
-  // Write the length
-  if (len < 126) {
-    scratch[0] = len & 0x7F;
-    if (writen_any(conn, scratch, 1) != 1) return -EIO;
-  } else if (len < (1 << 16)) {
-    scratch[0] = 126;
-    if (writen_any(conn, scratch, 1) != 1) return -EIO;
-    scratch[0] = (len >> 8) & 0xFF;
-    scratch[1] = len & 0xFF;
-    if (writen_any(conn, scratch, 2) != 2) return -EIO;
-  } else {
-    scratch[0] = 127;
-    if (writen_any(conn, scratch, 1) != 1) return -EIO;
-    scratch[0] = (len >> 56) & 0xFF;
-    scratch[1] = (len >> 48) & 0xFF;
-    scratch[2] = (len >> 40) & 0xFF;
-    scratch[3] = (len >> 32) & 0xFF;
-    scratch[4] = (len >> 24) & 0xFF;
-    scratch[5] = (len >> 16) & 0xFF;
-    scratch[6] = (len >> 8) & 0xFF;
-    scratch[7] = len & 0xFF;
-    if (writen_any(conn, scratch, 8) != 8) return -EIO;
-  }
-  // Write the unmasked data.
-  for (i = 0; i < len; i++) {
-    if (readn_any(conn, scratch, 1) != 1) return -EIO;
-    if (mask) scratch[0] ^= masking_key[i % 4];
-    if (writen_any(conn, scratch, 1) != 1) return -EIO;
-  }
+  do {
+    n = sizeof(scratch) - hdr_len;
+    if (n > len - sent) n = len - sent;
+    if (n > 0 && readn_any(conn, scratch + hdr_len, n) != n) return -EIO;
+    if (mask) websocket_unmask(scratch + hdr_len, n, masking_key, sent);
+    if (writen_any(conn, scratch, hdr_len + n) != hdr_len + n) return -EIO;
+    sent += n;
+    hdr_len = 0;
+  } while (sent < len);
   return 0;
 }
 
 /**
  * Receive a websocket message.  Receive the data into memory and unmask it.
- * Websockets are defined in RFC 6455.
+ * Websockets are defined in RFC 6455.  The frame headers are parsed from the
+ * input buffer of the Connection, so that a small message usually takes a
+ * single read.
  * @param conn the connection on which the websocket data is arriving
  * @param data the location to which data will be written. In the case of
  *             failure it may or may not be partially filled in. It should be a
@@ -104,7 +119,7 @@ int websocket_ping_response(Connection* conn, uint64_t len, int mask,
  *          that we successfully read a message of length zero.
  */
 int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
-  unsigned char scratch[8];  // 8 bytes of scratch space
+  const unsigned char* header;
   int mask;
   unsigned char fin = 0;
   unsigned char opcode = 0;
@@ -114,8 +129,8 @@ int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
   uint64_t current_offset = 0ULL;
   uint64_t next_offset;
   int first_frame = 1;
-  size_t extra_len_bytes = 0;
-  size_t bytes_read;
+  size_t extra_len_bytes;
+  size_t header_len;
   if (max_len < 0) return -EINVAL;
   // Read frames until you find a FIN frame ending the message.  The first
   // frame may be (and in many cases probably is) the final frame.
@@ -142,37 +157,39 @@ int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
     // + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
     // |                     Payload Data continued ...                |
     // +---------------------------------------------------------------+
-    // Read the header all the way up to the beginning of Payload Data
-    // First read the 2-byte required header
-    if ((bytes_read = readn_any(conn, scratch, 2)) != 2) {
-      log_println(1, "Failed to read the 2 byte websocket header (%u)",
-                  bytes_read);
+    // Buffer the header all the way up to the beginning of Payload Data
+    // First the 2-byte required header
+    if ((header = peekn_any(conn, 2)) == NULL) {
+      log_println(1, "Failed to read the 2 byte websocket header");
       return -EIO;
     }
-    fin = scratch[0] & FIN_BIT;
-    opcode = scratch[0] & 0x0F;
-    mask = scratch[1] & MASK_BIT;
+    fin = header[0] & FIN_BIT;
+    opcode = header[0] & 0x0F;
+    mask = header[1] & MASK_BIT;
     // Length is either 7 bits, 16 bits, or 64 bits.
-    len = scratch[1] & 0x7F;
+    len = header[1] & 0x7F;
     // Check for the signal values of len
+    extra_len_bytes = 0;
     if (len == 126ULL) {
       extra_len_bytes = 2;
     } else if (len == 127ULL) {
       extra_len_bytes = 8;
     }
-    // Read the extra length bytes, if required.
+    // Then the extra length bytes and the 4 byte mask, if required.
+    header_len = 2 + extra_len_bytes + (mask ? 4 : 0);
+    if ((header = peekn_any(conn, header_len)) == NULL) {
+      log_println(1, "Failed to read the %u byte websocket header",
+                  header_len);
+      return -EIO;
+    }
     if (extra_len_bytes > 0) {
-      if ((bytes_read = readn_any(conn, scratch, extra_len_bytes)) !=
-          extra_len_bytes) {
-        log_println(1, "Failed to read the %u extra length bytes (%u)",
-                    extra_len_bytes, bytes_read);
-        return -EIO;
-      }
       len = 0ULL;
       for (i = 0; i < extra_len_bytes; i++) {
-        len = (len << 8) + scratch[i];
+        len = (len << 8) + header[2 + i];
       }
     }
+    if (mask) memcpy(masking_key, header + 2 + extra_len_bytes, 4);
+    skipn_any(conn, header_len);
     // Make sure that integer operations will not overflow.
     if (sop_addx(NULL, sop_u64(len), sop_u64(current_offset)))
       next_offset = len + current_offset;
@@ -180,10 +197,7 @@ int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
       return -EOVERFLOW;
     // Make sure the message will fit in the provided memory
     if (next_offset > max_len) return -EMSGSIZE;
-    // Read the 4 byte mask, if required
-    if (mask) {
-      if (readn_any(conn, masking_key, 4) != 4) return -EIO;
-    } else {
+    if (!mask) {
       // According to RFC 6455 Sec. 5.1. "The server MUST close the connection
       // upon receiving a frame that is not masked."
       websocket_close_response(conn);
@@ -200,9 +214,7 @@ int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
         return -EIO;
     } else if (opcode == OPCODE_PONG) {
       // Read the PONG. Ignore it.
-      for (i = 0; i < len; i++) {
-        if (readn_any(conn, scratch, 1) != 1) return -EIO;
-      }
+      if (skipn_any(conn, len) != len) return -EIO;
     } else if ((first_frame &&
                 (opcode == OPCODE_TEXT || opcode == OPCODE_BINARY)) ||
                (!first_frame && opcode == OPCODE_CONTINUE)) {
@@ -212,12 +224,9 @@ int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
       // Read the frame data into memory
       if (readn_any(conn, &(((char*)data)[current_offset]), (size_t)len) != len)
         return -EIO;
-      // Unmask the data, if required
-      if (mask) {
-        for (i = 0; i < len; i++) {
-          ((unsigned char*)data)[current_offset + i] ^= masking_key[i % 4];
-        }
-      }
+      // Unmask the data
+      websocket_unmask(&(((unsigned char*)data)[current_offset]), len,
+                       masking_key, 0);
       // Increment our state
       current_offset = next_offset;
       first_frame = 0;
@@ -234,6 +243,141 @@ int64_t recv_websocket_msg(Connection* conn, void* data, int64_t max_len) {
     return -EOVERFLOW;
 }
 
+/**
+ * Start a websocket stream whose data is only counted.
+ * @param sink The stream
+ */
+void websocket_sink_init(WebsocketSink* sink) {
+  memset(sink, 0, sizeof(*sink));
+}
+
+/**
+ * Returns the length of the header of a websocket frame from its first two
+ * bytes.
+ * @param header The header
+ */
+static unsigned int websocket_header_len(const unsigned char* header) {
+  unsigned int len = 2;
+  if ((header[1] & 0x7F) == 126) {
+    len += 2;
+  } else if ((header[1] & 0x7F) == 127) {
+    len += 8;
+  }
+  if (header[1] & MASK_BIT) len += 4;
+  return len;
+}
+
+/**
+ * Check the header of the next frame of a counted websocket stream, and
+ * start its payload.
+ * @param sink The stream
+ * @param header The whole header of the frame
+ * @return 0 on success, -ENOLINK if the frame is not masked, -EINVAL if it
+ *         breaks the framing rules
+ */
+static int start_sink_frame(WebsocketSink* sink, const unsigned char* header) {
+  int fin = header[0] & FIN_BIT;
+  int opcode = header[0] & 0x0F;
+  uint64_t len = header[1] & 0x7F;
+  int extra_len_bytes = 0;
+  int i;
+
+  // RFC 6455 Sec. 5.1: "The server MUST close the connection upon receiving
+  // a frame that is not masked."
+  if (!(header[1] & MASK_BIT)) return -ENOLINK;
+  // No extension was negotiated, so the RSV bits must be clear
+  if (header[0] & 0x70) return -EINVAL;
+  if (len == 126) {
+    extra_len_bytes = 2;
+  } else if (len == 127) {
+    extra_len_bytes = 8;
+  }
+  if (extra_len_bytes > 0) {
+    len = 0;
+    for (i = 0; i < extra_len_bytes; i++) {
+      len = (len << 8) + header[2 + i];
+    }
+    // The most significant bit of a 64 bit length must be 0
+    if (len >> 63) return -EINVAL;
+  }
+  sink->frames++;
+  sink->remaining = len;
+  sink->counting = 0;
+  switch (opcode) {
+    case OPCODE_TEXT:
+    case OPCODE_BINARY:
+      if (sink->fragmented) return -EINVAL;
+      sink->fragmented = !fin;
+      sink->counting = 1;
+      return 0;
+    case OPCODE_CONTINUE:
+      if (!sink->fragmented) return -EINVAL;
+      sink->fragmented = !fin;
+      sink->counting = 1;
+      return 0;
+    case OPCODE_CLOSE:
+      sink->closed = 1;
+      // fall through
+    case OPCODE_PING:
+    case OPCODE_PONG:
+      // Control frames are never fragmented, and carry at most 125 bytes
+      return (fin && len <= 125) ? 0 : -EINVAL;
+    default:
+      return -EINVAL;
+  }
+}
+
+/**
+ * Count the data of a websocket stream, as it is read from the socket.  The
+ * frame headers are parsed wherever the reads split them, and the payload
+ * of the data frames is counted, but never unmasked or copied.  The payload
+ * of control frames is not counted, and PINGs are not answered.  Everything
+ * after a CLOSE frame is ignored.
+ * @param sink The stream
+ * @param data The bytes read from the stream
+ * @param len The number of bytes read
+ * @param payload Incremented by the bytes of payload of the data frames
+ * @return 0 on success, -ENOLINK if a frame is not masked, -EINVAL if a
+ *         frame breaks the framing rules
+ */
+int websocket_sink_feed(WebsocketSink* sink, const unsigned char* data,
+                        size_t len, uint64_t* payload) {
+  const unsigned char* p = data;
+  const unsigned char* end = data + len;
+  const unsigned char* header;
+  uint64_t n;
+  int err;
+
+  while (p < end && !sink->closed) {
+    if (sink->remaining > 0) {
+      n = end - p;
+      if (n > sink->remaining) n = sink->remaining;
+      if (sink->counting) *payload += n;
+      sink->remaining -= n;
+      p += n;
+      continue;
+    }
+    if (sink->headerLen == 0 && end - p >= 2 &&
+        end - p >= websocket_header_len(p)) {
+      // The whole header is in this read
+      header = p;
+      p += websocket_header_len(p);
+    } else {
+      // Gather the header across reads
+      while (p < end && (sink->headerLen < 2 ||
+                         sink->headerLen < websocket_header_len(sink->header)))
+        sink->header[sink->headerLen++] = *p++;
+      if (sink->headerLen < 2 ||
+          sink->headerLen < websocket_header_len(sink->header))
+        break;
+      header = sink->header;
+      sink->headerLen = 0;
+    }
+    if ((err = start_sink_frame(sink, header)) != 0) return err;
+  }
+  return 0;
+}
+
 /**
  * Receives an NDT message sent over websockets. Arguments are modeled after
  * recv_msg in network.h.
@@ -269,7 +413,9 @@ int64_t recv_websocket_ndt_msg(Connection* conn, int* msg_type, char* msg_value,
 /**
  * Reads a line from the Connection, up to maxlen long. Returns the length
  * of the line on success, a negative number on failure. On success the string
- * in dest will be null terminated.
+ * in dest will be null terminated.  The line is taken from the input buffer
+ * of the Connection, which is filled with whatever the client has sent, so
+ * the bytes following the line are kept for the next read.
  * @param conn The connection to read from
  * @param dest The memory to put the read values
  * @param max_len The max number of allowed characters to read
@@ -277,23 +423,84 @@ int64_t recv_websocket_ndt_msg(Connection* conn, int* msg_type, char* msg_value,
  *          NULL), or an error code.
  */
 int ws_readline(Connection* conn, char* dest, unsigned int max_len) {
+  ConnectionBuffer* in;
+  const unsigned char* newline;
   unsigned int count = 0;
-  for (count = 0; count < max_len; count++) {
-    if (readn_any(conn, &(dest[count]), 1) != 1) return -EIO;
-    if (dest[count] == '\n') {
-      // Be robust to UNIX and DOS newlines
-      if (count > 0 && dest[count - 1] == '\r') {
-        // null-terminate the string
-        dest[count - 1] = '\0';
-        return count - 1;
-      } else {
-        // null-terminate the string
-        dest[count] = '\0';
-        return count;
-      }
+  size_t n;
+  do {
+    if (peekn_any(conn, 1) == NULL) return -EIO;
+    in = conn->in;
+    n = in->end - in->start;
+    newline = memchr(in->data + in->start, '\n', n);
+    if (newline != NULL) n = newline - (in->data + in->start) + 1;
+    if (count + n > max_len) return -EMSGSIZE;
+    memcpy(&(dest[count]), in->data + in->start, n);
+    in->start += n;
+    count += n;
+  } while (newline == NULL);
+  // Drop the newline, and be robust to UNIX and DOS newlines
+  count--;
+  if (count > 0 && dest[count - 1] == '\r') count--;
+  // null-terminate the string
+  dest[count] = '\0';
+  return count;
+}
+
+// The request headers that read_websocket_header looks at
+enum {
+  WS_UPGRADE,
+  WS_CONNECTION,
+  WS_VERSION,
+  WS_PROTOCOL_NAME,
+  WS_KEY,
+  WS_HEADER_COUNT
+};
+const static char* const WS_HEADER_NAMES[WS_HEADER_COUNT] = {
+    "Upgrade", "Connection", "Sec-WebSocket-Version", "Sec-WebSocket-Protocol",
+    "Sec-WebSocket-Key"};
+
+/**
+ * Hash the name of an HTTP header, which is case-insensitive, with FNV-1a.
+ * @param name The name
+ * @param len The length of the name
+ * @returns The hash
+ */
+static uint32_t http_header_hash(const char* name, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Find which of the headers we look at an HTTP header is.  The names we
+ * look for are hashed once, so that the name of each header of the request
+ * is hashed and compared once, instead of being compared with every name.
+ * @param name The name of the header
+ * @param len The length of the name
+ * @returns The index of the header in WS_HEADER_NAMES, or -1
+ */
+static int find_websocket_header(const char* name, size_t len) {
+  static uint32_t hashes[WS_HEADER_COUNT];
+  static int hashed = 0;
+  uint32_t hash;
+  int i;
+  if (!hashed) {
+    for (i = 0; i < WS_HEADER_COUNT; i++) {
+      hashes[i] = http_header_hash(WS_HEADER_NAMES[i],
+                                   strlen(WS_HEADER_NAMES[i]));
     }
+    hashed = 1;
+  }
+  hash = http_header_hash(name, len);
+  for (i = 0; i < WS_HEADER_COUNT; i++) {
+    if (hash == hashes[i] && strlen(WS_HEADER_NAMES[i]) == len &&
+        strncasecmp(WS_HEADER_NAMES[i], name, len) == 0)
+      return i;
   }
-  return -EMSGSIZE;
+  return -1;
 }
 
 /**
@@ -361,6 +568,9 @@ int send_digest_base64(Connection* conn, const unsigned char* message_digest) {
 
 /**
  * Reads the websocket header and determines whether it is well-formed.
+ * The request is read in large chunks through the input buffer of the
+ * Connection, and whatever the client sent after it is left there for the
+ * websocket layer.
  * @param socket_fd The socket on which the connection is happening.
  * @param skip_bytes How many bytes of the initial handshake have already
  *                   been read and validated?
@@ -379,19 +589,15 @@ int read_websocket_header(Connection* conn, unsigned int skip_bytes,
   const static unsigned int MAX_HEADER_COUNT = 1024;
   char line[8192];  // Max length for a single line
   // String constants used when making a websocket connection.
-  const static char UPGRADE_HEADER[] = "Upgrade: websocket";
-  const static char CONNECTION_HEADER[] = "Connection: ";
-  const static char CONNECTION_HEADER_VALUE[] = " Upgrade";
-  const static char VERSION_HEADER[] = "Sec-WebSocket-Version: 13";
-  const static char WS_KEY[] = "Sec-WebSocket-Key: ";
   const static char FIRST_LINE[] = "GET /ndt_protocol HTTP/1.1";
   // Variables that actually vary
-  const char* suffix;
+  char* value;
+  char* end;
   int validated_connection = 0;
   int validated_upgrade = 0;
   int validated_version = 0;
   int validated_protocol = 0;
-  int i;
+  int i, len;
   // You can only fastforward into the very first line
   if (skip_bytes >= strlen(FIRST_LINE)) return EINVAL;
   // Read the first line.
@@ -400,37 +606,46 @@ int read_websocket_header(Connection* conn, unsigned int skip_bytes,
   // HTTP headers end with a blank line
   // We only save the header values we care about. The headers we only need to
   // check (i.e. have no data we need for later) are handled as they arrive.
-  if (ws_readline(conn, line, sizeof(line)) < 0) return EIO;
-  for (i = 0; i < MAX_HEADER_COUNT; i++) {
-    if (strcasecmp(line, UPGRADE_HEADER) == 0) {
-      validated_upgrade = 1;
-    } else if (strncmp(line, CONNECTION_HEADER, strlen(CONNECTION_HEADER)) ==
-               0) {
-      if (strstr(line, CONNECTION_HEADER_VALUE) != NULL) {
-        validated_connection = 1;
-      }
-    } else if (strcmp(line, VERSION_HEADER) == 0) {
-      validated_version = 1;
-    } else if (strncmp(line, WS_PROTOCOL, strlen(WS_PROTOCOL)) == 0) {
-      if (expected_protocol == NULL || strcmp(expected_protocol, "") == 0) {
-        validated_protocol = 1;
-      } else {
-        suffix = &(line[strlen(WS_PROTOCOL)]);
-        validated_protocol = (strstr(suffix, expected_protocol) != NULL);
+  if ((len = ws_readline(conn, line, sizeof(line))) < 0) return EIO;
+  for (i = 0; i < MAX_HEADER_COUNT && len > 0; i++) {
+    // Split the header into its name and its value, without the
+    // surrounding whitespace.
+    if ((value = memchr(line, ':', len)) != NULL) {
+      *value = '\0';
+      for (value++; *value == ' ' || *value == '\t'; value++) continue;
+      for (end = line + len; end > value && (end[-1] == ' ' || end[-1] == '\t');
+           end--)
+        continue;
+      *end = '\0';
+      switch (find_websocket_header(line, strlen(line))) {
+        case WS_UPGRADE:
+          validated_upgrade = (strcasecmp(value, "websocket") == 0);
+          break;
+        case WS_CONNECTION:
+          // A list of options, one of which must be Upgrade
+          if (strcasestr(value, "Upgrade") != NULL) validated_connection = 1;
+          break;
+        case WS_VERSION:
+          validated_version = (strcmp(value, "13") == 0);
+          break;
+        case WS_PROTOCOL_NAME:
+          validated_protocol =
+              (expected_protocol == NULL || strcmp(expected_protocol, "") == 0 ||
+               strstr(value, expected_protocol) != NULL);
+          break;
+        case WS_KEY:
+          if (strlen(value) + 1 != BASE64_SHA_DIGEST_LENGTH) return EBADMSG;
+          strncpy(key, value, BASE64_SHA_DIGEST_LENGTH);
+          break;
       }
-    } else if (strncmp(line, WS_KEY, strlen(WS_KEY)) == 0) {
-      suffix = &(line[strlen(WS_KEY)]);
-      if (strlen(suffix) + 1 != BASE64_SHA_DIGEST_LENGTH) return EBADMSG;
-      strncpy(key, suffix, BASE64_SHA_DIGEST_LENGTH);
     }
-    if (ws_readline(conn, line, sizeof(line)) < 0) return EIO;
-    if (strcmp(line, "") == 0) break;
+    if ((len = ws_readline(conn, line, sizeof(line))) < 0) return EIO;
   }
-  if (strcmp(line, "") == 0 && validated_connection && validated_upgrade &&
+  if (len == 0 && validated_connection && validated_upgrade &&
       validated_version && validated_protocol) {
     return 0;
   } else {
-    if (strcmp(line, "") != 0)
+    if (len != 0)
       log_println(1, "Websocket connection failed: bad last line of header");
     if (!validated_connection)
       log_println(1, "Websocket connection failed: bad Connection: header");
@@ -520,10 +735,43 @@ int initialize_websocket_connection(Connection* conn, unsigned int skip_bytes,
   return 0;
 }
 
+/**
+ * Fills in the header of a websocket frame sent from the server to a client,
+ * which carries one NDT message.  Messages sent from a server are never
+ * masked, so the header is followed directly by the payload.
+ * @param dest The place for the header, with room for WEBSOCKET_MAX_HEADER
+ *             bytes
+ * @param len The length of the payload, the NDT header included
+ * @return The length of the header
+ */
+int websocket_frame_header(unsigned char* dest, uint64_t len) {
+  int i;
+
+  dest[0] = FIN_BIT | OPCODE_BINARY;
+  if (len < 126) {
+    // 7 bits for the length
+    dest[1] = len & 0x7F;
+    return 2;
+  } else if (len < (1 << 16)) {
+    // Signal value for "2 byte length", then 16 bits for the length
+    dest[1] = 126;
+    dest[2] = (len >> 8) & 0xFF;
+    dest[3] = len & 0xFF;
+    return 4;
+  }
+  // Signal value for "8 byte length", then 64 bits for the length
+  dest[1] = 127;
+  for (i = 0; i < 8; ++i) {
+    dest[i + 2] = (len >> ((7 - i) * 8)) & 0xFF;
+  }
+  return WEBSOCKET_MAX_HEADER;
+}
+
 /**
  * Sends a websocket frame from the server to a client.  Messages sent from a
  * server MUST NOT be masked, according to the RFC, and so this function does
- * not support masking.  The arguments are modeled after send_msg.
+ * not support masking.  The arguments are modeled after send_msg.  The
+ * websocket header goes out in the same write as the NDT message.
  * @param conn The Connection on which tto send data
  * @param type The NDT message type
  * @param msg A pointer to the data to be sent
@@ -531,47 +779,19 @@ int initialize_websocket_connection(Connection* conn, unsigned int skip_bytes,
  */
 int send_websocket_msg(Connection* conn, int type, const void* msg,
                        uint64_t len) {
+  unsigned char websocket_hdr[WEBSOCKET_MAX_HEADER];
   int websocket_hdr_len;
-  int err;
-  int i;
-  uint64_t websocket_msg_len;
-  char websocket_msg[10];  // Max websocket header size if there is no mask
-  if (sop_addx(NULL, sop_u64(len), sop_u64(3))) {
-    websocket_msg_len = len + 3;  // NDT header is always 3 bytes
-  } else {
+
+  if (!sop_addx(NULL, sop_u64(len), sop_u64(3))) {
     return EINVAL;
   }
-  // Set up the websocket header
-  websocket_msg[0] = (char)0x82;  // FIN_BIT | BINARY_OPCODE
-  if (websocket_msg_len < 126) {
-    websocket_hdr_len = 2;
-    if (websocket_msg == NULL) return ENOMEM;
-    // 7 bits for the length
-    websocket_msg[1] = (char)(websocket_msg_len & 0x7F);
-  } else if (websocket_msg_len < (1 << 16)) {
-    websocket_hdr_len = 4;
-    if (websocket_msg == NULL) return ENOMEM;
-    // Signal value for "2 byte length"
-    websocket_msg[1] = 126;
-    // 16 bits for the length
-    websocket_msg[2] = (websocket_msg_len >> 8) & 0xFF;
-    websocket_msg[3] = websocket_msg_len & 0xFF;
-  } else {
-    websocket_hdr_len = 10;
-    if (websocket_msg == NULL) return ENOMEM;
-    // Signal value for "8 byte length"
-    websocket_msg[1] = 127;
-    // 64 bits for the length
-    for (i = 0; i < 8; ++i) {
-      websocket_msg[i + 2] = (websocket_msg_len >> ((7 - i) * 8)) & 0xFF;
-    }
-  }
-  // Send the header
-  if (writen_any(conn, websocket_msg, websocket_hdr_len) != websocket_hdr_len) {
-    return EIO;
-  }
+  // NDT header is always 3 bytes
+  websocket_hdr_len = websocket_frame_header(websocket_hdr, len + 3);
   // Websocket server -> client messages are not masked, so we can just send it
   // like it's an NDT message.
-  err = send_msg_any(conn, type, msg, (int)len);
-  return err;
+  if (send_msg_prefixed(conn, websocket_hdr, websocket_hdr_len, type, msg,
+                        (int)len) != 0) {
+    return EIO;
+  }
+  return 0;
 }
@@ -1,13 +1,36 @@
 #ifndef SRC_WEBSOCKET_H
 #define SRC_WEBSOCKET_H
 
+#include <stdint.h>
 #include "connection.h"
 
+// Longest header of a websocket frame from the server, which is never masked
+#define WEBSOCKET_MAX_HEADER 10
+
+// Longest header of a websocket frame from a client, which is always masked
+#define WEBSOCKET_MAX_CLIENT_HEADER 14
+
+// A websocket stream whose data is only counted, parsed as it arrives
+typedef struct websocketSink {
+  unsigned char header[WEBSOCKET_MAX_CLIENT_HEADER];  // partial frame header
+  unsigned int headerLen;  // bytes of the partial frame header
+  uint64_t remaining;  // bytes left of the payload of the current frame
+  int counting;  // set if the current frame carries data
+  int fragmented;  // set while a fragmented message is not finished
+  int closed;  // set once the client sent a CLOSE frame
+  uint64_t frames;  // frames received
+} WebsocketSink;
+
 int initialize_websocket_connection(Connection* conn, unsigned int skip_bytes,
                                     char* protocol);
 int64_t recv_websocket_msg(Connection* conn, void* data, int64_t len);
 int64_t recv_websocket_ndt_msg(Connection* conn, int* msg_type,
                                char* msg_value, int* msg_len);
 
+void websocket_close_response(Connection* conn);
+int websocket_frame_header(unsigned char* dest, uint64_t len);
+void websocket_sink_init(WebsocketSink* sink);
+int websocket_sink_feed(WebsocketSink* sink, const unsigned char* data,
+                        size_t len, uint64_t* payload);
 int send_websocket_msg(Connection* conn, int type, const void* msg, uint64_t len);
 #endif  // SRC_WEBSOCKET_H
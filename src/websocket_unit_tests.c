@@ -4,10 +4,13 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "jsonutils.h"
 #include "logging.h"
 #include "network.h"
+#include "protocol.h"
 #include "unit_testing.h"
 #include "websocket.h"
 
@@ -15,6 +18,10 @@
 // want to expose to the rest of the program.
 int websocket_sha(const char* key, unsigned long len, unsigned char* dest);
 int send_digest_base64(Connection* conn, const unsigned char* digest);
+void websocket_unmask(unsigned char* data, uint64_t len,
+                      const unsigned char masking_key[4], uint64_t offset);
+int read_websocket_header(Connection* conn, unsigned int skip_bytes,
+                          char* expected_protocol, char* key);
 
 /* Creates a socket pair and forks a subprocess to send data in one end. After
  * reading the data from the other end, reports whether all the data was the
@@ -165,6 +172,302 @@ void test_rfc_example_fragmented_with_ping() {
                             0);
 }
 
+void test_recv_pipelined_msgs() {
+  // A message needing a 2 byte length, then two small ones, all sent in one
+  // write and read ahead together.
+  unsigned char raw_data[8 + 200 + 2 * (6 + 5)] = {
+      0x82, 0xFE, 0x00, 0xC8, 0x01, 0x02, 0x03, 0x04};
+  unsigned char received[200];
+  const unsigned char mask[4] = {0x01, 0x02, 0x03, 0x04};
+  int sockets[2];
+  Connection child_conn = {-1, NULL}, parent_conn = {-1, NULL};
+  int i, j;
+
+  for (i = 0; i < 200; i++) {
+    raw_data[8 + i] = 'a' ^ mask[i % 4];
+  }
+  for (j = 0; j < 2; j++) {
+    memcpy(&raw_data[208 + j * 11], "\x82\x85\x01\x02\x03\x04", 6);
+    for (i = 0; i < 5; i++) {
+      raw_data[208 + j * 11 + 6 + i] = HELLO[i] ^ mask[i % 4];
+    }
+  }
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  child_conn.socket = sockets[0];
+  parent_conn.socket = sockets[1];
+  CHECK(writen_any(&child_conn, raw_data, sizeof(raw_data)) ==
+        sizeof(raw_data));
+  CHECK(recv_websocket_msg(&parent_conn, received, sizeof(received)) == 200);
+  for (i = 0; i < 200; i++) {
+    CHECK(received[i] == 'a');
+  }
+  for (j = 0; j < 2; j++) {
+    CHECK(recv_websocket_msg(&parent_conn, received, sizeof(received)) == 5);
+    CHECK(memcmp(received, HELLO, 5) == 0);
+  }
+  close_connection(&child_conn);
+  close_connection(&parent_conn);
+}
+
+void test_websocket_unmask() {
+  const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+  unsigned char data[64], expected[64];
+  int len, offset, start, i;
+
+  // Every alignment, every starting byte of the mask, and the lengths around
+  // a multiple of the word size.
+  for (start = 0; start < 8; start++) {
+    for (offset = 0; offset < 8; offset++) {
+      for (len = 0; len <= 33; len++) {
+        for (i = 0; i < len; i++) {
+          data[start + i] = i * 7;
+          expected[start + i] = (i * 7) ^ mask[(offset + i) % 4];
+        }
+        websocket_unmask(data + start, len, mask, offset);
+        ASSERT(memcmp(data + start, expected + start, len) == 0,
+               "Bad unmasking of %d bytes at %d from mask byte %d", len,
+               start, offset);
+      }
+    }
+  }
+}
+
+/* Returns the CLOCK_MONOTONIC time, in seconds. */
+double monotonic_secs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Receives a masked data frame the way recv_websocket_msg did before it had
+ * an input buffer: with a read for each part of the header, and unmasking a
+ * byte at a time.  Kept to benchmark recv_websocket_msg against.
+ * @param conn The Connection to read from
+ * @param data Where to put the payload
+ * @param max_len The size of data
+ * @return The length of the payload, or an error code
+ */
+int64_t recv_unbuffered_frame(Connection* conn, unsigned char* data,
+                              int64_t max_len) {
+  unsigned char scratch[8], masking_key[4];
+  size_t extra_len_bytes = 0;
+  uint64_t len, i;
+
+  if (readn_any(conn, scratch, 2) != 2) return -EIO;
+  len = scratch[1] & 0x7F;
+  if (len == 126) {
+    extra_len_bytes = 2;
+  } else if (len == 127) {
+    extra_len_bytes = 8;
+  }
+  if (extra_len_bytes > 0) {
+    if (readn_any(conn, scratch, extra_len_bytes) != extra_len_bytes)
+      return -EIO;
+    len = 0;
+    for (i = 0; i < extra_len_bytes; i++) {
+      len = (len << 8) + scratch[i];
+    }
+  }
+  if (len > max_len) return -EMSGSIZE;
+  if (readn_any(conn, masking_key, 4) != 4) return -EIO;
+  if (readn_any(conn, data, len) != len) return -EIO;
+  for (i = 0; i < len; i++) {
+    data[i] ^= masking_key[i % 4];
+  }
+  return len;
+}
+
+/* Times receiving the same frames with recv_websocket_msg and with
+ * recv_unbuffered_frame, and checks that both get the same payloads.
+ * @param frames The number of frames
+ * @param payload_len The length of the payload of each frame, below 65536
+ */
+void benchmark_frames(int frames, int payload_len) {
+  unsigned char* raw_data;
+  unsigned char* received;
+  unsigned char* reference;
+  int frame_len = 8 + payload_len;
+  int sockets[2], method, i;
+  pid_t writer_pid;
+  int writer_exit_code;
+  Connection child_conn = {-1, NULL}, parent_conn = {-1, NULL};
+  double start, elapsed[2];
+
+  CHECK((raw_data = (unsigned char*)malloc(frames * frame_len)) != NULL);
+  CHECK((received = (unsigned char*)malloc(payload_len)) != NULL);
+  // Every payload read the old way, to compare with recv_websocket_msg
+  CHECK((reference = (unsigned char*)malloc(frames * payload_len)) != NULL);
+  for (i = 0; i < frames; i++) {
+    // FIN_BIT | BINARY_OPCODE, MASK_BIT | 2 byte length, and the mask
+    raw_data[i * frame_len] = 0x82;
+    raw_data[i * frame_len + 1] = 0xFE;
+    raw_data[i * frame_len + 2] = payload_len >> 8;
+    raw_data[i * frame_len + 3] = payload_len & 0xFF;
+    memcpy(&raw_data[i * frame_len + 4], "\x01\x02\x03\x04", 4);
+    memset(&raw_data[i * frame_len + 8], 'a' + (i & 15), payload_len);
+  }
+  for (method = 0; method < 2; method++) {
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    child_conn.socket = sockets[0];
+    parent_conn.socket = sockets[1];
+    if ((writer_pid = fork()) == 0) {
+      close(sockets[1]);
+      CHECK(writen_any(&child_conn, raw_data, frames * frame_len) ==
+            frames * frame_len);
+      exit(0);
+    }
+    close(sockets[0]);
+    start = monotonic_secs();
+    for (i = 0; i < frames; i++) {
+      if (method == 0) {
+        CHECK(recv_unbuffered_frame(&parent_conn,
+                                    reference + i * payload_len,
+                                    payload_len) == payload_len);
+      } else {
+        CHECK(recv_websocket_msg(&parent_conn, received, payload_len) ==
+              payload_len);
+        CHECK(memcmp(received, reference + i * payload_len, payload_len) ==
+              0);
+      }
+    }
+    elapsed[method] = monotonic_secs() - start;
+    CHECK(reference[frames * payload_len - 1] ==
+          (('a' + ((frames - 1) & 15)) ^ 0x04));
+    close_connection(&parent_conn);
+    waitpid(writer_pid, &writer_exit_code, 0);
+    CHECK(WIFEXITED(writer_exit_code) && WEXITSTATUS(writer_exit_code) == 0);
+  }
+  fprintf(stderr, "%d frames of %d bytes: %.2f ms unbuffered, %.2f ms "
+          "buffered\n", frames, payload_len, elapsed[0] * 1000,
+          elapsed[1] * 1000);
+  free(raw_data);
+  free(received);
+  free(reference);
+}
+
+void test_benchmark_recv_websocket_msg() {
+  const unsigned char mask[4] = {0x01, 0x02, 0x03, 0x04};
+  const int len = 1 << 20, rounds = 64;
+  unsigned char* data;
+  unsigned char* expected;
+  double start, byte_time, word_time;
+  uint64_t i;
+  int j;
+
+  benchmark_frames(20000, 100);
+  benchmark_frames(500, 60000);
+
+  CHECK((data = (unsigned char*)malloc(len)) != NULL);
+  CHECK((expected = (unsigned char*)malloc(len)) != NULL);
+  memset(data, 'a', len);
+  start = monotonic_secs();
+  for (j = 0; j < rounds; j++) {
+    for (i = 0; i < len; i++) {
+      data[i] ^= mask[i % 4];
+    }
+  }
+  byte_time = monotonic_secs() - start;
+  // Both ways unmask the data the same
+  for (i = 0; i < len; i++) expected[i] = data[i] ^ mask[i % 4];
+  websocket_unmask(data, len, mask, 0);
+  CHECK(memcmp(data, expected, len) == 0);
+  websocket_unmask(data, len, mask, 0);
+  start = monotonic_secs();
+  for (j = 0; j < rounds; j++) {
+    websocket_unmask(data, len, mask, 0);
+  }
+  word_time = monotonic_secs() - start;
+  // An even number of rounds of each leaves the data unmasked
+  CHECK(data[0] == 'a' && data[len - 1] == 'a');
+  fprintf(stderr, "Unmasking %d MB: %.2f ms a byte at a time, %.2f ms a word "
+          "at a time\n", rounds * len >> 20, byte_time * 1000,
+          word_time * 1000);
+  free(data);
+  free(expected);
+}
+
+/* Appends a masked websocket frame with a payload of zeros.
+ * @param dest Where to append the frame
+ * @param first_byte The FIN bit and the opcode
+ * @param len The length of the payload, below 65536
+ * @return The length of the frame
+ */
+int append_masked_frame(unsigned char* dest, unsigned char first_byte,
+                        int len) {
+  int hdr_len = 2;
+  dest[0] = first_byte;
+  if (len < 126) {
+    dest[1] = 0x80 | len;
+  } else {
+    dest[1] = 0x80 | 126;
+    dest[2] = len >> 8;
+    dest[3] = len & 0xFF;
+    hdr_len = 4;
+  }
+  memcpy(dest + hdr_len, "\x01\x02\x03\x04", 4);
+  memset(dest + hdr_len + 4, 0, len);
+  return hdr_len + 4 + len;
+}
+
+void test_websocket_sink() {
+  unsigned char stream[1024];
+  WebsocketSink sink;
+  uint64_t payload;
+  int len = 0, split, i;
+
+  // A fragmented message with a PING in the middle, then a small message.
+  len += append_masked_frame(stream + len, 0x02, 300);
+  len += append_masked_frame(stream + len, 0x89, 5);
+  len += append_masked_frame(stream + len, 0x80, 200);
+  len += append_masked_frame(stream + len, 0x81, 7);
+  // Split the stream in two at every position, and then read it a byte at a
+  // time.
+  for (split = 0; split <= len; split++) {
+    websocket_sink_init(&sink);
+    payload = 0;
+    CHECK(websocket_sink_feed(&sink, stream, split, &payload) == 0);
+    CHECK(websocket_sink_feed(&sink, stream + split, len - split,
+                              &payload) == 0);
+    ASSERT(payload == 507, "Counted %d bytes of payload split at %d",
+           (int) payload, split);
+    CHECK(sink.frames == 4 && sink.headerLen == 0 && sink.remaining == 0);
+  }
+  websocket_sink_init(&sink);
+  payload = 0;
+  for (i = 0; i < len; i++) {
+    CHECK(websocket_sink_feed(&sink, stream + i, 1, &payload) == 0);
+  }
+  CHECK(payload == 507 && sink.frames == 4);
+
+  // Nothing after a CLOSE frame is counted.
+  len = append_masked_frame(stream, 0x82, 10);
+  len += append_masked_frame(stream + len, 0x88, 2);
+  len += append_masked_frame(stream + len, 0x82, 10);
+  websocket_sink_init(&sink);
+  payload = 0;
+  CHECK(websocket_sink_feed(&sink, stream, len, &payload) == 0);
+  CHECK(sink.closed && payload == 10);
+
+  // Frames breaking the rules.
+  websocket_sink_init(&sink);
+  len = append_masked_frame(stream, 0x82, 10);
+  stream[1] &= 0x7F;  // not masked
+  CHECK(websocket_sink_feed(&sink, stream, len, &payload) == -ENOLINK);
+  websocket_sink_init(&sink);
+  len = append_masked_frame(stream, 0x80, 10);  // continues nothing
+  CHECK(websocket_sink_feed(&sink, stream, len, &payload) == -EINVAL);
+  websocket_sink_init(&sink);
+  len = append_masked_frame(stream, 0x02, 10);
+  len += append_masked_frame(stream + len, 0x82, 10);  // interleaved message
+  CHECK(websocket_sink_feed(&sink, stream, len, &payload) == -EINVAL);
+  websocket_sink_init(&sink);
+  len = append_masked_frame(stream, 0x09, 10);  // fragmented PING
+  CHECK(websocket_sink_feed(&sink, stream, len, &payload) == -EINVAL);
+  websocket_sink_init(&sink);
+  len = append_masked_frame(stream, 0xC2, 10);  // RSV1 set
+  CHECK(websocket_sink_feed(&sink, stream, len, &payload) == -EINVAL);
+}
+
 void test_messages_too_large() {
   pid_t child_pid;
   int child_exit_code;
@@ -388,6 +691,107 @@ void test_ie11_websocket_handshake() {
   check_websocket_handshake(header, response);
 }
 
+/* A request with a websocket frame pipelined behind it, as a client which
+ * does not wait for the response may send it. */
+const char PIPELINED_HANDSHAKE[] =
+    "GET /ndt_protocol HTTP/1.1\r\n"
+    "Host: ndt.iupui.mlab2.nuq0t.measurement-lab.org:7000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:35.0) Gecko/20100101\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en,es;q=0.7,en-us;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Origin: null\r\n"
+    "sec-websocket-protocol: ndt\r\n"
+    "Sec-WebSocket-Key:FXsRm8SyAc2WCzXCn248UQ== \r\n"
+    "Connection: keep-alive, Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "UPGRADE: websocket\r\n"
+    "\r\n"
+    "\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58";  // "Hello"
+
+void test_frame_pipelined_after_header() {
+  char key[25];  // a base64 SHA1 digest
+  char received[6];
+  int sockets[2];
+  Connection child_conn = {-1, NULL}, parent_conn = {-1, NULL};
+
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  child_conn.socket = sockets[0];
+  parent_conn.socket = sockets[1];
+  CHECK(writen_any(&child_conn, PIPELINED_HANDSHAKE,
+                   sizeof(PIPELINED_HANDSHAKE) - 1) ==
+        sizeof(PIPELINED_HANDSHAKE) - 1);
+  CHECK(read_websocket_header(&parent_conn, 0, "ndt", key) == 0);
+  CHECK(strcmp(key, "FXsRm8SyAc2WCzXCn248UQ==") == 0);
+  CHECK(recv_websocket_msg(&parent_conn, received, 5) == 5);
+  CHECK(strncmp(received, "Hello", 5) == 0);
+  close_connection(&child_conn);
+  close_connection(&parent_conn);
+}
+
+/* Reads a line the way ws_readline did before it read through the input
+ * buffer: a byte at a time.  Kept to benchmark read_websocket_header against.
+ * @param conn The Connection to read from
+ * @param dest Where to put the line
+ * @param max_len The size of dest
+ * @return The length of the line, or an error code
+ */
+int readline_unbuffered(Connection* conn, char* dest, unsigned int max_len) {
+  unsigned int count;
+  for (count = 0; count < max_len; count++) {
+    if (readn_any(conn, &(dest[count]), 1) != 1) return -EIO;
+    if (dest[count] == '\n') {
+      if (count > 0 && dest[count - 1] == '\r') count--;
+      dest[count] = '\0';
+      return count;
+    }
+  }
+  return -EMSGSIZE;
+}
+
+/* Times reading the headers of many websocket handshakes with
+ * read_websocket_header and with readline_unbuffered, one handshake per
+ * stream, as the streams of a multi-stream test would send them. */
+void test_benchmark_read_websocket_header() {
+  const int streams = 2000;
+  const size_t header_len = strstr(PIPELINED_HANDSHAKE, "\r\n\r\n") + 4 -
+                            PIPELINED_HANDSHAKE;
+  char key[25];  // a base64 SHA1 digest
+  char line[8192];
+  int sockets[2], method, i, len;
+  Connection child_conn = {-1, NULL}, parent_conn = {-1, NULL};
+  double start, elapsed[2];
+
+  for (method = 0; method < 2; method++) {
+    elapsed[method] = 0;
+    for (i = 0; i < streams; i++) {
+      CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+      child_conn.socket = sockets[0];
+      parent_conn.socket = sockets[1];
+      CHECK(writen_any(&child_conn, PIPELINED_HANDSHAKE, header_len) ==
+            header_len);
+      start = monotonic_secs();
+      if (method == 0) {
+        do {
+          CHECK((len = readline_unbuffered(&parent_conn, line,
+                                           sizeof(line))) >= 0);
+        } while (len > 0);
+      } else {
+        CHECK(read_websocket_header(&parent_conn, 0, "ndt", key) == 0);
+        CHECK(strcmp(key, "FXsRm8SyAc2WCzXCn248UQ==") == 0);
+      }
+      elapsed[method] += monotonic_secs() - start;
+      close_connection(&child_conn);
+      close_connection(&parent_conn);
+    }
+  }
+  fprintf(stderr, "Handshake of %zu bytes: %.2f us a byte at a time, %.2f us "
+          "buffered\n", header_len, elapsed[0] * 1e6 / streams,
+          elapsed[1] * 1e6 / streams);
+}
+
 void test_websocket_sha() {
   const char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
   const unsigned char expected_digest[20] = {
@@ -433,9 +837,93 @@ void test_send_digest_base64() {
   check_send_digest_base64(digest, expected);
 }
 
+/* Reads everything sent down a socket until the other end is closed.
+ * @param sockfd The socket to read from
+ * @param dest The place for the data
+ * @param max_len The size of dest
+ * @return The number of bytes read
+ */
+int read_until_closed(int sockfd, char* dest, int max_len) {
+  int n, total = 0;
+  while (total < max_len &&
+         (n = read(sockfd, dest + total, max_len - total)) > 0)
+    total += n;
+  return total;
+}
+
+/* Sends the same messages once with send_json_message_any and once through a
+ * MsgBatch, from a subprocess, and checks that the client receives the same
+ * bytes both ways.
+ * @param connection_flags The JSON_SUPPORT and WEBSOCKET_SUPPORT flags
+ */
+void check_msg_batch(int connection_flags) {
+  static char expected[3 * MSG_BATCH_SIZE], received[3 * MSG_BATCH_SIZE];
+  static char large[MSG_BATCH_SIZE + 100];
+  const char* lines[] = {"CurMSS: 1448\n", "SACKEnabled: 3\n",
+                         "quote \" and backslash \\ and \001 tab\t\n"};
+  int old_sockets[2], new_sockets[2];
+  int expected_len, received_len;
+  Connection old_conn = {-1, NULL}, new_conn = {-1, NULL};
+  MsgBatch batch;
+  pid_t writer_pid;
+  int writer_exit_code;
+  int i, j;
+
+  memset(large, 'a', sizeof(large) - 1);
+  large[sizeof(large) - 1] = '\0';
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, old_sockets) == 0);
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, new_sockets) == 0);
+  if ((writer_pid = fork()) == 0) {
+    close(old_sockets[1]);
+    close(new_sockets[1]);
+    old_conn.socket = old_sockets[0];
+    new_conn.socket = new_sockets[0];
+    // Enough small messages to fill the batch more than once
+    for (i = 0; i < 300; i++) {
+      j = i % (sizeof(lines) / sizeof(lines[0]));
+      CHECK(send_json_message_any(&old_conn, TEST_MSG, lines[j],
+                                  strlen(lines[j]), connection_flags,
+                                  JSON_SINGLE_VALUE) == 0);
+    }
+    // A message too large for the batch goes out on its own
+    CHECK(send_json_message_any(&old_conn, TEST_MSG, large, strlen(large),
+                                connection_flags, JSON_SINGLE_VALUE) == 0);
+    close(old_sockets[0]);
+
+    msg_batch_init(&batch, &new_conn, connection_flags);
+    for (i = 0; i < 300; i++) {
+      j = i % (sizeof(lines) / sizeof(lines[0]));
+      CHECK(msg_batch_add_json(&batch, TEST_MSG, lines[j],
+                               strlen(lines[j])) == 0);
+    }
+    CHECK(msg_batch_add_json(&batch, TEST_MSG, large, strlen(large)) == 0);
+    CHECK(msg_batch_flush(&batch) == 0);
+    close(new_sockets[0]);
+    exit(0);
+  }
+  close(old_sockets[0]);
+  close(new_sockets[0]);
+  expected_len = read_until_closed(old_sockets[1], expected, sizeof(expected));
+  received_len = read_until_closed(new_sockets[1], received, sizeof(received));
+  ASSERT(expected_len == received_len, "Sent %d bytes in a batch, not %d",
+         received_len, expected_len);
+  CHECK(memcmp(expected, received, expected_len) == 0);
+  close(old_sockets[1]);
+  close(new_sockets[1]);
+  waitpid(writer_pid, &writer_exit_code, 0);
+  CHECK(WIFEXITED(writer_exit_code) && WEXITSTATUS(writer_exit_code) == 0);
+}
+
+void test_msg_batch() {
+  check_msg_batch(0);
+  check_msg_batch(JSON_SUPPORT);
+  check_msg_batch(JSON_SUPPORT | WEBSOCKET_SUPPORT);
+}
+
 int main() {
+  int failed;
   set_debuglvl(-1);
-  return RUN_TEST(test_messages_too_large) | RUN_TEST(test_recv_jumbo_msg) |
+  failed = RUN_TEST(test_messages_too_large) | RUN_TEST(test_recv_jumbo_msg) |
          RUN_TEST(test_recv_large_msg) | RUN_TEST(test_recv_masked_msg) |
          RUN_TEST(test_recv_unmasked_msg_closes_connection) |
          RUN_TEST(test_recv_websocket_ndt_msg) |
@@ -446,5 +934,17 @@ int main() {
 	 RUN_TEST(test_websocket_handshake) |
          RUN_TEST(test_firefox_websocket_handshake) |
          RUN_TEST(test_ie11_websocket_handshake) |
+         RUN_TEST(test_msg_batch) |
+         RUN_TEST(test_recv_pipelined_msgs) |
+         RUN_TEST(test_websocket_unmask) |
+         RUN_TEST(test_websocket_sink) |
+         RUN_TEST(test_frame_pipelined_after_header) |
          RUN_TEST(test_websocket_sha);
+  // The benchmarks take a while and only report their timings, so they are
+  // left out of make check unless NDT_BENCHMARKS is set.
+  if (getenv("NDT_BENCHMARKS") != NULL) {
+    failed |= RUN_TEST(test_benchmark_read_websocket_header) |
+              RUN_TEST(test_benchmark_recv_websocket_msg);
+  }
+  return failed;
 }